@@ -29,27 +29,62 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syscall.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * Open addressing, with slots in groups of group_width.  Each slot has a
+ * control byte, kept apart from the entries so that a whole group of them
+ * can be checked at once (with SSE2, if available): it's either empty,
+ * deleted, or has its high bit set and holds 7 bits of the hash of the key
+ * in the slot.  Only slots whose control byte matches are compared, and a
+ * lookup stops at the first group with an empty slot.  Empty is 0, so that
+ * new tables don't have to be cleared: small ones come from calloc(), and
+ * large ones straight from mmap(), as calloc() clears memory it's reusing
+ * all at once.
+ *
+ * Tables grow incrementally: a new table is allocated, and insertions and
+ * removals move a few slots from the old one until it's empty, so that no
+ * single insertion pays for rehashing everything.  Lookups look at both
+ * tables in the meantime.  Large old tables are also unmapped a bit at a
+ * time: entries as they're moved, and everything else (control bytes are
+ * needed until the end, as lookups still go through moved slots) in the
+ * insertions and removals after that.
+ */
 enum {
-	n_buckets = 512,
-	steps = 64,
+	group_width = 16,
+	ctrl_empty = 0x00,
+	ctrl_deleted = 0x01,
+	ctrl_full = 0x80,
+	/* Slots moved to the new table on each insertion or removal */
+	migrate_step = 2 * group_width,
+	/* Tables with at least this many slots are mmap()ed... */
+	mapped_capacity = 1 << 14,
+	/* ...and unmapped this many entries' worth of pages at a time */
+	release_step = 1 << 14,
 	default_odd_constant = 0x27d4eb2d
 };
 static unsigned odd_constant = default_odd_constant;
 
 struct hash_entry {
-	const char *key;
+	const void *key;
 	const void *value;
 	unsigned hashval;
 };
 
-struct hash_bucket {
+struct hash_table {
+	uint8_t *ctrl;
 	struct hash_entry *entries;
+	/* Always a power of 2 */
+	unsigned n_groups;
 	unsigned used;
-	unsigned total;
+	unsigned deleted;
 };
 
 struct hash {
@@ -58,9 +93,20 @@ struct hash {
 	int (*key_compare)(const void *k1, const void *k2);
 	void (*free_value)(void *value);
 	void (*free_key)(void *value);
-	struct hash_bucket buckets[];
+	struct hash_table table;
+	/* Table being moved into @table, if it's being resized */
+	struct hash_table old;
+	unsigned migrated;
+	/* Bytes at the start of @old that have been unmapped */
+	size_t released;
+	/* What's left of the last table that was moved, if it was mapped */
+	uint8_t *retired;
+	size_t retired_size;
 };
 
+static unsigned (*get_hash_str_func(void))(const void *key);
+static unsigned (*hash_str_func)(const void *key);
+
 static unsigned get_random_unsigned(void)
 {
 	unsigned value;
@@ -91,6 +137,7 @@ static void initialize_odd_constant(void)
 	 * described by Crosby and Wallach in UsenixSec2003.  */
 	odd_constant = get_random_unsigned() | 1;
 	murmur3_set_seed(odd_constant);
+	hash_str_func = get_hash_str_func();
 }
 
 static inline unsigned hash_int(const void *keyptr)
@@ -151,16 +198,313 @@ static inline int hash_int_key_cmp(const void *k1, const void *k2)
 	return (a > b) - (a < b);
 }
 
+static inline unsigned group_match(const uint8_t *ctrl, uint8_t byte)
+{
+#if defined(__SSE2__)
+	__m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+
+	return (unsigned)_mm_movemask_epi8(
+			_mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+#else
+	unsigned mask = 0;
+
+	for (unsigned i = 0; i < group_width; i++)
+		mask |= (unsigned)(ctrl[i] == byte) << i;
+	return mask;
+#endif
+}
+
+/* Empty and deleted slots are the ones without the high bit set */
+static inline unsigned group_match_free(const uint8_t *ctrl)
+{
+#if defined(__SSE2__)
+	return ~(unsigned)_mm_movemask_epi8(
+			_mm_loadu_si128((const __m128i *)ctrl)) & 0xffff;
+#else
+	unsigned mask = 0;
+
+	for (unsigned i = 0; i < group_width; i++)
+		mask |= (unsigned)!(ctrl[i] & ctrl_full) << i;
+	return mask;
+#endif
+}
+
+static inline uint8_t ctrl_hash(unsigned hashval)
+{
+	/* The group is picked with the low bits */
+	return (uint8_t)(ctrl_full | hashval >> 25);
+}
+
+static inline size_t table_capacity(const struct hash_table *table)
+{
+	return (size_t)table->n_groups * group_width;
+}
+
+/* Keeps at least 1/8 of the slots empty, so that lookups for keys that
+ * aren't there finish early */
+static inline bool table_is_full(const struct hash_table *table)
+{
+	size_t capacity = table_capacity(table);
+
+	return table->used + table->deleted + 1 > capacity - capacity / 8;
+}
+
+static inline bool table_is_mapped(size_t capacity)
+{
+	return capacity >= mapped_capacity;
+}
+
+/* Entries, followed by control bytes */
+static inline size_t table_mapping_size(size_t capacity)
+{
+	return capacity * (sizeof(struct hash_entry) + 1);
+}
+
+static int table_init(struct hash_table *table, unsigned n_groups)
+{
+	size_t capacity = (size_t)n_groups * group_width;
+
+	if (table_is_mapped(capacity)) {
+		void *mapping = mmap(NULL, table_mapping_size(capacity),
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (mapping == MAP_FAILED)
+			return -errno;
+
+		table->entries = mapping;
+		table->ctrl = (uint8_t *)(table->entries + capacity);
+		goto out;
+	}
+
+	table->ctrl = calloc(capacity, 1);
+	if (table->ctrl == NULL)
+		return -errno;
+
+	table->entries = reallocarray(NULL, capacity, sizeof(struct hash_entry));
+	if (table->entries == NULL) {
+		int err = -errno;
+		free(table->ctrl);
+		table->ctrl = NULL;
+		return err;
+	}
+
+out:
+	table->n_groups = n_groups;
+	table->used = 0;
+	table->deleted = 0;
+	return 0;
+}
+
+static void table_free(struct hash_table *table)
+{
+	size_t capacity = table_capacity(table);
+
+	if (table_is_mapped(capacity)) {
+		munmap(table->entries, table_mapping_size(capacity));
+	} else {
+		free(table->ctrl);
+		free(table->entries);
+	}
+	memset(table, 0, sizeof(*table));
+}
+
+static struct hash_entry *table_find(const struct hash *hash,
+				const struct hash_table *table,
+				const void *key, unsigned hashval)
+{
+	unsigned mask = table->n_groups - 1;
+	uint8_t h2 = ctrl_hash(hashval);
+
+	if (table->ctrl == NULL)
+		return NULL;
+
+	for (unsigned group = hashval & mask, probe = 0; probe <= mask;
+			group = (group + ++probe) & mask) {
+		const uint8_t *ctrl = table->ctrl + group * group_width;
+		unsigned match = group_match(ctrl, h2);
+
+		for (; match; match &= match - 1) {
+			struct hash_entry *entry = table->entries +
+				group * group_width + (unsigned)__builtin_ctz(match);
+
+			if (entry->hashval == hashval &&
+					hash->key_compare(key, entry->key) == 0)
+				return entry;
+		}
+
+		if (group_match(ctrl, ctrl_empty))
+			break;
+	}
+
+	return NULL;
+}
+
+/* Claims the first free slot for @hashval; @table must not be full */
+static struct hash_entry *table_claim(struct hash_table *table,
+				unsigned hashval)
+{
+	unsigned mask = table->n_groups - 1;
+	unsigned group = hashval & mask;
+
+	for (unsigned probe = 0;; group = (group + ++probe) & mask) {
+		uint8_t *ctrl = table->ctrl + group * group_width;
+		unsigned match = group_match_free(ctrl);
+
+		if (match) {
+			unsigned slot = (unsigned)__builtin_ctz(match);
+
+			if (ctrl[slot] == ctrl_deleted)
+				table->deleted--;
+			ctrl[slot] = ctrl_hash(hashval);
+			table->used++;
+
+			return table->entries + group * group_width + slot;
+		}
+	}
+}
+
+static void table_remove(struct hash_table *table, struct hash_entry *entry)
+{
+	size_t slot = (size_t)(entry - table->entries);
+	const uint8_t *group = table->ctrl + slot - slot % group_width;
+
+	/* If this group has never been full, no lookup went past it, so the
+	 * slot can be marked as empty rather than deleted */
+	if (group_match(group, ctrl_empty)) {
+		table->ctrl[slot] = ctrl_empty;
+	} else {
+		table->ctrl[slot] = ctrl_deleted;
+		table->deleted++;
+	}
+	table->used--;
+}
+
+static inline size_t release_size(void)
+{
+	size_t page_mask = (size_t)sysconf(_SC_PAGESIZE) - 1;
+
+	return (release_step * sizeof(struct hash_entry) + page_mask) & ~page_mask;
+}
+
+/* Unmaps the pages of entries that have been moved out of the old table */
+static void hash_release_migrated(struct hash *hash)
+{
+	size_t end = (size_t)hash->migrated * sizeof(struct hash_entry);
+
+	end -= end % release_size();
+	if (end > hash->released) {
+		munmap((uint8_t *)hash->old.entries + hash->released,
+			end - hash->released);
+		hash->released = end;
+	}
+}
+
+/* Unmaps up to @size bytes of what's left of the last table that was
+ * moved */
+static void hash_release_retired(struct hash *hash, size_t size)
+{
+	if (size > hash->retired_size)
+		size = hash->retired_size;
+
+	munmap(hash->retired, size);
+	hash->retired += size;
+	hash->retired_size -= size;
+	if (hash->retired_size == 0)
+		hash->retired = NULL;
+}
+
+/* Leaves what's left of the old table to be unmapped by the following
+ * calls to hash_migrate(), rather than all at once */
+static void hash_retire_old(struct hash *hash)
+{
+	if (hash->retired != NULL)
+		hash_release_retired(hash, SIZE_MAX);
+
+	hash->retired = (uint8_t *)hash->old.entries + hash->released;
+	hash->retired_size = table_mapping_size(table_capacity(&hash->old)) -
+		hash->released;
+	memset(&hash->old, 0, sizeof(hash->old));
+}
+
+static void hash_migrate(struct hash *hash, size_t n_slots)
+{
+	size_t capacity = table_capacity(&hash->old);
+
+	if (hash->old.ctrl == NULL) {
+		hash_release_retired(hash, release_size());
+		return;
+	}
+
+	for (; n_slots && hash->migrated < capacity; n_slots--, hash->migrated++) {
+		const struct hash_entry *entry;
+
+		if (!(hash->old.ctrl[hash->migrated] & ctrl_full))
+			continue;
+
+		entry = hash->old.entries + hash->migrated;
+		*table_claim(&hash->table, entry->hashval) = *entry;
+
+		/* Lookups go to the new table from now on */
+		hash->old.ctrl[hash->migrated] = ctrl_deleted;
+	}
+
+	if (!table_is_mapped(capacity)) {
+		if (hash->migrated == capacity)
+			table_free(&hash->old);
+	} else if (hash->migrated == capacity) {
+		hash_retire_old(hash);
+	} else {
+		hash_release_migrated(hash);
+	}
+}
+
+/* Makes sure there's room for one more entry in hash->table */
+static int hash_reserve(struct hash *hash)
+{
+	unsigned n_groups;
+	int ret;
+
+	if (!table_is_full(&hash->table))
+		return 0;
+
+	if (hash->old.ctrl != NULL) {
+		hash_migrate(hash, SIZE_MAX);
+		if (!table_is_full(&hash->table))
+			return 0;
+	}
+
+	/* Mostly deleted slots: same size will do */
+	n_groups = hash->table.n_groups;
+	if (hash->table.used >= table_capacity(&hash->table) / 2)
+		n_groups *= 2;
+
+	hash->old = hash->table;
+	ret = table_init(&hash->table, n_groups);
+	if (ret < 0) {
+		hash->table = hash->old;
+		memset(&hash->old, 0, sizeof(hash->old));
+		return ret;
+	}
+
+	hash->migrated = 0;
+	hash->released = 0;
+	hash_migrate(hash, migrate_step);
+	return 0;
+}
+
 static struct hash *hash_internal_new(
 			unsigned (*hash_value)(const void *key),
 			int (*key_compare)(const void *k1, const void *k2),
 			void (*free_key)(void *value),
 			void (*free_value)(void *value))
 {
-	struct hash *hash = calloc(1, sizeof(struct hash) +
-				n_buckets * sizeof(struct hash_bucket));
+	struct hash *hash = calloc(1, sizeof(struct hash));
 	if (hash == NULL)
 		return NULL;
+	if (table_init(&hash->table, 1) < 0) {
+		free(hash);
+		return NULL;
+	}
 	hash->hash_value = hash_value;
 	hash->key_compare = key_compare;
 	hash->free_value = free_value;
@@ -177,83 +521,93 @@ struct hash *hash_int_new(void (*free_key)(void *value),
 			free_value);
 }
 
-struct hash *hash_str_new(void (*free_key)(void *value),
-			void (*free_value)(void *value))
+static unsigned (*get_hash_str_func(void))(const void *key)
 {
-	unsigned (*hash_func)(const void *key);
-
 #if defined(HAVE_BUILTIN_CPU_INIT) && defined(HAVE_BUILTIN_IA32_CRC32)
 	__builtin_cpu_init();
-	if (__builtin_cpu_supports("sse4.2")) {
-		hash_func = hash_crc32;
-	} else {
-		hash_func = murmur3_simple;
-	}
-#else
-	hash_func = murmur3_simple;
+	if (__builtin_cpu_supports("sse4.2"))
+		return hash_crc32;
 #endif
+	return murmur3_simple;
+}
+
+unsigned hash_str(const void *key)
+{
+	return hash_str_func(key);
+}
 
+struct hash *hash_str_new(void (*free_key)(void *value),
+			void (*free_value)(void *value))
+{
 	return hash_internal_new(
-			hash_func,
+			get_hash_str_func(),
 			(int (*)(const void *, const void *))strcmp,
 			free_key,
 			free_value);
 }
 
-void hash_free(struct hash *hash)
+static void table_free_entries(const struct hash *hash,
+				const struct hash_table *table)
 {
-	struct hash_bucket *bucket, *bucket_end;
+	size_t capacity = table_capacity(table);
 
-	if (hash == NULL)
+	if (table->ctrl == NULL)
 		return;
 
-	bucket = hash->buckets;
-	bucket_end = bucket + n_buckets;
-	for (; bucket < bucket_end; bucket++) {
-		if (hash->free_value) {
-			struct hash_entry *entry, *entry_end;
-			entry = bucket->entries;
-			entry_end = entry + bucket->used;
-			for (; entry < entry_end; entry++) {
-				hash->free_value((void *)entry->value);
-				if (hash->free_key)
-					hash->free_key((void *)entry->key);
-			}
-		}
-		free(bucket->entries);
+	for (size_t slot = 0; slot < capacity; slot++) {
+		const struct hash_entry *entry = table->entries + slot;
+
+		if (!(table->ctrl[slot] & ctrl_full))
+			continue;
+		if (hash->free_value)
+			hash->free_value((void *)entry->value);
+		if (hash->free_key)
+			hash->free_key((void *)entry->key);
 	}
+}
+
+void hash_free(struct hash *hash)
+{
+	if (hash == NULL)
+		return;
+
+	table_free_entries(hash, &hash->table);
+	table_free_entries(hash, &hash->old);
+	table_free(&hash->table);
+	table_free(&hash->old);
+	if (hash->retired != NULL)
+		hash_release_retired(hash, SIZE_MAX);
 	free(hash);
 }
 
-/*
- * add or replace key in hash map.
- *
- * none of key or value are copied, just references are remembered as is,
- * make sure they are live while pair exists in hash!
- */
-int hash_add(struct hash *hash, const void *key, const void *value)
+static inline struct hash_entry *hash_find_entry(const struct hash *hash,
+								const void *key,
+								unsigned hashval)
+{
+	struct hash_entry *entry;
+
+	entry = table_find(hash, &hash->table, key, hashval);
+	if (entry == NULL && hash->old.ctrl != NULL)
+		entry = table_find(hash, &hash->old, key, hashval);
+
+	return entry;
+}
+
+static int hash_add_entry(struct hash *hash, const void *key,
+			const void *value, bool replace)
 {
 	unsigned hashval = hash->hash_value(key);
-	unsigned pos = hashval & (n_buckets - 1);
-	struct hash_bucket *bucket = hash->buckets + pos;
-	struct hash_entry *entry, *entry_end;
-
-	if (bucket->used + 1 >= bucket->total) {
-		unsigned new_total = bucket->total + steps;
-		struct hash_entry *tmp = reallocarray(bucket->entries, new_total, sizeof(*tmp));
-		if (tmp == NULL)
-			return -errno;
-		bucket->entries = tmp;
-		bucket->total = new_total;
-	}
+	struct hash_entry *entry;
+	int ret;
+
+	if (hash->old.ctrl != NULL || hash->retired != NULL)
+		hash_migrate(hash, migrate_step);
+
+	entry = hash_find_entry(hash, key, hashval);
+	if (entry) {
+		if (!replace)
+			return -EEXIST;
 
-	entry = bucket->entries;
-	entry_end = entry + bucket->used;
-	for (; entry < entry_end; entry++) {
-		if (hashval != entry->hashval)
-			continue;
-		if (hash->key_compare(key, entry->key) != 0)
-			continue;
 		if (hash->free_value)
 			hash->free_value((void *)entry->value);
 		if (hash->free_key)
@@ -264,66 +618,33 @@ int hash_add(struct hash *hash, const void *key, const void *value)
 		return 0;
 	}
 
+	ret = hash_reserve(hash);
+	if (ret < 0)
+		return ret;
+
+	entry = table_claim(&hash->table, hashval);
 	entry->key = key;
 	entry->value = value;
 	entry->hashval = hashval;
-	bucket->used++;
 	hash->count++;
 	return 0;
 }
 
-/* similar to hash_add(), but fails if key already exists */
-int hash_add_unique(struct hash *hash, const void *key, const void *value)
+/*
+ * add or replace key in hash map.
+ *
+ * none of key or value are copied, just references are remembered as is,
+ * make sure they are live while pair exists in hash!
+ */
+int hash_add(struct hash *hash, const void *key, const void *value)
 {
-	unsigned hashval = hash->hash_value(key);
-	unsigned pos = hashval & (n_buckets - 1);
-	struct hash_bucket *bucket = hash->buckets + pos;
-	struct hash_entry *entry, *entry_end;
-
-	if (bucket->used + 1 >= bucket->total) {
-		unsigned new_total = bucket->total + steps;
-		struct hash_entry *tmp = reallocarray(bucket->entries, new_total, sizeof(*tmp));
-		if (tmp == NULL)
-			return -errno;
-		bucket->entries = tmp;
-		bucket->total = new_total;
-	}
-
-	entry = bucket->entries;
-	entry_end = entry + bucket->used;
-	for (; entry < entry_end; entry++) {
-		if (hashval != entry->hashval)
-			continue;
-		if (hash->key_compare(key, entry->key) == 0)
-			return -EEXIST;
-	}
-
-	entry->key = key;
-	entry->value = value;
-	entry->hashval = hashval;
-	bucket->used++;
-	hash->count++;
-	return 0;
+	return hash_add_entry(hash, key, value, true);
 }
 
-static inline struct hash_entry *hash_find_entry(const struct hash *hash,
-								const char *key,
-								unsigned hashval)
+/* similar to hash_add(), but fails if key already exists */
+int hash_add_unique(struct hash *hash, const void *key, const void *value)
 {
-	unsigned pos = hashval & (n_buckets - 1);
-	const struct hash_bucket *bucket = hash->buckets + pos;
-	struct hash_entry *entry, *entry_end;
-
-	entry = bucket->entries;
-	entry_end = entry + bucket->used;
-	for (; entry < entry_end; entry++) {
-		if (hashval != entry->hashval)
-			continue;
-		if (hash->key_compare(key, entry->key) == 0)
-			return entry;
-	}
-
-	return NULL;
+	return hash_add_entry(hash, key, value, false);
 }
 
 void *hash_find(const struct hash *hash, const void *key)
@@ -339,38 +660,27 @@ void *hash_find(const struct hash *hash, const void *key)
 int hash_del(struct hash *hash, const void *key)
 {
 	unsigned hashval = hash->hash_value(key);
-	unsigned pos = hashval & (n_buckets - 1);
-	unsigned steps_used, steps_total;
-	struct hash_bucket *bucket = hash->buckets + pos;
-	struct hash_entry *entry, *entry_end;
+	struct hash_entry *entry;
 
-	entry = hash_find_entry(hash, key, hashval);
-	if (entry == NULL)
-		return -ENOENT;
+	if (hash->old.ctrl != NULL || hash->retired != NULL)
+		hash_migrate(hash, migrate_step);
+
+	entry = table_find(hash, &hash->table, key, hashval);
+	if (entry) {
+		table_remove(&hash->table, entry);
+	} else {
+		entry = table_find(hash, &hash->old, key, hashval);
+		if (entry == NULL)
+			return -ENOENT;
+		table_remove(&hash->old, entry);
+	}
 
 	if (hash->free_value)
 		hash->free_value((void *)entry->value);
 	if (hash->free_key)
 		hash->free_key((void *)entry->key);
 
-	entry_end = bucket->entries + bucket->used;
-	memmove(entry, entry + 1,
-		(size_t)(entry_end - entry) * sizeof(struct hash_entry));
-
-	bucket->used--;
 	hash->count--;
-
-	steps_used = bucket->used / steps;
-	steps_total = bucket->total / steps;
-	if (steps_used + 1 < steps_total) {
-		struct hash_entry *tmp = reallocarray(bucket->entries, steps_used + 1,
-			steps * sizeof(*tmp));
-		if (tmp) {
-			bucket->entries = tmp;
-			bucket->total = (steps_used + 1) * steps;
-		}
-	}
-
 	return 0;
 }
 
@@ -382,39 +692,36 @@ unsigned hash_get_count(const struct hash *hash)
 void hash_iter_init(const struct hash *hash, struct hash_iter *iter)
 {
 	iter->hash = hash;
-	iter->bucket = 0;
-	iter->entry = -1;
+	iter->table = 0;
+	iter->slot = 0;
 }
 
 bool hash_iter_next(struct hash_iter *iter, const void **key,
 							const void **value)
 {
-	const struct hash_bucket *b = iter->hash->buckets + iter->bucket;
-	const struct hash_entry *e;
+	const struct hash_table *tables[] = {
+		&iter->hash->table,
+		&iter->hash->old,
+	};
 
-	iter->entry++;
+	for (; iter->table < 2; iter->table++, iter->slot = 0) {
+		const struct hash_table *table = tables[iter->table];
+		size_t capacity = table->ctrl ? table_capacity(table) : 0;
 
-	if ((unsigned)iter->entry >= b->used) {
-		iter->entry = 0;
+		while (iter->slot < capacity) {
+			const struct hash_entry *e = table->entries + iter->slot;
 
-		for (iter->bucket++; iter->bucket < n_buckets;
-							iter->bucket++) {
-			b = iter->hash->buckets + iter->bucket;
+			if (!(table->ctrl[iter->slot++] & ctrl_full))
+				continue;
 
-			if (b->used > 0)
-				break;
-		}
+			if (value != NULL)
+				*value = e->value;
+			if (key != NULL)
+				*key = e->key;
 
-		if (iter->bucket >= n_buckets)
-			return false;
+			return true;
+		}
 	}
 
-	e = b->entries + iter->entry;
-
-	if (value != NULL)
-		*value = e->value;
-	if (key != NULL)
-		*key = e->key;
-
-	return true;
+	return false;
 }
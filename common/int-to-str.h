@@ -28,4 +28,7 @@ char *int_to_string(ssize_t value,
 char *uint_to_string(size_t value,
                      char buffer[static INT_TO_STR_BUFFER_SIZE],
                      size_t *len);
+char *uint_to_hex_string(size_t value,
+                     char buffer[static INT_TO_STR_BUFFER_SIZE],
+                     size_t *len);
 
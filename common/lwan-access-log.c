@@ -0,0 +1,585 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2016 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "lwan-private.h"
+
+/*
+ * Every I/O thread owns a single-producer, single-consumer ring of
+ * fixed-size records, so logging a request is just a few stores and
+ * never takes a lock or performs any I/O.  A writer thread formats
+ * records from all rings and writes them in batches.  If a ring is
+ * full, the record is dropped (and counted) instead of waiting for the
+ * writer to catch up.
+ */
+
+#define RING_SIZE 4096
+#define RING_MASK (RING_SIZE - 1)
+#define BATCH_SIZE 256
+#define MAX_LINE_LEN 1536
+#define IDLE_SLEEP_NSEC (20 * 1000 * 1000)
+#define DROP_REPORT_INTERVAL 10
+
+enum {
+    METHOD_UNKNOWN,
+    METHOD_GET,
+    METHOD_HEAD,
+    METHOD_POST
+};
+
+enum {
+    RECORD_URL_TRUNCATED = 1<<0
+};
+
+/*
+ * This is also the on-disk layout of the binary format: the first
+ * offsetof(url) bytes of a record, in host byte order, followed by
+ * url_len bytes of the request target, as sent by the client (not
+ * NUL-terminated).
+ */
+struct access_log_record {
+    uint64_t time_usec;
+    uint64_t bytes;
+    uint32_t duration_usec;
+    uint16_t status;
+    uint16_t url_len;
+    uint8_t method;
+    uint8_t family;
+    uint8_t version;
+    uint8_t flags;
+    uint8_t addr[16];
+    uint8_t padding[4];
+    char url[ACCESS_LOG_MAX_TARGET_LEN];
+};
+
+static_assert(sizeof(struct access_log_record) == 256,
+    "Access log records are 256 bytes long");
+static_assert(offsetof(struct access_log_record, url) == 48,
+    "Binary access log record headers are 48 bytes long");
+
+struct lwan_access_log_ring_t_ {
+    /* Only written by the I/O thread */
+    unsigned int head;
+    uint64_t dropped;
+    char padding0[64 - sizeof(unsigned int) - sizeof(uint64_t)];
+
+    /* Only written by the log writer */
+    unsigned int tail;
+    char padding1[64 - sizeof(unsigned int)];
+
+    struct access_log_record records[RING_SIZE];
+};
+
+struct lwan_access_log_t_ {
+    pthread_t self;
+    bool running;
+    int fd;
+    lwan_access_log_format_t format;
+
+    lwan_access_log_ring_t **rings;
+    unsigned int *taken;
+    unsigned int n_rings;
+
+    uint64_t reported_drops;
+    time_t drops_checked_at;
+
+    struct {
+        time_t time;
+        char str[32];
+        size_t len;
+    } date;
+
+    struct iovec iov[BATCH_SIZE];
+    int iov_count;
+    size_t buffer_used;
+    char buffer[BATCH_SIZE * MAX_LINE_LEN / 2];
+};
+
+static const char *const methods[] = {
+    [METHOD_UNKNOWN] = "UNKNOWN",
+    [METHOD_GET] = "GET",
+    [METHOD_HEAD] = "HEAD",
+    [METHOD_POST] = "POST",
+};
+
+static const char *const versions[] = {
+    [10] = "HTTP/1.0",
+    [11] = "HTTP/1.1",
+    [20] = "HTTP/2",
+};
+
+static ALWAYS_INLINE uint8_t
+request_method(const lwan_request_t *request)
+{
+    if (request->flags & REQUEST_METHOD_GET)
+        return METHOD_GET;
+    if (request->flags & REQUEST_METHOD_HEAD)
+        return METHOD_HEAD;
+    if (request->flags & REQUEST_METHOD_POST)
+        return METHOD_POST;
+    return METHOD_UNKNOWN;
+}
+
+static ALWAYS_INLINE uint8_t
+request_version(const lwan_request_t *request)
+{
+    if (request->flags & REQUEST_HTTP2)
+        return 20;
+    if (request->flags & REQUEST_IS_HTTP_1_0)
+        return 10;
+    return 11;
+}
+
+static void
+record_remote_address(struct access_log_record *record,
+    const lwan_request_t *request)
+{
+    struct sockaddr_storage storage;
+    const struct sockaddr_storage *addr;
+
+    if (request->flags & REQUEST_PROXIED) {
+        addr = (const struct sockaddr_storage *)&request->proxy->from;
+    } else {
+        socklen_t len = sizeof(storage);
+
+        if (UNLIKELY(getpeername(request->fd, (struct sockaddr *)&storage,
+                                 &len) < 0)) {
+            record->family = AF_UNSPEC;
+            return;
+        }
+        addr = &storage;
+    }
+
+    switch (addr->ss_family) {
+    case AF_INET:
+        memcpy(record->addr, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+        record->family = AF_INET;
+        break;
+    case AF_INET6:
+        memcpy(record->addr, &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+        record->family = AF_INET6;
+        break;
+    default:
+        record->family = AF_UNSPEC;
+    }
+}
+
+void
+lwan_access_log(lwan_request_t *request, const lwan_value_t *target)
+{
+    lwan_access_log_ring_t *ring = request->conn->thread->access_log;
+    struct access_log_record *record;
+    struct timespec now;
+    unsigned int head, tail;
+
+    if (!ring)
+        return;
+
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (UNLIKELY(head - tail >= RING_SIZE)) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    record = &ring->records[head & RING_MASK];
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    record->duration_usec = (uint32_t)(
+        (uint64_t)(now.tv_sec - request->stats.start.tv_sec) * 1000000 +
+        (uint64_t)((now.tv_nsec - request->stats.start.tv_nsec) / 1000));
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    record->time_usec = (uint64_t)now.tv_sec * 1000000 +
+        (uint64_t)now.tv_nsec / 1000;
+
+    record->bytes = request->stats.bytes_written;
+    record->status = (uint16_t)request->stats.status;
+    record->method = request_method(request);
+    record->version = request_version(request);
+    record->flags = 0;
+    memset(record->addr, 0, sizeof(record->addr));
+    record_remote_address(record, request);
+
+    if (LIKELY(target->value != NULL)) {
+        size_t len = target->len;
+
+        if (UNLIKELY(len > sizeof(record->url))) {
+            len = sizeof(record->url);
+            record->flags |= RECORD_URL_TRUNCATED;
+        }
+        memcpy(record->url, target->value, len);
+        record->url_len = (uint16_t)len;
+    } else {
+        record->url_len = 0;
+    }
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static char *
+append_escaped(char *out, const char *s, size_t len, bool json)
+{
+    static const char hex_digits[] = "0123456789abcdef";
+
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+
+        if (LIKELY(c >= 0x20 && c != 0x7f && c != '"' && c != '\\')) {
+            *out++ = (char)c;
+        } else if (c == '"' || c == '\\') {
+            *out++ = '\\';
+            *out++ = (char)c;
+        } else {
+            if (json) {
+                memcpy(out, "\\u00", 4);
+                out += 4;
+            } else {
+                memcpy(out, "\\x", 2);
+                out += 2;
+            }
+            *out++ = hex_digits[c >> 4];
+            *out++ = hex_digits[c & 0xf];
+        }
+    }
+
+    return out;
+}
+
+static const char *
+format_date(lwan_access_log_t *log, time_t t)
+{
+    if (log->date.time != t) {
+        struct tm tm;
+
+        gmtime_r(&t, &tm);
+        log->date.len = strftime(log->date.str, sizeof(log->date.str),
+            log->format == ACCESS_LOG_JSON ? "%Y-%m-%dT%H:%M:%S" :
+                                             "%d/%b/%Y:%H:%M:%S +0000", &tm);
+        log->date.time = t;
+    }
+
+    return log->date.str;
+}
+
+static void
+format_address(const struct access_log_record *record,
+    char buffer[static INET6_ADDRSTRLEN])
+{
+    if (!inet_ntop(record->family, record->addr, buffer, INET6_ADDRSTRLEN))
+        memcpy(buffer, "-", sizeof("-"));
+}
+
+static size_t
+format_text(lwan_access_log_t *log, const struct access_log_record *record,
+    char *out)
+{
+    char addr[INET6_ADDRSTRLEN];
+    char *p = out;
+
+    format_address(record, addr);
+    p += sprintf(p, "%s - - [%s] \"%s ", addr,
+        format_date(log, (time_t)(record->time_usec / 1000000)),
+        methods[record->method]);
+    p = append_escaped(p, record->url, record->url_len, false);
+    p += sprintf(p, " %s\" %u %" PRIu64 " %" PRIu32 "us\n",
+        versions[record->version], record->status, record->bytes,
+        record->duration_usec);
+
+    return (size_t)(p - out);
+}
+
+static size_t
+format_json(lwan_access_log_t *log, const struct access_log_record *record,
+    char *out)
+{
+    char addr[INET6_ADDRSTRLEN];
+    char *p = out;
+
+    format_address(record, addr);
+    p += sprintf(p, "{\"time\":\"%s.%06" PRIu64 "Z\",\"addr\":\"%s\","
+        "\"method\":\"%s\",\"url\":\"",
+        format_date(log, (time_t)(record->time_usec / 1000000)),
+        record->time_usec % 1000000, addr, methods[record->method]);
+    p = append_escaped(p, record->url, record->url_len, true);
+    p += sprintf(p, "\",\"version\":\"%s\",\"status\":%u,\"bytes\":%" PRIu64
+        ",\"duration_usec\":%" PRIu32 "}\n",
+        versions[record->version], record->status, record->bytes,
+        record->duration_usec);
+
+    return (size_t)(p - out);
+}
+
+static bool
+batch_append(lwan_access_log_t *log, const void *data, size_t len)
+{
+    struct iovec *last = log->iov_count ? &log->iov[log->iov_count - 1] : NULL;
+
+    /* Formatted lines are contiguous in the buffer; merge them */
+    if (last && (const char *)last->iov_base + last->iov_len == data) {
+        last->iov_len += len;
+        return true;
+    }
+
+    if (UNLIKELY(log->iov_count == BATCH_SIZE))
+        return false;
+
+    log->iov[log->iov_count++] = (struct iovec) {
+        .iov_base = (void *)data,
+        .iov_len = len
+    };
+    return true;
+}
+
+static bool
+batch_add_record(lwan_access_log_t *log, const struct access_log_record *record)
+{
+    char *out;
+    size_t len;
+
+    if (log->format == ACCESS_LOG_BINARY) {
+        return batch_append(log, record,
+            offsetof(struct access_log_record, url) + record->url_len);
+    }
+
+    if (sizeof(log->buffer) - log->buffer_used < MAX_LINE_LEN)
+        return false;
+
+    out = log->buffer + log->buffer_used;
+    if (log->format == ACCESS_LOG_JSON)
+        len = format_json(log, record, out);
+    else
+        len = format_text(log, record, out);
+
+    if (UNLIKELY(!batch_append(log, out, len)))
+        return false;
+
+    log->buffer_used += len;
+    return true;
+}
+
+static void
+batch_write(lwan_access_log_t *log)
+{
+    struct iovec *iov = log->iov;
+    int iov_count = log->iov_count;
+
+    while (iov_count) {
+        ssize_t written = writev(log->fd, iov, iov_count);
+
+        if (UNLIKELY(written < 0)) {
+            if (errno == EINTR)
+                continue;
+
+            lwan_status_perror("Could not write to access log");
+            break;
+        }
+
+        while (iov_count && (size_t)written >= iov->iov_len) {
+            written -= (ssize_t)iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= (size_t)written;
+        }
+    }
+
+    log->iov_count = 0;
+    log->buffer_used = 0;
+}
+
+static unsigned int
+drain(lwan_access_log_t *log)
+{
+    unsigned int total = 0;
+    bool full = false;
+
+    for (unsigned int i = 0; i < log->n_rings; i++) {
+        lwan_access_log_ring_t *ring = log->rings[i];
+        unsigned int tail = ring->tail;
+        unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        log->taken[i] = 0;
+        for (; !full && tail + log->taken[i] != head; log->taken[i]++) {
+            unsigned int index = (tail + log->taken[i]) & RING_MASK;
+
+            full = !batch_add_record(log, &ring->records[index]);
+            if (full)
+                break;
+        }
+        total += log->taken[i];
+    }
+
+    if (!total)
+        return 0;
+
+    batch_write(log);
+
+    /* Slots can only be reused once written out: binary records are
+     * written straight from the ring. */
+    for (unsigned int i = 0; i < log->n_rings; i++) {
+        lwan_access_log_ring_t *ring = log->rings[i];
+
+        __atomic_store_n(&ring->tail, ring->tail + log->taken[i],
+            __ATOMIC_RELEASE);
+    }
+
+    return total;
+}
+
+static uint64_t
+count_drops(const lwan_access_log_t *log)
+{
+    uint64_t drops = 0;
+
+    for (unsigned int i = 0; i < log->n_rings; i++)
+        drops += __atomic_load_n(&log->rings[i]->dropped, __ATOMIC_RELAXED);
+
+    return drops;
+}
+
+static void
+report_drops(lwan_access_log_t *log)
+{
+    uint64_t drops = count_drops(log);
+
+    if (drops != log->reported_drops) {
+        lwan_status_warning("Access log writer falling behind: "
+            "%" PRIu64 " records dropped so far", drops);
+        log->reported_drops = drops;
+    }
+}
+
+static void *
+writer_thread(void *data)
+{
+    lwan_access_log_t *log = data;
+    const struct timespec idle = { .tv_nsec = IDLE_SLEEP_NSEC };
+
+    while (__atomic_load_n(&log->running, __ATOMIC_ACQUIRE)) {
+        time_t now;
+
+        if (drain(log) < BATCH_SIZE)
+            nanosleep(&idle, NULL);
+
+        now = time(NULL);
+        if (now - log->drops_checked_at >= DROP_REPORT_INTERVAL) {
+            report_drops(log);
+            log->drops_checked_at = now;
+        }
+    }
+
+    while (drain(log))
+        ;
+
+    return NULL;
+}
+
+void
+lwan_access_log_init(lwan_t *l)
+{
+    lwan_access_log_t *log;
+
+    if (!l->config.access_log.path)
+        return;
+
+    lwan_status_debug("Initializing access log");
+
+    log = calloc(1, sizeof(*log));
+    if (!log)
+        lwan_status_critical_perror("calloc");
+
+    log->fd = open(l->config.access_log.path,
+        O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+    if (log->fd < 0) {
+        lwan_status_critical_perror("Could not open access log %s",
+            l->config.access_log.path);
+    }
+
+    log->format = l->config.access_log.format;
+    log->n_rings = (unsigned int)l->thread.count;
+    log->rings = calloc(log->n_rings, sizeof(*log->rings));
+    log->taken = calloc(log->n_rings, sizeof(*log->taken));
+    if (!log->rings || !log->taken)
+        lwan_status_critical_perror("calloc");
+
+    for (unsigned int i = 0; i < log->n_rings; i++) {
+        void *ring;
+
+        if (posix_memalign(&ring, 64, sizeof(lwan_access_log_ring_t)))
+            lwan_status_critical("Could not allocate access log ring");
+        memset(ring, 0, sizeof(lwan_access_log_ring_t));
+
+        log->rings[i] = ring;
+        l->thread.threads[i].access_log = ring;
+    }
+
+    log->drops_checked_at = time(NULL);
+    log->running = true;
+    if (pthread_create(&log->self, NULL, writer_thread, log))
+        lwan_status_critical_perror("pthread_create");
+
+    l->access_log = log;
+}
+
+void
+lwan_access_log_shutdown(lwan_t *l)
+{
+    lwan_access_log_t *log = l->access_log;
+    uint64_t drops;
+
+    if (!log)
+        return;
+
+    lwan_status_debug("Shutting down access log");
+
+    /* I/O threads are gone by now; the writer drains what's left */
+    __atomic_store_n(&log->running, false, __ATOMIC_RELEASE);
+    pthread_join(log->self, NULL);
+
+    drops = count_drops(log);
+    if (drops)
+        lwan_status_warning("%" PRIu64 " access log records were dropped", drops);
+
+    for (unsigned int i = 0; i < log->n_rings; i++)
+        free(log->rings[i]);
+    free(log->rings);
+    free(log->taken);
+    close(log->fd);
+    free(log);
+
+    l->access_log = NULL;
+}
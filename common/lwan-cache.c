@@ -19,62 +19,273 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "lwan.h"
 #include "lwan-private.h"
 #include "lwan-cache.h"
 #include "hash.h"
 
-#define GET_AND_REF_TRIES 5
+/*
+ * The cache is split in shards, chosen by the hash of the key.  Each shard
+ * has its own hash table, TTL queue, and a lock serializing writers.
+ * Lookups don't take any locks: hash chains are published with release
+ * stores, and entries (or bucket arrays) that are removed are only
+ * reclaimed after every thread that might have been looking at them is
+ * done (epoch-based reclamation, below).  Entries in the hash table hold a
+ * reference, which is dropped only after that, so a lookup can always take
+ * a reference on whatever it finds.
+ *
+ * Caches can optionally be limited in number of entries and bytes (as
+ * reported by the create callbacks); limits are split evenly among shards.
+ * Entries to evict are chosen with CLOCK, and are only evicted if the
+ * new entry has been used more often than them (TinyLFU admission), so
+ * that a scan through lots of keys that are used only once doesn't push
+ * out the entries everybody keeps using.
+ *
+ * Only one entry is created at a time for a given key: coroutines that
+ * miss while it's being created wait for it instead (other callers create
+ * their own, temporary, copy).  Optionally, expired entries can keep
+ * being returned for a while, as long as one of the lookups creates a
+ * fresh entry to replace them.  Caches with a revalidation callback first
+ * ask it whether an expired entry is still good, and keep it for another
+ * time to live if so; entries that expired and aren't used for another
+ * time to live are dropped.  Entries can also be dropped before they
+ * expire, if whoever created them knows they're out of date.
+ *
+ * Optionally, keys for which entries couldn't be created are remembered
+ * (for a shorter time), so that lookups for things that don't exist don't
+ * keep calling the create callback.  These negative entries are kept in a
+ * queue of their own, and are the first to go to make room for others.
+ *
+ * Caches with asynchronous fills enabled create entries for coroutines,
+ * and refresh stale entries, in a pool of threads shared by all caches,
+ * so that slow create callbacks don't hold up I/O threads.  Coroutines
+ * are suspended until their entry is ready.
+ */
+
+#define SHARD_BITS 4
+#define N_SHARDS (1 << SHARD_BITS)
+#define INITIAL_BUCKETS 16
+
+#define SKETCH_ROWS 4
+#define SKETCH_MIN_WIDTH 64
+#define SKETCH_MAX_WIDTH 65536
+#define SKETCH_COUNTER_MAX 15
 
 enum {
     /* Entry flags */
-    FLOATING = 1 << 0,
-    TEMPORARY = 1 << 1,
+    TEMPORARY = 1 << 0,
+    REFRESHING = 1 << 1,
+    /* Remembers that the create callback failed; never seen by users */
+    NEGATIVE = 1 << 2,
 
     /* Cache flags */
     SHUTTING_DOWN = 1 << 0
 };
 
-struct cache_t {
+struct cache_table {
+    /* Tables replaced by a larger one are kept in a list until reclaimed */
+    struct cache_table *retired_next;
+    unsigned mask;
+    struct cache_entry_t *buckets[];
+};
+
+/*
+ * Count-min sketch estimating how often keys have been looked up, with
+ * 4-bit saturating counters (stored in bytes).  Counters are halved once
+ * enough lookups have been recorded, so that the estimate favors recent
+ * history.  Counters are updated without locks; increments might get lost
+ * when two threads race, which is fine for an estimate.
+ */
+struct cache_sketch {
+    unsigned mask;
+    unsigned additions;
+    unsigned sample_size;
+    uint8_t counters[];
+};
+
+/* An entry being created, that other coroutines can wait for */
+struct cache_fill {
+    struct cache_fill *next;
+    struct cache_t *cache;
+    char *key;
+    unsigned hash;
+    unsigned invalidations;
+    unsigned refs;
+    bool done;
+    bool failed;
+    int error;
+    /* Asynchronous fills hand the entry over to the coroutine that
+     * started them through this; it's released with the fill if that
+     * coroutine is gone */
+    bool async;
+    struct cache_entry_t *entry;
+    /* Connections suspended until this is done */
     struct {
-        struct hash *table;
-        pthread_rwlock_t lock;
-    } hash;
+        lwan_connection_t **conns;
+        size_t len, size;
+    } waiters;
+};
+
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cache_table *table;
+    struct cache_table *retired;
+    unsigned n_entries;
+    size_t bytes;
+    /* Bumped by cache_invalidate(); entries being created while this
+     * changes aren't kept */
+    unsigned invalidations;
+    /* Ordered by time_to_die, since all entries have the same TTL */
+    struct list_head queue;
+    struct list_head negative_queue;
+    struct cache_fill *fills;
 
+    /* Entries removed from the table (other than by the pruner), freed
+     * once no lookup can be looking at them */
+    struct list_head unlinked;
+    uint64_t unlinked_epoch;
+
+    /* Only used if the cache has limits */
+    struct {
+        size_t max_bytes;
+        unsigned max_entries;
+        /* CLOCK hand, sweeping through the queue; NULL for its head */
+        struct cache_entry_t *hand;
+        struct cache_sketch *sketch;
+    } limits;
+
+    /* Updated by lookups not holding the lock */
     struct {
-        struct list_head list;
-        pthread_rwlock_t lock;
-    } queue;
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t rejections;
+        uint64_t coalesced;
+        uint64_t refreshes;
+        uint64_t revalidations;
+        uint64_t invalidations;
+    } stats __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+struct cache_t {
+    struct cache_shard shards[N_SHARDS];
 
     struct {
         CreateEntryCallback create_entry;
         DestroyEntryCallback destroy_entry;
+        RevalidateEntryCallback revalidate_entry;
         void *context;
     } cb;
 
     struct {
         time_t time_to_live;
+        time_t negative_time_to_live;
+        time_t stale_while_revalidate;
         clockid_t clock_id;
+        bool async_fill;
     } settings;
 
     unsigned flags;
-
-#ifndef NDEBUG
-    struct {
-        unsigned hits;
-        unsigned misses;
-        unsigned evicted;
-    } stats;
-#endif
+    /* Jobs queued in, or being run by, the job pool */
+    unsigned pending_fills;
 };
 
+#define STATS_ADD(shard_, field_, n_)                                          \
+    __atomic_fetch_add(&(shard_)->stats.field_, (uint64_t)(n_),               \
+                       __ATOMIC_RELAXED)
+
+/*
+ * Epoch-based reclamation.  Every thread doing lookups has a record with
+ * the epoch it saw when it started its current lookup (or 0 if it's not
+ * looking anything up).  After unlinking things, writers bump the global
+ * epoch and wait until no thread is still in an older epoch; only then it
+ * is safe to free them.  Lookups never block, so this wait is short.  Only
+ * the pruner (and cache_destroy()) waits; lookups that evict entries only
+ * free them if no wait would be necessary.  Records are never freed.
+ */
+struct reader {
+    uint64_t epoch;
+    struct reader *next;
+} __attribute__((aligned(64)));
+
+static uint64_t global_epoch = 1;
+static struct reader *readers;
+static __thread struct reader *this_reader;
+
 static bool cache_pruner_job(void *data);
+static void fill_pool_release(struct cache_t *cache);
+
+static struct reader *get_reader(void)
+{
+    struct reader *reader = this_reader;
+
+    if (LIKELY(reader))
+        return reader;
+
+    if (posix_memalign((void **)&reader, 64, sizeof(*reader)))
+        lwan_status_critical("Could not allocate cache reader record");
+
+    reader->epoch = 0;
+    reader->next = __atomic_load_n(&readers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&readers, &reader->next, reader,
+                false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+    return this_reader = reader;
+}
+
+static ALWAYS_INLINE void reader_enter(struct reader *reader)
+{
+    /* Must be visible before any pointer is loaded, so it's SEQ_CST */
+    __atomic_store_n(&reader->epoch,
+                     __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE),
+                     __ATOMIC_SEQ_CST);
+}
+
+static ALWAYS_INLINE void reader_leave(struct reader *reader)
+{
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+static ALWAYS_INLINE uint64_t advance_epoch(void)
+{
+    return __atomic_add_fetch(&global_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Whether all threads that were looking things up before @epoch was
+ * reached are done */
+static bool readers_past(uint64_t epoch)
+{
+    struct reader *reader;
+
+    for (reader = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); reader;
+         reader = reader->next) {
+        uint64_t reader_epoch = __atomic_load_n(&reader->epoch,
+                                                __ATOMIC_SEQ_CST);
+
+        if (reader_epoch && reader_epoch < epoch)
+            return false;
+    }
+
+    return true;
+}
+
+static void wait_for_readers(void)
+{
+    uint64_t epoch = advance_epoch();
+
+    while (!readers_past(epoch))
+        sched_yield();
+}
 
 static clockid_t detect_fastest_monotonic_clock(void)
 {
@@ -94,29 +305,50 @@ static ALWAYS_INLINE void clock_monotonic_gettime(struct cache_t *cache,
         lwan_status_perror("clock_gettime");
 }
 
+static struct cache_table *table_new(unsigned n_buckets)
+{
+    struct cache_table *table;
+
+    table = calloc(1, sizeof(*table) + n_buckets * sizeof(table->buckets[0]));
+    if (table)
+        table->mask = n_buckets - 1;
+
+    return table;
+}
+
 struct cache_t *cache_create(CreateEntryCallback create_entry_cb,
                              DestroyEntryCallback destroy_entry_cb,
                              void *cb_context,
                              time_t time_to_live)
 {
     struct cache_t *cache;
+    int shard;
 
     assert(create_entry_cb);
     assert(destroy_entry_cb);
     assert(time_to_live > 0);
 
-    cache = calloc(1, sizeof(*cache));
-    if (!cache)
+    /* Shards are aligned to cache lines */
+    if (posix_memalign((void **)&cache, 64, sizeof(*cache)))
         return NULL;
+    memset(cache, 0, sizeof(*cache));
+
+    for (shard = 0; shard < N_SHARDS; shard++) {
+        struct cache_shard *s = &cache->shards[shard];
 
-    cache->hash.table = hash_str_new(free, NULL);
-    if (!cache->hash.table)
-        goto error_no_hash;
+        s->table = table_new(INITIAL_BUCKETS);
+        if (!s->table)
+            goto error;
+
+        if (pthread_mutex_init(&s->lock, NULL)) {
+            free(s->table);
+            goto error;
+        }
 
-    if (pthread_rwlock_init(&cache->hash.lock, NULL))
-        goto error_no_hash_lock;
-    if (pthread_rwlock_init(&cache->queue.lock, NULL))
-        goto error_no_queue_lock;
+        list_head_init(&s->queue);
+        list_head_init(&s->negative_queue);
+        list_head_init(&s->unlinked);
+    }
 
     cache->cb.create_entry = create_entry_cb;
     cache->cb.destroy_entry = destroy_entry_cb;
@@ -125,83 +357,474 @@ struct cache_t *cache_create(CreateEntryCallback create_entry_cb,
     cache->settings.clock_id = detect_fastest_monotonic_clock();
     cache->settings.time_to_live = time_to_live;
 
-    list_head_init(&cache->queue.list);
-
     lwan_job_add(cache_pruner_job, cache);
 
     return cache;
 
-error_no_queue_lock:
-    pthread_rwlock_destroy(&cache->hash.lock);
-error_no_hash_lock:
-    hash_free(cache->hash.table);
-error_no_hash:
+error:
+    while (shard--) {
+        pthread_mutex_destroy(&cache->shards[shard].lock);
+        free(cache->shards[shard].table);
+    }
     free(cache);
 
     return NULL;
 }
 
+static unsigned round_up_to_power_of_two(unsigned value)
+{
+    unsigned power = 1;
+
+    while (power < value)
+        power <<= 1;
+
+    return power;
+}
+
+static struct cache_sketch *sketch_new(unsigned expected_entries)
+{
+    struct cache_sketch *sketch;
+    unsigned width;
+
+    if (expected_entries < SKETCH_MIN_WIDTH)
+        width = SKETCH_MIN_WIDTH;
+    else if (expected_entries > SKETCH_MAX_WIDTH)
+        width = SKETCH_MAX_WIDTH;
+    else
+        width = round_up_to_power_of_two(expected_entries);
+
+    sketch = calloc(1, sizeof(*sketch) + SKETCH_ROWS * width);
+    if (sketch) {
+        sketch->mask = width - 1;
+        sketch->sample_size = 10 * width;
+    }
+
+    return sketch;
+}
+
+bool cache_set_limits(struct cache_t *cache, size_t max_bytes,
+                      unsigned max_entries)
+{
+    assert(cache);
+
+    if (!max_bytes && !max_entries)
+        return true;
+
+    for (int shard = 0; shard < N_SHARDS; shard++) {
+        struct cache_shard *s = &cache->shards[shard];
+
+        if (max_bytes)
+            s->limits.max_bytes = max_bytes / N_SHARDS ? max_bytes / N_SHARDS : 1;
+        if (max_entries)
+            s->limits.max_entries = max_entries / N_SHARDS ? max_entries / N_SHARDS : 1;
+
+        /* Without an entry limit, the number of entries the sketch has
+         * to tell apart is anybody's guess */
+        s->limits.sketch = sketch_new(max_entries ? s->limits.max_entries : 1024);
+        if (!s->limits.sketch) {
+            while (shard--) {
+                free(cache->shards[shard].limits.sketch);
+                cache->shards[shard].limits.sketch = NULL;
+            }
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void cache_set_stale_while_revalidate(struct cache_t *cache, time_t period)
+{
+    assert(cache);
+    assert(period >= 0);
+
+    cache->settings.stale_while_revalidate = period;
+}
+
+void cache_set_negative_ttl(struct cache_t *cache, time_t time_to_live)
+{
+    assert(cache);
+    assert(time_to_live >= 0);
+
+    cache->settings.negative_time_to_live = time_to_live;
+}
+
+void cache_set_revalidate_callback(struct cache_t *cache,
+                                   RevalidateEntryCallback revalidate_entry_cb)
+{
+    assert(cache);
+
+    cache->cb.revalidate_entry = revalidate_entry_cb;
+}
+
+void cache_get_stats(struct cache_t *cache, struct cache_stats *stats)
+{
+    assert(cache);
+    assert(stats);
+
+    memset(stats, 0, sizeof(*stats));
+
+    for (int shard = 0; shard < N_SHARDS; shard++) {
+        struct cache_shard *s = &cache->shards[shard];
+
+        stats->hits += __atomic_load_n(&s->stats.hits, __ATOMIC_RELAXED);
+        stats->misses += __atomic_load_n(&s->stats.misses, __ATOMIC_RELAXED);
+        stats->evictions += __atomic_load_n(&s->stats.evictions, __ATOMIC_RELAXED);
+        stats->rejections += __atomic_load_n(&s->stats.rejections, __ATOMIC_RELAXED);
+        stats->coalesced += __atomic_load_n(&s->stats.coalesced, __ATOMIC_RELAXED);
+        stats->refreshes += __atomic_load_n(&s->stats.refreshes, __ATOMIC_RELAXED);
+        stats->revalidations += __atomic_load_n(&s->stats.revalidations, __ATOMIC_RELAXED);
+        stats->invalidations += __atomic_load_n(&s->stats.invalidations, __ATOMIC_RELAXED);
+
+        pthread_mutex_lock(&s->lock);
+        stats->entries += s->n_entries;
+        stats->bytes += s->bytes;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
 void cache_destroy(struct cache_t *cache)
 {
     assert(cache);
 
 #ifndef NDEBUG
-    lwan_status_debug("Cache stats: %d hits, %d misses, %d evictions",
-                      cache->stats.hits, cache->stats.misses,
-                      cache->stats.evicted);
+    struct cache_stats stats;
+
+    cache_get_stats(cache, &stats);
+    lwan_status_debug("Cache stats: %" PRIu64 " hits, %" PRIu64 " misses, "
+                      "%" PRIu64 " evictions, %" PRIu64 " rejections, "
+                      "%" PRIu64 " coalesced, %" PRIu64 " refreshes, "
+                      "%" PRIu64 " revalidations, %" PRIu64 " invalidations",
+                      stats.hits, stats.misses, stats.evictions,
+                      stats.rejections, stats.coalesced, stats.refreshes,
+                      stats.revalidations, stats.invalidations);
 #endif
 
+    if (cache->settings.async_fill)
+        fill_pool_release(cache);
+
     lwan_job_del(cache_pruner_job, cache);
     cache->flags |= SHUTTING_DOWN;
     cache_pruner_job(cache);
-    pthread_rwlock_destroy(&cache->hash.lock);
-    pthread_rwlock_destroy(&cache->queue.lock);
-    hash_free(cache->hash.table);
+
+    for (int shard = 0; shard < N_SHARDS; shard++) {
+        pthread_mutex_destroy(&cache->shards[shard].lock);
+        free(cache->shards[shard].table);
+        free(cache->shards[shard].limits.sketch);
+    }
     free(cache);
 }
 
-static ALWAYS_INLINE void convert_to_temporary(struct cache_entry_t *entry)
+static ALWAYS_INLINE struct cache_shard *get_shard(struct cache_t *cache,
+                                                   unsigned hash)
 {
-    entry->flags = TEMPORARY;
+    return &cache->shards[hash & (N_SHARDS - 1)];
 }
 
-struct cache_entry_t *cache_get_and_ref_entry(struct cache_t *cache,
-                                              const char *key, int *error)
+static ALWAYS_INLINE struct cache_entry_t **
+get_bucket(struct cache_table *table, unsigned hash)
+{
+    return &table->buckets[(hash >> SHARD_BITS) & table->mask];
+}
+
+/* Might be called without the shard lock; chains might be rearranged
+ * while a table is being resized, so a NULL return is only a hint unless
+ * the lock is held. */
+static struct cache_entry_t *shard_find(struct cache_shard *shard,
+                                        const char *key, unsigned hash)
 {
+    struct cache_table *table = __atomic_load_n(&shard->table,
+                                                __ATOMIC_ACQUIRE);
     struct cache_entry_t *entry;
-    char *key_copy;
 
-    assert(cache);
-    assert(error);
-    assert(key);
+    for (entry = __atomic_load_n(get_bucket(table, hash), __ATOMIC_ACQUIRE);
+         entry; entry = __atomic_load_n(&entry->next, __ATOMIC_ACQUIRE)) {
+        if (entry->hash == hash && !strcmp(entry->key, key))
+            return entry;
+    }
 
-    *error = 0;
+    return NULL;
+}
 
-    /* If the lock can't be obtained, return an error to allow, for instance,
-     * yielding from the coroutine and trying to obtain the lock at a later
-     * time. */
-    if (UNLIKELY(pthread_rwlock_tryrdlock(&cache->hash.lock) == EBUSY)) {
-        *error = EWOULDBLOCK;
+/* Must be called with the shard lock held */
+static void shard_grow(struct cache_shard *shard)
+{
+    struct cache_table *old = shard->table;
+    struct cache_table *new = table_new((old->mask + 1) * 2);
+
+    if (UNLIKELY(!new))
+        return;
+
+    /* Entries are moved to the new table while lookups might be following
+     * their chains in the old one.  Entries are pushed to the head of the
+     * new chains, so every chain still ends, but a lookup might miss an
+     * entry; those retry with the lock held. */
+    for (unsigned bucket = 0; bucket <= old->mask; bucket++) {
+        struct cache_entry_t *entry = old->buckets[bucket];
+
+        while (entry) {
+            struct cache_entry_t *next = entry->next;
+            struct cache_entry_t **new_bucket = get_bucket(new, entry->hash);
+
+            __atomic_store_n(&entry->next, *new_bucket, __ATOMIC_RELEASE);
+            *new_bucket = entry;
+
+            entry = next;
+        }
+    }
+
+    __atomic_store_n(&shard->table, new, __ATOMIC_RELEASE);
+
+    old->retired_next = shard->retired;
+    shard->retired = old;
+}
+
+/* Must be called with the shard lock held */
+static void shard_add(struct cache_shard *shard, struct cache_entry_t *entry)
+{
+    struct cache_entry_t **bucket;
+
+    if (shard->n_entries > 2 * (shard->table->mask + 1))
+        shard_grow(shard);
+
+    bucket = get_bucket(shard->table, entry->hash);
+    entry->next = *bucket;
+    __atomic_store_n(bucket, entry, __ATOMIC_RELEASE);
+
+    list_add_tail((entry->flags & NEGATIVE) ? &shard->negative_queue :
+                                              &shard->queue,
+                  &entry->entries);
+    shard->n_entries++;
+    shard->bytes += entry->cost;
+}
+
+static struct cache_entry_t *queue_next(struct cache_shard *shard,
+                                        struct cache_entry_t *entry)
+{
+    if (entry->entries.next == &shard->queue.n)
         return NULL;
+
+    return list_entry(entry->entries.next, struct cache_entry_t, entries);
+}
+
+/* Must be called with the shard lock held */
+static void shard_del(struct cache_shard *shard, struct cache_entry_t *entry)
+{
+    struct cache_entry_t **link = get_bucket(shard->table, entry->hash);
+
+    /* entry->next is left alone: lookups might be standing on it */
+    for (; *link; link = &(*link)->next) {
+        if (*link == entry) {
+            __atomic_store_n(link, entry->next, __ATOMIC_RELEASE);
+            break;
+        }
     }
-    /* Find the item in the hash table. If it's there, increment the reference
-     * and return it. */
-    entry = hash_find(cache->hash.table, key);
-    if (LIKELY(entry)) {
-        ATOMIC_INC(entry->refs);
-        pthread_rwlock_unlock(&cache->hash.lock);
-#ifndef NDEBUG
-        ATOMIC_INC(cache->stats.hits);
-#endif
-        return entry;
+
+    if (shard->limits.hand == entry)
+        shard->limits.hand = queue_next(shard, entry);
+
+    list_del(&entry->entries);
+    shard->n_entries--;
+    shard->bytes -= entry->cost;
+}
+
+/* Must be called with the shard lock held */
+static void shard_requeue(struct cache_shard *shard,
+                          struct cache_entry_t *entry, time_t time_to_die)
+{
+    if (shard->limits.hand == entry)
+        shard->limits.hand = queue_next(shard, entry);
+
+    /* Still sorted, since every entry has the same time to live */
+    list_del(&entry->entries);
+    list_add_tail(&shard->queue, &entry->entries);
+
+    __atomic_store_n(&entry->time_to_die, time_to_die, __ATOMIC_RELAXED);
+}
+
+static ALWAYS_INLINE unsigned sketch_index(const struct cache_sketch *sketch,
+                                           unsigned hash, unsigned row)
+{
+    static const unsigned seeds[SKETCH_ROWS] = {
+        0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f
+    };
+    /* The lower bits are the same for every key in a shard */
+    unsigned h = (hash >> SHARD_BITS) * seeds[row];
+
+    return row * (sketch->mask + 1) + ((h ^ (h >> 16)) & sketch->mask);
+}
+
+static void sketch_increment(struct cache_sketch *sketch, unsigned hash)
+{
+    for (unsigned row = 0; row < SKETCH_ROWS; row++) {
+        uint8_t *counter = &sketch->counters[sketch_index(sketch, hash, row)];
+        uint8_t value = __atomic_load_n(counter, __ATOMIC_RELAXED);
+
+        if (value < SKETCH_COUNTER_MAX)
+            __atomic_store_n(counter, (uint8_t)(value + 1), __ATOMIC_RELAXED);
     }
 
-    /* Unlock the cache so the item can be created. */
-    pthread_rwlock_unlock(&cache->hash.lock);
+    __atomic_store_n(&sketch->additions,
+                     __atomic_load_n(&sketch->additions, __ATOMIC_RELAXED) + 1,
+                     __ATOMIC_RELAXED);
+}
 
-#ifndef NDEBUG
-    ATOMIC_INC(cache->stats.misses);
-#endif
+static unsigned sketch_frequency(const struct cache_sketch *sketch,
+                                 unsigned hash)
+{
+    unsigned frequency = SKETCH_COUNTER_MAX;
+
+    for (unsigned row = 0; row < SKETCH_ROWS; row++) {
+        unsigned value = __atomic_load_n(
+            &sketch->counters[sketch_index(sketch, hash, row)],
+            __ATOMIC_RELAXED);
+
+        if (value < frequency)
+            frequency = value;
+    }
+
+    return frequency;
+}
+
+/* Must be called with the shard lock held */
+static void sketch_age(struct cache_sketch *sketch)
+{
+    unsigned n_counters = SKETCH_ROWS * (sketch->mask + 1);
+
+    if (__atomic_load_n(&sketch->additions, __ATOMIC_RELAXED) < sketch->sample_size)
+        return;
+
+    for (unsigned i = 0; i < n_counters; i++) {
+        uint8_t value = __atomic_load_n(&sketch->counters[i], __ATOMIC_RELAXED);
+
+        __atomic_store_n(&sketch->counters[i], (uint8_t)(value >> 1),
+                         __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&sketch->additions, sketch->sample_size / 2,
+                     __ATOMIC_RELAXED);
+}
+
+/* Must be called with the shard lock held.  Entries that have been used
+ * since the hand last went past them get a second chance. */
+static struct cache_entry_t *shard_clock_victim(struct cache_shard *shard)
+{
+    struct cache_entry_t *entry = shard->limits.hand;
+
+    for (unsigned visited = 0; visited <= 2 * shard->n_entries; visited++) {
+        if (!entry) {
+            entry = list_top(&shard->queue, struct cache_entry_t, entries);
+            if (!entry)
+                break;
+        }
+
+        if (!__atomic_exchange_n(&entry->referenced, 0, __ATOMIC_RELAXED)) {
+            shard->limits.hand = entry;
+            return entry;
+        }
+
+        entry = queue_next(shard, entry);
+    }
+
+    return NULL;
+}
+
+static ALWAYS_INLINE bool shard_over_limits(const struct cache_shard *shard,
+                                            size_t cost)
+{
+    if (shard->limits.max_entries &&
+        shard->n_entries + 1 > shard->limits.max_entries)
+        return true;
+
+    return shard->limits.max_bytes &&
+           shard->bytes + cost > shard->limits.max_bytes;
+}
+
+/* Must be called with the shard lock held.  Evicts entries until
+ * @candidate fits, as long as it's been used more often than them;
+ * returns false if it should not be kept. */
+static bool shard_make_room(struct cache_shard *shard,
+                            const struct cache_entry_t *candidate)
+{
+    const struct cache_sketch *sketch = shard->limits.sketch;
+    unsigned candidate_frequency;
+    bool evicted = false;
+    bool admit = true;
+
+    if (!sketch)
+        return true;
+
+    if (shard->limits.max_bytes && candidate->cost > shard->limits.max_bytes)
+        return false;
+
+    candidate_frequency = sketch_frequency(sketch, candidate->hash);
+
+    while (shard_over_limits(shard, candidate->cost)) {
+        struct cache_entry_t *victim;
+
+        /* Negative entries are cheap to create again, so they go first,
+         * oldest first; unless the candidate is one as well, in which case
+         * it has to earn its place like any other */
+        victim = list_top(&shard->negative_queue, struct cache_entry_t, entries);
+        if (!victim || (candidate->flags & NEGATIVE)) {
+            if (!victim)
+                victim = shard_clock_victim(shard);
+
+            if (!victim ||
+                candidate_frequency <= sketch_frequency(sketch, victim->hash)) {
+                admit = false;
+                break;
+            }
+        }
+
+        shard_del(shard, victim);
+        list_add_tail(&shard->unlinked, &victim->entries);
+        STATS_ADD(shard, evictions, 1);
+        evicted = true;
+    }
+
+    /* Lookups that might have found the victims started before this */
+    if (evicted)
+        shard->unlinked_epoch = advance_epoch();
+
+    return admit;
+}
+
+static ALWAYS_INLINE void convert_to_temporary(struct cache_entry_t *entry)
+{
+    entry->flags = TEMPORARY | (entry->flags & NEGATIVE);
+}
+
+static void destroy_entry(struct cache_t *cache, struct cache_entry_t *entry)
+{
+    free(entry->key);
+
+    if (entry->flags & NEGATIVE)
+        free(entry);
+    else
+        cache->cb.destroy_entry(entry, cache->cb.context);
+}
+
+/* Drops the reference held by the hash table on entries that have been
+ * removed from it; if someone else is still holding an entry, they'll
+ * destroy it once they're done. */
+static void release_entries(struct cache_t *cache, struct list_head *list)
+{
+    struct cache_entry_t *node, *next;
+
+    list_for_each_safe(list, node, next, entries) {
+        if (!ATOMIC_DEC(node->refs))
+            destroy_entry(cache, node);
+    }
+}
+
+static struct cache_entry_t *create_entry(struct cache_t *cache,
+                                          const char *key, unsigned hash,
+                                          int *error)
+{
+    struct cache_entry_t *entry;
+    char *key_copy;
+    size_t cost;
 
     key_copy = strdup(key);
     if (UNLIKELY(!key_copy)) {
@@ -210,154 +833,750 @@ struct cache_entry_t *cache_get_and_ref_entry(struct cache_t *cache,
     }
 
     entry = cache->cb.create_entry(key, cache->cb.context);
-    if (!entry) {
-        free(key_copy);
-        return NULL;
+    if (entry) {
+        cost = cache->shards[0].limits.sketch ? entry->cost : 0;
+        memset(entry, 0, sizeof(*entry));
+    } else {
+        if (!cache->settings.negative_time_to_live ||
+            !(entry = calloc(1, sizeof(*entry)))) {
+            free(key_copy);
+            return NULL;
+        }
+
+        cost = sizeof(*entry) + strlen(key) + 1;
+        entry->flags = NEGATIVE;
     }
 
-    memset(entry, 0, sizeof(*entry));
     entry->key = key_copy;
-    entry->refs = 1;
-
-    if (pthread_rwlock_trywrlock(&cache->hash.lock) == EBUSY) {
-        /* Couldn't obtain hash lock: instead of waiting, just return
-         * the recently-created item as a temporary item. Might result
-         * in starvation, though, so this might be changed back to
-         * pthread_rwlock_wrlock() again someday if this proves to be
-         * a problem. */
+    entry->hash = hash;
+    entry->cost = cost;
+
+    return entry;
+}
+
+/* Must be called with the shard lock held */
+static void shard_unlink(struct cache_shard *shard, struct cache_entry_t *entry)
+{
+    shard_del(shard, entry);
+    list_add_tail(&shard->unlinked, &entry->entries);
+    shard->unlinked_epoch = advance_epoch();
+}
+
+/* Must be called with the shard lock held.  Unlinked entries that no
+ * lookup can be looking at are moved to @reclaim, to be released after
+ * the lock is dropped; the pruner waits for the others. */
+static void shard_reclaim(struct cache_shard *shard, struct list_head *reclaim)
+{
+    if (!list_empty(&shard->unlinked) && readers_past(shard->unlinked_epoch))
+        list_append_list(reclaim, &shard->unlinked);
+}
+
+/* Must be called with the shard lock held.  Adds @entry to the shard,
+ * replacing @replacing (if it's still there); @invalidations is what
+ * shard->invalidations was before @entry started being created.  Returns
+ * @entry with a reference for the caller; if there's another entry for the
+ * same key, no room for it, or it might be out of date already, it's
+ * returned as a TEMPORARY entry instead. */
+static struct cache_entry_t *shard_insert(struct cache_t *cache,
+                                          struct cache_shard *shard,
+                                          struct cache_entry_t *entry,
+                                          struct cache_entry_t *replacing,
+                                          unsigned invalidations)
+{
+    struct cache_entry_t *existing = shard_find(shard, entry->key, entry->hash);
+    struct timespec time_to_die;
+
+    if (UNLIKELY(shard->invalidations != invalidations)) {
+        /* Whatever it was created from might have changed in the
+         * meantime; the next lookup creates it again */
+        entry->refs = 1;
         convert_to_temporary(entry);
         return entry;
     }
 
-    if (!hash_add_unique(cache->hash.table, entry->key, entry)) {
-        struct timespec time_to_die;
-        clock_monotonic_gettime(cache, &time_to_die);
-        entry->time_to_die = time_to_die.tv_sec + cache->settings.time_to_live;
-
-        if (LIKELY(!pthread_rwlock_wrlock(&cache->queue.lock))) {
-            list_add_tail(&cache->queue.list, &entry->entries);
-            pthread_rwlock_unlock(&cache->queue.lock);
-        } else {
+    if (existing) {
+        if (existing != replacing) {
+            /* Someone else created the same entry in the meantime (or the
+             * lookup missed it while the table was being resized).  Return
+             * the recently-created entry as a TEMPORARY one, so that it's
+             * destroyed the first time it's unreffed. */
+            entry->refs = 1;
             convert_to_temporary(entry);
+            return entry;
         }
-    } else {
-        /* Either there's another item with the same key (-EEXIST), or
-         * there was an error inside the hash table. In either case,
-         * just return a TEMPORARY entry so that it is destroyed the first
-         * time someone unrefs this entry. TEMPORARY entries are pretty much
-         * like FLOATING entries, but unreffing them do not use atomic
-         * operations. */
+
+        shard_unlink(shard, existing);
+    }
+
+    if (!shard_make_room(shard, entry)) {
+        STATS_ADD(shard, rejections, 1);
+
+        entry->refs = 1;
         convert_to_temporary(entry);
+        return entry;
     }
 
-    pthread_rwlock_unlock(&cache->hash.lock);
+    /* One reference for the caller, one for the hash table */
+    entry->refs = 2;
+
+    /* Queues are kept sorted by inserting with the lock held */
+    clock_monotonic_gettime(cache, &time_to_die);
+    entry->time_to_die = time_to_die.tv_sec +
+        ((entry->flags & NEGATIVE) ? cache->settings.negative_time_to_live :
+                                     cache->settings.time_to_live);
+
+    shard_add(shard, entry);
+
     return entry;
 }
 
-void cache_entry_unref(struct cache_t *cache, struct cache_entry_t *entry)
+static void fill_unref(void *data)
 {
-    assert(entry);
+    struct cache_fill *fill = data;
+
+    if (!ATOMIC_DEC(fill->refs)) {
+        if (fill->entry)
+            cache_entry_unref(fill->cache, fill->entry);
+        free(fill->waiters.conns);
+        free(fill->key);
+        free(fill);
+    }
+}
+
+/* Must be called with the shard lock held */
+static struct cache_fill *shard_find_fill(struct cache_shard *shard,
+                                          const char *key, unsigned hash)
+{
+    struct cache_fill *fill;
 
-    if (entry->flags & TEMPORARY) {
-        free(entry->key);
-        goto destroy_entry;
+    for (fill = shard->fills; fill; fill = fill->next) {
+        if (fill->hash == hash && !strcmp(fill->key, key))
+            return fill;
     }
 
-    if (ATOMIC_DEC(entry->refs))
-        return;
+    return NULL;
+}
 
-    /* FLOATING entries without references won't be picked up by the pruner
-     * job, so destroy them right here. */
-    if (entry->flags & FLOATING) {
-destroy_entry:
-        /* FIXME: There's a race condition here: if the cache is destroyed
-         * while there are cache items floating around, this will dereference
-         * deallocated memory. */
-        cache->cb.destroy_entry(entry, cache->cb.context);
+/* Must be called with the shard lock held */
+static struct cache_fill *shard_start_fill(struct cache_t *cache,
+                                           struct cache_shard *shard,
+                                           const char *key, unsigned hash)
+{
+    struct cache_fill *fill = calloc(1, sizeof(*fill));
+
+    if (UNLIKELY(!fill))
+        return NULL;
+
+    fill->key = strdup(key);
+    if (UNLIKELY(!fill->key)) {
+        free(fill);
+        return NULL;
     }
+
+    fill->cache = cache;
+    fill->hash = hash;
+    fill->invalidations = shard->invalidations;
+    fill->refs = 1;
+    fill->next = shard->fills;
+    shard->fills = fill;
+
+    return fill;
 }
 
-static bool cache_pruner_job(void *data)
+/* Must be called with the shard lock held */
+static void fill_remove_waiter(struct cache_fill *fill, lwan_connection_t *conn)
+{
+    for (size_t i = 0; i < fill->waiters.len; i++) {
+        if (fill->waiters.conns[i] == conn) {
+            fill->waiters.conns[i] = fill->waiters.conns[--fill->waiters.len];
+            return;
+        }
+    }
+}
+
+/* Must be called with the shard lock held; it's released by this
+ * function.  Suspends the coroutine until @fill is done; returns false if
+ * the connection timed out first (the fill might be stuck). */
+static bool shard_wait_for_fill(struct cache_shard *shard,
+                                struct cache_fill *fill, coro_t *coro)
+{
+    lwan_connection_t *conn = coro_get_data(coro);
+    lwan_connection_t *waiter = lwan_connection_wakeup_target(conn);
+    bool suspend = true;
+
+    if (fill->waiters.len == fill->waiters.size) {
+        size_t size = fill->waiters.size ? fill->waiters.size * 2 : 4;
+        lwan_connection_t **conns = realloc(fill->waiters.conns,
+                                            size * sizeof(*conns));
+
+        if (LIKELY(conns)) {
+            fill->waiters.conns = conns;
+            fill->waiters.size = size;
+        }
+    }
+
+    /* Without room to be woken up, just poll */
+    if (LIKELY(fill->waiters.len < fill->waiters.size))
+        fill->waiters.conns[fill->waiters.len++] = waiter;
+    else
+        suspend = false;
+
+    ATOMIC_INC(fill->refs);
+    pthread_mutex_unlock(&shard->lock);
+
+    /* Connections might be woken up for other reasons (e.g. timeouts), and
+     * might be woken up after this coroutine has finished, if the
+     * connection is closed in the meantime; neither is a problem. */
+    coro_defer(coro, fill_unref, fill);
+    while (!__atomic_load_n(&fill->done, __ATOMIC_ACQUIRE)) {
+        if (!suspend) {
+            coro_yield(coro, CONN_CORO_MAY_RESUME);
+            continue;
+        }
+
+        lwan_connection_suspend(conn);
+        if (!(conn->flags & CONN_TIMED_OUT))
+            continue;
+
+        /* Waiters are only woken up once the fill is done, and that's
+         * set with the lock held */
+        pthread_mutex_lock(&shard->lock);
+        if (!fill->done) {
+            fill_remove_waiter(fill, waiter);
+            pthread_mutex_unlock(&shard->lock);
+            return false;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    return true;
+}
+
+static struct cache_entry_t *finish_fill(struct cache_t *cache,
+                                         struct cache_shard *shard,
+                                         struct cache_fill *fill,
+                                         struct cache_entry_t *entry,
+                                         int error)
+{
+    struct cache_fill **link;
+    struct list_head reclaim;
+
+    list_head_init(&reclaim);
+
+    pthread_mutex_lock(&shard->lock);
+
+    for (link = &shard->fills; *link != fill; link = &(*link)->next)
+        ;
+    *link = fill->next;
+
+    if (entry)
+        entry = shard_insert(cache, shard, entry, NULL, fill->invalidations);
+
+    fill->failed = !entry;
+    fill->error = error;
+    if (fill->async) {
+        fill->entry = entry;
+        entry = NULL;
+    }
+    __atomic_store_n(&fill->done, true, __ATOMIC_RELEASE);
+
+    shard_reclaim(shard, &reclaim);
+
+    pthread_mutex_unlock(&shard->lock);
+
+    /* Nothing else is added to the list after the fill is done */
+    for (size_t i = 0; i < fill->waiters.len; i++)
+        lwan_connection_wake_from_any_thread(fill->waiters.conns[i]);
+
+    fill_unref(fill);
+    release_entries(cache, &reclaim);
+
+    return entry;
+}
+
+static ALWAYS_INLINE bool entry_is_stale(struct cache_t *cache,
+                                         const struct cache_entry_t *entry)
 {
-    struct cache_t *cache = data;
-    struct cache_entry_t *node, *next;
     struct timespec now;
-    bool shutting_down = cache->flags & SHUTTING_DOWN;
-    unsigned evicted = 0;
-    struct list_head queue;
 
-    if (UNLIKELY(pthread_rwlock_trywrlock(&cache->queue.lock) == EBUSY))
+    clock_monotonic_gettime(cache, &now);
+    return now.tv_sec >= __atomic_load_n(&entry->time_to_die, __ATOMIC_RELAXED);
+}
+
+/* Called with a reference to @stale, which is dropped.  Returns a fresh
+ * entry for the same key, or NULL if it couldn't be created (e.g. it
+ * doesn't exist anymore). */
+static struct cache_entry_t *refresh_entry(struct cache_t *cache,
+                                           struct cache_shard *shard,
+                                           struct cache_entry_t *stale,
+                                           int *error)
+{
+    struct cache_entry_t *fresh;
+    struct list_head reclaim;
+    unsigned invalidations = __atomic_load_n(&shard->invalidations,
+                                             __ATOMIC_RELAXED);
+
+    STATS_ADD(shard, refreshes, 1);
+
+    fresh = create_entry(cache, stale->key, stale->hash, error);
+
+    list_head_init(&reclaim);
+
+    pthread_mutex_lock(&shard->lock);
+
+    if (fresh)
+        fresh = shard_insert(cache, shard, fresh, stale, invalidations);
+    else if (shard_find(shard, stale->key, stale->hash) == stale)
+        shard_unlink(shard, stale);
+
+    shard_reclaim(shard, &reclaim);
+
+    pthread_mutex_unlock(&shard->lock);
+
+    release_entries(cache, &reclaim);
+    cache_entry_unref(cache, stale);
+
+    return fresh;
+}
+
+/* Called with a reference to @stale, which is returned with another time
+ * to live if the revalidation callback says it's still good.  Otherwise,
+ * it's dropped and replaced (see refresh_entry()). */
+static struct cache_entry_t *revalidate_entry(struct cache_t *cache,
+                                              struct cache_shard *shard,
+                                              struct cache_entry_t *stale,
+                                              int *error)
+{
+    struct timespec now;
+
+    if (!cache->cb.revalidate_entry || (stale->flags & NEGATIVE) ||
+        !cache->cb.revalidate_entry(stale, cache->cb.context))
+        return refresh_entry(cache, shard, stale, error);
+
+    STATS_ADD(shard, revalidations, 1);
+
+    clock_monotonic_gettime(cache, &now);
+
+    pthread_mutex_lock(&shard->lock);
+    if (shard_find(shard, stale->key, stale->hash) == stale)
+        shard_requeue(shard, stale, now.tv_sec + cache->settings.time_to_live);
+    pthread_mutex_unlock(&shard->lock);
+
+    __atomic_fetch_and(&stale->flags, ~(unsigned)REFRESHING, __ATOMIC_RELAXED);
+
+    return stale;
+}
+
+/* Work for the job pool: either an entry to create for @fill, or @stale
+ * to be revalidated */
+struct fill_job {
+    struct cache_t *cache;
+    struct cache_shard *shard;
+    struct cache_fill *fill;
+    struct cache_entry_t *stale;
+};
+
+static void run_fill_job(void *data)
+{
+    struct fill_job *job = data;
+    struct cache_entry_t *entry;
+    int error = 0;
+
+    if (job->fill) {
+        entry = create_entry(job->cache, job->fill->key, job->fill->hash,
+                             &error);
+        /* Hands the entry over to the coroutine waiting for it */
+        finish_fill(job->cache, job->shard, job->fill, entry, error);
+    } else {
+        entry = revalidate_entry(job->cache, job->shard, job->stale, &error);
+        if (entry)
+            cache_entry_unref(job->cache, entry);
+    }
+
+    free(job);
+}
+
+/* Waits for the jobs queued for @cache, and lets go of the pool */
+static void fill_pool_release(struct cache_t *cache)
+{
+    lwan_job_pool_wait(&cache->pending_fills);
+    lwan_job_pool_release();
+}
+
+static bool fill_pool_queue(struct cache_t *cache, struct cache_shard *shard,
+                            struct cache_fill *fill, struct cache_entry_t *stale)
+{
+    struct fill_job *job = malloc(sizeof(*job));
+
+    if (UNLIKELY(!job))
         return false;
 
-    /* If the queue is empty, there's nothing to do; unlock/return*/
-    if (list_empty(&cache->queue.list)) {
-        if (UNLIKELY(pthread_rwlock_unlock(&cache->queue.lock)))
-            lwan_status_perror("pthread_rwlock_unlock");
+    *job = (struct fill_job) {
+        .cache = cache,
+        .shard = shard,
+        .fill = fill,
+        .stale = stale,
+    };
+
+    if (UNLIKELY(!lwan_job_pool_queue(run_fill_job, job,
+                                      &cache->pending_fills))) {
+        free(job);
         return false;
     }
 
-    /* There are things to do; assign cache queue to a local queue,
-     * initialize cache queue to an empty queue. Then unlock */
-    list_head_init(&queue);
-    list_append_list(&queue, &cache->queue.list);
-    list_head_init(&cache->queue.list);
+    return true;
+}
+
+bool cache_enable_async_fill(struct cache_t *cache)
+{
+    assert(cache);
+
+    if (cache->settings.async_fill)
+        return true;
+
+    if (!lwan_job_pool_acquire())
+        return false;
+
+    cache->settings.async_fill = true;
+    return true;
+}
+
+static struct cache_entry_t *get_and_ref_entry(struct cache_t *cache,
+                                               const char *key, int *error,
+                                               coro_t *coro)
+{
+    struct reader *reader = get_reader();
+    unsigned hash = hash_str(key);
+    struct cache_shard *shard = get_shard(cache, hash);
+    struct cache_sketch *sketch = shard->limits.sketch;
+    struct cache_entry_t *entry;
+    struct cache_fill *fill;
+    unsigned invalidations;
 
-    if (UNLIKELY(pthread_rwlock_unlock(&cache->queue.lock))) {
-        lwan_status_perror("pthread_rwlock_unlock");
-        goto end;
+    assert(cache);
+    assert(error);
+    assert(key);
+
+    *error = 0;
+
+retry:
+    /* Find the item in the hash table. If it's there, increment the reference
+     * and return it.  Entries found here have at least the reference held
+     * by the hash table until this thread leaves the current epoch. */
+    reader_enter(reader);
+    entry = shard_find(shard, key, hash);
+    if (LIKELY(entry))
+        ATOMIC_INC(entry->refs);
+    reader_leave(reader);
+
+    if (LIKELY(entry)) {
+        /* Only count one use per CLOCK sweep, so that frequently used
+         * entries don't keep writing to the sketch */
+        if (sketch && !__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&entry->referenced, 1, __ATOMIC_RELAXED);
+            sketch_increment(sketch, hash);
+        }
+
+        STATS_ADD(shard, hits, 1);
+
+        /* Only one lookup revalidates a stale entry; the others keep using
+         * it in the meantime */
+        if (UNLIKELY(cache->settings.stale_while_revalidate ||
+                     cache->cb.revalidate_entry ||
+                     (__atomic_load_n(&entry->flags, __ATOMIC_RELAXED) &
+                      NEGATIVE)) &&
+            UNLIKELY(entry_is_stale(cache, entry)) &&
+            !(__atomic_fetch_or(&entry->flags, REFRESHING, __ATOMIC_RELAXED) &
+              REFRESHING)) {
+            /* Without a stale-while-revalidate period, the caller has to
+             * wait for the outcome */
+            if (cache->settings.async_fill &&
+                cache->settings.stale_while_revalidate) {
+                /* The job gets a reference of its own */
+                ATOMIC_INC(entry->refs);
+                if (LIKELY(fill_pool_queue(cache, shard, NULL, entry)))
+                    return entry;
+                ATOMIC_DEC(entry->refs);
+            }
+
+            return revalidate_entry(cache, shard, entry, error);
+        }
+
+        return entry;
+    }
+
+    STATS_ADD(shard, misses, 1);
+
+    pthread_mutex_lock(&shard->lock);
+
+    if (sketch) {
+        sketch_increment(sketch, hash);
+        sketch_age(sketch);
+    }
+
+    fill = shard_find_fill(shard, key, hash);
+    if (fill) {
+        if (coro) {
+            if (UNLIKELY(!shard_wait_for_fill(shard, fill, coro))) {
+                *error = ETIMEDOUT;
+                return NULL;
+            }
+            STATS_ADD(shard, coalesced, 1);
+
+            if (fill->failed) {
+                *error = fill->error;
+                return NULL;
+            }
+
+            /* Most likely in the table now */
+            goto retry;
+        }
+
+        /* Can't wait for it; create a temporary copy */
+        fill = NULL;
+    } else {
+        entry = shard_find(shard, key, hash);
+        if (entry) {
+            /* Added after the lookup above */
+            ATOMIC_INC(entry->refs);
+            pthread_mutex_unlock(&shard->lock);
+            return entry;
+        }
+
+        fill = shard_start_fill(cache, shard, key, hash);
+
+        if (fill && coro && cache->settings.async_fill &&
+            LIKELY(fill_pool_queue(cache, shard, fill, NULL))) {
+            /* Not seen by anybody else until the lock is released */
+            fill->async = true;
+            if (UNLIKELY(!shard_wait_for_fill(shard, fill, coro))) {
+                /* The entry is released with the fill */
+                *error = ETIMEDOUT;
+                return NULL;
+            }
+
+            entry = fill->entry;
+            fill->entry = NULL;
+            if (!entry)
+                *error = fill->error;
+
+            return entry;
+        }
+    }
+
+    invalidations = shard->invalidations;
+    pthread_mutex_unlock(&shard->lock);
+
+    entry = create_entry(cache, key, hash, error);
+
+    if (LIKELY(fill))
+        return finish_fill(cache, shard, fill, entry, *error);
+
+    if (entry) {
+        struct list_head reclaim;
+
+        list_head_init(&reclaim);
+
+        pthread_mutex_lock(&shard->lock);
+        entry = shard_insert(cache, shard, entry, NULL, invalidations);
+        shard_reclaim(shard, &reclaim);
+        pthread_mutex_unlock(&shard->lock);
+
+        release_entries(cache, &reclaim);
+    }
+
+    return entry;
+}
+
+/* Negative entries are returned by get_and_ref_entry() like any other */
+static ALWAYS_INLINE struct cache_entry_t *
+positive_entry(struct cache_t *cache, struct cache_entry_t *entry, int *error)
+{
+    if (UNLIKELY(entry != NULL) &&
+        UNLIKELY(__atomic_load_n(&entry->flags, __ATOMIC_RELAXED) & NEGATIVE)) {
+        cache_entry_unref(cache, entry);
+        *error = ENOENT;
+        return NULL;
+    }
+
+    return entry;
+}
+
+struct cache_entry_t *cache_get_and_ref_entry(struct cache_t *cache,
+                                              const char *key, int *error)
+{
+    return positive_entry(cache, get_and_ref_entry(cache, key, error, NULL),
+                          error);
+}
+
+void cache_invalidate(struct cache_t *cache, const char *key)
+{
+    unsigned hash = hash_str(key);
+    struct cache_shard *shard = get_shard(cache, hash);
+    struct cache_entry_t *entry;
+    struct list_head reclaim;
+
+    assert(cache);
+    assert(key);
+
+    list_head_init(&reclaim);
+
+    pthread_mutex_lock(&shard->lock);
+
+    /* Entries for the same key being created right now aren't kept
+     * either.  (This counts every key in the shard, but invalidations
+     * should be rare.) */
+    __atomic_store_n(&shard->invalidations, shard->invalidations + 1,
+                     __ATOMIC_RELAXED);
+
+    entry = shard_find(shard, key, hash);
+    if (entry) {
+        shard_unlink(shard, entry);
+        STATS_ADD(shard, invalidations, 1);
+    }
+
+    shard_reclaim(shard, &reclaim);
+
+    pthread_mutex_unlock(&shard->lock);
+
+    release_entries(cache, &reclaim);
+}
+
+void cache_invalidate_negative(struct cache_t *cache)
+{
+    struct list_head reclaim;
+
+    assert(cache);
+
+    list_head_init(&reclaim);
+
+    for (int s = 0; s < N_SHARDS; s++) {
+        struct cache_shard *shard = &cache->shards[s];
+        struct cache_entry_t *node, *next;
+        unsigned dropped = 0;
+
+        pthread_mutex_lock(&shard->lock);
+
+        __atomic_store_n(&shard->invalidations, shard->invalidations + 1,
+                         __ATOMIC_RELAXED);
+
+        list_for_each_safe(&shard->negative_queue, node, next, entries) {
+            shard_del(shard, node);
+            list_add_tail(&shard->unlinked, &node->entries);
+            dropped++;
+        }
+
+        if (dropped) {
+            shard->unlinked_epoch = advance_epoch();
+            STATS_ADD(shard, invalidations, dropped);
+        }
+
+        shard_reclaim(shard, &reclaim);
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    release_entries(cache, &reclaim);
+}
+
+void cache_entry_unref(struct cache_t *cache, struct cache_entry_t *entry)
+{
+    assert(entry);
+
+    /* TEMPORARY entries are never shared, so there's no need to use atomic
+     * operations to drop their only reference. */
+    if (__atomic_load_n(&entry->flags, __ATOMIC_RELAXED) & TEMPORARY) {
+        destroy_entry(cache, entry);
+        return;
     }
 
+    /* FIXME: There's a race condition here: if the cache is destroyed
+     * while there are cache items floating around, this will dereference
+     * deallocated memory. */
+    if (!ATOMIC_DEC(entry->refs))
+        destroy_entry(cache, entry);
+}
+
+static bool cache_pruner_job(void *data)
+{
+    struct cache_t *cache = data;
+    struct cache_table *retired_tables = NULL;
+    struct cache_entry_t *node, *next;
+    struct timespec now;
+    bool shutting_down = cache->flags & SHUTTING_DOWN;
+    time_t grace = cache->settings.stale_while_revalidate;
+    unsigned evicted = 0;
+    struct list_head evicted_list;
+
+    list_head_init(&evicted_list);
     clock_monotonic_gettime(cache, &now);
-    list_for_each_safe(&queue, node, next, entries) {
-        char *key = node->key;
 
-        if (now.tv_sec < node->time_to_die && LIKELY(!shutting_down))
-            break;
+    /* Give entries that can be revalidated a chance to be used again */
+    if (cache->cb.revalidate_entry && grace < cache->settings.time_to_live)
+        grace = cache->settings.time_to_live;
 
-        list_del(&node->entries);
+    for (int s = 0; s < N_SHARDS; s++) {
+        struct cache_shard *shard = &cache->shards[s];
+        unsigned expired = 0;
 
-        if (UNLIKELY(pthread_rwlock_wrlock(&cache->hash.lock))) {
-            lwan_status_perror("pthread_rwlock_wrlock");
-            continue;
+        pthread_mutex_lock(&shard->lock);
+
+        list_for_each_safe(&shard->queue, node, next, entries) {
+            if (now.tv_sec < node->time_to_die + grace &&
+                    LIKELY(!shutting_down))
+                break;
+
+            shard_del(shard, node);
+            list_add_tail(&evicted_list, &node->entries);
+            expired++;
+        }
+
+        list_for_each_safe(&shard->negative_queue, node, next, entries) {
+            if (now.tv_sec < node->time_to_die && LIKELY(!shutting_down))
+                break;
+
+            shard_del(shard, node);
+            list_add_tail(&evicted_list, &node->entries);
+            expired++;
         }
 
-        hash_del(cache->hash.table, key);
+        /* Entries evicted to make room for others, or replaced by fresh
+         * ones, that couldn't be freed right away */
+        if (!list_empty(&shard->unlinked)) {
+            list_append_list(&evicted_list, &shard->unlinked);
+            evicted++;
+        }
 
-        if (UNLIKELY(pthread_rwlock_unlock(&cache->hash.lock)))
-            lwan_status_perror("pthread_rwlock_unlock");
+        while (shard->retired) {
+            struct cache_table *table = shard->retired;
 
-        if (ATOMIC_INC(node->refs) == 1) {
-            cache->cb.destroy_entry(node, cache->cb.context);
-        } else {
-            ATOMIC_BITWISE(&node->flags, or, FLOATING);
-            /* Decrement the reference and see if we were genuinely the last one
-             * holding it.  If so, destroy the entry.  */
-            if (!ATOMIC_DEC(node->refs))
-                cache->cb.destroy_entry(node, cache->cb.context);
+            shard->retired = table->retired_next;
+            table->retired_next = retired_tables;
+            retired_tables = table;
         }
 
-        evicted++;
+        pthread_mutex_unlock(&shard->lock);
+
+        STATS_ADD(shard, evictions, expired);
+        evicted += expired;
     }
 
-    /* If local queue has been entirely processed, there's no need to
-     * append items in the cache queue to it; just update statistics and
-     * return */
-    if (list_empty(&queue))
-        goto end;
+    if (!evicted && !retired_tables)
+        return false;
 
-    /* Prepend local, unprocessed queue, to the cache queue. Since the cache
-     * item TTL is constant, items created later will be destroyed later. */
-    if (LIKELY(!pthread_rwlock_wrlock(&cache->queue.lock))) {
-        list_prepend_list(&cache->queue.list, &queue);
-        pthread_rwlock_unlock(&cache->queue.lock);
-    } else {
-        lwan_status_perror("pthread_rwlock_wrlock");
+    /* Nothing evicted above can be found by lookups anymore, but some
+     * might still be looking at them. */
+    wait_for_readers();
+
+    release_entries(cache, &evicted_list);
+
+    while (retired_tables) {
+        struct cache_table *table = retired_tables;
+
+        retired_tables = table->retired_next;
+        free(table);
     }
 
-end:
-#ifndef NDEBUG
-    ATOMIC_AAF(&cache->stats.evicted, evicted);
-#endif
     return evicted;
 }
 
@@ -365,30 +1584,22 @@ struct cache_entry_t*
 cache_coro_get_and_ref_entry(struct cache_t *cache, coro_t *coro,
                              const char *key)
 {
-    for (int tries = GET_AND_REF_TRIES; tries; tries--) {
-        int error;
-        struct cache_entry_t *ce = cache_get_and_ref_entry(cache, key, &error);
-
-        if (LIKELY(ce)) {
-            /*
-             * This is deferred here so that, if the coroutine is killed
-             * after it has been yielded, this cache entry is properly
-             * freed.
-             */
-            coro_defer2(coro, CORO_DEFER2(cache_entry_unref), cache, ce);
-            return ce;
-        }
+    int error = 0;
+    struct cache_entry_t *ce = get_and_ref_entry(cache, key, &error, coro);
 
-        /*
-         * If the cache would block while reading its hash table, yield and
-         * try again. On any other error, just return NULL.
-         */
-        if (error == EWOULDBLOCK) {
-            coro_yield(coro, CONN_CORO_MAY_RESUME);
-        } else {
-            break;
-        }
+    ce = positive_entry(cache, ce, &error);
+
+    if (UNLIKELY(!ce)) {
+        errno = error;
+        return NULL;
     }
 
-    return NULL;
+    /*
+     * This is deferred here so that, if the coroutine is killed
+     * after it has been yielded, this cache entry is properly
+     * freed.
+     */
+    coro_defer2(coro, CORO_DEFER2(cache_entry_unref), cache, ce);
+
+    return ce;
 }
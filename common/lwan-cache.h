@@ -19,6 +19,8 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
 #include "list.h"
@@ -26,16 +28,46 @@
 
 struct cache_entry_t {
   struct list_node entries;
+  /* Hash chain; followed without holding any locks */
+  struct cache_entry_t *next;
   char *key;
+  /* Approximate number of bytes held by this entry.  Create callbacks
+   * must set this if the cache has limits (see cache_set_limits()). */
+  size_t cost;
+  unsigned hash;
   unsigned refs;
   unsigned flags;
+  unsigned referenced;
   time_t time_to_die;
 };
 
+struct cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  /* Entries that expired, or that were evicted to make room for others */
+  uint64_t evictions;
+  /* Entries that weren't kept because they were used less often than the
+   * ones that would have to be evicted */
+  uint64_t rejections;
+  /* Lookups that waited for another one to create the same entry */
+  uint64_t coalesced;
+  /* Expired entries replaced by fresh ones */
+  uint64_t refreshes;
+  /* Expired entries that were found to be still up to date */
+  uint64_t revalidations;
+  /* Entries dropped by cache_invalidate() */
+  uint64_t invalidations;
+  size_t entries;
+  size_t bytes;
+};
+
 typedef struct cache_entry_t *(*CreateEntryCallback)(
       const char *key, void *context);
 typedef void (*DestroyEntryCallback)(
       struct cache_entry_t *entry, void *context);
+/* Returns true if @entry can keep being used after it expired */
+typedef bool (*RevalidateEntryCallback)(
+      struct cache_entry_t *entry, void *context);
 
 struct cache_t;
 
@@ -45,8 +77,22 @@ struct cache_t *cache_create(CreateEntryCallback create_entry_cb,
       time_t time_to_live);
 void cache_destroy(struct cache_t *cache);
 
+bool cache_set_limits(struct cache_t *cache, size_t max_bytes,
+      unsigned max_entries);
+void cache_set_stale_while_revalidate(struct cache_t *cache, time_t period);
+void cache_set_negative_ttl(struct cache_t *cache, time_t time_to_live);
+void cache_set_revalidate_callback(struct cache_t *cache,
+      RevalidateEntryCallback revalidate_entry_cb);
+bool cache_enable_async_fill(struct cache_t *cache);
+void cache_get_stats(struct cache_t *cache, struct cache_stats *stats);
+
 struct cache_entry_t *cache_get_and_ref_entry(struct cache_t *cache,
       const char *key, int *error);
 void cache_entry_unref(struct cache_t *cache, struct cache_entry_t *entry);
+void cache_invalidate(struct cache_t *cache, const char *key);
+void cache_invalidate_negative(struct cache_t *cache);
+/* Sets errno on failure; ETIMEDOUT means the connection timed out while
+ * waiting for another request to create the entry.  Might suspend the
+ * coroutine: streaming handlers should lwan_response_flush() before. */
 struct cache_entry_t *cache_coro_get_and_ref_entry(struct cache_t *cache,
       coro_t *coro, const char *key);
@@ -82,6 +82,9 @@ long parse_long(const char *value, long default_value)
     char *endptr;
     long parsed;
 
+    if (!value)
+        return default_value;
+
     errno = 0;
     parsed = strtol(value, &endptr, 0);
 
@@ -237,7 +240,9 @@ bool config_isolate_section(config_t *current_conf,
     long startpos, endpos;
     bool r = false;
 
-    *isolated = *current_conf;
+    /* Closed by the caller even if isolating fails, so it can't share
+     * the file with the current configuration */
+    *isolated = (config_t) { .file = NULL };
 
     if (current_conf->error_message)
         return false;
@@ -271,6 +276,30 @@ resetpos:
     return r;
 }
 
+char *config_isolated_text(config_t *isolated)
+{
+    long startpos = ftell(isolated->file);
+    size_t len;
+    char *text;
+
+    if (startpos < 0 || isolated->isolated.end < startpos)
+        return NULL;
+
+    len = (size_t)(isolated->isolated.end - startpos);
+    text = malloc(len + 1);
+    if (!text)
+        return NULL;
+
+    if (fread(text, 1, len, isolated->file) != len ||
+                fseek(isolated->file, startpos, SEEK_SET) < 0) {
+        free(text);
+        return NULL;
+    }
+
+    text[len] = '\0';
+    return text;
+}
+
 bool config_read_line(config_t *conf, config_line_t *l)
 {
     char *line, *line_end;
@@ -68,6 +68,8 @@ bool config_read_line(config_t *conf, config_line_t *l);
 bool config_isolate_section(config_t *current_conf,
     config_line_t *current_line, config_t *isolated);
 bool config_skip_section(config_t *conf, config_line_t *line);
+/* Contents of an isolated section, as they are in the file */
+char *config_isolated_text(config_t *isolated);
 
 bool parse_bool(const char *value, bool default_value);
 long parse_long(const char *value, long default_value);
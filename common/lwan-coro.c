@@ -32,9 +32,13 @@
 #include <valgrind/valgrind.h>
 #endif
 
-#define CORO_STACK_MIN		((3 * (PTHREAD_STACK_MIN)) / 2)
+/* Newer glibc versions define PTHREAD_STACK_MIN as a call to sysconf() when
+ * _GNU_SOURCE is defined; use the value it always had on Linux instead, so
+ * that the stack size remains a compile-time constant. */
+#define CORO_PTHREAD_STACK_MIN	16384
+#define CORO_STACK_MIN		((3 * (CORO_PTHREAD_STACK_MIN)) / 2)
 
-static_assert(DEFAULT_BUFFER_SIZE < (CORO_STACK_MIN + PTHREAD_STACK_MIN),
+static_assert(DEFAULT_BUFFER_SIZE < (CORO_STACK_MIN + CORO_PTHREAD_STACK_MIN),
     "Request buffer fits inside coroutine stack");
 
 typedef struct coro_defer_t_	coro_defer_t;
@@ -46,13 +50,20 @@ struct coro_defer_t_ {
     defer_func func;
     void *data1;
     void *data2;
-};
+    /* Sticky entries survive coro_collect_garbage().  This used to be
+     * a tag in the function pointer, but functions aren't guaranteed to
+     * be aligned. */
+    bool sticky;
+} __attribute__((aligned(16)));  /* coro_malloc_full() returns defer + 1 */
 
 struct coro_t_ {
     coro_switcher_t *switcher;
     coro_context_t context;
     int yield_value;
 
+    /* Coroutine (if any) this one was resumed from */
+    coro_t *parent;
+
 #if !defined(NDEBUG) && defined(USE_VALGRIND)
     unsigned int vg_stack_id;
 #endif
@@ -65,6 +76,10 @@ struct coro_t_ {
 
 static void coro_entry_point(coro_t *data, coro_function_t func);
 
+/* Read from signal handlers (see coro_current()), so this can't go through
+ * __tls_get_addr() */
+static __thread coro_t *current_coro __attribute__((tls_model("initial-exec")));
+
 /*
  * This swapcontext() implementation was obtained from glibc and modified
  * slightly to not save/restore the floating point registers, unneeded
@@ -146,23 +161,6 @@ coro_entry_point(coro_t *coro, coro_function_t func)
     coro_yield(coro, return_value);
 }
 
-static inline defer_func
-get_func_ptr(defer_func func)
-{
-    uintptr_t ptr = (uintptr_t)func;
-
-    ptr &= ~(uintptr_t)1;
-    return (defer_func)ptr;
-}
-
-static inline bool
-is_sticky(defer_func func)
-{
-    uintptr_t ptr = (uintptr_t)func;
-
-    return ptr & (uintptr_t)1;
-}
-
 static coro_defer_t *
 reverse(coro_defer_t *root)
 {
@@ -189,11 +187,11 @@ coro_run_deferred(coro_t *coro, bool sticky)
         coro_defer_t *tmp = defer;
 
         defer = defer->next;
-        if (!sticky && is_sticky(tmp->func)) {
+        if (!sticky && tmp->sticky) {
             tmp->next = sticked;
             sticked = tmp;
         } else {
-            get_func_ptr(tmp->func)(tmp->data1, tmp->data2);
+            tmp->func(tmp->data1, tmp->data2);
             free(tmp);
         }
     }
@@ -222,7 +220,10 @@ coro_reset(coro_t *coro, coro_function_t func, void *data)
     coro->context[6 /* RDI */] = (uintptr_t) coro;
     coro->context[7 /* RSI */] = (uintptr_t) func;
     coro->context[8 /* RIP */] = (uintptr_t) coro_entry_point;
-    coro->context[9 /* RSP */] = (uintptr_t) stack + CORO_STACK_MIN;
+    /* coro_entry_point() is jumped to, not called: align the stack as if
+     * a return address had been pushed, regardless of sizeof(coro_t) */
+    coro->context[9 /* RSP */] = (((uintptr_t) stack + CORO_STACK_MIN) &
+        ~(uintptr_t)0xf) - sizeof(uintptr_t);
 #elif defined(__i386__)
     /* Align stack and make room for two arguments */
     stack = (unsigned char *)((uintptr_t)(stack + CORO_STACK_MIN -
@@ -278,6 +279,9 @@ coro_resume(coro_t *coro)
     assert(coro);
     assert(coro->ended == false);
 
+    coro->parent = current_coro;
+    current_coro = coro;
+
 #if defined(__x86_64__) || defined(__i386__)
     coro_swapcontext(&coro->switcher->caller, &coro->context);
     if (!coro->ended)
@@ -296,6 +300,8 @@ coro_resume(coro_t *coro)
     }
 #endif
 
+    current_coro = coro->parent;
+
     return coro->yield_value;
 }
 
@@ -318,6 +324,37 @@ coro_yield(coro_t *coro, int value)
     return coro->yield_value;
 }
 
+coro_t *
+coro_current(void)
+{
+    return current_coro;
+}
+
+bool
+coro_get_stack_info(const coro_t *coro, struct coro_stack_info *info)
+{
+    const coro_context_t *caller = &coro->switcher->caller;
+
+    info->stack_lo = (uintptr_t)(coro + 1);
+    info->stack_hi = info->stack_lo + CORO_STACK_MIN;
+    info->parent = coro->parent;
+
+#if defined(__x86_64__)
+    info->caller_pc = (*caller)[8 /* RIP */];
+    info->caller_sp = (*caller)[9 /* RSP */];
+    info->caller_fp = (*caller)[1 /* RBP */];
+    return true;
+#elif defined(__i386__)
+    info->caller_pc = (*caller)[5 /* EIP */];
+    info->caller_sp = (*caller)[6 /* ESP */];
+    info->caller_fp = (*caller)[3 /* EBP */];
+    return true;
+#else
+    (void)caller;
+    return false;
+#endif
+}
+
 void
 coro_free(coro_t *coro)
 {
@@ -343,6 +380,7 @@ coro_defer_any(coro_t *coro, defer_func func, void *data1, void *data2)
     defer->func = func;
     defer->data1 = data1;
     defer->data2 = data2;
+    defer->sticky = false;
     coro->defer = defer;
 }
 
@@ -366,14 +404,11 @@ coro_malloc_full(coro_t *coro, size_t size, bool sticky, void (*destroy_func)())
     if (UNLIKELY(!defer))
         return NULL;
 
-    uintptr_t destroy_func_ptr = (uintptr_t)destroy_func;
-    if (sticky)
-        destroy_func_ptr |= (uintptr_t)1;
-
     defer->next = coro->defer;
-    defer->func = (defer_func)destroy_func_ptr;
+    defer->func = destroy_func;
     defer->data1 = defer + 1;
     defer->data2 = NULL;
+    defer->sticky = sticky;
 
     coro->defer = defer;
 
@@ -19,12 +19,12 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
-#if defined(__x86_64__)
 #include <stdint.h>
+#if defined(__x86_64__)
 typedef uintptr_t coro_context_t[10];
 #elif defined(__i386__)
-#include <stdint.h>
 typedef uintptr_t coro_context_t[7];
 #else
 #include <ucontext.h>
@@ -62,6 +62,19 @@ void   *coro_malloc_full(coro_t *coro, size_t size, bool sticky, void (*destroy_
 char   *coro_strdup(coro_t *coro, const char *str);
 char   *coro_printf(coro_t *coro, const char *fmt, ...);
 
+/* Used by the profiler to walk stacks from a signal handler; both are
+ * async-signal-safe.  coro_get_stack_info() returns false if the context
+ * layout isn't known for this architecture. */
+struct coro_stack_info {
+    uintptr_t stack_lo, stack_hi;
+    /* Where the coroutine was resumed from */
+    uintptr_t caller_pc, caller_sp, caller_fp;
+    coro_t *parent;
+};
+
+coro_t *coro_current(void);
+bool    coro_get_stack_info(const coro_t *coro, struct coro_stack_info *info);
+
 #define CORO_DEFER(fn)		((void (*)(void *))(fn))
 #define CORO_DEFER2(fn)		((void (*)(void *, void *))(fn))
 
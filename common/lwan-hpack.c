@@ -0,0 +1,549 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2016 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "lwan-hpack.h"
+
+/* Each entry costs its name and value lengths plus 32 bytes (RFC 7541 4.1) */
+#define ENTRY_OVERHEAD 32
+/* Decoded header blocks larger than this are dropped */
+#define MAX_DECODED_SIZE (DEFAULT_BUFFER_SIZE * 4)
+
+struct hpack_entry {
+    size_t name_len, value_len;
+    char data[]; /* Name, followed by value */
+};
+
+static const struct {
+    const char *name, *value;
+} static_table[] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+/*
+ * The Huffman code in RFC 7541 Appendix B is canonical, so it can be
+ * described by how many codes there are of each length, and the symbols
+ * sorted by code.  Decoding is then done one bit at a time, as in zlib's
+ * puff.c.
+ */
+static const unsigned char huffman_count[] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+
+static const unsigned short huffman_symbol[] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37,
+    45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65,
+    95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+    58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89,
+    106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59,
+    88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+    0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+    167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+    132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+    173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+    151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+    183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159,
+    171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+    255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+    246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+    6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+    249, 10, 13, 22, 256
+};
+
+#define HUFFMAN_EOS 256
+
+bool
+hpack_decoder_init(struct hpack_decoder *decoder, size_t max_size)
+{
+    decoder->first = decoder->count = decoder->size = 0;
+    decoder->max_size = decoder->max_size_limit = max_size;
+
+    decoder->capacity = max_size / ENTRY_OVERHEAD + 1;
+    decoder->entries = calloc(decoder->capacity, sizeof(*decoder->entries));
+    return decoder->entries != NULL;
+}
+
+static void
+evict_oldest(struct hpack_decoder *decoder)
+{
+    size_t last = (decoder->first + decoder->count - 1) % decoder->capacity;
+    struct hpack_entry *entry = decoder->entries[last];
+
+    decoder->size -= entry->name_len + entry->value_len + ENTRY_OVERHEAD;
+    decoder->count--;
+    free(entry);
+}
+
+void
+hpack_decoder_free(struct hpack_decoder *decoder)
+{
+    while (decoder->count)
+        evict_oldest(decoder);
+    free(decoder->entries);
+}
+
+static void
+evict_to_size(struct hpack_decoder *decoder, size_t size)
+{
+    while (decoder->size > size)
+        evict_oldest(decoder);
+}
+
+static void
+insert_entry(struct hpack_decoder *decoder, const char *name, size_t name_len,
+    const char *value, size_t value_len)
+{
+    size_t entry_size = name_len + value_len + ENTRY_OVERHEAD;
+
+    /* An entry larger than the table empties it (RFC 7541 4.4) */
+    if (entry_size > decoder->max_size) {
+        evict_to_size(decoder, 0);
+        return;
+    }
+
+    evict_to_size(decoder, decoder->max_size - entry_size);
+
+    struct hpack_entry *entry = malloc(sizeof(*entry) + name_len + value_len);
+    if (UNLIKELY(!entry)) {
+        /* Can't keep in sync with the encoder anymore */
+        evict_to_size(decoder, 0);
+        return;
+    }
+
+    entry->name_len = name_len;
+    entry->value_len = value_len;
+    memcpy(mempcpy(entry->data, name, name_len), value, value_len);
+
+    decoder->first = (decoder->first + decoder->capacity - 1) % decoder->capacity;
+    decoder->entries[decoder->first] = entry;
+    decoder->count++;
+    decoder->size += entry_size;
+}
+
+static bool
+lookup_index(const struct hpack_decoder *decoder, size_t index,
+    const char **name, size_t *name_len, const char **value, size_t *value_len)
+{
+    if (UNLIKELY(!index))
+        return false;
+
+    if (index <= N_ELEMENTS(static_table)) {
+        *name = static_table[index - 1].name;
+        *name_len = strlen(*name);
+        *value = static_table[index - 1].value;
+        *value_len = strlen(*value);
+        return true;
+    }
+
+    index -= N_ELEMENTS(static_table) + 1;
+    if (UNLIKELY(index >= decoder->count))
+        return false;
+
+    const struct hpack_entry *entry =
+                decoder->entries[(decoder->first + index) % decoder->capacity];
+    *name = entry->data;
+    *name_len = entry->name_len;
+    *value = entry->data + entry->name_len;
+    *value_len = entry->value_len;
+    return true;
+}
+
+static bool
+decode_int(const unsigned char **p, const unsigned char *end,
+    unsigned int prefix_bits, size_t *value)
+{
+    const unsigned int prefix_max = (1u << prefix_bits) - 1;
+    unsigned int shift = 0;
+
+    if (UNLIKELY(*p >= end))
+        return false;
+
+    *value = **p & prefix_max;
+    (*p)++;
+    if (*value < prefix_max)
+        return true;
+
+    while (*p < end) {
+        unsigned char byte = **p;
+
+        (*p)++;
+        if (UNLIKELY(shift > 28))
+            return false;
+        *value += (size_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+        shift += 7;
+    }
+
+    return false;
+}
+
+static char *
+scratch_reserve(strbuf_t *scratch, size_t len)
+{
+    size_t used = strbuf_get_length(scratch);
+
+    if (UNLIKELY(!strbuf_grow_to(scratch, used + len)))
+        return NULL;
+
+    return strbuf_get_buffer(scratch) + used;
+}
+
+static bool
+decode_huffman(const unsigned char *p, size_t len, strbuf_t *scratch,
+    size_t *decoded_len)
+{
+    /* The shortest code is 5 bits long */
+    char *out = scratch_reserve(scratch, len * 8 / 5 + 1);
+    char *out_start = out;
+    unsigned int code = 0, first = 0, bits = 0;
+    size_t index = 0;
+
+    if (UNLIKELY(!out))
+        return false;
+
+    for (size_t i = 0; i < len; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            code |= (p[i] >> bit) & 1;
+            bits++;
+
+            unsigned int count = huffman_count[bits];
+            if (code - first < count) {
+                unsigned short symbol = huffman_symbol[index + code - first];
+
+                if (UNLIKELY(symbol == HUFFMAN_EOS))
+                    return false;
+
+                *out++ = (char)symbol;
+                code = first = bits = 0;
+                index = 0;
+                continue;
+            }
+
+            if (UNLIKELY(bits == N_ELEMENTS(huffman_count) - 1))
+                return false;
+
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+    }
+
+    /* Padding must be shorter than a byte and be a prefix of EOS (all 1s);
+     * code has already been shifted to make room for the next bit */
+    if (UNLIKELY(bits > 7 || code != ((1u << bits) - 1) << 1))
+        return false;
+
+    *decoded_len = (size_t)(out - out_start);
+    return true;
+}
+
+static bool
+decode_string(const unsigned char **p, const unsigned char *end,
+    strbuf_t *scratch, size_t *offset, size_t *len)
+{
+    bool huffman = (*p < end) && (**p & 0x80);
+    size_t encoded_len;
+
+    if (UNLIKELY(!decode_int(p, end, 7, &encoded_len)))
+        return false;
+    if (UNLIKELY(encoded_len > (size_t)(end - *p)))
+        return false;
+
+    *offset = strbuf_get_length(scratch);
+
+    if (huffman) {
+        if (UNLIKELY(!decode_huffman(*p, encoded_len, scratch, len)))
+            return false;
+    } else {
+        char *out = scratch_reserve(scratch, encoded_len);
+        if (UNLIKELY(!out))
+            return false;
+        memcpy(out, *p, encoded_len);
+        *len = encoded_len;
+    }
+
+    scratch->len.buffer += *len;
+    *p += encoded_len;
+    return true;
+}
+
+static bool
+copy_to_scratch(strbuf_t *scratch, const char *str, size_t len, size_t *offset)
+{
+    char *out = scratch_reserve(scratch, len);
+
+    if (UNLIKELY(!out))
+        return false;
+
+    *offset = strbuf_get_length(scratch);
+    memcpy(out, str, len);
+    scratch->len.buffer += len;
+    return true;
+}
+
+hpack_status_t
+hpack_decode(struct hpack_decoder *decoder, const unsigned char *block,
+    size_t block_len, strbuf_t *scratch, struct hpack_header *headers,
+    size_t *n_headers)
+{
+    const unsigned char *p = block;
+    const unsigned char *end = block + block_len;
+    const size_t max_headers = *n_headers;
+    size_t name_offset, value_offset, name_len, value_len;
+    bool too_large = false;
+    size_t n = 0;
+
+    if (UNLIKELY(!strbuf_reset_length(scratch)))
+        return HPACK_ERROR;
+
+    while (p < end) {
+        const char *name, *value;
+        size_t index;
+
+        if (*p & 0x80) {
+            /* Indexed header field */
+            if (UNLIKELY(!decode_int(&p, end, 7, &index)))
+                return HPACK_ERROR;
+            if (UNLIKELY(!lookup_index(decoder, index, &name, &name_len, &value, &value_len)))
+                return HPACK_ERROR;
+            if (UNLIKELY(!copy_to_scratch(scratch, name, name_len, &name_offset)))
+                return HPACK_ERROR;
+            if (UNLIKELY(!copy_to_scratch(scratch, value, value_len, &value_offset)))
+                return HPACK_ERROR;
+        } else if ((*p & 0xe0) == 0x20) {
+            /* Dynamic table size update */
+            if (UNLIKELY(!decode_int(&p, end, 5, &index)))
+                return HPACK_ERROR;
+            if (UNLIKELY(index > decoder->max_size_limit))
+                return HPACK_ERROR;
+            decoder->max_size = index;
+            evict_to_size(decoder, index);
+            continue;
+        } else {
+            /* Literal header field, with incremental indexing (01xxxxxx),
+             * without indexing (0000xxxx), or never indexed (0001xxxx) */
+            bool add_to_table = (*p & 0xc0) == 0x40;
+
+            if (UNLIKELY(!decode_int(&p, end, add_to_table ? 6 : 4, &index)))
+                return HPACK_ERROR;
+
+            if (index) {
+                if (UNLIKELY(!lookup_index(decoder, index, &name, &name_len, &value, &value_len)))
+                    return HPACK_ERROR;
+                if (UNLIKELY(!copy_to_scratch(scratch, name, name_len, &name_offset)))
+                    return HPACK_ERROR;
+            } else if (UNLIKELY(!decode_string(&p, end, scratch, &name_offset, &name_len))) {
+                return HPACK_ERROR;
+            }
+
+            if (UNLIKELY(!decode_string(&p, end, scratch, &value_offset, &value_len)))
+                return HPACK_ERROR;
+
+            if (add_to_table) {
+                insert_entry(decoder, strbuf_get_buffer(scratch) + name_offset,
+                            name_len, strbuf_get_buffer(scratch) + value_offset,
+                            value_len);
+            }
+        }
+
+        /* Keep decoding (so the table stays in sync), but drop the headers */
+        if (UNLIKELY(n == max_headers || strbuf_get_length(scratch) > MAX_DECODED_SIZE)) {
+            too_large = true;
+            strbuf_reset_length(scratch);
+            continue;
+        }
+
+        /* Only offsets for now: the scratch buffer may move as it grows */
+        headers[n].name.value = (char *)(uintptr_t)name_offset;
+        headers[n].name.len = name_len;
+        headers[n].value.value = (char *)(uintptr_t)value_offset;
+        headers[n].value.len = value_len;
+        n++;
+    }
+
+    if (too_large)
+        return HPACK_TOO_LARGE;
+
+    for (size_t i = 0; i < n; i++) {
+        headers[i].name.value = strbuf_get_buffer(scratch) + (uintptr_t)headers[i].name.value;
+        headers[i].value.value = strbuf_get_buffer(scratch) + (uintptr_t)headers[i].value.value;
+    }
+    *n_headers = n;
+
+    return HPACK_OK;
+}
+
+static bool
+encode_int(strbuf_t *out, unsigned char first_byte, unsigned int prefix_bits,
+    size_t value)
+{
+    const size_t prefix_max = (1u << prefix_bits) - 1;
+    unsigned char buffer[16];
+    size_t len = 0;
+
+    if (value < prefix_max) {
+        buffer[len++] = (unsigned char)(first_byte | value);
+    } else {
+        buffer[len++] = (unsigned char)(first_byte | prefix_max);
+        for (value -= prefix_max; value >= 0x80; value >>= 7)
+            buffer[len++] = (unsigned char)((value & 0x7f) | 0x80);
+        buffer[len++] = (unsigned char)value;
+    }
+
+    return strbuf_append_str(out, (const char *)buffer, len);
+}
+
+static bool
+encode_string(strbuf_t *out, const char *str, size_t len)
+{
+    /* Huffman-encoding responses isn't worth the CPU time */
+    if (UNLIKELY(!encode_int(out, 0, 7, len)))
+        return false;
+    if (!len)
+        return true;
+    return strbuf_append_str(out, str, len);
+}
+
+bool
+hpack_encode_table_size_update(strbuf_t *out, size_t size)
+{
+    return encode_int(out, 0x20, 5, size);
+}
+
+bool
+hpack_encode_status(strbuf_t *out, lwan_http_status_t status)
+{
+    char value[3];
+
+    switch (status) {
+    case HTTP_OK: return encode_int(out, 0x80, 7, 8);
+    case HTTP_NOT_MODIFIED: return encode_int(out, 0x80, 7, 11);
+    case HTTP_BAD_REQUEST: return encode_int(out, 0x80, 7, 12);
+    case HTTP_NOT_FOUND: return encode_int(out, 0x80, 7, 13);
+    case HTTP_INTERNAL_ERROR: return encode_int(out, 0x80, 7, 14);
+    case HTTP_PARTIAL_CONTENT: return encode_int(out, 0x80, 7, 10);
+    default:
+        break;
+    }
+
+    value[0] = (char)('0' + (status / 100) % 10);
+    value[1] = (char)('0' + (status / 10) % 10);
+    value[2] = (char)('0' + status % 10);
+
+    /* Literal without indexing, name from the static table (":status") */
+    return encode_int(out, 0x00, 4, 8) && encode_string(out, value, sizeof(value));
+}
+
+static size_t
+static_name_index(const char *name, size_t name_len)
+{
+    /* Pseudo-headers aren't looked up; regular headers start at "accept-charset" */
+    for (size_t i = 14; i < N_ELEMENTS(static_table); i++) {
+        if (!strncmp(static_table[i].name, name, name_len) &&
+                    static_table[i].name[name_len] == '\0')
+            return i + 1;
+    }
+
+    return 0;
+}
+
+bool
+hpack_encode_header(strbuf_t *out, const char *name, size_t name_len,
+    const char *value, size_t value_len)
+{
+    size_t index = static_name_index(name, name_len);
+
+    /* Literal without indexing; the dynamic table isn't used for responses */
+    if (index)
+        return encode_int(out, 0x00, 4, index) && encode_string(out, value, value_len);
+
+    return encode_int(out, 0x00, 4, 0) && encode_string(out, name, name_len) &&
+                encode_string(out, value, value_len);
+}
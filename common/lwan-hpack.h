@@ -0,0 +1,61 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2016 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include "lwan.h"
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+
+struct hpack_entry;
+
+struct hpack_decoder {
+    /* Ring buffer; entries[first] is the newest entry */
+    struct hpack_entry **entries;
+    size_t first, count, capacity;
+
+    size_t size, max_size;
+    /* As announced with SETTINGS_HEADER_TABLE_SIZE */
+    size_t max_size_limit;
+};
+
+struct hpack_header {
+    lwan_value_t name;
+    lwan_value_t value;
+};
+
+typedef enum {
+    HPACK_OK,
+    /* Block decoded (and decoder state kept in sync), but headers dropped */
+    HPACK_TOO_LARGE,
+    /* Connection must be closed with COMPRESSION_ERROR */
+    HPACK_ERROR
+} hpack_status_t;
+
+bool hpack_decoder_init(struct hpack_decoder *decoder, size_t max_size);
+void hpack_decoder_free(struct hpack_decoder *decoder);
+
+hpack_status_t hpack_decode(struct hpack_decoder *decoder,
+    const unsigned char *block, size_t block_len, strbuf_t *scratch,
+    struct hpack_header *headers, size_t *n_headers);
+
+bool hpack_encode_table_size_update(strbuf_t *out, size_t size);
+bool hpack_encode_status(strbuf_t *out, lwan_http_status_t status);
+bool hpack_encode_header(strbuf_t *out, const char *name, size_t name_len,
+    const char *value, size_t value_len);
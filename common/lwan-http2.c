@@ -0,0 +1,1877 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2016 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Cleartext HTTP/2 (RFC 7540), either with prior knowledge or upgraded
+ * from HTTP/1.1.
+ *
+ * The connection coroutine becomes the connection engine: it reads and
+ * parses frames, and writes everything to the socket.  Each stream runs
+ * in a coroutine of its own, as if it were an HTTP/1.1 connection: the
+ * request is converted to HTTP/1.1 and processed by lwan_process_request(),
+ * so handlers are unaware of HTTP/2.  What handlers write is diverted here
+ * by the I/O wrappers, and the HTTP/1.1 response header is converted to a
+ * HEADERS frame.  Streams yield to the engine, which sends their output as
+ * DATA frames, round-robin, as flow control allows.
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <netinet/tcp.h>
+
+#include "base64.h"
+#include "int-to-str.h"
+#include "list.h"
+#include "lwan-hpack.h"
+#include "lwan-io-wrappers.h"
+#include "lwan-private.h"
+#include "lwan-stats.h"
+
+#define HTTP2_FRAME_HEADER_SIZE 9
+#define HTTP2_DEFAULT_FRAME_SIZE 16384
+#define HTTP2_MAX_FRAME_SIZE 16777215
+#define HTTP2_DEFAULT_WINDOW_SIZE 65535
+#define HTTP2_MAX_WINDOW_SIZE 0x7fffffff
+#define HTTP2_MAX_CONCURRENT_STREAMS 100
+#define HTTP2_MAX_HEADER_FIELDS 128
+#define HTTP2_MAX_HEADER_BLOCK_SIZE (DEFAULT_BUFFER_SIZE * 4)
+/* Room for two frames of the maximum size we accept */
+#define HTTP2_INPUT_BUFFER_SIZE (2 * (HTTP2_DEFAULT_FRAME_SIZE + HTTP2_FRAME_HEADER_SIZE))
+/* Upper bound of what's written to the socket in one go */
+#define HTTP2_MAX_BATCH_SIZE (256 * 1024)
+#define HTTP2_MAX_BATCH_IOV 64
+/* File contents are read in chunks of this size, as DATA frames need headers */
+#define HTTP2_FILE_BUFFER_SIZE (64 * 1024)
+/* Stream coroutines are recycled, up to this many per connection */
+#define HTTP2_CORO_POOL_SIZE 8
+
+enum http2_frame_type {
+    FRAME_DATA = 0,
+    FRAME_HEADERS = 1,
+    FRAME_PRIORITY = 2,
+    FRAME_RST_STREAM = 3,
+    FRAME_SETTINGS = 4,
+    FRAME_PUSH_PROMISE = 5,
+    FRAME_PING = 6,
+    FRAME_GOAWAY = 7,
+    FRAME_WINDOW_UPDATE = 8,
+    FRAME_CONTINUATION = 9
+};
+
+enum http2_frame_flags {
+    FLAG_END_STREAM = 0x1,
+    FLAG_ACK = 0x1,
+    FLAG_END_HEADERS = 0x4,
+    FLAG_PADDED = 0x8,
+    FLAG_PRIORITY = 0x20
+};
+
+enum http2_error {
+    ERROR_NO_ERROR = 0x0,
+    ERROR_PROTOCOL = 0x1,
+    ERROR_INTERNAL = 0x2,
+    ERROR_FLOW_CONTROL = 0x3,
+    ERROR_STREAM_CLOSED = 0x5,
+    ERROR_FRAME_SIZE = 0x6,
+    ERROR_REFUSED_STREAM = 0x7,
+    ERROR_COMPRESSION = 0x9,
+    ERROR_ENHANCE_YOUR_CALM = 0xb
+};
+
+enum http2_setting {
+    SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    SETTINGS_ENABLE_PUSH = 0x2,
+    SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    SETTINGS_MAX_FRAME_SIZE = 0x5,
+    SETTINGS_MAX_HEADER_LIST_SIZE = 0x6
+};
+
+struct http2_frame {
+    const unsigned char *payload;
+    size_t len;
+    uint32_t stream_id;
+    unsigned char type;
+    unsigned char flags;
+};
+
+struct http2_connection;
+
+struct http2_stream {
+    /* Requests in this stream point here, so yielding request->conn->coro
+     * from a handler yields the stream coroutine back to the engine. */
+    lwan_connection_t conn;
+
+    struct list_node node;
+    struct http2_connection *h2;
+    uint32_t id;
+    int64_t send_window;
+
+    /* False while the request body is being received */
+    bool running;
+    bool headers_sent;
+    bool write_failed;
+
+    /* Generation of h2->out when the HEADERS frame was queued; if it's
+     * still the current one, END_STREAM can be set in that frame */
+    unsigned int headers_generation;
+    size_t headers_flags_offset;
+
+    struct {
+        char *buffer;
+        size_t len;
+    } body, response_header;
+
+    struct {
+        struct iovec *iov;
+        int iov_count;
+        int file_fd;
+        off_t file_offset;
+        /* Bytes left to send; the stream is not resumed until it's 0 */
+        size_t len;
+        /* Bytes queued in the batch being written */
+        size_t scheduled;
+    } pending;
+
+    /* Request upgraded from HTTP/1.1, served as stream 1 */
+    lwan_request_t *upgraded_request;
+
+    size_t request_len;
+    char request[DEFAULT_BUFFER_SIZE + 1];
+};
+
+struct http2_connection {
+    lwan_t *lwan;
+    /* Request this connection started as; socket I/O goes through it */
+    lwan_request_t *request;
+
+    coro_switcher_t switcher;
+    struct list_head streams;
+    unsigned int n_streams;
+    coro_t *coro_pool[HTTP2_CORO_POOL_SIZE];
+    unsigned int n_pooled;
+
+    uint32_t last_stream_id;
+    struct {
+        uint32_t stream_id;
+        bool end_stream;
+    } continuation;
+
+    struct hpack_decoder decoder;
+    struct hpack_header headers[HTTP2_MAX_HEADER_FIELDS];
+    strbuf_t *header_block;
+    strbuf_t *scratch;
+
+    /* Control and HEADERS frames waiting to be written */
+    strbuf_t *out;
+    unsigned int out_generation;
+    char *file_buffer;
+
+    int64_t send_window;
+    struct {
+        uint32_t initial_window_size;
+        uint32_t max_frame_size;
+    } peer;
+
+    struct {
+        void (*callback)(lwan_t *l, lwan_request_t *request, void *data);
+        void *data;
+        /* Request target of the upgraded request, for the access log */
+        const lwan_value_t *target;
+    } upgrade;
+
+    bool need_preface;
+    bool table_size_update_sent;
+    bool goaway_received;
+    bool goaway_sent;
+
+    struct {
+        size_t pos, len;
+        unsigned char buffer[HTTP2_INPUT_BUFFER_SIZE];
+    } in;
+};
+
+static ALWAYS_INLINE void
+abort_connection(struct http2_connection *h2)
+{
+    coro_yield(h2->request->conn->coro, CONN_CORO_ABORT);
+    __builtin_unreachable();
+}
+
+static ALWAYS_INLINE uint32_t
+read_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+                (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+static ALWAYS_INLINE void
+write_u32(unsigned char *p, uint32_t value)
+{
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)value;
+}
+
+static void
+write_frame_header(unsigned char *p, size_t len, unsigned char type,
+    unsigned char flags, uint32_t stream_id)
+{
+    p[0] = (unsigned char)(len >> 16);
+    p[1] = (unsigned char)(len >> 8);
+    p[2] = (unsigned char)len;
+    p[3] = type;
+    p[4] = flags;
+    write_u32(p + 5, stream_id & 0x7fffffff);
+}
+
+static void
+append_frame(struct http2_connection *h2, unsigned char type,
+    unsigned char flags, uint32_t stream_id, const void *payload, size_t len)
+{
+    unsigned char header[HTTP2_FRAME_HEADER_SIZE];
+
+    write_frame_header(header, len, type, flags, stream_id);
+
+    if (UNLIKELY(!strbuf_append_str(h2->out, (const char *)header, sizeof(header))))
+        abort_connection(h2);
+    if (len && UNLIKELY(!strbuf_append_str(h2->out, payload, len)))
+        abort_connection(h2);
+}
+
+static void
+write_output(struct http2_connection *h2)
+{
+    if (!strbuf_get_length(h2->out))
+        return;
+
+    lwan_write(h2->request, strbuf_get_buffer(h2->out), strbuf_get_length(h2->out));
+    if (UNLIKELY(!strbuf_reset_length(h2->out)))
+        abort_connection(h2);
+    h2->out_generation++;
+}
+
+static void
+connection_error(struct http2_connection *h2, enum http2_error error)
+{
+    unsigned char payload[8];
+
+    write_u32(payload, h2->last_stream_id);
+    write_u32(payload + 4, error);
+    append_frame(h2, FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+    write_output(h2);
+
+    abort_connection(h2);
+}
+
+/* Streams started up to now are still served; the client opens
+ * connections elsewhere for the others */
+static void
+send_goaway(struct http2_connection *h2)
+{
+    unsigned char payload[8];
+
+    if (h2->goaway_sent)
+        return;
+
+    write_u32(payload, h2->last_stream_id);
+    write_u32(payload + 4, ERROR_NO_ERROR);
+    append_frame(h2, FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+    h2->goaway_sent = true;
+}
+
+static void
+send_window_update(struct http2_connection *h2, uint32_t stream_id, size_t increment)
+{
+    unsigned char payload[4];
+
+    write_u32(payload, (uint32_t)increment);
+    append_frame(h2, FRAME_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+static struct http2_stream *
+find_stream(struct http2_connection *h2, uint32_t id)
+{
+    struct http2_stream *stream;
+
+    list_for_each(&h2->streams, stream, node) {
+        if (stream->id == id)
+            return stream;
+    }
+
+    return NULL;
+}
+
+static int
+stream_coro(coro_t *coro)
+{
+    /* Like other request coroutines, the data is the connection */
+    lwan_connection_t *conn = coro_get_data(coro);
+    struct http2_stream *stream = container_of(conn, struct http2_stream, conn);
+    struct http2_connection *h2 = stream->h2;
+    strbuf_t *response_buffer = strbuf_new();
+
+    if (UNLIKELY(!response_buffer))
+        return CONN_CORO_ABORT;
+    coro_defer(coro, CORO_DEFER(strbuf_free), response_buffer);
+
+    if (stream->upgraded_request) {
+        lwan_request_t request = *stream->upgraded_request;
+
+        request.conn = &stream->conn;
+        request.flags |= REQUEST_HTTP2;
+        request.write_stats = NULL;
+        request.response.buffer = response_buffer;
+        request.stats.bytes_written = 0;
+
+        h2->upgrade.callback(h2->lwan, &request, h2->upgrade.data);
+        lwan_stats_record_request(&request);
+        lwan_access_log(&request, h2->upgrade.target);
+    } else {
+        lwan_request_t request = {
+            .conn = &stream->conn,
+            .fd = h2->request->fd,
+            .response = {
+                .buffer = response_buffer
+            },
+            .flags = REQUEST_HTTP2 | (h2->request->flags & REQUEST_PROXIED),
+            .proxy = h2->request->proxy
+        };
+        lwan_value_t buffer = {
+            .value = stream->request,
+            .len = stream->request_len
+        };
+
+        lwan_process_request(h2->lwan, &request, &buffer, buffer.value);
+    }
+
+    return CONN_CORO_FINISHED;
+}
+
+static struct http2_stream *
+new_stream(struct http2_connection *h2, uint32_t id)
+{
+    struct http2_stream *stream = malloc(sizeof(*stream));
+
+    if (UNLIKELY(!stream))
+        return NULL;
+
+    stream->h2 = h2;
+    stream->id = id;
+    stream->send_window = h2->peer.initial_window_size;
+    stream->running = false;
+    stream->headers_sent = false;
+    stream->write_failed = false;
+    stream->body.buffer = NULL;
+    stream->body.len = 0;
+    stream->response_header.buffer = NULL;
+    stream->response_header.len = 0;
+    stream->pending.len = 0;
+    stream->pending.scheduled = 0;
+    stream->upgraded_request = NULL;
+    stream->request_len = 0;
+    stream->conn.coro = NULL;
+
+    list_add_tail(&h2->streams, &stream->node);
+    h2->n_streams++;
+
+    return stream;
+}
+
+static void
+free_stream(struct http2_connection *h2, struct http2_stream *stream)
+{
+    coro_t *coro = stream->conn.coro;
+
+    if (coro) {
+        if (h2->n_pooled < HTTP2_CORO_POOL_SIZE) {
+            /* Resetting runs whatever was deferred by the stream */
+            coro_reset(coro, stream_coro, NULL);
+            h2->coro_pool[h2->n_pooled++] = coro;
+        } else {
+            coro_free(coro);
+            LWAN_STATS_INC(h2->request->conn->thread->stats, coros_freed);
+        }
+    }
+
+    list_del(&stream->node);
+    h2->n_streams--;
+
+    free(stream->body.buffer);
+    free(stream);
+}
+
+static void
+reset_stream(struct http2_connection *h2, uint32_t stream_id,
+    enum http2_error error)
+{
+    struct http2_stream *stream = find_stream(h2, stream_id);
+    unsigned char payload[4];
+
+    write_u32(payload, error);
+    append_frame(h2, FRAME_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+
+    if (stream)
+        free_stream(h2, stream);
+}
+
+static bool
+start_stream(struct http2_connection *h2, struct http2_stream *stream)
+{
+    coro_t *coro;
+
+    if (h2->n_pooled) {
+        coro = h2->coro_pool[--h2->n_pooled];
+        coro_reset(coro, stream_coro, &stream->conn);
+    } else {
+        coro = coro_new(&h2->switcher, stream_coro, &stream->conn);
+        if (UNLIKELY(!coro))
+            return false;
+        LWAN_STATS_INC(h2->request->conn->thread->stats, coros_created);
+    }
+
+    stream->conn = (lwan_connection_t) {
+        .flags = CONN_IS_ALIVE | CONN_KEEP_ALIVE | CONN_HTTP2_STREAM |
+            (h2->request->conn->flags & CONN_LISTENER_MASK),
+        .coro = coro,
+        .thread = h2->request->conn->thread
+    };
+    stream->running = true;
+
+    return true;
+}
+
+static void
+send_headers(struct http2_connection *h2, struct http2_stream *stream,
+    const strbuf_t *block, unsigned char flags)
+{
+    const char *p = strbuf_get_buffer(block);
+    size_t len = strbuf_get_length(block);
+    unsigned char type = FRAME_HEADERS;
+
+    stream->headers_generation = h2->out_generation;
+    stream->headers_flags_offset = strbuf_get_length(h2->out) + 4;
+
+    do {
+        size_t frame_len = len < h2->peer.max_frame_size ? len : h2->peer.max_frame_size;
+
+        len -= frame_len;
+        append_frame(h2, type, (unsigned char)(flags | (len ? 0 : FLAG_END_HEADERS)),
+                    stream->id, p, frame_len);
+
+        p += frame_len;
+        type = FRAME_CONTINUATION;
+        flags = 0;
+    } while (len);
+
+    stream->headers_sent = true;
+}
+
+static bool
+begin_header_block(struct http2_connection *h2)
+{
+    if (UNLIKELY(!strbuf_reset_length(h2->scratch)))
+        return false;
+
+    /* The dynamic table isn't used to encode responses; telling the peer
+     * once makes any SETTINGS_HEADER_TABLE_SIZE it sends irrelevant. */
+    if (!h2->table_size_update_sent) {
+        h2->table_size_update_sent = true;
+        return hpack_encode_table_size_update(h2->scratch, 0);
+    }
+
+    return true;
+}
+
+static void
+send_status_only(struct http2_connection *h2, struct http2_stream *stream,
+    lwan_http_status_t status)
+{
+    if (UNLIKELY(!begin_header_block(h2) || !hpack_encode_status(h2->scratch, status)))
+        abort_connection(h2);
+
+    send_headers(h2, stream, h2->scratch, FLAG_END_STREAM);
+}
+
+static bool
+is_connection_specific_header(const char *name, size_t len)
+{
+    switch (len) {
+    case 7:
+        return !strncmp(name, "upgrade", len);
+    case 10:
+        return !strncmp(name, "connection", len) || !strncmp(name, "keep-alive", len);
+    case 16:
+        return !strncmp(name, "proxy-connection", len);
+    case 17:
+        return !strncmp(name, "transfer-encoding", len);
+    default:
+        return false;
+    }
+}
+
+static bool
+translate_response_header(struct http2_stream *stream)
+{
+    struct http2_connection *h2 = stream->h2;
+    char *p = stream->response_header.buffer;
+    char *end = p + stream->response_header.len;
+    long status;
+
+    /* "HTTP/1.1 200 OK\r\n" */
+    if (UNLIKELY(end - p < 12 || strncmp(p, "HTTP/1.", 7)))
+        return false;
+    p[12] = '\0';
+    status = parse_long(p + 9, -1);
+    if (UNLIKELY(status < 200 || status > 999))
+        return false;
+
+    if (UNLIKELY(!begin_header_block(h2) ||
+                !hpack_encode_status(h2->scratch, (lwan_http_status_t)status)))
+        return false;
+
+    p = memchr(p + 13, '\n', (size_t)(end - p - 13));
+    if (UNLIKELY(!p))
+        return false;
+
+    for (p++; p < end; ) {
+        char *line_end = memchr(p, '\r', (size_t)(end - p));
+        if (UNLIKELY(!line_end))
+            return false;
+        if (line_end == p)
+            break;
+
+        char *colon = memchr(p, ':', (size_t)(line_end - p));
+        if (UNLIKELY(!colon))
+            return false;
+
+        size_t name_len = (size_t)(colon - p);
+        for (char *c = p; c < colon; c++)
+            *c = (char)tolower(*c);
+
+        if (!is_connection_specific_header(p, name_len)) {
+            char *value = colon + 1;
+
+            while (value < line_end && *value == ' ')
+                value++;
+
+            if (UNLIKELY(!hpack_encode_header(h2->scratch, p, name_len, value,
+                                (size_t)(line_end - value))))
+                return false;
+        }
+
+        p = line_end + 2;
+    }
+
+    send_headers(h2, stream, h2->scratch, 0);
+    return true;
+}
+
+static void
+advance_iov(struct iovec **iov, int *iov_count, size_t len)
+{
+    while (len && *iov_count) {
+        if (len < (*iov)->iov_len) {
+            (*iov)->iov_base = (char *)(*iov)->iov_base + len;
+            (*iov)->iov_len -= len;
+            return;
+        }
+
+        len -= (*iov)->iov_len;
+        (*iov)++;
+        (*iov_count)--;
+    }
+
+    /* Skip empty vectors, so pending data always starts at the first one */
+    while (*iov_count && !(*iov)->iov_len) {
+        (*iov)++;
+        (*iov_count)--;
+    }
+}
+
+static bool
+consume_response_header(struct http2_stream *stream, struct iovec **iov,
+    int *iov_count)
+{
+    while (*iov_count) {
+        size_t old_len = stream->response_header.len;
+        size_t room = DEFAULT_BUFFER_SIZE - old_len;
+        size_t to_copy = (*iov)->iov_len < room ? (*iov)->iov_len : room;
+
+        if (UNLIKELY(!to_copy))
+            return false;
+
+        memcpy(stream->response_header.buffer + old_len, (*iov)->iov_base, to_copy);
+        stream->response_header.len += to_copy;
+
+        size_t search_from = old_len > 3 ? old_len - 3 : 0;
+        char *header_end = memmem(stream->response_header.buffer + search_from,
+                    stream->response_header.len - search_from, "\r\n\r\n", 4);
+        if (header_end) {
+            stream->response_header.len =
+                        (size_t)(header_end - stream->response_header.buffer) + 4;
+            advance_iov(iov, iov_count, stream->response_header.len - old_len);
+            return translate_response_header(stream);
+        }
+
+        advance_iov(iov, iov_count, to_copy);
+    }
+
+    return true;
+}
+
+static ALWAYS_INLINE struct http2_stream *
+stream_from_request(lwan_request_t *request)
+{
+    return container_of(request->conn, struct http2_stream, conn);
+}
+
+static void
+wait_until_sent(struct http2_stream *stream)
+{
+    while (stream->pending.len)
+        coro_yield(stream->conn.coro, CONN_CORO_MAY_RESUME);
+}
+
+ssize_t
+lwan_http2_writev(lwan_request_t *request, struct iovec *iov, int iov_count)
+{
+    struct http2_stream *stream = stream_from_request(request);
+    size_t total_len = 0;
+
+    for (int i = 0; i < iov_count; i++)
+        total_len += iov[i].iov_len;
+
+    if (UNLIKELY(!stream->headers_sent)) {
+        if (!stream->response_header.buffer) {
+            stream->response_header.buffer = coro_malloc(stream->conn.coro,
+                        DEFAULT_BUFFER_SIZE);
+            if (UNLIKELY(!stream->response_header.buffer))
+                goto abort;
+        }
+
+        if (UNLIKELY(!consume_response_header(stream, &iov, &iov_count)))
+            goto abort;
+    }
+
+    advance_iov(&iov, &iov_count, 0);
+    if (iov_count) {
+        stream->pending.iov = iov;
+        stream->pending.iov_count = iov_count;
+        stream->pending.file_fd = -1;
+        stream->pending.len = 0;
+        for (int i = 0; i < iov_count; i++)
+            stream->pending.len += iov[i].iov_len;
+
+        wait_until_sent(stream);
+    }
+
+    request->stats.bytes_written += total_len;
+    return (ssize_t)total_len;
+
+abort:
+    coro_yield(stream->conn.coro, CONN_CORO_ABORT);
+    __builtin_unreachable();
+}
+
+ssize_t
+lwan_http2_sendfile(lwan_request_t *request, int in_fd, off_t offset, size_t count)
+{
+    struct http2_stream *stream = stream_from_request(request);
+
+    if (UNLIKELY(!stream->headers_sent)) {
+        coro_yield(stream->conn.coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
+    stream->pending.iov = NULL;
+    stream->pending.iov_count = 0;
+    stream->pending.file_fd = in_fd;
+    stream->pending.file_offset = offset;
+    stream->pending.len = count;
+
+    wait_until_sent(stream);
+
+    request->stats.bytes_written += count;
+    return (ssize_t)count;
+}
+
+lwan_connection_t *
+lwan_http2_stream_parent(lwan_connection_t *conn)
+{
+    struct http2_stream *stream = container_of(conn, struct http2_stream, conn);
+
+    return stream->h2->request->conn;
+}
+
+static ALWAYS_INLINE size_t
+sendable_len(const struct http2_connection *h2, const struct http2_stream *stream)
+{
+    int64_t len = (int64_t)(stream->pending.len - stream->pending.scheduled);
+
+    if (len > h2->peer.max_frame_size)
+        len = h2->peer.max_frame_size;
+    if (len > stream->send_window)
+        len = stream->send_window;
+    if (len > h2->send_window)
+        len = h2->send_window;
+
+    return len > 0 ? (size_t)len : 0;
+}
+
+static int
+collect_pending_iov(struct http2_stream *stream, size_t *len,
+    struct iovec *iov, int max_iov)
+{
+    size_t skip = stream->pending.scheduled;
+    size_t remaining = *len;
+    int n = 0;
+
+    for (int i = 0; i < stream->pending.iov_count && remaining; i++) {
+        const struct iovec *src = &stream->pending.iov[i];
+
+        if (skip >= src->iov_len) {
+            skip -= src->iov_len;
+            continue;
+        }
+
+        if (n == max_iov) {
+            /* Out of vectors; send a shorter frame */
+            *len -= remaining;
+            break;
+        }
+
+        size_t piece = src->iov_len - skip;
+        if (piece > remaining)
+            piece = remaining;
+
+        iov[n].iov_base = (char *)src->iov_base + skip;
+        iov[n].iov_len = piece;
+        n++;
+
+        remaining -= piece;
+        skip = 0;
+    }
+
+    return n;
+}
+
+static bool
+has_pending_output(const struct http2_connection *h2)
+{
+    const struct http2_stream *stream;
+
+    if (strbuf_get_length(h2->out))
+        return true;
+
+    list_for_each(&h2->streams, stream, node) {
+        if (stream->pending.len && sendable_len(h2, stream))
+            return true;
+    }
+
+    return false;
+}
+
+/* Suspended streams are parked until they're woken up, either one by one
+ * or, once this connection is woken up, all of them at once */
+static ALWAYS_INLINE bool
+stream_is_parked(const struct http2_connection *h2,
+    const struct http2_stream *stream)
+{
+    return (stream->conn.flags & CONN_SUSPENDED) &&
+                (h2->request->conn->flags & CONN_PARKED_STREAMS);
+}
+
+static bool
+has_runnable_streams(const struct http2_connection *h2)
+{
+    const struct http2_stream *stream;
+
+    list_for_each(&h2->streams, stream, node) {
+        if (stream->running && !stream->pending.len &&
+                    !stream_is_parked(h2, stream))
+            return true;
+    }
+
+    return false;
+}
+
+
+/*
+ * Writes queued frames along with DATA frames for streams with pending
+ * output.  Each stream gets one frame per round, round-robin, until
+ * nothing else can be sent or the batch is full; everything goes out in
+ * a single writev().
+ */
+static void
+flush_output(struct http2_connection *h2)
+{
+    unsigned char frame_headers[HTTP2_MAX_BATCH_IOV / 2][HTTP2_FRAME_HEADER_SIZE];
+    struct iovec iov[HTTP2_MAX_BATCH_IOV];
+    size_t batch_len = strbuf_get_length(h2->out);
+    size_t file_buffer_used = 0;
+    struct http2_stream *stream, *next;
+    unsigned int n_frames = 0;
+    int n_iov = 0;
+    bool progress;
+
+    if (batch_len) {
+        iov[n_iov].iov_base = strbuf_get_buffer(h2->out);
+        iov[n_iov].iov_len = batch_len;
+        n_iov++;
+    }
+
+    do {
+        progress = false;
+
+        list_for_each(&h2->streams, stream, node) {
+            if (n_iov + 2 > HTTP2_MAX_BATCH_IOV || batch_len >= HTTP2_MAX_BATCH_SIZE)
+                goto batch_full;
+            if (!stream->pending.len || stream->write_failed)
+                continue;
+
+            size_t frame_len = sendable_len(h2, stream);
+            if (!frame_len)
+                continue;
+
+            int n_data_iov;
+            if (stream->pending.iov) {
+                n_data_iov = collect_pending_iov(stream, &frame_len,
+                            iov + n_iov + 1, HTTP2_MAX_BATCH_IOV - n_iov - 1);
+            } else {
+                /* DATA frames need a header every max_frame_size bytes,
+                 * which would cost a sendfile() call per frame; reading
+                 * the file lets it be batched with everything else. */
+                if (frame_len > HTTP2_FILE_BUFFER_SIZE - file_buffer_used)
+                    frame_len = HTTP2_FILE_BUFFER_SIZE - file_buffer_used;
+                if (!frame_len)
+                    continue;
+
+                if (!h2->file_buffer) {
+                    h2->file_buffer = malloc(HTTP2_FILE_BUFFER_SIZE);
+                    if (UNLIKELY(!h2->file_buffer))
+                        abort_connection(h2);
+                }
+
+                char *buffer = h2->file_buffer + file_buffer_used;
+                ssize_t r = pread(stream->pending.file_fd, buffer, frame_len,
+                            stream->pending.file_offset + (off_t)stream->pending.scheduled);
+                if (UNLIKELY(r <= 0)) {
+                    /* File has been truncated or can't be read anymore */
+                    stream->write_failed = true;
+                    continue;
+                }
+
+                frame_len = (size_t)r;
+                file_buffer_used += frame_len;
+
+                iov[n_iov + 1].iov_base = buffer;
+                iov[n_iov + 1].iov_len = frame_len;
+                n_data_iov = 1;
+            }
+
+            write_frame_header(frame_headers[n_frames], frame_len, FRAME_DATA,
+                        0, stream->id);
+            iov[n_iov].iov_base = frame_headers[n_frames];
+            iov[n_iov].iov_len = HTTP2_FRAME_HEADER_SIZE;
+            n_iov += n_data_iov + 1;
+            n_frames++;
+
+            stream->pending.scheduled += frame_len;
+            stream->send_window -= (int64_t)frame_len;
+            h2->send_window -= (int64_t)frame_len;
+            batch_len += frame_len + HTTP2_FRAME_HEADER_SIZE;
+            progress = true;
+        }
+    } while (progress);
+
+batch_full:
+    if (n_iov) {
+        lwan_writev(h2->request, iov, n_iov);
+
+        if (UNLIKELY(!strbuf_reset_length(h2->out)))
+            abort_connection(h2);
+        h2->out_generation++;
+    }
+
+    list_for_each_safe(&h2->streams, stream, next, node) {
+        size_t sent = stream->pending.scheduled;
+
+        if (UNLIKELY(stream->write_failed)) {
+            reset_stream(h2, stream->id, ERROR_INTERNAL);
+            continue;
+        }
+        if (!sent)
+            continue;
+
+        if (stream->pending.iov)
+            advance_iov(&stream->pending.iov, &stream->pending.iov_count, sent);
+        else
+            stream->pending.file_offset += (off_t)sent;
+        stream->pending.len -= sent;
+        stream->pending.scheduled = 0;
+    }
+
+    /* Another stream goes first next time, in case this batch got full */
+    if (n_frames) {
+        stream = list_top(&h2->streams, struct http2_stream, node);
+        if (stream) {
+            list_del(&stream->node);
+            list_add_tail(&h2->streams, &stream->node);
+        }
+    }
+}
+
+static void
+end_stream(struct http2_connection *h2, struct http2_stream *stream)
+{
+    if (stream->headers_generation == h2->out_generation) {
+        /* HEADERS frame hasn't been sent yet, and there's no body */
+        char *flags = strbuf_get_buffer(h2->out) + stream->headers_flags_offset;
+
+        *flags = (char)(*flags | FLAG_END_STREAM);
+    } else {
+        append_frame(h2, FRAME_DATA, FLAG_END_STREAM, stream->id, NULL, 0);
+    }
+
+    free_stream(h2, stream);
+}
+
+static void
+run_streams(struct http2_connection *h2)
+{
+    lwan_connection_t *conn = h2->request->conn;
+    /* Streams suspending themselves below set this flag again */
+    bool woken = !(conn->flags & CONN_PARKED_STREAMS);
+    struct http2_stream *stream, *next;
+    bool parked = false;
+
+    list_for_each_safe(&h2->streams, stream, next, node) {
+        if (stream->conn.flags & CONN_SUSPENDED) {
+            if (!woken) {
+                parked = true;
+                continue;
+            }
+
+            /* Woken up along with the connection: let the stream know if
+             * that's because of a timeout */
+            stream->conn.flags &= ~CONN_SUSPENDED;
+            if (conn->flags & CONN_TIMED_OUT)
+                stream->conn.flags |= CONN_TIMED_OUT;
+        }
+        if (!stream->running || stream->pending.len)
+            continue;
+
+        switch (coro_resume(stream->conn.coro)) {
+        case CONN_CORO_MAY_RESUME:
+            if (stream->conn.flags & CONN_SUSPENDED)
+                parked = true;
+            break;
+        case CONN_CORO_FINISHED:
+            if (LIKELY(stream->headers_sent)) {
+                end_stream(h2, stream);
+                break;
+            }
+            /* fallthrough */
+        default:
+            reset_stream(h2, stream->id, ERROR_INTERNAL);
+        }
+    }
+
+    conn->flags &= ~CONN_TIMED_OUT;
+    if (!parked)
+        conn->flags &= ~CONN_PARKED_STREAMS;
+}
+
+static void
+respond_and_close(struct http2_connection *h2, struct http2_stream *stream,
+    lwan_http_status_t status, bool request_complete)
+{
+    send_status_only(h2, stream, status);
+
+    /* Tell the client to stop sending the request body */
+    if (!request_complete) {
+        unsigned char payload[4];
+
+        write_u32(payload, ERROR_NO_ERROR);
+        append_frame(h2, FRAME_RST_STREAM, 0, stream->id, payload, sizeof(payload));
+    }
+
+    free_stream(h2, stream);
+}
+
+static bool
+append_request(struct http2_stream *stream, const char *str, size_t len)
+{
+    /* lwan_process_request() needs room for the NUL terminator, and
+     * treats a full buffer as a request that's too large */
+    if (UNLIKELY(len >= DEFAULT_BUFFER_SIZE - stream->request_len))
+        return false;
+
+    memcpy(stream->request + stream->request_len, str, len);
+    stream->request_len += len;
+    return true;
+}
+
+#define APPEND_CONST(stream_, str_) append_request(stream_, str_, sizeof(str_) - 1)
+#define APPEND_VALUE(stream_, value_) append_request(stream_, (value_)->value, (value_)->len)
+
+static bool
+is_valid_value(const lwan_value_t *value)
+{
+    for (size_t i = 0; i < value->len; i++) {
+        switch (value->value[i]) {
+        case '\0':
+        case '\r':
+        case '\n':
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool
+is_valid_name(const lwan_value_t *name)
+{
+    if (UNLIKELY(!name->len))
+        return false;
+
+    for (size_t i = 0; i < name->len; i++) {
+        char c = name->value[i];
+
+        /* Field names must be sent in lowercase (RFC 7540 section 8.1.2) */
+        if (c <= ' ' || c == ':' || c >= 0x7f || (c >= 'A' && c <= 'Z'))
+            return false;
+    }
+
+    return true;
+}
+
+static ALWAYS_INLINE bool
+value_equals(const lwan_value_t *value, const char *str, size_t len)
+{
+    return value->len == len && !memcmp(value->value, str, len);
+}
+
+#define VALUE_EQUALS(value_, str_) value_equals(value_, str_, sizeof(str_) - 1)
+
+/*
+ * Converts a decoded header block to an HTTP/1.1 request, which is then
+ * processed by lwan_process_request() as if it were read from a socket.
+ */
+static lwan_http_status_t
+build_request(struct http2_stream *stream, const struct hpack_header *headers,
+    size_t n_headers)
+{
+    const lwan_value_t *method = NULL, *path = NULL, *scheme = NULL;
+    const lwan_value_t *authority = NULL;
+    bool has_cookies = false;
+    size_t i;
+
+    for (i = 0; i < n_headers; i++) {
+        const struct hpack_header *header = &headers[i];
+        const lwan_value_t **pseudo;
+
+        if (!header->name.len || header->name.value[0] != ':')
+            break;
+
+        if (VALUE_EQUALS(&header->name, ":method"))
+            pseudo = &method;
+        else if (VALUE_EQUALS(&header->name, ":path"))
+            pseudo = &path;
+        else if (VALUE_EQUALS(&header->name, ":scheme"))
+            pseudo = &scheme;
+        else if (VALUE_EQUALS(&header->name, ":authority"))
+            pseudo = &authority;
+        else
+            return HTTP_BAD_REQUEST;
+
+        if (UNLIKELY(*pseudo || !is_valid_value(&header->value)))
+            return HTTP_BAD_REQUEST;
+        *pseudo = &header->value;
+    }
+
+    if (UNLIKELY(!method || !path || !scheme || !method->len || !path->len))
+        return HTTP_BAD_REQUEST;
+    if (UNLIKELY(memchr(method->value, ' ', method->len) ||
+                memchr(path->value, ' ', path->len)))
+        return HTTP_BAD_REQUEST;
+
+    if (!APPEND_VALUE(stream, method) || !APPEND_CONST(stream, " ") ||
+                !APPEND_VALUE(stream, path) || !APPEND_CONST(stream, " HTTP/1.1\r\n"))
+        return HTTP_TOO_LARGE;
+
+    if (authority) {
+        if (!APPEND_CONST(stream, "Host: ") || !APPEND_VALUE(stream, authority) ||
+                    !APPEND_CONST(stream, "\r\n"))
+            return HTTP_TOO_LARGE;
+    }
+
+    for (; i < n_headers; i++) {
+        const struct hpack_header *header = &headers[i];
+
+        if (UNLIKELY(!is_valid_name(&header->name) || !is_valid_value(&header->value)))
+            return HTTP_BAD_REQUEST;
+
+        if (is_connection_specific_header(header->name.value, header->name.len))
+            continue;
+        /* Recomputed from the DATA frames */
+        if (VALUE_EQUALS(&header->name, "content-length"))
+            continue;
+        if (authority && VALUE_EQUALS(&header->name, "host"))
+            continue;
+        /* Might have been split in multiple fields; joined below */
+        if (VALUE_EQUALS(&header->name, "cookie")) {
+            has_cookies = true;
+            continue;
+        }
+
+        if (!APPEND_VALUE(stream, &header->name) || !APPEND_CONST(stream, ": ") ||
+                    !APPEND_VALUE(stream, &header->value) || !APPEND_CONST(stream, "\r\n"))
+            return HTTP_TOO_LARGE;
+    }
+
+    if (has_cookies) {
+        const char *separator = "cookie: ";
+
+        for (i = 0; i < n_headers; i++) {
+            const struct hpack_header *header = &headers[i];
+
+            if (!VALUE_EQUALS(&header->name, "cookie"))
+                continue;
+
+            if (!append_request(stream, separator, strlen(separator)) ||
+                        !APPEND_VALUE(stream, &header->value))
+                return HTTP_TOO_LARGE;
+            separator = "; ";
+        }
+
+        if (!APPEND_CONST(stream, "\r\n"))
+            return HTTP_TOO_LARGE;
+    }
+
+    return HTTP_OK;
+}
+
+#undef APPEND_CONST
+#undef APPEND_VALUE
+
+static void
+complete_request(struct http2_connection *h2, struct http2_stream *stream)
+{
+    if (stream->body.len || !strncmp(stream->request, "POST ", 5)) {
+        char length_buffer[INT_TO_STR_BUFFER_SIZE];
+        size_t length_len;
+        char *length = uint_to_string(stream->body.len, length_buffer, &length_len);
+
+        if (!append_request(stream, "Content-Length: ", sizeof("Content-Length: ") - 1) ||
+                    !append_request(stream, length, length_len) ||
+                    !append_request(stream, "\r\n", 2))
+            goto too_large;
+    }
+
+    if (!append_request(stream, "\r\n", 2))
+        goto too_large;
+    if (stream->body.len && !append_request(stream, stream->body.buffer, stream->body.len))
+        goto too_large;
+
+    free(stream->body.buffer);
+    stream->body.buffer = NULL;
+
+    if (UNLIKELY(!start_stream(h2, stream)))
+        reset_stream(h2, stream->id, ERROR_INTERNAL);
+    return;
+
+too_large:
+    respond_and_close(h2, stream, HTTP_TOO_LARGE, true);
+}
+
+static void
+end_header_block(struct http2_connection *h2)
+{
+    uint32_t id = h2->continuation.stream_id;
+    bool end_stream = h2->continuation.end_stream;
+    size_t n_headers = N_ELEMENTS(h2->headers);
+    struct http2_stream *stream;
+    hpack_status_t status;
+    lwan_http_status_t request_status;
+
+    h2->continuation.stream_id = 0;
+
+    /* Header blocks are always decoded, even if the stream is going to be
+     * refused, so that the dynamic table is kept in sync with the peer. */
+    status = hpack_decode(&h2->decoder,
+                (const unsigned char *)strbuf_get_buffer(h2->header_block),
+                strbuf_get_length(h2->header_block), h2->scratch, h2->headers,
+                &n_headers);
+    if (UNLIKELY(status == HPACK_ERROR))
+        connection_error(h2, ERROR_COMPRESSION);
+
+    stream = find_stream(h2, id);
+    if (stream) {
+        /* Trailers are discarded */
+        complete_request(h2, stream);
+        return;
+    }
+
+    h2->last_stream_id = id;
+
+    /* Safe to retry elsewhere, as the request hasn't been looked at */
+    if (UNLIKELY(h2->goaway_sent)) {
+        reset_stream(h2, id, ERROR_REFUSED_STREAM);
+        return;
+    }
+
+    if (UNLIKELY(h2->n_streams >= HTTP2_MAX_CONCURRENT_STREAMS)) {
+        reset_stream(h2, id, ERROR_REFUSED_STREAM);
+        return;
+    }
+
+    stream = new_stream(h2, id);
+    if (UNLIKELY(!stream)) {
+        reset_stream(h2, id, ERROR_REFUSED_STREAM);
+        return;
+    }
+
+    if (UNLIKELY(status == HPACK_TOO_LARGE)) {
+        respond_and_close(h2, stream, HTTP_TOO_LARGE, end_stream);
+        return;
+    }
+
+    request_status = build_request(stream, h2->headers, n_headers);
+    if (UNLIKELY(request_status == HTTP_BAD_REQUEST)) {
+        reset_stream(h2, id, ERROR_PROTOCOL);
+        return;
+    }
+    if (UNLIKELY(request_status == HTTP_TOO_LARGE)) {
+        respond_and_close(h2, stream, HTTP_TOO_LARGE, end_stream);
+        return;
+    }
+
+    if (end_stream)
+        complete_request(h2, stream);
+}
+
+static void
+append_header_block(struct http2_connection *h2, const unsigned char *fragment,
+    size_t len)
+{
+    if (UNLIKELY(strbuf_get_length(h2->header_block) + len > HTTP2_MAX_HEADER_BLOCK_SIZE))
+        connection_error(h2, ERROR_ENHANCE_YOUR_CALM);
+
+    if (UNLIKELY(!strbuf_append_str(h2->header_block, (const char *)fragment, len)))
+        abort_connection(h2);
+}
+
+static void
+strip_padding(struct http2_connection *h2, const struct http2_frame *frame,
+    const unsigned char **payload, size_t *len)
+{
+    *payload = frame->payload;
+    *len = frame->len;
+
+    if (frame->flags & FLAG_PADDED) {
+        size_t pad_len;
+
+        if (UNLIKELY(!*len))
+            connection_error(h2, ERROR_FRAME_SIZE);
+
+        pad_len = **payload;
+        if (UNLIKELY(pad_len >= *len))
+            connection_error(h2, ERROR_PROTOCOL);
+
+        (*payload)++;
+        *len -= pad_len + 1;
+    }
+}
+
+static void
+handle_headers(struct http2_connection *h2, const struct http2_frame *frame)
+{
+    const unsigned char *payload;
+    struct http2_stream *stream;
+    size_t len;
+
+    if (UNLIKELY(!frame->stream_id || !(frame->stream_id & 1)))
+        connection_error(h2, ERROR_PROTOCOL);
+
+    strip_padding(h2, frame, &payload, &len);
+
+    /* Stream prioritization is advisory, and isn't implemented */
+    if (frame->flags & FLAG_PRIORITY) {
+        if (UNLIKELY(len < 5))
+            connection_error(h2, ERROR_FRAME_SIZE);
+        payload += 5;
+        len -= 5;
+    }
+
+    stream = find_stream(h2, frame->stream_id);
+    if (stream) {
+        /* Trailers, only allowed if they end the stream */
+        if (UNLIKELY(stream->running || !(frame->flags & FLAG_END_STREAM)))
+            connection_error(h2, ERROR_PROTOCOL);
+    } else if (UNLIKELY(frame->stream_id <= h2->last_stream_id)) {
+        connection_error(h2, ERROR_STREAM_CLOSED);
+    }
+
+    if (UNLIKELY(!strbuf_reset_length(h2->header_block)))
+        abort_connection(h2);
+    append_header_block(h2, payload, len);
+
+    h2->continuation.stream_id = frame->stream_id;
+    h2->continuation.end_stream = frame->flags & FLAG_END_STREAM;
+
+    if (frame->flags & FLAG_END_HEADERS)
+        end_header_block(h2);
+}
+
+static void
+handle_continuation(struct http2_connection *h2, const struct http2_frame *frame)
+{
+    /* Interleaved frames have been rejected already */
+    if (UNLIKELY(!h2->continuation.stream_id))
+        connection_error(h2, ERROR_PROTOCOL);
+
+    append_header_block(h2, frame->payload, frame->len);
+
+    if (frame->flags & FLAG_END_HEADERS)
+        end_header_block(h2);
+}
+
+static void
+handle_data(struct http2_connection *h2, const struct http2_frame *frame)
+{
+    const unsigned char *payload;
+    struct http2_stream *stream;
+    size_t len;
+
+    if (UNLIKELY(!frame->stream_id))
+        connection_error(h2, ERROR_PROTOCOL);
+
+    strip_padding(h2, frame, &payload, &len);
+
+    /* Request bodies are small enough to be buffered in full, so the
+     * connection window is replenished right away.  The stream window is
+     * never exhausted before the body is deemed too large. */
+    if (frame->len)
+        send_window_update(h2, 0, frame->len);
+
+    stream = find_stream(h2, frame->stream_id);
+    if (!stream) {
+        if (UNLIKELY(frame->stream_id > h2->last_stream_id))
+            connection_error(h2, ERROR_PROTOCOL);
+        /* Stream has been reset, but the peer might not know it yet */
+        return;
+    }
+    if (UNLIKELY(stream->running)) {
+        reset_stream(h2, frame->stream_id, ERROR_STREAM_CLOSED);
+        return;
+    }
+
+    if (UNLIKELY(stream->body.len + len > DEFAULT_BUFFER_SIZE)) {
+        respond_and_close(h2, stream, HTTP_TOO_LARGE,
+                    frame->flags & FLAG_END_STREAM);
+        return;
+    }
+
+    if (len) {
+        if (!stream->body.buffer) {
+            stream->body.buffer = malloc(DEFAULT_BUFFER_SIZE);
+            if (UNLIKELY(!stream->body.buffer)) {
+                reset_stream(h2, frame->stream_id, ERROR_INTERNAL);
+                return;
+            }
+        }
+
+        memcpy(stream->body.buffer + stream->body.len, payload, len);
+        stream->body.len += len;
+    }
+
+    if (frame->flags & FLAG_END_STREAM)
+        complete_request(h2, stream);
+}
+
+static void
+apply_settings(struct http2_connection *h2, const unsigned char *payload,
+    size_t len)
+{
+    struct http2_stream *stream;
+
+    if (UNLIKELY(len % 6 != 0))
+        connection_error(h2, ERROR_FRAME_SIZE);
+
+    for (const unsigned char *p = payload; p < payload + len; p += 6) {
+        uint32_t value = read_u32(p + 2);
+
+        switch (p[0] << 8 | p[1]) {
+        case SETTINGS_ENABLE_PUSH:
+            if (UNLIKELY(value > 1))
+                connection_error(h2, ERROR_PROTOCOL);
+            break;
+
+        case SETTINGS_INITIAL_WINDOW_SIZE:
+            if (UNLIKELY(value > HTTP2_MAX_WINDOW_SIZE))
+                connection_error(h2, ERROR_FLOW_CONTROL);
+
+            list_for_each(&h2->streams, stream, node) {
+                stream->send_window += (int64_t)value - h2->peer.initial_window_size;
+                if (UNLIKELY(stream->send_window > HTTP2_MAX_WINDOW_SIZE))
+                    connection_error(h2, ERROR_FLOW_CONTROL);
+            }
+            h2->peer.initial_window_size = value;
+            break;
+
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (UNLIKELY(value < HTTP2_DEFAULT_FRAME_SIZE || value > HTTP2_MAX_FRAME_SIZE))
+                connection_error(h2, ERROR_PROTOCOL);
+            h2->peer.max_frame_size = value;
+            break;
+
+        default:
+            /* SETTINGS_HEADER_TABLE_SIZE doesn't matter as the encoder
+             * doesn't use the dynamic table; the rest is advisory, or
+             * unknown and must be ignored. */
+            break;
+        }
+    }
+}
+
+static void
+handle_settings(struct http2_connection *h2, const struct http2_frame *frame)
+{
+    if (UNLIKELY(frame->stream_id))
+        connection_error(h2, ERROR_PROTOCOL);
+
+    if (frame->flags & FLAG_ACK) {
+        if (UNLIKELY(frame->len != 0))
+            connection_error(h2, ERROR_FRAME_SIZE);
+        return;
+    }
+
+    apply_settings(h2, frame->payload, frame->len);
+    append_frame(h2, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+}
+
+static void
+handle_ping(struct http2_connection *h2, const struct http2_frame *frame)
+{
+    if (UNLIKELY(frame->stream_id))
+        connection_error(h2, ERROR_PROTOCOL);
+    if (UNLIKELY(frame->len != 8))
+        connection_error(h2, ERROR_FRAME_SIZE);
+
+    if (!(frame->flags & FLAG_ACK))
+        append_frame(h2, FRAME_PING, FLAG_ACK, 0, frame->payload, frame->len);
+}
+
+static void
+handle_goaway(struct http2_connection *h2, const struct http2_frame *frame)
+{
+    if (UNLIKELY(frame->stream_id))
+        connection_error(h2, ERROR_PROTOCOL);
+    if (UNLIKELY(frame->len < 8))
+        connection_error(h2, ERROR_FRAME_SIZE);
+
+    /* Streams being served are finished before closing the connection */
+    h2->goaway_received = true;
+}
+
+static void
+handle_window_update(struct http2_connection *h2, const struct http2_frame *frame)
+{
+    struct http2_stream *stream;
+    uint32_t increment;
+
+    if (UNLIKELY(frame->len != 4))
+        connection_error(h2, ERROR_FRAME_SIZE);
+
+    increment = read_u32(frame->payload) & 0x7fffffff;
+
+    if (!frame->stream_id) {
+        if (UNLIKELY(!increment))
+            connection_error(h2, ERROR_PROTOCOL);
+
+        h2->send_window += increment;
+        if (UNLIKELY(h2->send_window > HTTP2_MAX_WINDOW_SIZE))
+            connection_error(h2, ERROR_FLOW_CONTROL);
+        return;
+    }
+
+    stream = find_stream(h2, frame->stream_id);
+    if (!stream) {
+        if (UNLIKELY(frame->stream_id > h2->last_stream_id))
+            connection_error(h2, ERROR_PROTOCOL);
+        return;
+    }
+
+    if (UNLIKELY(!increment)) {
+        reset_stream(h2, frame->stream_id, ERROR_PROTOCOL);
+        return;
+    }
+
+    stream->send_window += increment;
+    if (UNLIKELY(stream->send_window > HTTP2_MAX_WINDOW_SIZE))
+        reset_stream(h2, frame->stream_id, ERROR_FLOW_CONTROL);
+}
+
+static void
+handle_rst_stream(struct http2_connection *h2, const struct http2_frame *frame)
+{
+    struct http2_stream *stream;
+
+    if (UNLIKELY(!frame->stream_id || frame->stream_id > h2->last_stream_id))
+        connection_error(h2, ERROR_PROTOCOL);
+    if (UNLIKELY(frame->len != 4))
+        connection_error(h2, ERROR_FRAME_SIZE);
+
+    stream = find_stream(h2, frame->stream_id);
+    if (stream)
+        free_stream(h2, stream);
+}
+
+static void
+handle_priority(struct http2_connection *h2, const struct http2_frame *frame)
+{
+    if (UNLIKELY(!frame->stream_id))
+        connection_error(h2, ERROR_PROTOCOL);
+
+    if (UNLIKELY(frame->len != 5)) {
+        reset_stream(h2, frame->stream_id, ERROR_FRAME_SIZE);
+        return;
+    }
+
+    /* Parsed only to reject streams that depend on themselves */
+    if (UNLIKELY((read_u32(frame->payload) & 0x7fffffff) == frame->stream_id))
+        reset_stream(h2, frame->stream_id, ERROR_PROTOCOL);
+}
+
+static void
+process_frames(struct http2_connection *h2)
+{
+    if (h2->need_preface) {
+        if (h2->in.len < sizeof(HTTP2_PREFACE) - 1)
+            return;
+        if (UNLIKELY(memcmp(h2->in.buffer, HTTP2_PREFACE, sizeof(HTTP2_PREFACE) - 1)))
+            abort_connection(h2);
+
+        h2->in.pos = sizeof(HTTP2_PREFACE) - 1;
+        h2->need_preface = false;
+    }
+
+    while (h2->in.len - h2->in.pos >= HTTP2_FRAME_HEADER_SIZE) {
+        const unsigned char *p = h2->in.buffer + h2->in.pos;
+        struct http2_frame frame = {
+            .len = (size_t)p[0] << 16 | (size_t)p[1] << 8 | (size_t)p[2],
+            .type = p[3],
+            .flags = p[4],
+            .stream_id = read_u32(p + 5) & 0x7fffffff,
+            .payload = p + HTTP2_FRAME_HEADER_SIZE
+        };
+
+        /* SETTINGS_MAX_FRAME_SIZE is never raised */
+        if (UNLIKELY(frame.len > HTTP2_DEFAULT_FRAME_SIZE))
+            connection_error(h2, ERROR_FRAME_SIZE);
+        if (h2->in.len - h2->in.pos - HTTP2_FRAME_HEADER_SIZE < frame.len)
+            break;
+
+        h2->in.pos += HTTP2_FRAME_HEADER_SIZE + frame.len;
+
+        if (UNLIKELY(h2->continuation.stream_id &&
+                    (frame.type != FRAME_CONTINUATION ||
+                     frame.stream_id != h2->continuation.stream_id)))
+            connection_error(h2, ERROR_PROTOCOL);
+
+        switch (frame.type) {
+        case FRAME_DATA:
+            handle_data(h2, &frame);
+            break;
+        case FRAME_HEADERS:
+            handle_headers(h2, &frame);
+            break;
+        case FRAME_PRIORITY:
+            handle_priority(h2, &frame);
+            break;
+        case FRAME_RST_STREAM:
+            handle_rst_stream(h2, &frame);
+            break;
+        case FRAME_SETTINGS:
+            handle_settings(h2, &frame);
+            break;
+        case FRAME_PING:
+            handle_ping(h2, &frame);
+            break;
+        case FRAME_GOAWAY:
+            handle_goaway(h2, &frame);
+            break;
+        case FRAME_WINDOW_UPDATE:
+            handle_window_update(h2, &frame);
+            break;
+        case FRAME_CONTINUATION:
+            handle_continuation(h2, &frame);
+            break;
+        case FRAME_PUSH_PROMISE:
+            /* Clients can't push */
+            connection_error(h2, ERROR_PROTOCOL);
+        default:
+            /* Unknown frame types must be ignored */
+            break;
+        }
+    }
+
+    if (h2->in.pos) {
+        h2->in.len -= h2->in.pos;
+        memmove(h2->in.buffer, h2->in.buffer + h2->in.pos, h2->in.len);
+        h2->in.pos = 0;
+    }
+}
+
+static void
+process_input(struct http2_connection *h2, bool wait_for_input)
+{
+    lwan_connection_t *conn = h2->request->conn;
+
+    for (;;) {
+        ssize_t n = lwan_read_socket(h2->request, h2->in.buffer + h2->in.len,
+                    sizeof(h2->in.buffer) - h2->in.len);
+
+        if (n > 0) {
+            h2->in.len += (size_t)n;
+            process_frames(h2);
+            return;
+        }
+        if (!n)
+            abort_connection(h2);
+
+        switch (errno) {
+        case EINTR:
+            continue;
+        case EAGAIN:
+            /* Streams might have been woken up while waiting */
+            if (!wait_for_input || has_runnable_streams(h2))
+                return;
+
+            LWAN_STATS_INC(conn->thread->stats, eagain_yields);
+            conn->flags |= CONN_MUST_READ;
+            coro_yield(conn->coro, CONN_CORO_MAY_RESUME);
+            conn->flags &= ~CONN_MUST_READ;
+            continue;
+        default:
+            abort_connection(h2);
+        }
+    }
+}
+
+static void __attribute__((noreturn))
+serve(struct http2_connection *h2)
+{
+    for (;;) {
+        bool busy = has_runnable_streams(h2) || has_pending_output(h2);
+
+        process_input(h2, !busy);
+        run_streams(h2);
+        if (UNLIKELY(__atomic_load_n(&h2->lwan->draining, __ATOMIC_RELAXED)))
+            send_goaway(h2);
+        flush_output(h2);
+
+        if ((h2->goaway_received || h2->goaway_sent) && !h2->n_streams)
+            abort_connection(h2);
+
+        /* Give other connections on this thread a chance to run */
+        if (has_runnable_streams(h2) || has_pending_output(h2))
+            coro_yield(h2->request->conn->coro, CONN_CORO_MAY_RESUME);
+    }
+}
+
+static void
+destroy_connection(struct http2_connection *h2)
+{
+    lwan_thread_stats_t *stats = h2->request->conn->thread->stats;
+    struct http2_stream *stream, *next;
+
+    list_for_each_safe(&h2->streams, stream, next, node) {
+        if (stream->conn.coro) {
+            coro_free(stream->conn.coro);
+            LWAN_STATS_INC(stats, coros_freed);
+        }
+        list_del(&stream->node);
+        free(stream->body.buffer);
+        free(stream);
+    }
+
+    while (h2->n_pooled) {
+        coro_free(h2->coro_pool[--h2->n_pooled]);
+        LWAN_STATS_INC(stats, coros_freed);
+    }
+
+    hpack_decoder_free(&h2->decoder);
+    strbuf_free(h2->header_block);
+    strbuf_free(h2->scratch);
+    strbuf_free(h2->out);
+    free(h2->file_buffer);
+}
+
+static struct http2_connection *
+new_connection(lwan_t *l, lwan_request_t *request, const char *data, size_t len)
+{
+    struct http2_connection *h2;
+    unsigned char settings[12];
+
+    h2 = coro_malloc_full(request->conn->coro, sizeof(*h2), true,
+                destroy_connection);
+    if (UNLIKELY(!h2)) {
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
+    h2->lwan = l;
+    h2->request = request;
+    list_head_init(&h2->streams);
+    h2->n_streams = 0;
+    h2->n_pooled = 0;
+    h2->last_stream_id = 0;
+    h2->continuation.stream_id = 0;
+    h2->out_generation = 0;
+    h2->file_buffer = NULL;
+    h2->send_window = HTTP2_DEFAULT_WINDOW_SIZE;
+    h2->peer.initial_window_size = HTTP2_DEFAULT_WINDOW_SIZE;
+    h2->peer.max_frame_size = HTTP2_DEFAULT_FRAME_SIZE;
+    h2->upgrade.callback = NULL;
+    h2->need_preface = false;
+    h2->table_size_update_sent = false;
+    h2->goaway_received = false;
+    h2->goaway_sent = false;
+    h2->in.pos = 0;
+    h2->in.len = 0;
+
+    h2->header_block = strbuf_new();
+    h2->scratch = strbuf_new();
+    h2->out = strbuf_new();
+    if (UNLIKELY(!hpack_decoder_init(&h2->decoder, HPACK_DEFAULT_TABLE_SIZE)))
+        abort_connection(h2);
+    if (UNLIKELY(!h2->header_block || !h2->scratch || !h2->out))
+        abort_connection(h2);
+
+    if (UNLIKELY(len > sizeof(h2->in.buffer)))
+        abort_connection(h2);
+    memcpy(h2->in.buffer, data, len);
+    h2->in.len = len;
+
+    request->conn->flags |= CONN_KEEP_ALIVE;
+
+    /* Output is already batched by the engine; small frames (e.g. a
+     * response to a single request) shouldn't wait for delayed ACKs.
+     * Failure here is harmless: just ignore it. */
+    (void)setsockopt(request->fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+    /* Server connection preface */
+    settings[0] = 0;
+    settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    write_u32(settings + 2, HTTP2_MAX_CONCURRENT_STREAMS);
+    settings[6] = 0;
+    settings[7] = SETTINGS_MAX_HEADER_LIST_SIZE;
+    write_u32(settings + 8, HTTP2_MAX_HEADER_BLOCK_SIZE);
+    append_frame(h2, FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+
+    return h2;
+}
+
+void
+lwan_http2_serve(lwan_t *l, lwan_request_t *request, const char *data, size_t len)
+{
+    struct http2_connection *h2 = new_connection(l, request, data, len);
+
+    process_frames(h2);
+    serve(h2);
+}
+
+static unsigned char *
+decode_settings(const lwan_value_t *settings, size_t *len)
+{
+    /* Sent as base64url, without padding */
+    char buffer[256];
+    size_t i;
+
+    if (UNLIKELY(settings->len > sizeof(buffer) - 3))
+        return NULL;
+
+    for (i = 0; i < settings->len; i++) {
+        char c = settings->value[i];
+
+        buffer[i] = c == '-' ? '+' : c == '_' ? '/' : c;
+    }
+    while (i % 4)
+        buffer[i++] = '=';
+
+    return base64_decode((const unsigned char *)buffer, i, len);
+}
+
+void
+lwan_http2_upgrade(lwan_t *l, lwan_request_t *request,
+    const lwan_value_t *settings, const lwan_value_t *target,
+    const char *data, size_t len,
+    void (*handler)(lwan_t *l, lwan_request_t *request, void *data),
+    void *handler_data)
+{
+    static const char switching_protocols[] = "HTTP/1.1 101 Switching Protocols\r\n"
+        "Connection: Upgrade\r\n"
+        "Upgrade: h2c\r\n"
+        "\r\n";
+    struct http2_connection *h2;
+    struct http2_stream *stream;
+    unsigned char *decoded;
+    size_t decoded_len;
+
+    decoded = decode_settings(settings, &decoded_len);
+    if (UNLIKELY(!decoded)) {
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+    coro_defer(request->conn->coro, CORO_DEFER(free), decoded);
+
+    lwan_send(request, switching_protocols, sizeof(switching_protocols) - 1, 0);
+
+    h2 = new_connection(l, request, data, len);
+    h2->need_preface = true;
+    h2->upgrade.callback = handler;
+    h2->upgrade.data = handler_data;
+    h2->upgrade.target = target;
+
+    /* Acknowledged implicitly by the 101 response */
+    apply_settings(h2, decoded, decoded_len);
+
+    /* The upgraded request is served as stream 1, half-closed already */
+    stream = new_stream(h2, 1);
+    if (UNLIKELY(!stream))
+        abort_connection(h2);
+    stream->upgraded_request = request;
+    h2->last_stream_id = 1;
+    if (UNLIKELY(!start_stream(h2, stream)))
+        abort_connection(h2);
+
+    process_frames(h2);
+    serve(h2);
+}
@@ -17,14 +17,20 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/sendfile.h>
+#include <sys/socket.h>
 
-#include "lwan.h"
+#include "lwan-private.h"
 #include "lwan-io-wrappers.h"
+#include "lwan-stats.h"
 
 static const int MAX_FAILED_TRIES = 5;
 static const size_t BUFFER_SIZE = 1400;
@@ -56,18 +62,149 @@ lwan_openat(lwan_request_t *request,
     return -ENFILE;
 }
 
+struct write_stall_t {
+    struct timespec since;
+    bool blocked;
+};
+
+static ALWAYS_INLINE void
+clock_monotonic_gettime(struct timespec *ts)
+{
+    if (UNLIKELY(clock_gettime(CLOCK_MONOTONIC, ts) < 0))
+        lwan_status_perror("clock_gettime");
+}
+
+static ALWAYS_INLINE uint64_t
+elapsed_usec(const struct timespec *since, const struct timespec *now)
+{
+    return (uint64_t)(now->tv_sec - since->tv_sec) * 1000000 +
+        (uint64_t)((now->tv_nsec - since->tv_nsec) / 1000);
+}
+
+static ALWAYS_INLINE void
+account_written(lwan_request_t *request, struct write_stall_t *stall,
+                size_t written)
+{
+    lwan_write_stats_t *stats = request->write_stats;
+
+    request->stats.bytes_written += written;
+    LWAN_STATS_ADD(request->conn->thread->stats, bytes_out, written);
+
+    if (UNLIKELY(!stats))
+        return;
+
+    stats->bytes_queued += written;
+
+    if (UNLIKELY(stall->blocked)) {
+        struct timespec now;
+
+        clock_monotonic_gettime(&now);
+        stats->blocked_usec += elapsed_usec(&stall->since, &now);
+        stall->blocked = false;
+    }
+}
+
+static void
+wait_until_writable(lwan_request_t *request, struct write_stall_t *stall)
+{
+    lwan_connection_t *conn = request->conn;
+    struct timespec now;
+
+    /*
+     * Instead of giving up after a few tries, park the coroutine until the
+     * socket is writable again (the scheduler watches for EPOLLOUT whenever
+     * a coroutine yields with CONN_CORO_MAY_RESUME).  A connection is only
+     * dropped if it can't make any progress within the write stall timeout;
+     * the timeout restarts every time something is written.
+     */
+    clock_monotonic_gettime(&now);
+
+    if (!stall->blocked) {
+        stall->since = now;
+        stall->blocked = true;
+
+        if (LIKELY(request->write_stats))
+            request->write_stats->stalls++;
+    } else if (now.tv_sec - stall->since.tv_sec >=
+                    conn->thread->lwan->config.write_stall_timeout) {
+        LWAN_STATS_INC(conn->thread->stats, write_stall_timeouts);
+        LWAN_STATS_INC(conn->thread->stats, timeouts);
+        coro_yield(conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
+    LWAN_STATS_INC(conn->thread->stats, eagain_yields);
+    conn->flags |= CONN_WRITE_BLOCKED;
+    coro_yield(conn->coro, CONN_CORO_MAY_RESUME);
+    conn->flags &= ~CONN_WRITE_BLOCKED;
+}
+
+/*
+ * On TLS connections that couldn't be fully offloaded to the kernel, these
+ * go through the userspace record layer.  They have the same semantics as
+ * the system calls they stand in for.
+ */
+static ALWAYS_INLINE ssize_t
+sock_writev(lwan_request_t *request, const struct iovec *iov, int iov_count)
+{
+#if defined(HAVE_OPENSSL)
+    if (UNLIKELY(request->tls != NULL))
+        return lwan_tls_writev(request->tls, iov, iov_count);
+#endif
+    return writev(request->fd, iov, iov_count);
+}
+
+static ALWAYS_INLINE ssize_t
+sock_send(lwan_request_t *request, const void *buf, size_t count, int flags)
+{
+#if defined(HAVE_OPENSSL)
+    if (UNLIKELY(request->tls != NULL))
+        return lwan_tls_send(request->tls, buf, count, flags);
+#endif
+    return send(request->fd, buf, count, flags);
+}
+
+static ALWAYS_INLINE ssize_t
+sock_sendfile(lwan_request_t *request, int in_fd, off_t *offset, size_t count)
+{
+#if defined(HAVE_OPENSSL)
+    if (UNLIKELY(request->tls != NULL))
+        return lwan_tls_sendfile(request->tls, in_fd, offset, count);
+#endif
+    return sendfile(request->fd, in_fd, offset, count);
+}
+
+ssize_t
+lwan_read_socket(lwan_request_t *request, void *buf, size_t count)
+{
+    ssize_t n;
+
+#if defined(HAVE_OPENSSL)
+    if (UNLIKELY(request->tls != NULL))
+        n = lwan_tls_read(request->tls, buf, count);
+    else
+#endif
+        n = read(request->fd, buf, count);
+
+    if (LIKELY(n > 0))
+        LWAN_STATS_ADD(request->conn->thread->stats, bytes_in, n);
+
+    return n;
+}
+
 ssize_t
 lwan_writev(lwan_request_t *request, struct iovec *iov, int iov_count)
 {
+    struct write_stall_t stall = { .blocked = false };
     ssize_t total_written = 0;
     int curr_iov = 0;
 
-    for (int tries = MAX_FAILED_TRIES; tries;) {
-        ssize_t written = writev(request->fd, iov + curr_iov, iov_count - curr_iov);
-        if (UNLIKELY(written < 0)) {
-            /* FIXME: Consider short writes as another try as well? */
-            tries--;
+    if (request->flags & REQUEST_HTTP2)
+        return lwan_http2_writev(request, iov, iov_count);
 
+    for (;;) {
+        ssize_t written = sock_writev(request, iov + curr_iov, iov_count - curr_iov);
+        if (UNLIKELY(written < 0)) {
             switch (errno) {
             case EAGAIN:
             case EINTR:
@@ -78,6 +215,7 @@ lwan_writev(lwan_request_t *request, struct iovec *iov, int iov_count)
         }
 
         total_written += written;
+        account_written(request, &stall, (size_t)written);
 
         while (curr_iov < iov_count && written >= (ssize_t)iov[curr_iov].iov_len) {
             written -= (ssize_t)iov[curr_iov].iov_len;
@@ -91,7 +229,7 @@ lwan_writev(lwan_request_t *request, struct iovec *iov, int iov_count)
         iov[curr_iov].iov_len -= (size_t)written;
 
 try_again:
-        coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+        wait_until_writable(request, &stall);
     }
 
 out:
@@ -102,13 +240,17 @@ out:
 ssize_t
 lwan_write(lwan_request_t *request, const void *buf, size_t count)
 {
+    struct write_stall_t stall = { .blocked = false };
     ssize_t total_written = 0;
 
-    for (int tries = MAX_FAILED_TRIES; tries;) {
-        ssize_t written = write(request->fd, buf, count);
-        if (UNLIKELY(written < 0)) {
-            tries--;
+    if (request->flags & REQUEST_HTTP2) {
+        struct iovec iov = { .iov_base = (void *)buf, .iov_len = count };
+        return lwan_http2_writev(request, &iov, 1);
+    }
 
+    for (;;) {
+        ssize_t written = sock_send(request, buf, count - (size_t)total_written, 0);
+        if (UNLIKELY(written < 0)) {
             switch (errno) {
             case EAGAIN:
             case EINTR:
@@ -119,13 +261,14 @@ lwan_write(lwan_request_t *request, const void *buf, size_t count)
         }
 
         total_written += written;
+        account_written(request, &stall, (size_t)written);
+
         if ((size_t)total_written == count)
             return total_written;
-        if ((size_t)total_written < count)
-            buf = (char *)buf + written;
+        buf = (char *)buf + written;
 
 try_again:
-        coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+        wait_until_writable(request, &stall);
     }
 
 out:
@@ -136,13 +279,17 @@ out:
 ssize_t
 lwan_send(lwan_request_t *request, const void *buf, size_t count, int flags)
 {
+    struct write_stall_t stall = { .blocked = false };
     ssize_t total_sent = 0;
 
-    for (int tries = MAX_FAILED_TRIES; tries;) {
-        ssize_t written = send(request->fd, buf, count, flags);
-        if (UNLIKELY(written < 0)) {
-            tries--;
+    if (request->flags & REQUEST_HTTP2) {
+        struct iovec iov = { .iov_base = (void *)buf, .iov_len = count };
+        return lwan_http2_writev(request, &iov, 1);
+    }
 
+    for (;;) {
+        ssize_t written = sock_send(request, buf, count - (size_t)total_sent, flags);
+        if (UNLIKELY(written < 0)) {
             switch (errno) {
             case EAGAIN:
             case EINTR:
@@ -153,13 +300,14 @@ lwan_send(lwan_request_t *request, const void *buf, size_t count, int flags)
         }
 
         total_sent += written;
+        account_written(request, &stall, (size_t)written);
+
         if ((size_t)total_sent == count)
             return total_sent;
-        if ((size_t)total_sent < count)
-            buf = (char *)buf + written;
+        buf = (char *)buf + written;
 
 try_again:
-        coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+        wait_until_writable(request, &stall);
     }
 
 out:
@@ -168,33 +316,33 @@ out:
 }
 
 static ALWAYS_INLINE ssize_t
-sendfile_read_write(coro_t *coro, int in_fd, int out_fd, off_t offset, size_t count)
+sendfile_read_write(lwan_request_t *request, int in_fd, off_t offset, size_t count)
 {
-    /* FIXME: Use lwan_{read,write}() here */
+    coro_t *coro = request->conn->coro;
     ssize_t total_bytes_written = 0;
     /* This buffer is allocated on the heap in order to minimize stack usage
      * inside the coroutine */
     char *buffer = coro_malloc(coro, BUFFER_SIZE);
 
-    if (offset && lseek(in_fd, offset, SEEK_SET) < 0) {
-        lwan_status_perror("lseek");
-        return -1;
+    if (UNLIKELY(!buffer)) {
+        coro_yield(coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
     }
 
+    /* The file position isn't used, as @in_fd might be shared with other
+     * requests */
     while (count > 0) {
-        ssize_t read_bytes = read(in_fd, buffer, BUFFER_SIZE);
-        if (read_bytes < 0) {
+        ssize_t read_bytes = pread(in_fd, buffer,
+                    count < BUFFER_SIZE ? count : BUFFER_SIZE, offset);
+        if (read_bytes <= 0) {
             coro_yield(coro, CONN_CORO_ABORT);
             __builtin_unreachable();
         }
 
-        ssize_t bytes_written = write(out_fd, buffer, (size_t)read_bytes);
-        if (bytes_written < 0) {
-            coro_yield(coro, CONN_CORO_ABORT);
-            __builtin_unreachable();
-        }
+        ssize_t bytes_written = lwan_write(request, buffer, (size_t)read_bytes);
 
         total_bytes_written += bytes_written;
+        offset += bytes_written;
         count -= (size_t)bytes_written;
         coro_yield(coro, CONN_CORO_MAY_RESUME);
     }
@@ -203,30 +351,37 @@ sendfile_read_write(coro_t *coro, int in_fd, int out_fd, off_t offset, size_t co
 }
 
 static ALWAYS_INLINE ssize_t
-sendfile_linux_sendfile(coro_t *coro, int in_fd, int out_fd, off_t offset, size_t count)
+sendfile_linux_sendfile(lwan_request_t *request, int in_fd, off_t offset, size_t count)
 {
+    struct write_stall_t stall = { .blocked = false };
     size_t total_written = 0;
     size_t to_be_written = count;
 
     do {
-        ssize_t written = sendfile(out_fd, in_fd, &offset, to_be_written);
+        ssize_t written = sock_sendfile(request, in_fd, &offset, to_be_written);
         if (written < 0) {
             switch (errno) {
             case EAGAIN:
             case EINTR:
-                coro_yield(coro, CONN_CORO_MAY_RESUME);
+                wait_until_writable(request, &stall);
                 continue;
 
+            case ENOSYS:
+            case EINVAL:
+                if (!total_written)
+                    return -1;
+                /* fallthrough */
             default:
-                coro_yield(coro, CONN_CORO_ABORT);
+                coro_yield(request->conn->coro, CONN_CORO_ABORT);
                 __builtin_unreachable();
             }
         }
 
         total_written += (size_t)written;
         to_be_written -= (size_t)written;
+        account_written(request, &stall, (size_t)written);
 
-        coro_yield(coro, CONN_CORO_MAY_RESUME);
+        coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
     } while (to_be_written > 0);
 
     return (ssize_t)total_written;
@@ -235,15 +390,188 @@ sendfile_linux_sendfile(coro_t *coro, int in_fd, int out_fd, off_t offset, size_
 ssize_t
 lwan_sendfile(lwan_request_t *request, int in_fd, off_t offset, size_t count)
 {
-    ssize_t written_bytes = sendfile_linux_sendfile(
-			request->conn->coro, in_fd, request->fd, offset, count);
+    if (request->flags & REQUEST_HTTP2)
+        return lwan_http2_sendfile(request, in_fd, offset, count);
+
+    ssize_t written_bytes = sendfile_linux_sendfile(request, in_fd, offset, count);
 
     if (UNLIKELY(written_bytes < 0)) {
         switch (errno) {
         case ENOSYS:
         case EINVAL:
-            return sendfile_read_write(request->conn->coro, in_fd, request->fd, offset, count);
+            return sendfile_read_write(request, in_fd, offset, count);
         }
     }
     return written_bytes;
 }
+
+/* A window of a file to read into the page cache.  Holds its own copy of
+ * the descriptor, as the coroutine waiting for it (and whatever it got the
+ * file from) might be gone before it's done. */
+struct readahead_job {
+    /* Whatever lwan_connection_wakeup_target() returned */
+    lwan_connection_t *conn;
+    int fd;
+    off_t offset;
+    size_t count;
+    unsigned int refs;
+    bool done;
+};
+
+/* Pages of a file mapped only to learn about (or fault in) their page
+ * cache state; nothing is ever read through them */
+struct file_window {
+    void *addr;
+    size_t len;
+};
+
+static bool
+map_window(struct file_window *window, int fd, off_t offset, size_t count)
+{
+    off_t start = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+
+    window->len = count + (size_t)(offset - start);
+    window->addr = mmap(NULL, window->len, PROT_READ, MAP_SHARED, fd, start);
+
+    return window->addr != MAP_FAILED;
+}
+
+/* Number of bytes from the start of @window (which might not be page
+ * aligned, @skip bytes into its first page) in the page cache */
+static size_t
+window_resident_len(const struct file_window *window, size_t skip)
+{
+    const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t n_pages = (window->len + page_size - 1) / page_size;
+    unsigned char resident[1024];
+
+    for (size_t page = 0; page < n_pages; page += sizeof(resident)) {
+        size_t n = n_pages - page;
+
+        if (n > sizeof(resident))
+            n = sizeof(resident);
+
+        /* If it can't be told, the window is sent right away */
+        if (UNLIKELY(mincore((char *)window->addr + page * page_size,
+                    n * page_size, resident) < 0))
+            return window->len - skip;
+
+        for (size_t i = 0; i < n; i++) {
+            if (!(resident[i] & 1)) {
+                size_t len = (page + i) * page_size;
+                return len > skip ? len - skip : 0;
+            }
+        }
+    }
+
+    return window->len - skip;
+}
+
+size_t
+lwan_resident_len(const void *map, int fd, off_t offset, size_t count)
+{
+    off_t start = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+    size_t skip = (size_t)(offset - start);
+    struct file_window window;
+    size_t len;
+
+    if (map) {
+        window.addr = (char *)map + start;
+        window.len = count + skip;
+        return window_resident_len(&window, skip);
+    }
+
+    /* Mapping a window doesn't read anything, and lets mincore() look at
+     * every page in it; files that can't be mapped are just sent */
+    if (UNLIKELY(!map_window(&window, fd, offset, count)))
+        return count;
+    len = window_resident_len(&window, skip);
+    munmap(window.addr, window.len);
+
+    return len;
+}
+
+static void
+readahead_job_unref(void *data)
+{
+    struct readahead_job *job = data;
+
+    if (!ATOMIC_DEC(job->refs)) {
+        close(job->fd);
+        free(job);
+    }
+}
+
+static void
+run_readahead_job(void *data)
+{
+    struct readahead_job *job = data;
+
+    /* readahead() reads the whole window at once, but might return
+     * before it's all there; populating a mapping of it waits for that
+     * without copying anything */
+    readahead(job->fd, job->offset, job->count);
+#if defined(MADV_POPULATE_READ)
+    struct file_window window;
+
+    if (map_window(&window, job->fd, job->offset, job->count)) {
+        madvise(window.addr, window.len, MADV_POPULATE_READ);
+        munmap(window.addr, window.len);
+    }
+#endif
+
+    __atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+
+    /* The connection might have been closed (and even reused) in the
+     * meantime; coroutines check if what they're waiting for is done,
+     * so waking it up isn't a problem */
+    lwan_connection_wake_from_any_thread(job->conn);
+
+    readahead_job_unref(job);
+}
+
+bool
+lwan_readahead_pool_acquire(void)
+{
+    return lwan_job_pool_acquire();
+}
+
+void
+lwan_readahead_pool_release(void)
+{
+    lwan_job_pool_release();
+}
+
+void
+lwan_readahead(lwan_request_t *request, int fd, off_t offset, size_t count)
+{
+    lwan_connection_t *conn = request->conn;
+    struct readahead_job *job;
+
+    job = malloc(sizeof(*job));
+    if (UNLIKELY(!job))
+        return;
+
+    *job = (struct readahead_job) {
+        .conn = lwan_connection_wakeup_target(conn),
+        .fd = fcntl(fd, F_DUPFD_CLOEXEC, 0),
+        .offset = offset,
+        .count = count,
+        .refs = 2,
+    };
+    if (UNLIKELY(job->fd < 0)) {
+        free(job);
+        return;
+    }
+
+    if (UNLIKELY(!lwan_job_pool_queue(run_readahead_job, job, NULL))) {
+        close(job->fd);
+        free(job);
+        return;
+    }
+
+    coro_defer(conn->coro, readahead_job_unref, job);
+    lwan_response_flush(request);
+    while (!__atomic_load_n(&job->done, __ATOMIC_ACQUIRE))
+        lwan_connection_suspend(conn);
+}
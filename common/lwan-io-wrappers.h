@@ -35,3 +35,23 @@ ssize_t lwan_send(lwan_request_t *request, const void *buf, size_t count,
 ssize_t lwan_sendfile(lwan_request_t *request, int in_fd,
                       off_t offset, size_t count);
 
+/* How many of the @count bytes from @offset are in the page cache, before
+ * the first page that isn't.  @map is a mapping of the whole file, if
+ * there's one around; otherwise, the range is mapped to look at it. */
+size_t lwan_resident_len(const void *map, int fd, off_t offset,
+                         size_t count);
+/* The coroutine is parked while the job pool reads the @count bytes from
+ * @offset into the page cache, so that sending them doesn't block the I/O
+ * thread.  Does nothing if the pool isn't running (see
+ * lwan_readahead_pool_acquire()). */
+void lwan_readahead(lwan_request_t *request, int fd, off_t offset,
+                    size_t count);
+/* The job pool is started by the first user, and stopped once all of
+ * them are gone.  Fails if it can't be started. */
+bool lwan_readahead_pool_acquire(void);
+void lwan_readahead_pool_release(void);
+
+/* Unlike the other wrappers, this one doesn't yield: it behaves like a
+ * single read(2) on the (non-blocking) client socket. */
+ssize_t lwan_read_socket(lwan_request_t *request, void *buf, size_t count);
+
@@ -146,3 +146,169 @@ void lwan_job_del(bool (*cb)(void *data), void *data)
         pthread_mutex_unlock(&queue_mutex);
     }
 }
+
+/* Work that blocks (e.g. on the disk), queued to run outside of the I/O
+ * threads by lwan_job_pool_queue() */
+struct pool_job_t {
+    struct pool_job_t *next;
+    void (*cb)(void *data);
+    void *data;
+    unsigned int *pending;
+};
+
+/* Threads shared by everything that queues work to the pool; started by
+ * the first user, and stopped once all of them are gone */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t finished;
+    struct pool_job_t *head, *tail;
+    pthread_t *threads;
+    unsigned int n_threads;
+    unsigned int users;
+    bool stopping;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .queued = PTHREAD_COND_INITIALIZER,
+    .finished = PTHREAD_COND_INITIALIZER,
+};
+
+static void*
+pool_thread(void *data __attribute__((unused)))
+{
+    pthread_mutex_lock(&pool.lock);
+
+    for (;;) {
+        struct pool_job_t *job;
+
+        while (!pool.head && !pool.stopping)
+            pthread_cond_wait(&pool.queued, &pool.lock);
+
+        job = pool.head;
+        if (!job)
+            break;
+        pool.head = job->next;
+
+        pthread_mutex_unlock(&pool.lock);
+        job->cb(job->data);
+        pthread_mutex_lock(&pool.lock);
+
+        if (job->pending && !--*job->pending)
+            pthread_cond_broadcast(&pool.finished);
+        free(job);
+    }
+
+    pthread_mutex_unlock(&pool.lock);
+
+    return NULL;
+}
+
+/* Must be called with pool.lock held */
+static void
+pool_stop(void)
+{
+    pool.stopping = true;
+    pthread_cond_broadcast(&pool.queued);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (unsigned int i = 0; i < pool.n_threads; i++)
+        pthread_join(pool.threads[i], NULL);
+
+    pthread_mutex_lock(&pool.lock);
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.n_threads = 0;
+    pool.stopping = false;
+}
+
+bool lwan_job_pool_acquire(void)
+{
+    long n_cpus;
+    unsigned int n_threads;
+    bool ret = true;
+
+    pthread_mutex_lock(&pool.lock);
+
+    if (pool.users++)
+        goto out;
+
+    /* Jobs mostly wait on I/O; have a few threads even on a single CPU */
+    n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n_threads = n_cpus > 2 ? (unsigned int)n_cpus : 2;
+
+    pool.threads = calloc(n_threads, sizeof(pthread_t));
+    if (!pool.threads)
+        goto error;
+
+    for (; pool.n_threads < n_threads; pool.n_threads++) {
+        if (pthread_create(&pool.threads[pool.n_threads], NULL, pool_thread,
+                    NULL))
+            goto error;
+    }
+
+out:
+    pthread_mutex_unlock(&pool.lock);
+    return ret;
+
+error:
+    lwan_status_perror("Could not start job pool threads");
+    pool_stop();
+    pool.users--;
+    ret = false;
+    goto out;
+}
+
+void lwan_job_pool_release(void)
+{
+    pthread_mutex_lock(&pool.lock);
+
+    /* Threads go through what's queued before stopping */
+    if (!--pool.users)
+        pool_stop();
+
+    pthread_mutex_unlock(&pool.lock);
+}
+
+bool lwan_job_pool_queue(void (*cb)(void *data), void *data,
+    unsigned int *pending)
+{
+    struct pool_job_t *job;
+
+    assert(cb);
+
+    job = malloc(sizeof(*job));
+    if (UNLIKELY(!job))
+        return false;
+
+    *job = (struct pool_job_t) {
+        .cb = cb,
+        .data = data,
+        .pending = pending,
+    };
+
+    pthread_mutex_lock(&pool.lock);
+    if (UNLIKELY(!pool.n_threads)) {
+        pthread_mutex_unlock(&pool.lock);
+        free(job);
+        return false;
+    }
+    if (pool.head)
+        pool.tail->next = job;
+    else
+        pool.head = job;
+    pool.tail = job;
+    if (pending)
+        (*pending)++;
+    pthread_cond_signal(&pool.queued);
+    pthread_mutex_unlock(&pool.lock);
+
+    return true;
+}
+
+void lwan_job_pool_wait(const unsigned int *pending)
+{
+    pthread_mutex_lock(&pool.lock);
+    while (*pending)
+        pthread_cond_wait(&pool.finished, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
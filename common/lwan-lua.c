@@ -38,6 +38,7 @@ struct lwan_lua_priv_t {
     char *script_file;
     pthread_key_t cache_key;
     unsigned cache_period;
+    bool cache_async_fill;
 };
 
 struct lwan_lua_state_t {
@@ -75,6 +76,15 @@ static int req_send_event_cb(lua_State *L)
     return 0;
 }
 
+static int req_flush_cb(lua_State *L)
+{
+    lwan_request_t *request = userdata_as_request(L, 1);
+
+    lwan_response_flush(request);
+
+    return 0;
+}
+
 static int req_yield_cb(lua_State *L)
 {
     return lua_yield(L, 0);
@@ -198,6 +208,7 @@ static const struct luaL_reg lwan_request_meta_regs[] = {
     { "set_response", req_set_response_cb },
     { "say", req_say_cb },
     { "send_event", req_send_event_cb },
+    { "flush", req_flush_cb },
     { "cookie", req_cookie_cb },
     { "set_headers", req_set_headers_cb },
     { NULL, NULL }
@@ -253,6 +264,8 @@ static struct cache_t *get_or_create_cache(struct lwan_lua_priv_t *priv)
         cache = cache_create(state_create, state_destroy, priv, priv->cache_period);
         if (UNLIKELY(!cache))
             lwan_status_error("Could not create cache");
+        else if (priv->cache_async_fill && !cache_enable_async_fill(cache))
+            lwan_status_warning("Could not enable asynchronous cache fills");
         /* FIXME: This cache instance leaks: store it somewhere and
          * free it on module shutdown */
         pthread_setspecific(priv->cache_key, cache);
@@ -373,6 +386,7 @@ lua_handle_cb(lwan_request_t *request,
     while (true) {
         switch (lua_resume(L, n_arguments)) {
         case LUA_YIELD:
+            lwan_response_flush(request);
             coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
             n_arguments = 0;
             break;
@@ -419,6 +433,7 @@ static void *lua_init(void *data)
     }
 
     priv->cache_period = settings->cache_period;
+    priv->cache_async_fill = settings->cache_async_fill;
 
     return priv;
 
@@ -447,7 +462,8 @@ static void *lua_init_from_hash(const struct hash *hash)
     struct lwan_lua_settings_t settings = {
         .default_type = hash_find(hash, "default_type"),
         .script_file = hash_find(hash, "script_file"),
-        .cache_period = parse_time_period(hash_find(hash, "cache_period"), 15)
+        .cache_period = parse_time_period(hash_find(hash, "cache_period"), 15),
+        .cache_async_fill = parse_bool(hash_find(hash, "cache_async_fill"), false)
     };
     return lua_init(&settings);
 }
@@ -25,6 +25,9 @@ struct lwan_lua_settings_t {
     const char *default_type;
     const char *script_file;
     unsigned int cache_period;
+    /* Load scripts in the cache fill threads rather than in the I/O
+     * threads */
+    bool cache_async_fill;
 };
 
 #define LUA(default_type_) \
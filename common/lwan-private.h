@@ -19,8 +19,27 @@
 
 #pragma once
 
+#include <sys/uio.h>
+
+#if defined(HAVE_SYS_SDT_H)
+#include <sys/sdt.h>
+#endif
+
 #include "lwan.h"
 
+/* USDT probes, in the "lwan" provider; these are a single nop when not
+ * being traced, so they're always built in if sys/sdt.h is available.
+ * List them with e.g. `bpftrace -l 'usdt:/path/to/lwan:lwan:*'`. */
+#if defined(HAVE_SYS_SDT_H)
+#define LWAN_PROBE1(name_, a1_) DTRACE_PROBE1(lwan, name_, a1_)
+#define LWAN_PROBE2(name_, a1_, a2_) DTRACE_PROBE2(lwan, name_, a1_, a2_)
+#define LWAN_PROBE3(name_, a1_, a2_, a3_) DTRACE_PROBE3(lwan, name_, a1_, a2_, a3_)
+#else
+#define LWAN_PROBE1(name_, a1_)
+#define LWAN_PROBE2(name_, a1_, a2_)
+#define LWAN_PROBE3(name_, a1_, a2_, a3_)
+#endif
+
 void lwan_response_init(void);
 void lwan_response_shutdown(void);
 
@@ -29,7 +48,31 @@ void lwan_socket_shutdown(lwan_t *l);
 
 void lwan_thread_init(lwan_t *l);
 void lwan_thread_shutdown(lwan_t *l);
-void lwan_thread_add_client(lwan_thread_t *t, int fd);
+void lwan_thread_add_client(lwan_thread_t *t, int fd,
+    lwan_connection_flags_t flags);
+void lwan_thread_notify(lwan_thread_t *t, lwan_thread_notification_t *notification);
+
+static inline const lwan_listener_t *
+lwan_connection_get_listener(const lwan_t *l, const lwan_connection_t *conn)
+{
+    return &l->listeners[(conn->flags & CONN_LISTENER_MASK) >> CONN_LISTENER_SHIFT];
+}
+
+static inline bool
+lwan_thread_at_connection_limit(const lwan_thread_t *t)
+{
+    unsigned int limit = t->lwan->thread.connection_limit;
+
+    return limit && __atomic_load_n(&t->n_connections, __ATOMIC_RELAXED) >= limit;
+}
+
+void lwan_connection_suspend(lwan_connection_t *conn);
+void lwan_connection_wake(lwan_connection_t *conn);
+void lwan_connection_wake_from_any_thread(lwan_connection_t *conn);
+lwan_connection_t *lwan_connection_wakeup_target(lwan_connection_t *conn);
+
+void lwan_websocket_finish(lwan_request_t *request)
+    __attribute__((noreturn));
 
 void lwan_status_init(lwan_t *l);
 void lwan_status_shutdown(lwan_t *l);
@@ -39,12 +82,59 @@ void lwan_job_thread_shutdown(void);
 void lwan_job_add(bool (*cb)(void *data), void *data);
 void lwan_job_del(bool (*cb)(void *data), void *data);
 
+/* Threads for work that would block the I/O threads; started by the
+ * first user, and stopped (after running what's queued) once the last
+ * one releases them.  Jobs can be counted in @pending until they've
+ * run, so that lwan_job_pool_wait() can wait for them. */
+bool lwan_job_pool_acquire(void);
+void lwan_job_pool_release(void);
+bool lwan_job_pool_queue(void (*cb)(void *data), void *data,
+                         unsigned int *pending);
+void lwan_job_pool_wait(const unsigned int *pending);
+
 void lwan_tables_init(void);
 void lwan_tables_shutdown(void);
 
 char *lwan_process_request(lwan_t *l, lwan_request_t *request,
                            lwan_value_t *buffer, char *next_request);
 
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+void lwan_http2_serve(lwan_t *l, lwan_request_t *request,
+    const char *data, size_t len) __attribute__((noreturn));
+void lwan_http2_upgrade(lwan_t *l, lwan_request_t *request,
+    const lwan_value_t *settings, const lwan_value_t *target,
+    const char *data, size_t len,
+    void (*handler)(lwan_t *l, lwan_request_t *request, void *data),
+    void *handler_data) __attribute__((noreturn));
+ssize_t lwan_http2_writev(lwan_request_t *request, struct iovec *iov, int iov_count);
+ssize_t lwan_http2_sendfile(lwan_request_t *request, int in_fd, off_t offset,
+    size_t count);
+lwan_connection_t *lwan_http2_stream_parent(lwan_connection_t *conn);
+
+void lwan_access_log_init(lwan_t *l);
+void lwan_access_log_shutdown(lwan_t *l);
+/* Longer request targets are truncated in access logs */
+#define ACCESS_LOG_MAX_TARGET_LEN 208
+void lwan_access_log(lwan_request_t *request, const lwan_value_t *target);
+
+void lwan_stats_init(lwan_t *l);
+void lwan_stats_shutdown(lwan_t *l);
+unsigned int lwan_stats_register_prefix(lwan_t *l, const char *prefix);
+lwan_thread_stats_t *lwan_stats_for_thread(lwan_t *l, unsigned int thread);
+void lwan_stats_record_request(lwan_request_t *request);
+
+void lwan_tls_init(lwan_t *l);
+void lwan_tls_shutdown(lwan_t *l);
+lwan_tls_session_t *lwan_tls_accept(lwan_t *l, lwan_connection_t *conn, int fd);
+ssize_t lwan_tls_read(lwan_tls_session_t *session, void *buf, size_t count);
+ssize_t lwan_tls_send(lwan_tls_session_t *session, const void *buf,
+    size_t count, int flags);
+ssize_t lwan_tls_writev(lwan_tls_session_t *session, const struct iovec *iov,
+    int iov_count);
+ssize_t lwan_tls_sendfile(lwan_tls_session_t *session, int in_fd,
+    off_t *offset, size_t count);
+
 void lwan_straitjacket_enforce(config_t *c, config_line_t *l);
 
 #undef static_assert
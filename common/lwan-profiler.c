@@ -0,0 +1,529 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2016 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+
+#include "lwan-private.h"
+#include "lwan-config.h"
+#include "lwan-coro.h"
+#include "lwan-profiler.h"
+
+/*
+ * Sampling profiler.  Each I/O thread gets a timer ticking with the CPU
+ * time it consumes; on every tick, the thread is interrupted with SIGPROF
+ * and the signal handler walks the frame pointer chain.  When running a
+ * coroutine, the walk continues from the context the coroutine was resumed
+ * from once the bottom of its stack is reached, so stacks always end in
+ * the I/O loop.  Stacks are counted in a per-thread hash table that's only
+ * written by the signal handler of that thread, and read (without locks)
+ * when serving the folded stacks.
+ *
+ * This needs frame pointers (-fno-omit-frame-pointer) to produce anything
+ * more useful than the sampled function.
+ */
+
+#if defined(__x86_64__)
+#define UC_PC(uc_) ((uintptr_t)(uc_)->uc_mcontext.gregs[REG_RIP])
+#define UC_SP(uc_) ((uintptr_t)(uc_)->uc_mcontext.gregs[REG_RSP])
+#define UC_FP(uc_) ((uintptr_t)(uc_)->uc_mcontext.gregs[REG_RBP])
+#elif defined(__i386__)
+#define UC_PC(uc_) ((uintptr_t)(uc_)->uc_mcontext.gregs[REG_EIP])
+#define UC_SP(uc_) ((uintptr_t)(uc_)->uc_mcontext.gregs[REG_ESP])
+#define UC_FP(uc_) ((uintptr_t)(uc_)->uc_mcontext.gregs[REG_EBP])
+#elif defined(__aarch64__)
+#define UC_PC(uc_) ((uintptr_t)(uc_)->uc_mcontext.pc)
+#define UC_SP(uc_) ((uintptr_t)(uc_)->uc_mcontext.sp)
+#define UC_FP(uc_) ((uintptr_t)(uc_)->uc_mcontext.regs[29])
+#else
+#define PROFILER_UNSUPPORTED
+#endif
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#define MAX_DEPTH 48
+#define MAX_PROBES 16
+#define TABLE_SIZE 2048 /* Per thread; must be a power of two */
+#define DEFAULT_FREQUENCY 99
+#define MAX_FREQUENCY 10000
+
+struct stack_entry {
+    /* 0 while the entry is free; published last */
+    uint64_t hash;
+    uint64_t count;
+    unsigned int depth;
+    /* [0] is the sampled PC; others are return addresses */
+    uintptr_t pcs[MAX_DEPTH];
+};
+
+struct profiler_thread {
+    struct stack_entry *stacks;
+    uintptr_t stack_lo, stack_hi;
+    uint64_t samples;
+    uint64_t dropped;
+    timer_t timer;
+    bool has_timer;
+    bool busy;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct profiler_thread *threads;
+    unsigned int n_threads;
+    unsigned int frequency;
+    unsigned int refs;
+    bool running;
+    bool handler_installed;
+    /* Checked by the signal handler; timers might fire after deletion */
+    bool enabled;
+} profiler = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .frequency = DEFAULT_FREQUENCY
+};
+
+#if !defined(PROFILER_UNSUPPORTED)
+/* Reads whatever is in the stack, including redzones added by ASan */
+static unsigned int __attribute__((no_sanitize_address))
+walk_stack(const struct profiler_thread *thread, uintptr_t pc, uintptr_t sp,
+    uintptr_t fp, uintptr_t pcs[static MAX_DEPTH])
+{
+    coro_t *coro = coro_current();
+    struct coro_stack_info info = { .parent = NULL };
+    unsigned int depth = 0;
+
+    pcs[depth++] = pc;
+
+    for (;;) {
+        uintptr_t stack_hi;
+
+        /* The signal might have arrived while switching coroutines, so
+         * look for the stack the SP is in rather than trusting coro */
+        for (; coro; coro = info.parent) {
+            if (!coro_get_stack_info(coro, &info))
+                return depth;
+            if (sp >= info.stack_lo && sp < info.stack_hi)
+                break;
+        }
+        if (coro) {
+            stack_hi = info.stack_hi;
+        } else {
+            if (sp < thread->stack_lo || sp >= thread->stack_hi)
+                return depth;
+            stack_hi = thread->stack_hi;
+        }
+
+        /* Frames must be aligned, and each one must be above the previous
+         * one in the same stack; this also keeps the walk from touching
+         * memory that isn't there. */
+        while (depth < MAX_DEPTH) {
+            const uintptr_t *frame = (const uintptr_t *)fp;
+
+            if (fp < sp || fp > stack_hi - 2 * sizeof(uintptr_t))
+                break;
+            if (fp & (sizeof(uintptr_t) - 1))
+                break;
+            if (!frame[1])
+                break;
+
+            pcs[depth++] = frame[1];
+            sp = fp + 2 * sizeof(uintptr_t);
+            fp = frame[0];
+        }
+
+        if (!coro || depth == MAX_DEPTH)
+            return depth;
+
+        /* Reached the bottom of the coroutine stack: continue from where
+         * it was resumed */
+        pcs[depth++] = info.caller_pc;
+        sp = info.caller_sp;
+        fp = info.caller_fp;
+        coro = info.parent;
+    }
+}
+
+static uint64_t
+hash_stack(const uintptr_t *pcs, unsigned int depth)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for (unsigned int i = 0; i < depth; i++)
+        hash = (hash ^ pcs[i]) * 0x100000001b3ull;
+
+    /* 0 marks free entries */
+    return hash | 1;
+}
+
+static void
+record_stack(struct profiler_thread *thread, const uintptr_t *pcs,
+    unsigned int depth)
+{
+    uint64_t hash = hash_stack(pcs, depth);
+
+    for (unsigned int probe = 0; probe < MAX_PROBES; probe++) {
+        struct stack_entry *entry = &thread->stacks[(hash + probe) & (TABLE_SIZE - 1)];
+
+        /* This is the only writer, so plain loads are fine */
+        if (!entry->hash) {
+            entry->depth = depth;
+            entry->count = 1;
+            memcpy(entry->pcs, pcs, depth * sizeof(*pcs));
+            __atomic_store_n(&entry->hash, hash, __ATOMIC_RELEASE);
+            return;
+        }
+
+        if (entry->hash == hash && entry->depth == depth &&
+                !memcmp(entry->pcs, pcs, depth * sizeof(*pcs))) {
+            __atomic_store_n(&entry->count, entry->count + 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    __atomic_store_n(&thread->dropped, thread->dropped + 1, __ATOMIC_RELAXED);
+}
+
+static void
+profiler_signal_handler(int signo __attribute__((unused)), siginfo_t *si,
+    void *context)
+{
+    struct profiler_thread *thread = si->si_value.sival_ptr;
+    const ucontext_t *uc = context;
+    uintptr_t pcs[MAX_DEPTH];
+    unsigned int depth;
+
+    if (UNLIKELY(si->si_code != SI_TIMER || !thread))
+        return;
+
+    /* Pairs with the wait in profiler_stop() */
+    __atomic_store_n(&thread->busy, true, __ATOMIC_SEQ_CST);
+    if (LIKELY(__atomic_load_n(&profiler.enabled, __ATOMIC_SEQ_CST))) {
+        depth = walk_stack(thread, UC_PC(uc), UC_SP(uc), UC_FP(uc), pcs);
+        record_stack(thread, pcs, depth);
+        __atomic_store_n(&thread->samples, thread->samples + 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&thread->busy, false, __ATOMIC_RELEASE);
+}
+#endif
+
+/* Must be called with profiler.lock held */
+static void
+profiler_stop(void)
+{
+    uint64_t samples = 0, dropped = 0;
+
+    if (!profiler.running)
+        return;
+
+    __atomic_store_n(&profiler.enabled, false, __ATOMIC_SEQ_CST);
+
+    for (unsigned int i = 0; i < profiler.n_threads; i++) {
+        struct profiler_thread *thread = &profiler.threads[i];
+
+        if (thread->has_timer) {
+            timer_delete(thread->timer);
+            thread->has_timer = false;
+        }
+
+        while (__atomic_load_n(&thread->busy, __ATOMIC_SEQ_CST))
+            sched_yield();
+
+        samples += thread->samples;
+        dropped += thread->dropped;
+    }
+
+    profiler.running = false;
+
+    lwan_status_info("Profiler stopped: %" PRIu64 " samples, %" PRIu64
+        " dropped", samples, dropped);
+}
+
+/* Must be called with profiler.lock held */
+static lwan_http_status_t
+profiler_start(lwan_t *l, unsigned int frequency)
+{
+#if defined(PROFILER_UNSUPPORTED)
+    (void)l;
+    (void)frequency;
+
+    lwan_status_error("Profiler not supported on this architecture");
+    return HTTP_NOT_IMPLEMENTED;
+#else
+    const struct timespec period = {
+        .tv_sec = frequency == 1,
+        .tv_nsec = frequency == 1 ? 0 : 1000000000 / frequency
+    };
+    const struct itimerspec interval = {
+        .it_interval = period,
+        .it_value = period
+    };
+
+    profiler_stop();
+
+    if (!profiler.threads) {
+        profiler.threads = calloc(l->thread.count, sizeof(*profiler.threads));
+        if (!profiler.threads)
+            return HTTP_INTERNAL_ERROR;
+        profiler.n_threads = l->thread.count;
+    }
+
+    if (!profiler.handler_installed) {
+        struct sigaction sa = {
+            .sa_sigaction = profiler_signal_handler,
+            .sa_flags = SA_SIGINFO | SA_RESTART
+        };
+
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGPROF, &sa, NULL) < 0) {
+            lwan_status_perror("Could not install profiler signal handler");
+            return HTTP_INTERNAL_ERROR;
+        }
+        profiler.handler_installed = true;
+    }
+
+    for (unsigned int i = 0; i < profiler.n_threads; i++) {
+        struct profiler_thread *thread = &profiler.threads[i];
+        const lwan_thread_t *t = &l->thread.threads[i];
+        pthread_attr_t attr;
+        void *stack;
+        size_t stack_size;
+
+        if (!thread->stacks) {
+            thread->stacks = calloc(TABLE_SIZE, sizeof(*thread->stacks));
+            if (!thread->stacks)
+                return HTTP_INTERNAL_ERROR;
+        } else {
+            memset(thread->stacks, 0, TABLE_SIZE * sizeof(*thread->stacks));
+        }
+        thread->samples = 0;
+        thread->dropped = 0;
+
+        if (pthread_getattr_np(t->self, &attr))
+            return HTTP_INTERNAL_ERROR;
+        if (pthread_attr_getstack(&attr, &stack, &stack_size)) {
+            pthread_attr_destroy(&attr);
+            return HTTP_INTERNAL_ERROR;
+        }
+        pthread_attr_destroy(&attr);
+
+        thread->stack_lo = (uintptr_t)stack;
+        thread->stack_hi = (uintptr_t)stack + stack_size;
+    }
+
+    __atomic_store_n(&profiler.enabled, true, __ATOMIC_SEQ_CST);
+    profiler.running = true;
+    profiler.frequency = frequency;
+
+    for (unsigned int i = 0; i < profiler.n_threads; i++) {
+        struct profiler_thread *thread = &profiler.threads[i];
+        const lwan_thread_t *t = &l->thread.threads[i];
+        pid_t tid = __atomic_load_n(&t->tid, __ATOMIC_ACQUIRE);
+        struct sigevent sev = {
+            .sigev_notify = SIGEV_THREAD_ID,
+            .sigev_signo = SIGPROF,
+            .sigev_value.sival_ptr = thread,
+        };
+        clockid_t clock;
+
+        if (!tid)
+            continue;
+        sev.sigev_notify_thread_id = tid;
+
+        if (pthread_getcpuclockid(t->self, &clock))
+            continue;
+        if (timer_create(clock, &sev, &thread->timer) < 0) {
+            lwan_status_perror("Could not create profiler timer");
+            continue;
+        }
+        thread->has_timer = true;
+
+        if (timer_settime(thread->timer, 0, &interval, NULL) < 0)
+            lwan_status_perror("Could not arm profiler timer");
+    }
+
+    lwan_status_info("Profiling %d threads at %dHz", profiler.n_threads, frequency);
+
+    return HTTP_OK;
+#endif
+}
+
+static void
+append_frame(strbuf_t *buffer, uintptr_t pc)
+{
+    Dl_info info;
+
+    if (!dladdr((void *)pc, &info)) {
+        strbuf_append_printf(buffer, "0x%" PRIxPTR, pc);
+    } else if (info.dli_sname) {
+        strbuf_append_str(buffer, info.dli_sname, 0);
+    } else {
+        /* Not exported (e.g. static functions); this can be resolved
+         * later with addr2line */
+        const char *file = strrchr(info.dli_fname, '/');
+
+        strbuf_append_printf(buffer, "%s+0x%" PRIxPTR,
+            file ? file + 1 : info.dli_fname, pc - (uintptr_t)info.dli_fbase);
+    }
+}
+
+/* One line per stack, from the outermost frame to the sampled one, followed
+ * by the number of samples, as expected by flamegraph.pl and friends */
+static void
+append_folded_stacks(strbuf_t *buffer)
+{
+    for (unsigned int i = 0; i < profiler.n_threads; i++) {
+        const struct profiler_thread *thread = &profiler.threads[i];
+
+        if (!thread->stacks)
+            continue;
+
+        for (unsigned int e = 0; e < TABLE_SIZE; e++) {
+            const struct stack_entry *entry = &thread->stacks[e];
+            unsigned int depth;
+
+            if (!__atomic_load_n(&entry->hash, __ATOMIC_ACQUIRE))
+                continue;
+
+            strbuf_append_printf(buffer, "lwan-thread-%u", i + 1);
+
+            depth = entry->depth;
+            while (depth--) {
+                strbuf_append_char(buffer, ';');
+                /* Return addresses point after the call instruction, which
+                 * might be in another function already */
+                append_frame(buffer, depth ? entry->pcs[depth] - 1 : entry->pcs[0]);
+            }
+
+            strbuf_append_printf(buffer, " %" PRIu64 "\n",
+                __atomic_load_n(&entry->count, __ATOMIC_RELAXED));
+        }
+    }
+}
+
+static lwan_http_status_t
+profiler_handle_cb(lwan_request_t *request, lwan_response_t *response,
+    void *data __attribute__((unused)))
+{
+    const char *action = lwan_request_get_query_param(request, "action");
+    lwan_http_status_t status = HTTP_OK;
+
+    response->mime_type = "text/plain";
+
+    pthread_mutex_lock(&profiler.lock);
+
+    if (!action) {
+        append_folded_stacks(response->buffer);
+    } else if (!strcmp(action, "start")) {
+        const char *frequency_param = lwan_request_get_query_param(request, "frequency");
+        long frequency = frequency_param ?
+                    parse_long(frequency_param, -1) : profiler.frequency;
+
+        if (frequency < 1 || frequency > MAX_FREQUENCY) {
+            status = HTTP_BAD_REQUEST;
+        } else {
+            status = profiler_start(request->conn->thread->lwan,
+                        (unsigned int)frequency);
+            if (status == HTTP_OK)
+                strbuf_printf(response->buffer, "Profiling at %ldHz\n", frequency);
+        }
+    } else if (!strcmp(action, "stop")) {
+        profiler_stop();
+        strbuf_set_static(response->buffer, "Stopped\n", sizeof("Stopped\n") - 1);
+    } else {
+        status = HTTP_BAD_REQUEST;
+    }
+
+    pthread_mutex_unlock(&profiler.lock);
+
+    return status;
+}
+
+static void *
+profiler_init(void *args)
+{
+    struct lwan_profiler_settings_t *settings = args;
+
+    pthread_mutex_lock(&profiler.lock);
+    if (settings->frequency >= 1 && settings->frequency <= MAX_FREQUENCY)
+        profiler.frequency = settings->frequency;
+    else
+        lwan_status_warning("Invalid profiler frequency, using %dHz",
+            profiler.frequency);
+    profiler.refs++;
+    pthread_mutex_unlock(&profiler.lock);
+
+    /* There's a single profiler, shared by all instances of this module */
+    return &profiler;
+}
+
+static void *
+profiler_init_from_hash(const struct hash *hash)
+{
+    const char *frequency = hash_find(hash, "frequency");
+    struct lwan_profiler_settings_t settings = {
+        .frequency = DEFAULT_FREQUENCY
+    };
+
+    if (frequency)
+        settings.frequency = (unsigned int)parse_int(frequency, 0);
+
+    return profiler_init(&settings);
+}
+
+static void
+profiler_shutdown(void *data __attribute__((unused)))
+{
+    pthread_mutex_lock(&profiler.lock);
+
+    if (!--profiler.refs) {
+        profiler_stop();
+
+        for (unsigned int i = 0; i < profiler.n_threads; i++)
+            free(profiler.threads[i].stacks);
+        free(profiler.threads);
+        profiler.threads = NULL;
+        profiler.n_threads = 0;
+    }
+
+    pthread_mutex_unlock(&profiler.lock);
+}
+
+const lwan_module_t *
+lwan_module_profiler(void)
+{
+    static const lwan_module_t profiler_module = {
+        .name = "profiler",
+        .init = profiler_init,
+        .init_from_hash = profiler_init_from_hash,
+        .shutdown = profiler_shutdown,
+        .handle = profiler_handle_cb,
+        .flags = HANDLER_PARSE_QUERY_STRING
+    };
+
+    return &profiler_module;
+}
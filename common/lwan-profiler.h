@@ -0,0 +1,36 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2016 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include "lwan.h"
+
+struct lwan_profiler_settings_t {
+    /* Default sampling rate, in Hz, if not given when starting */
+    unsigned int frequency;
+};
+
+#define PROFILER(frequency_) \
+  .module = lwan_module_profiler(), \
+  .args = ((struct lwan_profiler_settings_t[]) {{ \
+    .frequency = frequency_ \
+  }}), \
+  .flags = HANDLER_PARSE_QUERY_STRING
+
+const lwan_module_t *lwan_module_profiler(void);
@@ -24,12 +24,17 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 
 #include "lwan.h"
 #include "lwan-config.h"
 #include "lwan-http-authorize.h"
+#include "lwan-io-wrappers.h"
+#include "lwan-private.h"
+#include "lwan-stats.h"
 
 typedef enum {
     FINALIZER_DONE,
@@ -45,6 +50,15 @@ struct request_parser_helper {
     lwan_value_t if_modified_since;
     lwan_value_t range;
     lwan_value_t cookie;
+    lwan_value_t last_event_id;
+    lwan_value_t upgrade;
+    lwan_value_t http2_settings;
+
+    struct {
+        lwan_value_t key;
+        lwan_value_t extensions;
+        lwan_value_t version;
+    } websocket;
 
     lwan_value_t query_string;
     lwan_value_t fragment;
@@ -56,6 +70,11 @@ struct request_parser_helper {
 
     int urls_rewritten;
     char connection;
+
+    /* Copy of the request target, as sent, if it's going to be logged;
+     * len is the length of the whole target */
+    lwan_value_t target;
+    char target_buffer[ACCESS_LOG_MAX_TARGET_LEN];
 };
 
 union proxy_protocol_header {
@@ -478,6 +497,17 @@ identify_http_path(lwan_request_t *request, char *buffer,
     request->url.value = buffer;
     request->url.len = (size_t)(space - buffer);
 
+    if (request->conn->thread->access_log) {
+        /* The URL is split and decoded in place from here on */
+        size_t len = request->url.len;
+
+        if (len > sizeof(helper->target_buffer))
+            len = sizeof(helper->target_buffer);
+        memcpy(helper->target_buffer, buffer, len);
+        helper->target.value = helper->target_buffer;
+        helper->target.len = request->url.len;
+    }
+
     parse_fragment_and_query(request, helper, space);
 
     request->original_url = request->url;
@@ -525,8 +555,15 @@ parse_headers(struct request_parser_helper *helper, char *buffer, char *buffer_e
         HTTP_HDR_CONNECTION        = MULTICHAR_CONSTANT_L('C','o','n','n'),
         HTTP_HDR_CONTENT           = MULTICHAR_CONSTANT_L('C','o','n','t'),
         HTTP_HDR_COOKIE            = MULTICHAR_CONSTANT_L('C','o','o','k'),
+        HTTP_HDR_HTTP2_SETTINGS    = MULTICHAR_CONSTANT_L('H','T','T','P'),
         HTTP_HDR_IF_MODIFIED_SINCE = MULTICHAR_CONSTANT_L('I','f','-','M'),
-        HTTP_HDR_RANGE             = MULTICHAR_CONSTANT_L('R','a','n','g')
+        HTTP_HDR_LAST_EVENT_ID     = MULTICHAR_CONSTANT_L('L','a','s','t'),
+        HTTP_HDR_RANGE             = MULTICHAR_CONSTANT_L('R','a','n','g'),
+        HTTP_HDR_SEC_WEBSOCKET     = MULTICHAR_CONSTANT_L('S','e','c','-'),
+        HTTP_HDR_UPGRADE           = MULTICHAR_CONSTANT_L('U','p','g','r'),
+        HTTP_HDR_WS_EXTENSIONS     = MULTICHAR_CONSTANT_L('E','x','t','e'),
+        HTTP_HDR_WS_KEY            = MULTICHAR_CONSTANT_L('K','e','y',':'),
+        HTTP_HDR_WS_VERSION        = MULTICHAR_CONSTANT_L('V','e','r','s')
     };
 
     for (char *p = buffer; *p; buffer = ++p) {
@@ -574,14 +611,48 @@ retry:
             helper->cookie.value = value;
             helper->cookie.len = length;
             break;
+        CASE_HEADER(HTTP_HDR_HTTP2_SETTINGS, "HTTP2-Settings")
+            helper->http2_settings.value = value;
+            helper->http2_settings.len = length;
+            break;
         CASE_HEADER(HTTP_HDR_IF_MODIFIED_SINCE, "If-Modified-Since")
             helper->if_modified_since.value = value;
             helper->if_modified_since.len = length;
             break;
+        CASE_HEADER(HTTP_HDR_LAST_EVENT_ID, "Last-Event-ID")
+            helper->last_event_id.value = value;
+            helper->last_event_id.len = length;
+            break;
         CASE_HEADER(HTTP_HDR_RANGE, "Range")
             helper->range.value = value;
             helper->range.len = length;
             break;
+        CASE_HEADER(HTTP_HDR_UPGRADE, "Upgrade")
+            helper->upgrade.value = value;
+            helper->upgrade.len = length;
+            break;
+        case HTTP_HDR_SEC_WEBSOCKET:
+            if (UNLIKELY(strncmp(p, "Sec-WebSocket-", sizeof("Sec-WebSocket-") - 1)))
+                goto did_not_match;
+            p += sizeof("Sec-WebSocket-") - 1;
+            if ((p + sizeof(int32_t)) >= buffer_end)
+                goto did_not_match;
+
+            STRING_SWITCH_L(p) {
+            CASE_HEADER(HTTP_HDR_WS_EXTENSIONS, "Extensions")
+                helper->websocket.extensions.value = value;
+                helper->websocket.extensions.len = length;
+                break;
+            CASE_HEADER(HTTP_HDR_WS_KEY, "Key")
+                helper->websocket.key.value = value;
+                helper->websocket.key.len = length;
+                break;
+            CASE_HEADER(HTTP_HDR_WS_VERSION, "Version")
+                helper->websocket.version.value = value;
+                helper->websocket.version.len = length;
+                break;
+            }
+            break;
         }
 did_not_match:
         p = memchr(p, '\n', (size_t)(buffer_end - p));
@@ -595,6 +666,25 @@ did_not_match:
 #undef CASE_HEADER
 #undef MATCH_HEADER
 
+static void
+parse_websocket_upgrade(lwan_request_t *request, struct request_parser_helper *helper)
+{
+    if (!helper->upgrade.len || strcasecmp(helper->upgrade.value, "websocket"))
+        return;
+
+    /* Only RFC 6455 WebSockets are supported */
+    if (UNLIKELY(!helper->websocket.key.len || !helper->websocket.version.len))
+        return;
+    if (UNLIKELY(strcmp(helper->websocket.version.value, "13")))
+        return;
+    if (UNLIKELY(!(request->flags & REQUEST_METHOD_GET)))
+        return;
+
+    request->header.websocket.key = helper->websocket.key;
+    request->header.websocket.extensions = helper->websocket.extensions;
+    request->flags |= REQUEST_UPGRADE_WEBSOCKET;
+}
+
 static void
 parse_if_modified_since(lwan_request_t *request, struct request_parser_helper *helper)
 {
@@ -699,6 +789,13 @@ compute_keep_alive_flag(lwan_request_t *request, struct request_parser_helper *h
         is_keep_alive = (helper->connection == 'k');
     else
         is_keep_alive = (helper->connection != 'c');
+    /* Clients go to the new process for their next requests */
+    if (UNLIKELY(__atomic_load_n(&request->conn->thread->lwan->draining,
+                __ATOMIC_RELAXED)))
+        is_keep_alive = false;
+    /* Making room for new connections */
+    if (UNLIKELY(lwan_thread_at_connection_limit(request->conn->thread)))
+        is_keep_alive = false;
     if (is_keep_alive)
         request->conn->flags |= CONN_KEEP_ALIVE;
     else
@@ -723,7 +820,7 @@ static lwan_http_status_t read_from_request_socket(lwan_request_t *request,
     }
 
     for (; packets_remaining > 0; packets_remaining--) {
-        n = read(request->fd, buffer->value + total_read,
+        n = lwan_read_socket(request, buffer->value + total_read,
                     (size_t)(buffer_size - total_read));
         /* Client has shutdown orderly, nothing else to do; kill coro */
         if (UNLIKELY(n == 0)) {
@@ -736,6 +833,7 @@ static lwan_http_status_t read_from_request_socket(lwan_request_t *request,
             case EAGAIN:
             case EINTR:
 yield_and_read_again:
+                LWAN_STATS_INC(request->conn->thread->stats, eagain_yields);
                 request->conn->flags |= CONN_MUST_READ;
                 coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
                 continue;
@@ -779,14 +877,26 @@ try_to_finalize:
     return HTTP_TIMEOUT;
 }
 
+static bool
+has_http2_preface(struct request_parser_helper *helper, size_t total_read)
+{
+    /* Might be preceded by a PROXY protocol header */
+    return memmem(helper->buffer->value, total_read, HTTP2_PREFACE,
+                sizeof(HTTP2_PREFACE) - 1) != NULL;
+}
+
 static lwan_read_finalizer_t read_request_finalizer(size_t total_read,
     size_t buffer_size, struct request_parser_helper *helper)
 {
     if (UNLIKELY(total_read < 4))
         return FINALIZER_YIELD_TRY_AGAIN;
 
-    if (UNLIKELY(total_read == buffer_size))
+    if (UNLIKELY(total_read == buffer_size)) {
+        /* HTTP/2 with prior knowledge: frames might fill the buffer */
+        if (has_http2_preface(helper, total_read))
+            return FINALIZER_DONE;
         return FINALIZER_ERROR_TOO_LARGE;
+    }
 
     if (LIKELY(helper->next_request)) {
         helper->next_request = NULL;
@@ -796,6 +906,10 @@ static lwan_read_finalizer_t read_request_finalizer(size_t total_read,
     if (LIKELY(!memcmp(helper->buffer->value + total_read - 4, "\r\n\r\n", 4)))
         return FINALIZER_DONE;
 
+    /* HTTP/2 with prior knowledge: frames usually follow the preface */
+    if (UNLIKELY(has_http2_preface(helper, total_read)))
+        return FINALIZER_DONE;
+
     if (get_http_method(helper->buffer->value) == REQUEST_METHOD_POST) {
         char *post_data_separator = strrchr(helper->buffer->value, '\n');
         if (post_data_separator) {
@@ -883,6 +997,14 @@ parse_http_request(lwan_request_t *request, struct request_parser_helper *helper
 
     buffer = ignore_leading_whitespace(buffer);
 
+    if (UNLIKELY(!strncmp(buffer, HTTP2_PREFACE, sizeof(HTTP2_PREFACE) - 1))) {
+        if (request->flags & REQUEST_HTTP2)
+            return HTTP_BAD_REQUEST;
+
+        helper->next_request = buffer + sizeof(HTTP2_PREFACE) - 1;
+        return HTTP_SWITCHING_PROTOCOLS;
+    }
+
     char *path = identify_http_method(request, buffer);
     if (UNLIKELY(buffer == path)) {
         if (UNLIKELY(!*buffer))
@@ -920,8 +1042,8 @@ prepare_for_response(lwan_url_map_t *url_map,
                       lwan_request_t *request,
                       struct request_parser_helper *helper)
 {
-    request->url.value += url_map->prefix_len;
-    request->url.len -= url_map->prefix_len;
+    request->url.value += request->route.match.len;
+    request->url.len -= request->route.match.len;
 
     if (url_map->flags & HANDLER_PARSE_QUERY_STRING)
         parse_query_string(request, helper);
@@ -938,11 +1060,22 @@ prepare_for_response(lwan_url_map_t *url_map,
     if (url_map->flags & HANDLER_PARSE_COOKIES)
         parse_cookies(request, helper);
 
+    if (url_map->flags & HANDLER_PARSE_LAST_EVENT_ID)
+        request->header.last_event_id = helper->last_event_id;
+
+    if (url_map->flags & HANDLER_PARSE_WEBSOCKET)
+        parse_websocket_upgrade(request, helper);
+
     if (request->flags & REQUEST_METHOD_POST) {
-        if (url_map->flags & HANDLER_PARSE_POST_DATA)
+        if (url_map->flags & HANDLER_PARSE_POST_DATA) {
             parse_post_data(request, helper);
-        else
+        } else {
+            unsigned int methods = url_map->methods ?
+                (unsigned int)url_map->methods : REQUEST_METHOD_MASK;
+
+            request->route.match.other_methods = methods & ~(unsigned int)REQUEST_METHOD_POST;
             return HTTP_NOT_ALLOWED;
+        }
     }
 
     if (url_map->flags & HANDLER_MUST_AUTHORIZE) {
@@ -979,12 +1112,184 @@ handle_rewrite(lwan_request_t *request, struct request_parser_helper *helper)
 
     return true;
 }
+
+static void
+release_routes(void *data1, void *data2)
+{
+    lwan_connection_t *conn = data1;
+    unsigned int *refs = data2;
+
+    /* If a newer reference is still pending, it's just taken again */
+    conn->flags &= ~(CONN_ROUTES_REF | CONN_ROUTES_SLOT_MASK);
+    __atomic_fetch_sub(refs, 1, __ATOMIC_RELEASE);
+}
+
+static const lwan_trie_t *
+acquire_routes(lwan_t *l, lwan_request_t *request)
+{
+    lwan_connection_t *conn = request->conn;
+    lwan_routes_t *routes = __atomic_load_n(&l->routes, __ATOMIC_ACQUIRE);
+    unsigned int listener = (unsigned int)(conn->flags & CONN_LISTENER_MASK) >> CONN_LISTENER_SHIFT;
+    unsigned int *refs;
+
+    /* Routes are kept alive for as long as anything deferred by the
+     * request (e.g. releasing a file cache entry) hasn't run, so the
+     * release is deferred as well; that happens once the request is
+     * done, and the next request in the connection takes another
+     * reference. */
+    while (true) {
+        unsigned int slot = routes->generation & (LWAN_ROUTES_SLOTS - 1);
+        lwan_connection_flags_t slot_flags =
+            (lwan_connection_flags_t)(slot << CONN_ROUTES_SLOT_SHIFT);
+
+        /* A slot isn't reused while it has references, so this can't be
+         * a reference to an older generation */
+        if ((conn->flags & (CONN_ROUTES_REF | CONN_ROUTES_SLOT_MASK)) ==
+                    (CONN_ROUTES_REF | slot_flags))
+            return &routes->trie[listener];
+
+        refs = &conn->thread->route_refs[slot];
+        __atomic_fetch_add(refs, 1, __ATOMIC_SEQ_CST);
+
+        /* Routes are retired only after they've been replaced, and the
+         * references to their generation are gone: if they're still
+         * current, the reference has been seen or will be. */
+        lwan_routes_t *current = __atomic_load_n(&l->routes, __ATOMIC_SEQ_CST);
+        if (LIKELY(current == routes)) {
+            conn->flags = (conn->flags & ~CONN_ROUTES_SLOT_MASK) |
+                        CONN_ROUTES_REF | slot_flags;
+            break;
+        }
+
+        __atomic_fetch_sub(refs, 1, __ATOMIC_RELEASE);
+        routes = current;
+    }
+
+    coro_defer2(conn->coro, release_routes, conn, refs);
+    return &routes->trie[listener];
+}
+
+static void
+release_request_slot(void *data)
+{
+    unsigned int **count = data;
+
+    if (*count) {
+        __atomic_fetch_sub(*count, 1, __ATOMIC_RELEASE);
+        *count = NULL;
+    }
+}
+
+/* A slot is given back once the handler returns; if the coroutine is
+ * aborted before that, it's given back when the connection goes away */
+static unsigned int **
+acquire_request_slot(lwan_request_t *request, lwan_url_map_t *url_map)
+{
+    unsigned int **count;
+
+    if (__atomic_add_fetch(&url_map->concurrent_requests, 1, __ATOMIC_ACQUIRE) >
+                url_map->max_concurrent_requests)
+        goto busy;
+
+    count = coro_malloc_full(request->conn->coro, sizeof(*count), false,
+                release_request_slot);
+    if (UNLIKELY(!count))
+        goto busy;
+
+    *count = &url_map->concurrent_requests;
+    return count;
+
+busy:
+    __atomic_fetch_sub(&url_map->concurrent_requests, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void
+handle_request(lwan_t *l, lwan_request_t *request, void *data)
+{
+    struct request_parser_helper *helper = data;
+    const lwan_trie_t *routes = acquire_routes(l, request);
+    lwan_http_status_t status;
+    lwan_url_map_t *url_map;
+    unsigned int **slot;
+
+lookup_again:
+    request->route.url = request->url.value;
+    url_map = lwan_trie_lookup_route(routes, request->url.value,
+        request->flags & REQUEST_METHOD_MASK, &request->route.match);
+    if (UNLIKELY(!url_map)) {
+        /* Allowed methods are sent in the Allow header */
+        lwan_default_response(request, request->route.match.other_methods ?
+            HTTP_NOT_ALLOWED : HTTP_NOT_FOUND);
+        return;
+    }
+
+    request->stats.prefix = url_map->stats_index;
+    LWAN_STATS_TIMESTAMP_PHASE(l, request, REQUEST_PHASE_ROUTED);
+    LWAN_PROBE2(request__routed, request, url_map->prefix);
+
+    status = prepare_for_response(url_map, request, helper);
+    if (UNLIKELY(status != HTTP_OK)) {
+        lwan_default_response(request, status);
+        return;
+    }
+    LWAN_STATS_TIMESTAMP_PHASE(l, request, REQUEST_PHASE_PREPARED);
+    LWAN_PROBE1(request__prepared, request);
+
+    slot = NULL;
+    if (UNLIKELY(url_map->max_concurrent_requests)) {
+        slot = acquire_request_slot(request, url_map);
+        if (!slot) {
+            lwan_default_response(request, HTTP_UNAVAILABLE);
+            return;
+        }
+    }
+
+    status = url_map->handler(request, &request->response, url_map->data);
+    if (UNLIKELY(slot != NULL))
+        release_request_slot(slot);
+    LWAN_STATS_TIMESTAMP_PHASE(l, request, REQUEST_PHASE_HANDLED);
+    LWAN_PROBE2(request__handled, request, status);
+    if (UNLIKELY(url_map->flags & HANDLER_CAN_REWRITE_URL)) {
+        if (request->flags & RESPONSE_URL_REWRITTEN) {
+            if (LIKELY(handle_rewrite(request, helper)))
+                goto lookup_again;
+            return;
+        }
+    }
+
+    lwan_response(request, status);
+}
+
+static bool
+http2_enabled(const lwan_t *l, const lwan_connection_t *conn)
+{
+    /* Offered during the TLS handshake, following the global setting */
+    if (conn->flags & CONN_TLS)
+        return l->config.http2;
+    return lwan_connection_get_listener(l, conn)->http2;
+}
+
+static bool
+wants_http2_upgrade(lwan_t *l, lwan_request_t *request,
+    struct request_parser_helper *helper)
+{
+    if (!helper->http2_settings.len || !helper->upgrade.len)
+        return false;
+    if (!http2_enabled(l, request->conn) || (request->flags & REQUEST_HTTP2))
+        return false;
+    if (strcasecmp(helper->upgrade.value, "h2c"))
+        return false;
+
+    /* Requests with a body are served over HTTP/1.1 */
+    return !helper->content_length.len;
+}
+
 char *
 lwan_process_request(lwan_t *l, lwan_request_t *request,
     lwan_value_t *buffer, char *next_request)
 {
     lwan_http_status_t status;
-    lwan_url_map_t *url_map;
 
     struct request_parser_helper helper = {
         .buffer = buffer,
@@ -992,6 +1297,10 @@ lwan_process_request(lwan_t *l, lwan_request_t *request,
     };
 
     status = read_request(request, &helper);
+    clock_gettime(CLOCK_MONOTONIC, &request->stats.start);
+    LWAN_STATS_TIMESTAMP_PHASE(l, request, REQUEST_PHASE_READ);
+    LWAN_PROBE2(request__read, request, status);
+
     if (UNLIKELY(status != HTTP_OK)) {
         /* This request was bad, but maybe there's a good one in the
          * pipeline.  */
@@ -1002,41 +1311,43 @@ lwan_process_request(lwan_t *l, lwan_request_t *request,
          * next request), or HTTP_TIMEOUT.  Nothing to do, just abort the
          * coroutine.  */
         lwan_default_response(request, status);
+        lwan_stats_record_request(request);
         coro_yield(request->conn->coro, CONN_CORO_ABORT);
         __builtin_unreachable();
     }
 
     status = parse_http_request(request, &helper);
     if (UNLIKELY(status != HTTP_OK)) {
-        lwan_default_response(request, status);
-        goto out;
-    }
+        if (status == HTTP_SWITCHING_PROTOCOLS && http2_enabled(l, request->conn)) {
+            lwan_http2_serve(l, request, helper.next_request,
+                        (size_t)(buffer->value + buffer->len - helper.next_request));
+        }
 
-lookup_again:
-    url_map = lwan_trie_lookup_prefix(&l->url_map_trie, request->url.value);
-    if (UNLIKELY(!url_map)) {
-        lwan_default_response(request, HTTP_NOT_FOUND);
+        lwan_default_response(request, status == HTTP_SWITCHING_PROTOCOLS ?
+                    HTTP_NOT_ALLOWED : status);
         goto out;
     }
+    LWAN_STATS_TIMESTAMP_PHASE(l, request, REQUEST_PHASE_PARSED);
+    LWAN_PROBE2(request__parsed, request, request->url.value);
 
-    status = prepare_for_response(url_map, request, &helper);
-    if (UNLIKELY(status != HTTP_OK)) {
-        lwan_default_response(request, status);
-        goto out;
-    }
+    if (UNLIKELY(wants_http2_upgrade(l, request, &helper))) {
+        /* Pipelined data, if any, is the client connection preface */
+        char *data = helper.next_request ? helper.next_request : buffer->value + buffer->len;
 
-    status = url_map->handler(request, &request->response, url_map->data);
-    if (UNLIKELY(url_map->flags & HANDLER_CAN_REWRITE_URL)) {
-        if (request->flags & RESPONSE_URL_REWRITTEN) {
-            if (LIKELY(handle_rewrite(request, &helper)))
-                goto lookup_again;
-            goto out;
-        }
+        lwan_http2_upgrade(l, request, &helper.http2_settings, &helper.target,
+                    data, (size_t)(buffer->value + buffer->len - data),
+                    handle_request, &helper);
     }
 
-    lwan_response(request, status);
+    handle_request(l, request, &helper);
 
 out:
+    lwan_stats_record_request(request);
+    LWAN_PROBE3(request__done, request, request->stats.status,
+                request->stats.bytes_written);
+    if (request->stats.status)
+        lwan_access_log(request, &helper.target);
+
     return helper.next_request;
 }
 
@@ -1087,12 +1398,41 @@ lwan_request_get_cookie(lwan_request_t *request, const char *key)
                                             request->cookies.len, key);
 }
 
+lwan_value_t
+lwan_request_get_route_param(const lwan_request_t *request, const char *name)
+{
+    const lwan_trie_match_t *match = &request->route.match;
+
+    for (unsigned short i = 0; i < match->n_params; i++) {
+        if (!strcmp(match->param_names[i], name)) {
+            return (lwan_value_t) {
+                .value = (char *)request->route.url + match->params[i].offset,
+                .len = match->params[i].len
+            };
+        }
+    }
+
+    return (lwan_value_t) { .value = NULL, .len = 0 };
+}
+
 ALWAYS_INLINE int
 lwan_connection_get_fd(const lwan_t *lwan, const lwan_connection_t *conn)
 {
     return (int)(ptrdiff_t)(conn - lwan->conns);
 }
 
+const char *
+lwan_request_get_method_str(const lwan_request_t *request)
+{
+    if (request->flags & REQUEST_METHOD_GET)
+        return "GET";
+    if (request->flags & REQUEST_METHOD_HEAD)
+        return "HEAD";
+    if (request->flags & REQUEST_METHOD_POST)
+        return "POST";
+    return "UNKNOWN";
+}
+
 const char *
 lwan_request_get_remote_address(lwan_request_t *request,
             char buffer[static INET6_ADDRSTRLEN])
@@ -1116,6 +1456,9 @@ lwan_request_get_remote_address(lwan_request_t *request,
             return NULL;
     }
 
+    if (sock_addr->ss_family == AF_UNIX)
+        return memcpy(buffer, "*unix*", sizeof("*unix*"));
+
     if (sock_addr->ss_family == AF_INET)
         return inet_ntop(AF_INET,
                          &((struct sockaddr_in *) sock_addr)->sin_addr,
@@ -23,12 +23,23 @@
 #include <sys/uio.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "int-to-str.h"
 #include "lwan.h"
 #include "lwan-io-wrappers.h"
+#include "lwan-private.h"
+#include "lwan-stats.h"
 #include "lwan-template.h"
 
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT 25
+#endif
+
+/* Amount of data not yet sent by the kernel that a streaming response can
+ * have queued before the socket stops being writable. */
+static const int STREAMING_NOTSENT_LOWAT = 16384;
+
 static lwan_tpl_t *error_template = NULL;
 
 static const char *error_template_str = "<html><head><style>" \
@@ -88,18 +99,6 @@ lwan_response_shutdown(void)
 }
 
 #ifndef NDEBUG
-static const char *
-get_request_method(lwan_request_t *request)
-{
-    if (request->flags & REQUEST_METHOD_GET)
-        return "GET";
-    if (request->flags & REQUEST_METHOD_HEAD)
-        return "HEAD";
-    if (request->flags & REQUEST_METHOD_POST)
-        return "POST";
-    return "UNKNOWN";
-}
-
 static void
 log_request(lwan_request_t *request, lwan_http_status_t status)
 {
@@ -108,7 +107,7 @@ log_request(lwan_request_t *request, lwan_http_status_t status)
     lwan_status_debug("%s [%s] \"%s %s HTTP/%s\" %d %s",
         lwan_request_get_remote_address(request, ip_buffer),
         request->conn->thread->date.date,
-        get_request_method(request),
+        lwan_request_get_method_str(request),
         request->original_url.value,
         request->flags & REQUEST_IS_HTTP_1_0 ? "1.0" : "1.1",
         status,
@@ -132,7 +131,14 @@ lwan_response(lwan_request_t *request, lwan_http_status_t status)
         return;
     }
 
+    if (UNLIKELY(request->flags & RESPONSE_WEBSOCKET)) {
+        /* Handler is done with the WebSocket: close the connection */
+        lwan_websocket_finish(request);
+    }
+
     if (UNLIKELY(request->flags & RESPONSE_SENT_HEADERS)) {
+        /* Event streams might have buffered events */
+        lwan_response_flush(request);
         lwan_status_debug("Headers already sent, ignoring call");
         return;
     }
@@ -237,6 +243,7 @@ lwan_prepare_response_header(lwan_request_t *request, lwan_http_status_t status,
     bool expires_overridden = false;
 
     p_headers = headers;
+    request->stats.status = status;
 
     if (request->flags & REQUEST_IS_HTTP_1_0)
         APPEND_CONSTANT("HTTP/1.0 ");
@@ -256,6 +263,11 @@ lwan_prepare_response_header(lwan_request_t *request, lwan_http_status_t status,
             APPEND_UINT(strbuf_get_length(request->response.buffer));
     }
 
+    if (UNLIKELY(status == HTTP_SWITCHING_PROTOCOLS)) {
+        APPEND_CONSTANT("\r\nConnection: Upgrade");
+        goto append_headers;
+    }
+
     APPEND_CONSTANT("\r\nContent-Type: ");
     APPEND_STRING(request->response.mime_type);
 
@@ -264,6 +276,7 @@ lwan_prepare_response_header(lwan_request_t *request, lwan_http_status_t status,
     else
         APPEND_CONSTANT("\r\nConnection: close");
 
+append_headers:
     if ((status < HTTP_BAD_REQUEST && request->response.headers)) {
         lwan_key_value_t *header;
 
@@ -293,6 +306,24 @@ lwan_prepare_response_header(lwan_request_t *request, lwan_http_status_t status,
                 break;
             }
         }
+    } else if (status == HTTP_NOT_ALLOWED && request->route.match.other_methods) {
+        unsigned int methods = request->route.match.other_methods;
+        const char *separator = "\r\nAllow: ";
+
+        if (methods & REQUEST_METHOD_GET) {
+            APPEND_STRING(separator);
+            APPEND_CONSTANT("GET");
+            separator = ", ";
+        }
+        if (methods & REQUEST_METHOD_HEAD) {
+            APPEND_STRING(separator);
+            APPEND_CONSTANT("HEAD");
+            separator = ", ";
+        }
+        if (methods & REQUEST_METHOD_POST) {
+            APPEND_STRING(separator);
+            APPEND_CONSTANT("POST");
+        }
     }
 
     if (LIKELY(!date_overridden)) {
@@ -305,6 +336,16 @@ lwan_prepare_response_header(lwan_request_t *request, lwan_http_status_t status,
         APPEND_STRING_LEN(request->conn->thread->date.expires, 29);
     }
 
+    if (UNLIKELY(request->conn->thread->lwan->config.request_timing.server_timing)) {
+        char timing[128];
+        size_t len = lwan_stats_format_server_timing(request, timing, sizeof(timing));
+
+        if (len) {
+            APPEND_CONSTANT("\r\nServer-Timing: ");
+            APPEND_STRING_LEN(timing, len);
+        }
+    }
+
     APPEND_CONSTANT("\r\nServer: lwan\r\n\r\n\0");
 
     return (size_t)(p_headers - headers - 1);
@@ -318,27 +359,115 @@ lwan_prepare_response_header(lwan_request_t *request, lwan_http_status_t status,
 #undef APPEND_UINT
 #undef RETURN_0_ON_OVERFLOW
 
-bool
-lwan_response_set_chunked(lwan_request_t *request, lwan_http_status_t status)
+static void
+limit_unsent_data(lwan_request_t *request)
+{
+    /* Streaming responses are usually generated as fast as the handler
+     * can produce them; limit how much the kernel will buffer for this
+     * socket so that the coroutine is parked (and memory isn't wasted)
+     * when the client can't keep up.  This sticks for the lifetime of
+     * the connection, so it's set only once.  HTTP/2 streams share the
+     * socket, and are parked by flow control instead. */
+    if (request->conn->flags & CONN_NOTSENT_LOWAT)
+        return;
+    if (request->flags & REQUEST_HTTP2)
+        return;
+
+    request->conn->flags |= CONN_NOTSENT_LOWAT;
+
+    /* Failure here is harmless (e.g. older kernels): just ignore it. */
+    (void)setsockopt(request->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                &STREAMING_NOTSENT_LOWAT, sizeof(int));
+}
+
+void
+lwan_response_flush(lwan_request_t *request)
+{
+    lwan_response_t *response = &request->response;
+    size_t used = response->pending.used;
+
+    if (!used)
+        return;
+
+    response->pending.used = 0;
+    lwan_write(request, response->pending.buffer, used);
+}
+
+static void
+stream_write(lwan_request_t *request, struct iovec *vec, int vec_len)
+{
+    lwan_response_t *response = &request->response;
+    const size_t watermark = request->conn->thread->lwan->config.stream_flush_watermark;
+    struct iovec out_vec[8];
+    size_t total_len = 0;
+
+    assert(vec_len < (int)N_ELEMENTS(out_vec));
+
+    for (int i = 0; i < vec_len; i++)
+        total_len += vec[i].iov_len;
+
+    /*
+     * Small chunks and events are copied to a buffer and written in one go
+     * when it fills up, instead of costing a writev() each.  Anything that
+     * doesn't fit is written right away, together with what's pending, so
+     * large chunks are never copied.  Whoever gives up the CPU while
+     * streaming must call lwan_response_flush() first.
+     */
+    if (response->pending.used + total_len < watermark) {
+        if (UNLIKELY(!response->pending.buffer)) {
+            response->pending.buffer = coro_malloc(request->conn->coro, watermark);
+            if (UNLIKELY(!response->pending.buffer))
+                goto write_through;
+        }
+
+        char *p = response->pending.buffer + response->pending.used;
+        for (int i = 0; i < vec_len; i++)
+            p = mempcpy(p, vec[i].iov_base, vec[i].iov_len);
+        response->pending.used += total_len;
+
+        return;
+    }
+
+write_through:
+    out_vec[0].iov_base = response->pending.buffer;
+    out_vec[0].iov_len = response->pending.used;
+    memcpy(out_vec + 1, vec, (size_t)vec_len * sizeof(*vec));
+    response->pending.used = 0;
+
+    lwan_writev(request, out_vec, vec_len + 1);
+}
+
+static bool
+stream_write_headers(lwan_request_t *request, lwan_http_status_t status)
 {
     char buffer[DEFAULT_BUFFER_SIZE];
     size_t buffer_len;
 
-    if (request->flags & RESPONSE_SENT_HEADERS)
-        return false;
-
-    request->flags |= RESPONSE_CHUNKED_ENCODING;
     buffer_len = lwan_prepare_response_header(request, status,
                                                 buffer, DEFAULT_BUFFER_SIZE);
     if (UNLIKELY(!buffer_len))
         return false;
 
     request->flags |= RESPONSE_SENT_HEADERS;
-    lwan_send(request, buffer, buffer_len, MSG_MORE);
+    limit_unsent_data(request);
+
+    stream_write(request, (struct iovec[]) {
+        { .iov_base = buffer, .iov_len = buffer_len }
+    }, 1);
 
     return true;
 }
 
+bool
+lwan_response_set_chunked(lwan_request_t *request, lwan_http_status_t status)
+{
+    if (request->flags & RESPONSE_SENT_HEADERS)
+        return false;
+
+    request->flags |= RESPONSE_CHUNKED_ENCODING;
+    return stream_write_headers(request, status);
+}
+
 void
 lwan_response_send_chunk(lwan_request_t *request)
 {
@@ -348,57 +477,62 @@ lwan_response_send_chunk(lwan_request_t *request)
     }
 
     size_t buffer_len = strbuf_get_length(request->response.buffer);
+
+    if (request->flags & REQUEST_HTTP2) {
+        /* DATA frames are framing enough; the stream ends when the
+         * handler returns */
+        if (buffer_len) {
+            stream_write(request, (struct iovec[]) {
+                { .iov_base = strbuf_get_buffer(request->response.buffer), .iov_len = buffer_len }
+            }, 1);
+            goto reset_buffer;
+        }
+
+        lwan_response_flush(request);
+        return;
+    }
+
     if (UNLIKELY(!buffer_len)) {
         static const char last_chunk[] = "0\r\n\r\n";
-        lwan_send(request, last_chunk, sizeof(last_chunk) - 1, 0);
+
+        stream_write(request, (struct iovec[]) {
+            { .iov_base = (char *)last_chunk, .iov_len = sizeof(last_chunk) - 1 }
+        }, 1);
+        lwan_response_flush(request);
         return;
     }
 
-    char chunk_size[3 * sizeof(size_t) + 2];
-    int converted_len = snprintf(chunk_size, sizeof(chunk_size), "%zx\r\n", buffer_len);
-    if (UNLIKELY(converted_len < 0 || (size_t)converted_len >= sizeof(chunk_size)))
-        goto abort_coro;
-    size_t chunk_size_len = (size_t)converted_len;
+    char chunk_size_buffer[INT_TO_STR_BUFFER_SIZE];
+    size_t chunk_size_len;
+    char *chunk_size = uint_to_hex_string(buffer_len, chunk_size_buffer,
+                &chunk_size_len);
 
     struct iovec chunk_vec[] = {
         { .iov_base = chunk_size, .iov_len = chunk_size_len },
+        { .iov_base = "\r\n", .iov_len = 2 },
         { .iov_base = strbuf_get_buffer(request->response.buffer), .iov_len = buffer_len },
         { .iov_base = "\r\n", .iov_len = 2 }
     };
 
-    lwan_writev(request, chunk_vec, N_ELEMENTS(chunk_vec));
+    stream_write(request, chunk_vec, N_ELEMENTS(chunk_vec));
 
-    if (LIKELY(strbuf_reset_length(request->response.buffer))) {
-        coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
-        return;
+reset_buffer:
+    if (UNLIKELY(!strbuf_reset_length(request->response.buffer))) {
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
     }
-
-abort_coro:
-    coro_yield(request->conn->coro, CONN_CORO_ABORT);
-    __builtin_unreachable();
 }
 
 bool
 lwan_response_set_event_stream(lwan_request_t *request,
                                lwan_http_status_t status)
 {
-    char buffer[DEFAULT_BUFFER_SIZE];
-    size_t buffer_len;
-
     if (request->flags & RESPONSE_SENT_HEADERS)
         return false;
 
     request->response.mime_type = "text/event-stream";
     request->flags |= RESPONSE_NO_CONTENT_LENGTH;
-    buffer_len = lwan_prepare_response_header(request, status,
-                                                buffer, DEFAULT_BUFFER_SIZE);
-    if (UNLIKELY(!buffer_len))
-        return false;
-
-    request->flags |= RESPONSE_SENT_HEADERS;
-    lwan_send(request, buffer, buffer_len, MSG_MORE);
-
-    return true;
+    return stream_write_headers(request, status);
 }
 
 void
@@ -442,12 +576,10 @@ lwan_response_send_event(lwan_request_t *request, const char *event)
     vec[last].iov_len = 4;
     last++;
 
-    lwan_writev(request, vec, last);
+    stream_write(request, vec, last);
 
     if (UNLIKELY(!strbuf_reset_length(request->response.buffer))) {
         coro_yield(request->conn->coro, CONN_CORO_ABORT);
         __builtin_unreachable();
     }
-
-    coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
 }
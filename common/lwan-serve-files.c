@@ -21,9 +21,15 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <zlib.h>
 
@@ -36,6 +42,8 @@
 #include "realpathat.h"
 #include "hash.h"
 
+static const size_t READAHEAD_WINDOW = 1024 * 1024;
+
 static const char *compression_none = NULL;
 static const char *compression_gzip = "gzip";
 static const char *compression_deflate = "deflate";
@@ -47,6 +55,9 @@ typedef struct mmap_cache_data_t_	mmap_cache_data_t;
 typedef struct sendfile_cache_data_t_	sendfile_cache_data_t;
 typedef struct dir_list_cache_data_t_	dir_list_cache_data_t;
 typedef struct redir_cache_data_t_	redir_cache_data_t;
+typedef struct file_watcher_t_		file_watcher_t;
+typedef struct watched_dir_t_		watched_dir_t;
+typedef struct dir_prefix_entry_t_	dir_prefix_entry_t;
 
 struct serve_files_priv_t_ {
     struct cache_t *cache;
@@ -62,7 +73,15 @@ struct serve_files_priv_t_ {
 
     lwan_tpl_t *directory_list_tpl;
 
+    /* Only if the cache is invalidated as soon as files change */
+    file_watcher_t *watcher;
+
+    /* Resolved directories, so that only the last component of a path has
+     * to be looked at; NULL if disabled */
+    struct cache_t *dir_cache;
+
     bool serve_precompressed_files;
+    bool nonblocking_reads;
 };
 
 struct cache_funcs_t_ {
@@ -85,15 +104,16 @@ struct mmap_cache_data_t_ {
 };
 
 struct sendfile_cache_data_t_ {
-    /*
-     * FIXME Investigate if keeping files open and dup()ing them
-     *       is faster than openat()ing. This won't scale as well,
-     *       but might be a good alternative for popular files.
-     */
-
     struct {
         char *filename;
         size_t size;
+        /* Kept open for as long as the entry is cached, and shared by all
+         * requests (which always pass an offset); -1 if the file has to be
+         * opened for each request */
+        int fd;
+        /* With nonblocking reads, a mapping of the open file, only used to
+         * look at its page cache state; NULL if there isn't one */
+        void *map;
     } compressed, uncompressed;
 };
 
@@ -115,8 +135,74 @@ struct file_cache_entry_t_ {
 
     const char *mime_type;
     const cache_funcs_t *funcs;
+
+    /* File (or directory) this was created from, relative to the root;
+     * checked again once the entry expires */
+    struct {
+        char *path;
+        dev_t dev;
+        ino_t ino;
+        mode_t mode;
+        off_t size;
+        struct timespec mtime;
+    } source;
+
+    /* Only if the cache is invalidated as soon as files change */
+    struct {
+        struct list_node entries;
+        watched_dir_t *dir;
+        char *key;
+    } watch;
+};
+
+struct watched_dir_t_ {
+    int wd;
+    /* Entries created from this directory, or from files in it */
+    struct list_head entries;
+};
+
+struct dir_prefix_entry_t_ {
+    struct cache_entry_t base;
+    /* O_PATH descriptor, so that files are looked up in the directory
+     * that was resolved, even if the path now leads somewhere else */
+    int fd;
+    char path[];
+};
+
+struct file_watcher_t_ {
+    pthread_t self;
+    pthread_mutex_t lock;
+    int fd;
+    int stop_fd;
+    /* Watch descriptor -> watched_dir_t */
+    struct hash *dirs;
+    bool warned;
 };
 
+/* Descriptors kept open by sendfile entries, for all instances; capped to a
+ * fraction of the process limit, so that there are always some left for
+ * connections and for files opened by each request.  The cap is computed
+ * when the first one is opened: instances are initialized before lwan
+ * raises the limit. */
+static struct {
+    unsigned int open;
+    unsigned int max;
+    pthread_once_t max_once;
+} cached_fds = { .max_once = PTHREAD_ONCE_INIT };
+
+static void
+compute_cached_fds_max(void)
+{
+    struct rlimit r;
+
+    /* Files are opened for each request if this fails */
+    if (LIKELY(getrlimit(RLIMIT_NOFILE, &r) >= 0))
+        cached_fds.max = r.rlim_cur < UINT_MAX ?
+                    (unsigned int)(r.rlim_cur / 4) : UINT_MAX / 4;
+    else
+        lwan_status_perror("getrlimit");
+}
+
 struct file_list_t {
     const char *full_path;
     const char *rel_path;
@@ -356,6 +442,8 @@ mmap_init(file_cache_entry_t *ce,
     md->uncompressed.size = (size_t)st->st_size;
     compress_cached_entry(md);
 
+    ce->base.cost += md->uncompressed.size + md->compressed.size;
+
     ce->mime_type = lwan_determine_mime_type_for_file_name(
                 full_path + priv->root.path_len);
 
@@ -367,6 +455,65 @@ close_file:
     return success;
 }
 
+static int
+open_cached_fd(serve_files_priv_t *priv, const char *filename,
+    const struct stat *st)
+{
+    struct stat fd_st;
+    int fd;
+
+    pthread_once(&cached_fds.max_once, compute_cached_fds_max);
+    if (ATOMIC_INC(cached_fds.open) > cached_fds.max)
+        goto out;
+
+    fd = openat(priv->root.fd, filename, priv->open_mode);
+    if (UNLIKELY(fd < 0))
+        goto out;
+
+    /* The file might have been replaced since it was looked at */
+    if (UNLIKELY(fstat(fd, &fd_st) < 0 || fd_st.st_ino != st->st_ino ||
+                fd_st.st_dev != st->st_dev)) {
+        close(fd);
+        goto out;
+    }
+
+    return fd;
+
+out:
+    ATOMIC_DEC(cached_fds.open);
+    return -1;
+}
+
+static void
+close_cached_fd(int fd)
+{
+    if (fd >= 0) {
+        close(fd);
+        ATOMIC_DEC(cached_fds.open);
+    }
+}
+
+static void *
+map_cached_fd(serve_files_priv_t *priv, int fd, size_t size)
+{
+    void *map;
+
+    if (!priv->nonblocking_reads || fd < 0 || !size)
+        return NULL;
+
+    /* Nothing is read through this, so it doesn't cost anything but
+     * address space; without it, ranges are mapped for each request */
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+static void
+unmap_cached_fd(void *map, size_t size)
+{
+    if (map)
+        munmap(map, size);
+}
+
 static bool
 sendfile_init(file_cache_entry_t *ce,
                serve_files_priv_t *priv,
@@ -391,21 +538,32 @@ sendfile_init(file_cache_entry_t *ce,
     if (LIKELY(ret >= 0 && compressed_st.st_mtime >= st->st_mtime &&
             is_compression_worthy((size_t)compressed_st.st_size, (size_t)st->st_size))) {
         sd->compressed.size = (size_t)compressed_st.st_size;
+        sd->compressed.fd = open_cached_fd(priv, sd->compressed.filename,
+                    &compressed_st);
+        sd->compressed.map = map_cached_fd(priv, sd->compressed.fd,
+                    sd->compressed.size);
     } else {
         free(sd->compressed.filename);
 
 only_uncompressed:
         sd->compressed.filename = NULL;
         sd->compressed.size = 0;
+        sd->compressed.fd = -1;
+        sd->compressed.map = NULL;
     }
 
     /* Regardless of the existence of $FILENAME.gz, store the full path */
     sd->uncompressed.size = (size_t)st->st_size;
     sd->uncompressed.filename = strdup(full_path + priv->root.path_len + 1);
     if (UNLIKELY(!sd->uncompressed.filename)) {
+        unmap_cached_fd(sd->compressed.map, sd->compressed.size);
+        close_cached_fd(sd->compressed.fd);
         free(sd->compressed.filename);
         return false;
     }
+    sd->uncompressed.fd = open_cached_fd(priv, sd->uncompressed.filename, st);
+    sd->uncompressed.map = map_cached_fd(priv, sd->uncompressed.fd,
+                sd->uncompressed.size);
 
     return true;
 }
@@ -423,9 +581,13 @@ dirlist_init(file_cache_entry_t *ce,
     };
 
     dd->rendered = lwan_tpl_apply(priv->directory_list_tpl, &vars);
+    if (UNLIKELY(!dd->rendered))
+        return false;
+
+    ce->base.cost += strbuf_get_length(dd->rendered);
     ce->mime_type = "text/html";
 
-    return !!dd->rendered;
+    return true;
 }
 
 static bool
@@ -508,6 +670,9 @@ create_cache_entry_from_funcs(serve_files_priv_t *priv, const char *full_path,
     if (UNLIKELY(!fce))
         return NULL;
 
+    /* Initialization functions add whatever they allocate to this */
+    fce->base.cost = sizeof(*fce) + funcs->struct_size;
+
     if (LIKELY(funcs->init(fce, priv, full_path, st))) {
         fce->funcs = funcs;
         return fce;
@@ -521,6 +686,438 @@ create_cache_entry_from_funcs(serve_files_priv_t *priv, const char *full_path,
     return create_cache_entry_from_funcs(priv, full_path, st, &sendfile_funcs);
 }
 
+#define WATCH_EVENTS \
+    (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF | \
+     IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+/* Starts watching the directory containing the file @fce was created from
+ * (or the directory itself, for listings and redirects), so that @key is
+ * invalidated as soon as something changes there.  If that's not possible,
+ * the entry is still revalidated once it expires. */
+static void
+watch_cache_entry(serve_files_priv_t *priv, file_cache_entry_t *fce,
+    const char *key)
+{
+    file_watcher_t *watcher = priv->watcher;
+    const char *path = fce->source.path;
+    char dir_path[PATH_MAX];
+    watched_dir_t *dir;
+    int path_len;
+    int ret;
+    int wd;
+
+    fce->watch.dir = NULL;
+    fce->watch.key = NULL;
+
+    if (!watcher)
+        return;
+
+    path_len = (int)strlen(path);
+    if (!S_ISDIR(fce->source.mode)) {
+        const char *slash = memrchr(path, '/', (size_t)path_len);
+
+        if (slash) {
+            path_len = (int)(slash - path);
+        } else {
+            path = ".";
+            path_len = 1;
+        }
+    }
+
+    ret = snprintf(dir_path, sizeof(dir_path), "%s/%.*s", priv->root.path,
+        path_len, path);
+    if (UNLIKELY(ret < 0 || ret >= (int)sizeof(dir_path)))
+        return;
+
+    fce->watch.key = strdup(key);
+    if (UNLIKELY(!fce->watch.key))
+        return;
+
+    pthread_mutex_lock(&watcher->lock);
+
+    wd = inotify_add_watch(watcher->fd, dir_path, WATCH_EVENTS);
+    if (UNLIKELY(wd < 0)) {
+        if (!watcher->warned) {
+            lwan_status_perror("Could not watch %s; files there will be "
+                "checked once they expire", dir_path);
+            watcher->warned = true;
+        }
+        goto out;
+    }
+
+    dir = hash_find(watcher->dirs, (void *)(intptr_t)wd);
+    if (!dir) {
+        dir = malloc(sizeof(*dir));
+        if (UNLIKELY(!dir))
+            goto out_rm_watch;
+
+        dir->wd = wd;
+        list_head_init(&dir->entries);
+
+        if (UNLIKELY(hash_add(watcher->dirs, (void *)(intptr_t)wd, dir) < 0)) {
+            free(dir);
+            goto out_rm_watch;
+        }
+    }
+
+    list_add_tail(&dir->entries, &fce->watch.entries);
+    fce->watch.dir = dir;
+
+out:
+    pthread_mutex_unlock(&watcher->lock);
+
+    if (!fce->watch.dir) {
+        free(fce->watch.key);
+        fce->watch.key = NULL;
+    }
+    return;
+
+out_rm_watch:
+    inotify_rm_watch(watcher->fd, wd);
+    goto out;
+}
+
+static void
+unwatch_cache_entry(serve_files_priv_t *priv, file_cache_entry_t *fce)
+{
+    file_watcher_t *watcher = priv->watcher;
+    watched_dir_t *dir;
+
+    if (!watcher)
+        return;
+
+    pthread_mutex_lock(&watcher->lock);
+
+    /* Might have been dropped by the watcher thread */
+    dir = fce->watch.dir;
+    if (dir) {
+        list_del(&fce->watch.entries);
+
+        if (list_empty(&dir->entries)) {
+            inotify_rm_watch(watcher->fd, dir->wd);
+            hash_del(watcher->dirs, (void *)(intptr_t)dir->wd);
+        }
+    }
+
+    pthread_mutex_unlock(&watcher->lock);
+
+    free(fce->watch.key);
+}
+
+struct invalidated_keys {
+    char **keys;
+    size_t len, size;
+};
+
+/* Must be called with the watcher lock held.  Collects the keys of entries
+ * in @dir that depend on @name, or all of them if @name is NULL; if @drop
+ * is set, they're also removed from @dir. */
+static void
+collect_invalidated_keys(watched_dir_t *dir, const char *name, bool drop,
+    struct invalidated_keys *keys)
+{
+    file_cache_entry_t *fce, *next;
+
+    list_for_each_safe(&dir->entries, fce, next, watch.entries) {
+        if (name && !S_ISDIR(fce->source.mode)) {
+            const char *base = strrchr(fce->source.path, '/');
+
+            if (strcmp(base ? base + 1 : fce->source.path, name))
+                continue;
+        }
+
+        if (keys->len == keys->size) {
+            size_t size = keys->size ? keys->size * 2 : 16;
+            char **new_keys = realloc(keys->keys, size * sizeof(char *));
+
+            if (UNLIKELY(!new_keys))
+                return;
+
+            keys->keys = new_keys;
+            keys->size = size;
+        }
+
+        keys->keys[keys->len] = strdup(fce->watch.key);
+        if (LIKELY(keys->keys[keys->len]))
+            keys->len++;
+
+        if (drop) {
+            list_del(&fce->watch.entries);
+            fce->watch.dir = NULL;
+        }
+    }
+}
+
+static void
+handle_watch_events(serve_files_priv_t *priv, const char *buffer, size_t len)
+{
+    file_watcher_t *watcher = priv->watcher;
+    struct invalidated_keys keys = { .keys = NULL };
+    const struct inotify_event *event;
+    bool appeared = false;
+
+    pthread_mutex_lock(&watcher->lock);
+
+    for (const char *p = buffer; p < buffer + len;
+            p += sizeof(*event) + event->len) {
+        watched_dir_t *dir;
+
+        event = (const struct inotify_event *)p;
+
+        if (event->mask & (IN_CREATE | IN_MOVED_TO | IN_ATTRIB | IN_Q_OVERFLOW))
+            appeared = true;
+
+        if (event->mask & IN_Q_OVERFLOW) {
+            /* Events were lost; anything could have changed */
+            struct hash_iter iter;
+            const void *value;
+
+            lwan_status_warning("Too many changes to files; dropping all of them from the cache");
+
+            hash_iter_init(watcher->dirs, &iter);
+            while (hash_iter_next(&iter, NULL, &value))
+                collect_invalidated_keys((watched_dir_t *)value, NULL, false, &keys);
+            continue;
+        }
+
+        dir = hash_find(watcher->dirs, (void *)(intptr_t)event->wd);
+        if (!dir)
+            continue;
+
+        if (event->mask & IN_IGNORED) {
+            /* Removed (or unmounted): the watch is gone */
+            collect_invalidated_keys(dir, NULL, true, &keys);
+            hash_del(watcher->dirs, (void *)(intptr_t)event->wd);
+        } else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+            collect_invalidated_keys(dir, NULL, false, &keys);
+        } else {
+            collect_invalidated_keys(dir, event->len ? event->name : NULL,
+                false, &keys);
+        }
+    }
+
+    pthread_mutex_unlock(&watcher->lock);
+
+    /* Invalidating might destroy entries, which takes the watcher lock */
+    for (size_t i = 0; i < keys.len; i++) {
+        cache_invalidate(priv->cache, keys.keys[i]);
+        free(keys.keys[i]);
+    }
+    free(keys.keys);
+
+    /* Whatever was created (or made readable) might be something that
+     * was remembered as not found; these aren't tracked individually */
+    if (appeared)
+        cache_invalidate_negative(priv->cache);
+}
+
+static void *
+watcher_thread(void *data)
+{
+    serve_files_priv_t *priv = data;
+    file_watcher_t *watcher = priv->watcher;
+    char buffer[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[] = {
+        { .fd = watcher->fd, .events = POLLIN },
+        { .fd = watcher->stop_fd, .events = POLLIN },
+    };
+
+    for (;;) {
+        ssize_t len;
+
+        if (UNLIKELY(poll(fds, N_ELEMENTS(fds), -1) < 0)) {
+            if (errno == EINTR)
+                continue;
+
+            lwan_status_perror("poll");
+            break;
+        }
+
+        if (fds[1].revents)
+            break;
+
+        len = read(watcher->fd, buffer, sizeof(buffer));
+        if (len > 0)
+            handle_watch_events(priv, buffer, (size_t)len);
+    }
+
+    return NULL;
+}
+
+static file_watcher_t *
+watcher_new(void)
+{
+    file_watcher_t *watcher = malloc(sizeof(*watcher));
+
+    if (!watcher)
+        return NULL;
+
+    watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher->fd < 0)
+        goto out_inotify_init;
+
+    watcher->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (watcher->stop_fd < 0)
+        goto out_eventfd;
+
+    watcher->dirs = hash_int_new(NULL, free);
+    if (!watcher->dirs)
+        goto out_hash_new;
+
+    if (pthread_mutex_init(&watcher->lock, NULL))
+        goto out_mutex_init;
+
+    watcher->warned = false;
+
+    return watcher;
+
+out_mutex_init:
+    hash_free(watcher->dirs);
+out_hash_new:
+    close(watcher->stop_fd);
+out_eventfd:
+    close(watcher->fd);
+out_inotify_init:
+    free(watcher);
+    return NULL;
+}
+
+static void
+watcher_free(file_watcher_t *watcher)
+{
+    pthread_mutex_destroy(&watcher->lock);
+    hash_free(watcher->dirs);
+    close(watcher->stop_fd);
+    close(watcher->fd);
+    free(watcher);
+}
+
+static void
+watcher_stop(file_watcher_t *watcher)
+{
+    uint64_t stop = 1;
+
+    if (UNLIKELY(write(watcher->stop_fd, &stop, sizeof(stop)) < 0))
+        lwan_status_perror("write");
+
+    pthread_join(watcher->self, NULL);
+}
+
+static struct cache_entry_t *
+create_dir_prefix_entry(const char *key, void *context)
+{
+    serve_files_priv_t *priv = context;
+    dir_prefix_entry_t *dpe, *shrunk;
+    struct stat st;
+    size_t len;
+
+    /* Resolved in place, as this is called with create_cache_entry()'s
+     * buffers already on the stack */
+    dpe = malloc(sizeof(*dpe) + PATH_MAX);
+    if (UNLIKELY(!dpe))
+        return NULL;
+
+    if (UNLIKELY(!realpathat2(priv->root.fd, priv->root.path, key,
+                dpe->path, &st)))
+        goto out_free;
+
+    if (UNLIKELY(!S_ISDIR(st.st_mode)))
+        goto out_free;
+
+    if (UNLIKELY(strncmp(dpe->path, priv->root.path, priv->root.path_len)))
+        goto out_free;
+    if (UNLIKELY(dpe->path[priv->root.path_len] != '/' &&
+                 dpe->path[priv->root.path_len] != '\0'))
+        goto out_free;
+
+    dpe->fd = open(dpe->path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (UNLIKELY(dpe->fd < 0))
+        goto out_free;
+
+    len = strlen(dpe->path);
+    shrunk = realloc(dpe, sizeof(*dpe) + len + 1);
+    if (LIKELY(shrunk != NULL))
+        dpe = shrunk;
+
+    dpe->base.cost = sizeof(*dpe) + len + 1;
+
+    return (struct cache_entry_t *)dpe;
+
+out_free:
+    free(dpe);
+    return NULL;
+}
+
+static void
+destroy_dir_prefix_entry(struct cache_entry_t *entry,
+    void *context __attribute__((unused)))
+{
+    dir_prefix_entry_t *dpe = (dir_prefix_entry_t *)entry;
+
+    close(dpe->fd);
+    free(dpe);
+}
+
+/* Resolves @key (relative to the root, and already canonical) into
+ * @full_path.  With the directory prefix cache, only the last component
+ * is looked at, in the directory the rest of the path was resolved to;
+ * anything else (symbolic links included) is resolved the slow way. */
+static char *
+resolve_path(serve_files_priv_t *priv, const char *key, char *full_path,
+    struct stat *st)
+{
+    const char *name = strrchr(key, '/');
+    struct cache_entry_t *ce;
+    dir_prefix_entry_t *dpe;
+    char *dir;
+    int error;
+    int ret;
+
+    if (!priv->dir_cache || !name || name[1] == '\0')
+        goto slow_path;
+    if (!strcmp(name + 1, ".") || !strcmp(name + 1, ".."))
+        goto slow_path;
+
+    /* This runs in a coroutine (or a cache fill thread); keep the stack
+     * usage down, as create_cache_entry() already uses quite a bit */
+    dir = strndup(key, (size_t)(name - key));
+    if (UNLIKELY(!dir))
+        return NULL;
+    name++;
+
+    ce = cache_get_and_ref_entry(priv->dir_cache, dir, &error);
+    free(dir);
+    if (UNLIKELY(!ce))
+        return NULL;
+
+    dpe = (dir_prefix_entry_t *)ce;
+
+    if (fstatat(dpe->fd, name, st, AT_SYMLINK_NOFOLLOW) < 0) {
+        error = errno;
+        cache_entry_unref(priv->dir_cache, ce);
+
+        if (error == ENOENT || error == ENOTDIR)
+            return NULL;
+        goto slow_path;
+    }
+
+    if (S_ISLNK(st->st_mode)) {
+        cache_entry_unref(priv->dir_cache, ce);
+        goto slow_path;
+    }
+
+    ret = snprintf(full_path, PATH_MAX, "%s/%s", dpe->path, name);
+    cache_entry_unref(priv->dir_cache, ce);
+    if (UNLIKELY(ret < 0 || ret >= PATH_MAX))
+        return NULL;
+
+    return full_path;
+
+slow_path:
+    return realpathat2(priv->root.fd, priv->root.path, key, full_path, st);
+}
+
 static struct cache_entry_t *
 create_cache_entry(const char *key, void *context)
 {
@@ -531,8 +1128,7 @@ create_cache_entry(const char *key, void *context)
     const cache_funcs_t *funcs;
     char full_path[PATH_MAX];
 
-    if (UNLIKELY(!realpathat2(priv->root.fd, priv->root.path,
-                key, full_path, &st)))
+    if (UNLIKELY(!resolve_path(priv, key, full_path, &st)))
         return NULL;
 
     if (UNLIKELY((st.st_mode & world_readable) != world_readable))
@@ -549,12 +1145,51 @@ create_cache_entry(const char *key, void *context)
     if (UNLIKELY(!fce))
         return NULL;
 
+    if (full_path[priv->root.path_len] == '\0')
+        fce->source.path = strdup(".");
+    else
+        fce->source.path = strdup(full_path + priv->root.path_len + 1);
+    if (UNLIKELY(!fce->source.path)) {
+        fce->funcs->free(fce + 1);
+        free(fce);
+        return NULL;
+    }
+    fce->base.cost += strlen(fce->source.path) + 1;
+
+    fce->source.dev = st.st_dev;
+    fce->source.ino = st.st_ino;
+    fce->source.mode = st.st_mode;
+    fce->source.size = st.st_size;
+    fce->source.mtime = st.st_mtim;
+
+    watch_cache_entry(priv, fce, key);
+
     lwan_format_rfc_time(st.st_mtime, fce->last_modified.string);
     fce->last_modified.integer = st.st_mtime;
 
     return (struct cache_entry_t *)fce;
 }
 
+/* Expired entries are kept as long as what they were created from hasn't
+ * changed; this is a lot cheaper than creating them again. */
+static bool
+revalidate_cache_entry(struct cache_entry_t *entry, void *context)
+{
+    serve_files_priv_t *priv = context;
+    file_cache_entry_t *fce = (file_cache_entry_t *)entry;
+    struct stat st;
+
+    if (UNLIKELY(fstatat(priv->root.fd, fce->source.path, &st, 0) < 0))
+        return false;
+
+    return st.st_ino == fce->source.ino &&
+        st.st_dev == fce->source.dev &&
+        st.st_mode == fce->source.mode &&
+        st.st_size == fce->source.size &&
+        st.st_mtim.tv_sec == fce->source.mtime.tv_sec &&
+        st.st_mtim.tv_nsec == fce->source.mtime.tv_nsec;
+}
+
 static void
 mmap_free(void *data)
 {
@@ -569,6 +1204,10 @@ sendfile_free(void *data)
 {
     sendfile_cache_data_t *sd = data;
 
+    unmap_cached_fd(sd->compressed.map, sd->compressed.size);
+    unmap_cached_fd(sd->uncompressed.map, sd->uncompressed.size);
+    close_cached_fd(sd->compressed.fd);
+    close_cached_fd(sd->uncompressed.fd);
     free(sd->compressed.filename);
     free(sd->uncompressed.filename);
 }
@@ -590,11 +1229,13 @@ redir_free(void *data)
 }
 
 static void
-destroy_cache_entry(struct cache_entry_t *entry, void *context __attribute__((unused)))
+destroy_cache_entry(struct cache_entry_t *entry, void *context)
 {
     file_cache_entry_t *fce = (file_cache_entry_t *)entry;
 
+    unwatch_cache_entry(context, fce);
     fce->funcs->free(fce + 1);
+    free(fce->source.path);
     free(fce);
 }
 
@@ -665,12 +1306,26 @@ serve_files_init(void *args)
     }
 
     priv->cache = cache_create(create_cache_entry, destroy_cache_entry,
-                priv, 5);
+                priv, settings->cache_period ? (time_t)settings->cache_period : 5);
     if (!priv->cache) {
         lwan_status_error("Couldn't create cache");
         goto out_cache_create;
     }
 
+    if (!cache_set_limits(priv->cache, settings->cache_max_size,
+                settings->cache_max_entries)) {
+        lwan_status_error("Couldn't set cache limits");
+        goto out_cache_set_limits;
+    }
+    cache_set_stale_while_revalidate(priv->cache,
+                (time_t)settings->cache_stale_while_revalidate);
+    cache_set_revalidate_callback(priv->cache, revalidate_cache_entry);
+    cache_set_negative_ttl(priv->cache, (time_t)settings->cache_negative_period);
+    if (settings->cache_async_fill && !cache_enable_async_fill(priv->cache)) {
+        lwan_status_error("Couldn't enable asynchronous cache fills");
+        goto out_cache_set_limits;
+    }
+
     priv->directory_list_tpl = lwan_tpl_compile_string(
                 directory_list_tpl_str, file_list_desc);
     if (!priv->directory_list_tpl) {
@@ -684,10 +1339,53 @@ serve_files_init(void *args)
     priv->open_mode = open_mode;
     priv->index_html = settings->index_html ? settings->index_html : "index.html";
     priv->serve_precompressed_files = settings->serve_precompressed_files;
+    priv->watcher = NULL;
+    priv->dir_cache = NULL;
+    priv->nonblocking_reads = false;
+
+    if (settings->cache_directory_prefixes) {
+        /* Directories are kept open, so there's a limit to how many */
+        priv->dir_cache = cache_create(create_dir_prefix_entry,
+                    destroy_dir_prefix_entry, priv, 5);
+        if (!priv->dir_cache ||
+                !cache_set_limits(priv->dir_cache, 0, 1024)) {
+            lwan_status_error("Couldn't create directory prefix cache");
+            goto out_dir_cache;
+        }
+    }
+
+    if (settings->cache_invalidate_on_change) {
+        priv->watcher = watcher_new();
+        if (!priv->watcher) {
+            lwan_status_perror("Could not watch files for changes");
+            goto out_watcher_new;
+        }
+
+        if (pthread_create(&priv->watcher->self, NULL, watcher_thread, priv)) {
+            lwan_status_perror("pthread_create");
+            goto out_watcher_start;
+        }
+    }
+
+    if (settings->nonblocking_reads) {
+        if (lwan_readahead_pool_acquire())
+            priv->nonblocking_reads = true;
+        else
+            lwan_status_warning("Nonblocking reads unavailable: files will be "
+                        "read from the I/O threads");
+    }
 
     return priv;
 
+out_watcher_start:
+    watcher_free(priv->watcher);
+out_watcher_new:
+out_dir_cache:
+    if (priv->dir_cache)
+        cache_destroy(priv->dir_cache);
+    lwan_tpl_free(priv->directory_list_tpl);
 out_tpl_compile:
+out_cache_set_limits:
     cache_destroy(priv->cache);
 out_cache_create:
     free(priv);
@@ -706,8 +1404,48 @@ serve_files_init_from_hash(const struct hash *hash)
         .root_path = hash_find(hash, "path"),
         .index_html = hash_find(hash, "index_path"),
         .serve_precompressed_files =
-            parse_bool(hash_find(hash, "serve_precompressed_files"), true)
+            parse_bool(hash_find(hash, "serve_precompressed_files"), true),
+        .cache_max_size =
+            (size_t)parse_long(hash_find(hash, "cache_max_size"), 0),
+        .cache_max_entries =
+            (unsigned int)parse_int(hash_find(hash, "cache_max_entries"), 0),
+        .cache_stale_while_revalidate =
+            parse_time_period(hash_find(hash, "cache_stale_while_revalidate"), 0),
+        .cache_async_fill =
+            parse_bool(hash_find(hash, "cache_async_fill"), false),
+        .cache_directory_prefixes =
+            parse_bool(hash_find(hash, "cache_directory_prefixes"), false),
+        .nonblocking_reads =
+            parse_bool(hash_find(hash, "nonblocking_reads"), false)
     };
+    const char *invalidation = hash_find(hash, "cache_invalidation");
+    const char *negative_period = hash_find(hash, "cache_negative_period");
+
+    if (!invalidation || !strcmp(invalidation, "ttl")) {
+        settings.cache_invalidate_on_change = false;
+    } else if (!strcmp(invalidation, "inotify")) {
+        settings.cache_invalidate_on_change = true;
+    } else {
+        lwan_status_error("Unknown cache invalidation mode: %s", invalidation);
+        return NULL;
+    }
+
+    /* Files are mostly checked when they change, so they can be kept
+     * for longer */
+    settings.cache_period = parse_time_period(hash_find(hash, "cache_period"),
+        settings.cache_invalidate_on_change ? 3600 : 5);
+
+    /* parse_time_period() treats 0 as "use the default" */
+    if (negative_period && !strcmp(negative_period, "0"))
+        settings.cache_negative_period = 0;
+    else
+        settings.cache_negative_period = parse_time_period(negative_period, 2);
+
+    if ((ssize_t)settings.cache_max_size < 0 || (int)settings.cache_max_entries < 0) {
+        lwan_status_error("Cache limits can't be negative");
+        return NULL;
+    }
+
     return serve_files_init(&settings);
 }
 
@@ -721,8 +1459,17 @@ serve_files_shutdown(void *data)
         return;
     }
 
+    if (priv->watcher)
+        watcher_stop(priv->watcher);
+
     lwan_tpl_free(priv->directory_list_tpl);
     cache_destroy(priv->cache);
+    if (priv->dir_cache)
+        cache_destroy(priv->dir_cache);
+    if (priv->watcher)
+        watcher_free(priv->watcher);
+    if (priv->nonblocking_reads)
+        lwan_readahead_pool_release();
     close(priv->root.fd);
     free(priv->root.path);
     free(priv);
@@ -811,6 +1558,41 @@ compute_range(lwan_request_t *request, off_t *from, off_t *to, off_t size)
     return HTTP_PARTIAL_CONTENT;
 }
 
+static void
+send_file_contents(lwan_request_t *request, int file_fd, const void *map,
+    off_t from, size_t len)
+{
+    serve_files_priv_t *priv = request->response.stream.priv;
+    size_t resident;
+
+    if (!priv->nonblocking_reads) {
+        lwan_sendfile(request, file_fd, from, len);
+        return;
+    }
+
+    /* Whatever is in the page cache is sent at once: for files that are,
+     * that's all of them */
+    resident = lwan_resident_len(map, file_fd, from, len);
+    if (LIKELY(resident)) {
+        lwan_sendfile(request, file_fd, from, resident);
+        from += (off_t)resident;
+        len -= resident;
+    }
+
+    /* Past that, it's sent a window at a time, so that each can be read
+     * in by other threads if it isn't in the page cache */
+    while (len) {
+        size_t window = len < READAHEAD_WINDOW ? len : READAHEAD_WINDOW;
+
+        if (lwan_resident_len(map, file_fd, from, window) < window)
+            lwan_readahead(request, file_fd, from, window);
+        lwan_sendfile(request, file_fd, from, window);
+
+        from += (off_t)window;
+        len -= window;
+    }
+}
+
 static lwan_http_status_t
 sendfile_serve(lwan_request_t *request, void *data)
 {
@@ -822,7 +1604,9 @@ sendfile_serve(lwan_request_t *request, void *data)
     off_t from, to;
     const char *compressed;
     char *filename;
+    void *map;
     size_t size;
+    int file_fd;
 
     if (sd->compressed.size && (request->flags & REQUEST_ACCEPT_GZIP)) {
         from = 0;
@@ -831,6 +1615,8 @@ sendfile_serve(lwan_request_t *request, void *data)
         compressed = compression_gzip;
         filename = sd->compressed.filename;
         size = sd->compressed.size;
+        file_fd = sd->compressed.fd;
+        map = sd->compressed.map;
 
         return_status = HTTP_OK;
     } else {
@@ -841,6 +1627,8 @@ sendfile_serve(lwan_request_t *request, void *data)
         compressed = compression_none;
         filename = sd->uncompressed.filename;
         size = sd->uncompressed.size;
+        file_fd = sd->uncompressed.fd;
+        map = sd->uncompressed.map;
     }
 
     if (client_has_fresh_content(request, fce->last_modified.integer))
@@ -853,7 +1641,10 @@ sendfile_serve(lwan_request_t *request, void *data)
 
     if (request->flags & REQUEST_METHOD_HEAD || return_status == HTTP_NOT_MODIFIED) {
         lwan_write(request, headers, header_len);
-    } else {
+        return return_status;
+    }
+
+    if (file_fd < 0) {
         serve_files_priv_t *priv = request->response.stream.priv;
         /*
          * lwan_openat() will yield from the coroutine if openat()
@@ -862,7 +1653,7 @@ sendfile_serve(lwan_request_t *request, void *data)
          * The file will be automatically closed whenever this
          * coroutine is freed.
          */
-        int file_fd = lwan_openat(request, priv->root.fd, filename, priv->open_mode);
+        file_fd = lwan_openat(request, priv->root.fd, filename, priv->open_mode);
         if (UNLIKELY(file_fd < 0)) {
             switch (file_fd) {
             case -EACCES:
@@ -873,11 +1664,11 @@ sendfile_serve(lwan_request_t *request, void *data)
                 return HTTP_NOT_FOUND;
             }
         }
-
-        lwan_send(request, headers, header_len, MSG_MORE);
-        lwan_sendfile(request, file_fd, from, (size_t)to);
     }
 
+    lwan_send(request, headers, header_len, MSG_MORE);
+    send_file_contents(request, file_fd, map, from, (size_t)to);
+
     return return_status;
 }
 
@@ -973,20 +1764,98 @@ redir_serve(lwan_request_t *request, void *data)
     return HTTP_MOVED_PERMANENTLY;
 }
 
+static bool
+is_canonical_path(const char *path)
+{
+    while (*path) {
+        const char *end = strchrnul(path, '/');
+
+        switch (end - path) {
+        case 0:
+            return false;
+        case 1:
+            if (path[0] == '.')
+                return false;
+            break;
+        case 2:
+            if (path[0] == '.' && path[1] == '.')
+                return false;
+            break;
+        }
+
+        if (!*end)
+            break;
+        path = end + 1;
+    }
+
+    return true;
+}
+
+/* Removes empty, "." and ".." components from @path (".." never goes
+ * above the root), so that different spellings of the same path share a
+ * cache entry.  A trailing slash is kept, as directories are redirected
+ * when it's missing.  @canonical is never longer than @path. */
+static void
+canonicalize_path(const char *path, char *canonical)
+{
+    size_t len = 0;
+    bool trailing_slash = false;
+
+    while (*path) {
+        const char *end = strchrnul(path, '/');
+        size_t component_len = (size_t)(end - path);
+
+        trailing_slash = *end == '/';
+
+        if (component_len == 0 ||
+                (component_len == 1 && path[0] == '.')) {
+            trailing_slash = true;
+        } else if (component_len == 2 && path[0] == '.' && path[1] == '.') {
+            while (len > 0 && canonical[len - 1] != '/')
+                len--;
+            if (len > 0)
+                len--;
+            trailing_slash = true;
+        } else {
+            if (len)
+                canonical[len++] = '/';
+            memcpy(canonical + len, path, component_len);
+            len += component_len;
+        }
+
+        path = *end ? end + 1 : end;
+    }
+
+    if (trailing_slash && len)
+        canonical[len++] = '/';
+
+    canonical[len] = '\0';
+}
+
 static lwan_http_status_t
 serve_files_handle_cb(lwan_request_t *request, lwan_response_t *response, void *data)
 {
     lwan_http_status_t return_status = HTTP_NOT_FOUND;
     serve_files_priv_t *priv = data;
     struct cache_entry_t *ce;
+    char *key = request->url.value;
 
     if (UNLIKELY(!priv)) {
         return_status = HTTP_INTERNAL_ERROR;
         goto fail;
     }
 
-    ce = cache_coro_get_and_ref_entry(priv->cache, request->conn->coro,
-                request->url.value);
+    /* Not done in place: the original URL is still needed for logging */
+    if (UNLIKELY(!is_canonical_path(key))) {
+        key = coro_malloc(request->conn->coro, strlen(key) + 1);
+        if (UNLIKELY(!key)) {
+            return_status = HTTP_INTERNAL_ERROR;
+            goto fail;
+        }
+        canonicalize_path(request->url.value, key);
+    }
+
+    ce = cache_coro_get_and_ref_entry(priv->cache, request->conn->coro, key);
     if (LIKELY(ce)) {
         file_cache_entry_t *fce = (file_cache_entry_t *)ce;
         response->mime_type = fce->mime_type;
@@ -996,6 +1865,8 @@ serve_files_handle_cb(lwan_request_t *request, lwan_response_t *response, void *
 
         return HTTP_OK;
     }
+    if (errno == ETIMEDOUT)
+        return_status = HTTP_UNAVAILABLE;
 
 fail:
     response->stream.callback = NULL;
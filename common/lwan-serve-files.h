@@ -29,6 +29,26 @@ struct lwan_serve_files_settings_t {
   const char *root_path;
   const char *index_html;
   bool serve_precompressed_files;
+  /* Limits for the file cache; 0 for no limit */
+  size_t cache_max_size;
+  unsigned int cache_max_entries;
+  /* Seconds until files are checked for changes (5 if 0) */
+  unsigned int cache_period;
+  /* Seconds expired files keep being served while they're reloaded */
+  unsigned int cache_stale_while_revalidate;
+  /* Drop files from the cache as soon as they change, using inotify */
+  bool cache_invalidate_on_change;
+  /* Open and read files in the cache fill threads rather than in the
+   * I/O threads */
+  bool cache_async_fill;
+  /* Seconds files that weren't found are remembered as such; 0 to not
+   * remember them */
+  unsigned int cache_negative_period;
+  /* Keep resolved directories in a cache of their own */
+  bool cache_directory_prefixes;
+  /* Read parts of large files that aren't in the page cache in other
+   * threads, rather than having sendfile() block the I/O threads */
+  bool nonblocking_reads;
 };
 
 #define SERVE_FILES_SETTINGS(root_path_, index_html_, serve_precompressed_files_) \
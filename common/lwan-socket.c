@@ -26,7 +26,9 @@
 #include <string.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "lwan.h"
@@ -55,14 +57,27 @@ get_backlog_size(void)
     return backlog;
 }
 
-static int
-setup_socket_from_systemd(void)
+#define UNIX_PREFIX "unix:"
+
+static const char *
+get_unix_path(const char *address)
 {
-    int fd = SD_LISTEN_FDS_START;
+    if (strncmp(address, UNIX_PREFIX, sizeof(UNIX_PREFIX) - 1))
+        return NULL;
+    return address + sizeof(UNIX_PREFIX) - 1;
+}
 
-    if (!sd_is_socket_inet(fd, AF_UNSPEC, SOCK_STREAM, 1, 0))
-        lwan_status_critical("Passed file descriptor is not a "
-            "listening TCP socket");
+static int
+setup_socket_from_systemd(int fd, const char *address)
+{
+    if (get_unix_path(address)) {
+        if (sd_is_socket_unix(fd, SOCK_STREAM, 1, NULL, 0) <= 0)
+            lwan_status_critical("Passed file descriptor %d is not a "
+                "listening Unix domain socket (for %s)", fd, address);
+    } else if (sd_is_socket_inet(fd, AF_UNSPEC, SOCK_STREAM, 1, 0) <= 0) {
+        lwan_status_critical("Passed file descriptor %d is not a "
+            "listening TCP socket (for %s)", fd, address);
+    }
 
     int flags = fcntl(fd, F_GETFD);
     if (flags < 0)
@@ -135,7 +150,7 @@ parse_listener(char *listener, char **node, char **port)
 }
 
 static int
-listen_addrinfo(int fd, const struct addrinfo *addr)
+listen_addrinfo(int fd, const struct addrinfo *addr, const char *scheme)
 {
     if (listen(fd, get_backlog_size()) < 0)
         lwan_status_critical_perror("listen");
@@ -147,9 +162,9 @@ listen_addrinfo(int fd, const struct addrinfo *addr)
         lwan_status_critical("getnameinfo: %s", gai_strerror(ret));
 
     if (addr->ai_family == AF_INET6)
-        lwan_status_info("Listening on http://[%s]:%s", host_buf, serv_buf);
+        lwan_status_info("Listening on %s://[%s]:%s", scheme, host_buf, serv_buf);
     else
-        lwan_status_info("Listening on http://%s:%s", host_buf, serv_buf);
+        lwan_status_info("Listening on %s://%s:%s", scheme, host_buf, serv_buf);
 
     return fd;
 }
@@ -172,7 +187,8 @@ listen_addrinfo(int fd, const struct addrinfo *addr)
 #endif
 
 static int
-bind_and_listen_addrinfos(struct addrinfo *addrs, bool reuse_port)
+bind_and_listen_addrinfos(struct addrinfo *addrs, bool reuse_port,
+                          const char *scheme)
 {
     const struct addrinfo *addr;
 
@@ -188,7 +204,7 @@ bind_and_listen_addrinfos(struct addrinfo *addrs, bool reuse_port)
                                                 (int[]){ reuse_port }, sizeof(int));
 
         if (!bind(fd, addr->ai_addr, addr->ai_addrlen))
-            return listen_addrinfo(fd, addr);
+            return listen_addrinfo(fd, addr, scheme);
 
         close(fd);
     }
@@ -197,13 +213,44 @@ bind_and_listen_addrinfos(struct addrinfo *addrs, bool reuse_port)
 }
 
 static int
-setup_socket_normally(lwan_t *l)
+setup_unix_socket(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct stat st;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        lwan_status_critical("Unix domain socket path too long: %s", path);
+    strcpy(addr.sun_path, path);
+
+    /* Left behind by a process that didn't shut down cleanly (or that
+     * handed it over to another one that's gone now) */
+    if (!lstat(path, &st) && S_ISSOCK(st.st_mode) && unlink(path) < 0)
+        lwan_status_critical_perror("Could not remove %s", path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        lwan_status_critical_perror("socket");
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        lwan_status_critical_perror("Could not bind to %s", path);
+    if (listen(fd, get_backlog_size()) < 0)
+        lwan_status_critical_perror("listen");
+
+    lwan_status_info("Listening on unix:%s", path);
+
+    return fd;
+}
+
+static int
+setup_socket_normally(lwan_t *l, const char *config_listener,
+                      const char *scheme)
 {
     char *node, *port;
-    char *listener = strdupa(l->config.listener);
+    char *listener = strdupa(config_listener);
     sa_family_t family = parse_listener(listener, &node, &port);
     if (family == AF_UNSPEC)
-        lwan_status_critical("Could not parse listener: %s", l->config.listener);
+        lwan_status_critical("Could not parse listener: %s", config_listener);
 
     struct addrinfo *addrs;
     struct addrinfo hints = {
@@ -216,7 +263,7 @@ setup_socket_normally(lwan_t *l)
     if (ret)
         lwan_status_critical("getaddrinfo: %s", gai_strerror(ret));
 
-    int fd = bind_and_listen_addrinfos(addrs, l->config.reuse_port);
+    int fd = bind_and_listen_addrinfos(addrs, l->config.reuse_port, scheme);
     freeaddrinfo(addrs);
     return fd;
 }
@@ -225,6 +272,21 @@ setup_socket_normally(lwan_t *l)
 #define TCP_FASTOPEN 23
 #endif
 
+static void
+set_listener_options(int fd, bool tcp)
+{
+    SET_SOCKET_OPTION(SOL_SOCKET, SO_LINGER,
+        (&(struct linger){ .l_onoff = 1, .l_linger = 1 }), sizeof(struct linger));
+
+    if (!tcp)
+        return;
+
+    SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_FASTOPEN,
+                                            (int[]){ 5 }, sizeof(int));
+    SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_QUICKACK,
+                                            (int[]){ 0 }, sizeof(int));
+}
+
 void
 lwan_socket_init(lwan_t *l)
 {
@@ -232,24 +294,68 @@ lwan_socket_init(lwan_t *l)
 
     lwan_status_debug("Initializing sockets");
 
+    /* Sockets are passed the same way by systemd and by a process being
+     * upgraded to this one: one for each listener, in the order they're
+     * in the configuration file, then the TLS one, if any. */
     n = sd_listen_fds(1);
-    if (n > 1) {
+    if (n > l->n_listeners + !!l->config.tls.listener)
         lwan_status_critical("Too many file descriptors received");
-    } else if (n == 1) {
-        fd = setup_socket_from_systemd();
+    if (n > 0 && n < l->n_listeners)
+        lwan_status_critical("Received %d file descriptors, but %d "
+            "listeners are configured", n, l->n_listeners);
+
+    for (unsigned short i = 0; i < l->n_listeners; i++) {
+        lwan_listener_t *listener = &l->listeners[i];
+        const char *path = get_unix_path(listener->address);
+
+        if (n > 0) {
+            fd = setup_socket_from_systemd(SD_LISTEN_FDS_START + i,
+                listener->address);
+        } else if (path) {
+            fd = setup_unix_socket(path);
+            listener->owns_path = true;
+        } else {
+            fd = setup_socket_normally(l, listener->address, "http");
+        }
+
+        set_listener_options(fd, !path);
+        listener->fd = fd;
+    }
+
+    if (l->config.tls.listener) {
+        if (n > l->n_listeners)
+            fd = setup_socket_from_systemd(SD_LISTEN_FDS_START + l->n_listeners,
+                l->config.tls.listener);
+        else
+            fd = setup_socket_normally(l, l->config.tls.listener, "https");
+        set_listener_options(fd, true);
+        l->tls_socket = fd;
     } else {
-        fd = setup_socket_normally(l);
+        l->tls_socket = -1;
     }
+}
 
-    SET_SOCKET_OPTION(SOL_SOCKET, SO_LINGER,
-        (&(struct linger){ .l_onoff = 1, .l_linger = 1 }), sizeof(struct linger));
+void
+lwan_socket_shutdown(lwan_t *l)
+{
+    for (unsigned short i = 0; i < l->n_listeners; i++) {
+        lwan_listener_t *listener = &l->listeners[i];
 
-    SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_FASTOPEN,
-                                            (int[]){ 5 }, sizeof(int));
-    SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_QUICKACK,
-                                            (int[]){ 0 }, sizeof(int));
+        if (listener->fd >= 0)
+            close(listener->fd);
+
+        /* After an upgrade, the new binary is listening on it */
+        if (listener->owns_path && !l->draining)
+            unlink(get_unix_path(listener->address));
 
-    l->main_socket = fd;
+        free(listener->address);
+    }
+    l->n_listeners = 0;
+
+    if (l->tls_socket >= 0) {
+        close(l->tls_socket);
+        l->tls_socket = -1;
+    }
 }
 
 #undef SET_SOCKET_OPTION
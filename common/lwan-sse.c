@@ -0,0 +1,517 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2016 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "lwan-private.h"
+#include "lwan-io-wrappers.h"
+#include "lwan-sse.h"
+#include "int-to-str.h"
+#include "list.h"
+
+#define SSE_BATCH_SIZE 16
+
+/*
+ * Events are encoded once, when published, and kept in a ring shared by
+ * every subscriber; each subscriber only remembers the ID of the last event
+ * it has sent.  The ID line is formatted separately because IDs are only
+ * assigned with the channel lock held.
+ */
+struct sse_event {
+    unsigned int refs;
+    unsigned int id_len;
+    char id[sizeof("id: \n") + INT_TO_STR_BUFFER_SIZE];
+    const char *name;
+    size_t len;
+    char data[];
+};
+
+/*
+ * Subscribers are tracked per I/O thread, and only ever touched by the
+ * thread they belong to.  Publishing queues one notification per thread
+ * (regardless of how many events have been published before the thread
+ * had a chance to process it), and the thread then wakes up its own
+ * subscribers.
+ */
+struct sse_thread_slot {
+    lwan_thread_notification_t notification;
+    struct list_head subscribers;
+    lwan_thread_t *thread;
+    unsigned int n_subscribers;
+};
+
+struct lwan_sse_channel_t_ {
+    pthread_mutex_t lock;
+
+    struct {
+        struct sse_event **events;
+        size_t size;
+        uint64_t last_id;
+    } ring;
+
+    struct sse_thread_slot *slots;
+    unsigned short n_slots;
+
+    size_t max_lag;
+    lwan_sse_slow_consumer_policy_t policy;
+};
+
+struct lwan_sse_subscriber_t_ {
+    struct list_node node;
+    lwan_sse_channel_t *channel;
+    struct sse_thread_slot *slot;
+    lwan_request_t *request;
+    uint64_t last_id;
+
+    /* References held while events are being written, so that they are
+     * released even if the connection is closed in the meantime. */
+    struct sse_event *batch[SSE_BATCH_SIZE];
+    size_t batch_len;
+};
+
+static void
+sse_event_unref(struct sse_event *event)
+{
+    if (event && !__atomic_sub_fetch(&event->refs, 1, __ATOMIC_ACQ_REL))
+        free(event);
+}
+
+static ALWAYS_INLINE struct sse_event *
+sse_event_ref(struct sse_event *event)
+{
+    __atomic_add_fetch(&event->refs, 1, __ATOMIC_RELAXED);
+    return event;
+}
+
+static struct sse_event *
+sse_event_encode(const char *name, const char *data, size_t data_len)
+{
+    size_t name_len = name ? strlen(name) : 0;
+    size_t n_lines = 1;
+    size_t len;
+
+    for (size_t i = 0; i < data_len; i++)
+        n_lines += data[i] == '\n';
+
+    len = n_lines * (sizeof("data: \n") - 1) + data_len + 1;
+    if (name)
+        len += sizeof("event: \n") - 1 + name_len;
+
+    struct sse_event *event = malloc(sizeof(*event) + len + name_len + 1);
+    if (UNLIKELY(!event))
+        return NULL;
+
+    char *p = event->data;
+    if (name) {
+        p = mempcpy(p, "event: ", sizeof("event: ") - 1);
+        p = mempcpy(p, name, name_len);
+        *p++ = '\n';
+    }
+    for (const char *line = data, *end = data + data_len; ; ) {
+        const char *eol = line < end ? memchr(line, '\n', (size_t)(end - line)) : NULL;
+        size_t line_len = eol ? (size_t)(eol - line) : (size_t)(end - line);
+
+        p = mempcpy(p, "data: ", sizeof("data: ") - 1);
+        p = mempcpy(p, line, line_len);
+        *p++ = '\n';
+
+        if (!eol)
+            break;
+        line = eol + 1;
+    }
+    *p++ = '\n';
+    assert((size_t)(p - event->data) == len);
+
+    if (name) {
+        memcpy(p, name, name_len + 1);
+        event->name = p;
+    } else {
+        event->name = NULL;
+    }
+
+    event->refs = 1;
+    event->len = len;
+
+    return event;
+}
+
+static void
+sse_event_set_id(struct sse_event *event, uint64_t id)
+{
+    char buffer[INT_TO_STR_BUFFER_SIZE];
+    size_t len;
+    char *id_str = uint_to_string((size_t)id, buffer, &len);
+    char *p = event->id;
+
+    p = mempcpy(p, "id: ", sizeof("id: ") - 1);
+    p = mempcpy(p, id_str, len);
+    *p++ = '\n';
+
+    event->id_len = (unsigned int)(p - event->id);
+}
+
+static void
+wake_subscribers(lwan_thread_notification_t *notification)
+{
+    struct sse_thread_slot *slot = (struct sse_thread_slot *)notification;
+    lwan_sse_subscriber_t *subscriber;
+
+    /* Runs in the I/O thread owning this slot; subscribers that aren't
+     * suspended are in the middle of writing and will check for new
+     * events before suspending again. */
+    list_for_each(&slot->subscribers, subscriber, node)
+        lwan_connection_wake(subscriber->request->conn);
+}
+
+lwan_sse_channel_t *
+lwan_sse_channel_new(const lwan_t *l, size_t replay_size, size_t max_lag,
+    lwan_sse_slow_consumer_policy_t policy)
+{
+    lwan_sse_channel_t *channel;
+
+    if (!replay_size)
+        replay_size = 1;
+    if (!max_lag || max_lag > replay_size)
+        max_lag = replay_size;
+
+    channel = calloc(1, sizeof(*channel));
+    if (!channel)
+        return NULL;
+
+    channel->ring.events = calloc(replay_size, sizeof(*channel->ring.events));
+    if (!channel->ring.events)
+        goto error_free_channel;
+
+    channel->slots = calloc(l->thread.count, sizeof(*channel->slots));
+    if (!channel->slots)
+        goto error_free_events;
+
+    if (pthread_mutex_init(&channel->lock, NULL))
+        goto error_free_slots;
+
+    for (unsigned short i = 0; i < l->thread.count; i++) {
+        struct sse_thread_slot *slot = &channel->slots[i];
+
+        slot->notification.callback = wake_subscribers;
+        slot->thread = &l->thread.threads[i];
+        list_head_init(&slot->subscribers);
+    }
+
+    channel->ring.size = replay_size;
+    channel->n_slots = l->thread.count;
+    channel->max_lag = max_lag;
+    channel->policy = policy;
+
+    return channel;
+
+error_free_slots:
+    free(channel->slots);
+error_free_events:
+    free(channel->ring.events);
+error_free_channel:
+    free(channel);
+    return NULL;
+}
+
+void
+lwan_sse_channel_free(lwan_sse_channel_t *channel)
+{
+    if (!channel)
+        return;
+
+    for (unsigned short i = 0; i < channel->n_slots; i++) {
+        if (channel->slots[i].n_subscribers)
+            lwan_status_warning("SSE channel freed with subscribers on thread %d", i);
+    }
+
+    for (size_t i = 0; i < channel->ring.size; i++)
+        sse_event_unref(channel->ring.events[i]);
+
+    pthread_mutex_destroy(&channel->lock);
+    free(channel->ring.events);
+    free(channel->slots);
+    free(channel);
+}
+
+bool
+lwan_sse_channel_publish(lwan_sse_channel_t *channel, const char *event,
+    const char *data, size_t data_len)
+{
+    struct sse_event *encoded = sse_event_encode(event, data, data_len);
+    struct sse_event *evicted;
+
+    if (UNLIKELY(!encoded))
+        return false;
+
+    pthread_mutex_lock(&channel->lock);
+
+    uint64_t id = ++channel->ring.last_id;
+    sse_event_set_id(encoded, id);
+
+    /* The ring holds the reference returned by sse_event_encode() */
+    struct sse_event **slot = &channel->ring.events[id % channel->ring.size];
+    evicted = *slot;
+    *slot = encoded;
+
+    pthread_mutex_unlock(&channel->lock);
+
+    sse_event_unref(evicted);
+
+    for (unsigned short i = 0; i < channel->n_slots; i++) {
+        struct sse_thread_slot *thread_slot = &channel->slots[i];
+
+        if (__atomic_load_n(&thread_slot->n_subscribers, __ATOMIC_ACQUIRE))
+            lwan_thread_notify(thread_slot->thread, &thread_slot->notification);
+    }
+
+    return true;
+}
+
+static uint64_t
+parse_last_event_id(lwan_request_t *request, uint64_t last_id)
+{
+    lwan_value_t *header = &request->header.last_event_id;
+    char *end;
+
+    if (!header->len)
+        return last_id;
+
+    errno = 0;
+    unsigned long long id = strtoull(header->value, &end, 10);
+    if (UNLIKELY(errno || *end || end == header->value))
+        return last_id;
+
+    /* IDs from a previous incarnation of the channel are meaningless */
+    if (id > last_id)
+        return last_id;
+
+    return (uint64_t)id;
+}
+
+static void
+subscriber_destroy(void *data)
+{
+    lwan_sse_subscriber_t *subscriber = data;
+
+    lwan_sse_channel_unsubscribe(subscriber);
+
+    for (size_t i = 0; i < subscriber->batch_len; i++)
+        sse_event_unref(subscriber->batch[i]);
+}
+
+lwan_sse_subscriber_t *
+lwan_sse_channel_subscribe(lwan_sse_channel_t *channel, lwan_request_t *request)
+{
+    lwan_thread_t *thread = request->conn->thread;
+    lwan_sse_subscriber_t *subscriber;
+    uint64_t last_id;
+
+    /* Subscribers are woken up through their connection, which HTTP/2
+     * streams don't have */
+    if (UNLIKELY(request->flags & REQUEST_HTTP2))
+        return NULL;
+
+    if (!(request->flags & RESPONSE_SENT_HEADERS)) {
+        if (UNLIKELY(!lwan_response_set_event_stream(request, HTTP_OK)))
+            return NULL;
+    }
+
+    subscriber = coro_malloc_full(request->conn->coro, sizeof(*subscriber),
+                false, subscriber_destroy);
+    if (UNLIKELY(!subscriber))
+        return NULL;
+
+    pthread_mutex_lock(&channel->lock);
+    last_id = channel->ring.last_id;
+    pthread_mutex_unlock(&channel->lock);
+
+    /* Events published from now on but before this subscriber is in the
+     * list won't notify this thread; they're picked up by the first call
+     * to lwan_sse_subscriber_wait() anyway. */
+    subscriber->channel = channel;
+    subscriber->slot = &channel->slots[thread - thread->lwan->thread.threads];
+    subscriber->request = request;
+    subscriber->last_id = parse_last_event_id(request, last_id);
+    subscriber->batch_len = 0;
+
+    list_add_tail(&subscriber->slot->subscribers, &subscriber->node);
+    __atomic_add_fetch(&subscriber->slot->n_subscribers, 1, __ATOMIC_RELEASE);
+
+    /* Let the client know the stream is open before the first event */
+    lwan_response_flush(request);
+
+    return subscriber;
+}
+
+void
+lwan_sse_channel_unsubscribe(lwan_sse_subscriber_t *subscriber)
+{
+    if (!subscriber->channel)
+        return;
+
+    list_del(&subscriber->node);
+    __atomic_sub_fetch(&subscriber->slot->n_subscribers, 1, __ATOMIC_RELEASE);
+    subscriber->channel = NULL;
+}
+
+static bool
+same_event_type(const struct sse_event *a, const struct sse_event *b)
+{
+    if (!a->name || !b->name)
+        return a->name == b->name;
+    return !strcmp(a->name, b->name);
+}
+
+static size_t
+coalesce_events(lwan_sse_channel_t *channel, uint64_t first, uint64_t last,
+    struct sse_event *batch[])
+{
+    size_t n_events = 0;
+
+    /* Newest events first, so that older events of the same type are
+     * skipped; then put the batch back in chronological order. */
+    for (uint64_t id = last; id >= first && n_events < SSE_BATCH_SIZE; id--) {
+        struct sse_event *event = channel->ring.events[id % channel->ring.size];
+        size_t i;
+
+        for (i = 0; i < n_events; i++) {
+            if (same_event_type(batch[i], event))
+                break;
+        }
+        if (i == n_events)
+            batch[n_events++] = sse_event_ref(event);
+    }
+
+    for (size_t i = 0; i < n_events / 2; i++) {
+        struct sse_event *tmp = batch[i];
+        batch[i] = batch[n_events - i - 1];
+        batch[n_events - i - 1] = tmp;
+    }
+
+    return n_events;
+}
+
+static bool
+collect_events(lwan_sse_subscriber_t *subscriber)
+{
+    lwan_sse_channel_t *channel = subscriber->channel;
+    bool keep_subscribed = true;
+
+    pthread_mutex_lock(&channel->lock);
+
+    uint64_t last = channel->ring.last_id;
+    uint64_t first = subscriber->last_id + 1;
+    if (first > last)
+        goto out;
+
+    uint64_t oldest = last >= channel->ring.size ? last - channel->ring.size + 1 : 1;
+    if (first < oldest || last - first >= channel->max_lag) {
+        switch (channel->policy) {
+        case SSE_SLOW_CONSUMER_DISCONNECT:
+            keep_subscribed = false;
+            goto out;
+        case SSE_SLOW_CONSUMER_COALESCE:
+            subscriber->batch_len = coalesce_events(channel,
+                        first < oldest ? oldest : first, last, subscriber->batch);
+            subscriber->last_id = last;
+            goto out;
+        case SSE_SLOW_CONSUMER_DROP:
+            lwan_status_debug("SSE subscriber lagging, dropping %"PRIu64" events",
+                        last - channel->max_lag + 1 - first);
+            first = last - channel->max_lag + 1;
+            break;
+        }
+    }
+
+    for (; first <= last && subscriber->batch_len < SSE_BATCH_SIZE; first++) {
+        struct sse_event *event = channel->ring.events[first % channel->ring.size];
+        subscriber->batch[subscriber->batch_len++] = sse_event_ref(event);
+    }
+    subscriber->last_id = first - 1;
+
+out:
+    pthread_mutex_unlock(&channel->lock);
+    return keep_subscribed;
+}
+
+static void
+send_batch(lwan_sse_subscriber_t *subscriber)
+{
+    struct iovec vec[SSE_BATCH_SIZE * 2];
+    int vec_len = 0;
+
+    for (size_t i = 0; i < subscriber->batch_len; i++) {
+        struct sse_event *event = subscriber->batch[i];
+
+        vec[vec_len].iov_base = event->id;
+        vec[vec_len].iov_len = event->id_len;
+        vec_len++;
+
+        vec[vec_len].iov_base = event->data;
+        vec[vec_len].iov_len = event->len;
+        vec_len++;
+    }
+
+    lwan_response_flush(subscriber->request);
+    lwan_writev(subscriber->request, vec, vec_len);
+
+    for (size_t i = 0; i < subscriber->batch_len; i++)
+        sse_event_unref(subscriber->batch[i]);
+    subscriber->batch_len = 0;
+}
+
+bool
+lwan_sse_subscriber_wait(lwan_sse_subscriber_t *subscriber)
+{
+    lwan_request_t *request = subscriber->request;
+
+    while (subscriber->channel) {
+        if (UNLIKELY(!collect_events(subscriber))) {
+            lwan_status_debug("SSE subscriber lagging, disconnecting");
+            coro_yield(request->conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+
+        if (subscriber->batch_len) {
+            send_batch(subscriber);
+            return true;
+        }
+
+        if (request->conn->flags & CONN_TIMED_OUT) {
+            /* Nothing was published, but the keep-alive timeout expired:
+             * send a comment so that idle connections are kept open by
+             * proxies and dead peers are eventually detected. */
+            static const char heartbeat[] = ":\n\n";
+
+            lwan_response_flush(request);
+            lwan_write(request, heartbeat, sizeof(heartbeat) - 1);
+        }
+
+        lwan_connection_suspend(request->conn);
+    }
+
+    return false;
+}
@@ -0,0 +1,47 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2016 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include "lwan.h"
+
+typedef struct lwan_sse_channel_t_	lwan_sse_channel_t;
+typedef struct lwan_sse_subscriber_t_	lwan_sse_subscriber_t;
+
+typedef enum {
+    /* Skip the oldest events a subscriber hasn't received yet */
+    SSE_SLOW_CONSUMER_DROP,
+    /* Send only the newest event of each type */
+    SSE_SLOW_CONSUMER_COALESCE,
+    /* Close the connection; clients will reconnect with Last-Event-ID */
+    SSE_SLOW_CONSUMER_DISCONNECT
+} lwan_sse_slow_consumer_policy_t;
+
+lwan_sse_channel_t *lwan_sse_channel_new(const lwan_t *l, size_t replay_size,
+    size_t max_lag, lwan_sse_slow_consumer_policy_t policy);
+void lwan_sse_channel_free(lwan_sse_channel_t *channel);
+
+bool lwan_sse_channel_publish(lwan_sse_channel_t *channel, const char *event,
+    const char *data, size_t data_len);
+
+lwan_sse_subscriber_t *lwan_sse_channel_subscribe(lwan_sse_channel_t *channel,
+    lwan_request_t *request) __attribute__((warn_unused_result));
+void lwan_sse_channel_unsubscribe(lwan_sse_subscriber_t *subscriber);
+
+bool lwan_sse_subscriber_wait(lwan_sse_subscriber_t *subscriber);
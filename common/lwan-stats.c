@@ -0,0 +1,733 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2016 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "lwan-private.h"
+#include "lwan-stats.h"
+
+#define ALIGN_TO(n_, a_) (((n_) + (a_) - 1) & ~((size_t)(a_) - 1))
+
+struct lwan_stats_t_ {
+    struct lwan_stats_header *header;
+    size_t size;
+
+    int shm_fd;
+    char *shm_name;
+
+    double nsec_per_tick;
+
+    /* Prefixes registered before the region is mapped are kept here too */
+    unsigned int n_prefixes;
+    char prefixes[LWAN_STATS_MAX_PREFIXES][LWAN_STATS_PREFIX_LEN];
+};
+
+enum stats_format {
+    STATS_FORMAT_PROMETHEUS,
+    STATS_FORMAT_JSON
+};
+
+static lwan_stats_t *
+get_stats(lwan_t *l)
+{
+    if (!l->stats) {
+        l->stats = calloc(1, sizeof(*l->stats));
+        if (!l->stats)
+            lwan_status_critical_perror("calloc");
+
+        l->stats->shm_fd = -1;
+        /* Requests that didn't match any prefix */
+        l->stats->n_prefixes = 1;
+    }
+
+    return l->stats;
+}
+
+void
+lwan_stats_open_shared_memory(lwan_t *l, const char *name)
+{
+    lwan_stats_t *stats = get_stats(l);
+
+    if (stats->shm_fd >= 0) {
+        lwan_status_warning("Statistics already published as %s", stats->shm_name);
+        return;
+    }
+
+    /* Opened right away, as a straitjacket might make /dev/shm
+     * unreachable by the time the region is mapped.  A segment with the
+     * same name is unlinked rather than reused: it might still be mapped
+     * by a process being upgraded to this one. */
+    if (shm_unlink(name) < 0 && errno != ENOENT)
+        lwan_status_perror("Could not remove shared memory segment %s", name);
+    stats->shm_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (stats->shm_fd < 0)
+        lwan_status_critical_perror("Could not open shared memory segment %s", name);
+
+    stats->shm_name = strdup(name);
+}
+
+/* The name now belongs to the process this one was upgraded to, so it
+ * isn't unlinked on shutdown */
+void
+lwan_stats_disown_shared_memory(lwan_t *l)
+{
+    lwan_stats_t *stats = l->stats;
+
+    if (stats) {
+        free(stats->shm_name);
+        stats->shm_name = NULL;
+    }
+}
+
+unsigned int
+lwan_stats_register_prefix(lwan_t *l, const char *prefix)
+{
+    lwan_stats_t *stats = get_stats(l);
+    unsigned int index;
+
+    for (index = 1; index < stats->n_prefixes; index++) {
+        if (!strncmp(stats->prefixes[index], prefix, LWAN_STATS_PREFIX_LEN - 1))
+            return index;
+    }
+
+    if (index == LWAN_STATS_MAX_PREFIXES) {
+        lwan_status_warning("Too many prefixes; latencies for %s won't be "
+            "tracked separately", prefix);
+        return 0;
+    }
+
+    strncpy(stats->prefixes[index], prefix, LWAN_STATS_PREFIX_LEN - 1);
+    stats->n_prefixes++;
+
+    if (stats->header) {
+        memcpy(stats->header->prefixes[index], stats->prefixes[index],
+            LWAN_STATS_PREFIX_LEN);
+        __atomic_store_n(&stats->header->n_prefixes, stats->n_prefixes,
+            __ATOMIC_RELEASE);
+    }
+
+    return index;
+}
+
+static double
+calibrate_ticks(void)
+{
+#if defined(__x86_64__)
+    const struct timespec delay = { .tv_nsec = 10 * 1000 * 1000 };
+    struct timespec start, end;
+    uint64_t start_ticks, end_ticks;
+    double elapsed_nsec;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    start_ticks = lwan_stats_ticks();
+    nanosleep(&delay, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end_ticks = lwan_stats_ticks();
+
+    elapsed_nsec = (double)(end.tv_sec - start.tv_sec) * 1e9 +
+        (double)(end.tv_nsec - start.tv_nsec);
+    return elapsed_nsec / (double)(end_ticks - start_ticks);
+#else
+    return 1.0;
+#endif
+}
+
+void
+lwan_stats_init(lwan_t *l)
+{
+    lwan_stats_t *stats = get_stats(l);
+    const size_t header_size = ALIGN_TO(sizeof(struct lwan_stats_header),
+        sizeof(lwan_thread_stats_t));
+    void *region;
+
+    lwan_status_debug("Initializing statistics");
+
+    stats->size = header_size + sizeof(lwan_thread_stats_t) * l->thread.count;
+
+    if (stats->shm_fd >= 0) {
+        if (ftruncate(stats->shm_fd, (off_t)stats->size) < 0)
+            lwan_status_critical_perror("ftruncate");
+
+        region = mmap(NULL, stats->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            stats->shm_fd, 0);
+    } else {
+        region = mmap(NULL, stats->size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (region == MAP_FAILED)
+        lwan_status_critical_perror("mmap");
+
+    stats->header = region;
+    *stats->header = (struct lwan_stats_header) {
+        .magic = LWAN_STATS_MAGIC,
+        .version = LWAN_STATS_VERSION,
+        .n_threads = l->thread.count,
+        .n_prefixes = stats->n_prefixes,
+        .thread_stats_size = sizeof(lwan_thread_stats_t),
+        .thread_stats_offset = header_size
+    };
+    memcpy(stats->header->prefixes, stats->prefixes, sizeof(stats->prefixes));
+
+    if (stats->shm_name)
+        lwan_status_info("Publishing statistics as %s", stats->shm_name);
+
+    if (l->config.request_timing.enabled) {
+        stats->nsec_per_tick = calibrate_ticks();
+        lwan_status_debug("Timing request phases, %.3fns per tick",
+            stats->nsec_per_tick);
+    }
+}
+
+lwan_thread_stats_t *
+lwan_stats_for_thread(lwan_t *l, unsigned int thread)
+{
+    const struct lwan_stats_header *header = l->stats->header;
+
+    return (lwan_thread_stats_t *)((char *)header +
+        header->thread_stats_offset) + thread;
+}
+
+void
+lwan_stats_shutdown(lwan_t *l)
+{
+    lwan_stats_t *stats = l->stats;
+
+    if (!stats)
+        return;
+
+    lwan_status_debug("Shutting down statistics");
+
+    if (stats->header)
+        munmap(stats->header, stats->size);
+
+    if (stats->shm_fd >= 0)
+        close(stats->shm_fd);
+
+    if (stats->shm_name) {
+        if (shm_unlink(stats->shm_name) < 0 && errno != ENOENT)
+            lwan_status_perror("Could not remove shared memory segment %s",
+                stats->shm_name);
+        free(stats->shm_name);
+    }
+
+    free(stats);
+    l->stats = NULL;
+}
+
+static const char *const phase_names[LWAN_STATS_PHASES] = {
+    "parse", "route", "prepare", "handler", "write"
+};
+
+uint64_t
+lwan_stats_ticks_to_nsec(const lwan_t *l, uint64_t ticks)
+{
+    return (uint64_t)((double)ticks * l->stats->nsec_per_tick);
+}
+
+static uint64_t
+phase_nsec(const lwan_t *l, const uint64_t *phases, unsigned int phase)
+{
+    /* Phases that didn't happen (e.g. the handler, for requests that
+     * couldn't be routed) took no time */
+    if (!phases[phase] || !phases[phase + 1] || phases[phase + 1] < phases[phase])
+        return 0;
+
+    return lwan_stats_ticks_to_nsec(l, phases[phase + 1] - phases[phase]);
+}
+
+size_t
+lwan_stats_format_server_timing(const lwan_request_t *request, char *buffer,
+    size_t buffer_len)
+{
+    const lwan_t *l = request->conn->thread->lwan;
+    size_t len = 0;
+
+    /* Only phases up to the handler are known by the time headers are
+     * sent */
+    for (unsigned int p = 0; p < REQUEST_PHASE_HANDLED; p++) {
+        int r;
+
+        if (!request->stats.phases[p] || !request->stats.phases[p + 1])
+            continue;
+
+        r = snprintf(buffer + len, buffer_len - len, "%s%s;dur=%.3f",
+            len ? ", " : "", phase_names[p],
+            (double)phase_nsec(l, request->stats.phases, p) / 1000000.0);
+        if (r < 0 || (size_t)r >= buffer_len - len)
+            break;
+        len += (size_t)r;
+    }
+
+    return len;
+}
+
+static void
+log_slow_request(const lwan_request_t *request, uint64_t total_nsec,
+    const uint64_t nsec[static LWAN_STATS_PHASES])
+{
+    lwan_status_warning("Slow request: %s %.*s took %.3fms (parse %.3fms, "
+        "route %.3fms, prepare %.3fms, handler %.3fms, write %.3fms)",
+        lwan_request_get_method_str(request),
+        (int)request->original_url.len,
+        request->original_url.value ? request->original_url.value : "",
+        (double)total_nsec / 1000000.0,
+        (double)nsec[0] / 1000000.0, (double)nsec[1] / 1000000.0,
+        (double)nsec[2] / 1000000.0, (double)nsec[3] / 1000000.0,
+        (double)nsec[4] / 1000000.0);
+}
+
+static void
+record_histogram(struct lwan_stats_histogram *histogram, uint64_t value)
+{
+    LWAN_STATS_INC(histogram, count);
+    LWAN_STATS_ADD(histogram, sum, value);
+    LWAN_STATS_INC(histogram, buckets[lwan_stats_histogram_bucket(value)]);
+}
+
+static void
+record_phases(const lwan_t *l, lwan_request_t *request,
+    lwan_thread_stats_t *stats)
+{
+    uint64_t *phases = request->stats.phases;
+    uint64_t nsec[LWAN_STATS_PHASES];
+    uint64_t total_nsec = 0;
+
+    phases[REQUEST_PHASE_WRITTEN] = lwan_stats_ticks();
+
+    for (unsigned int p = 0; p < LWAN_STATS_PHASES; p++) {
+        if (!phases[p + 1])
+            phases[p + 1] = phases[p];
+
+        nsec[p] = phase_nsec(l, phases, p);
+        total_nsec += nsec[p];
+        record_histogram(&stats->phases[p], nsec[p]);
+    }
+
+    if (l->config.request_timing.slow_request_threshold &&
+            total_nsec >= (uint64_t)l->config.request_timing.slow_request_threshold * 1000000)
+        log_slow_request(request, total_nsec, nsec);
+}
+
+void
+lwan_stats_record_request(lwan_request_t *request)
+{
+    const lwan_t *l = request->conn->thread->lwan;
+    lwan_thread_stats_t *stats = request->conn->thread->stats;
+    unsigned int status_class = (unsigned int)request->stats.status / 100;
+    struct timespec now;
+    uint64_t usec;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    usec = (uint64_t)(now.tv_sec - request->stats.start.tv_sec) * 1000000 +
+        (uint64_t)((now.tv_nsec - request->stats.start.tv_nsec) / 1000);
+
+    LWAN_STATS_INC(stats, requests[status_class < 6 ? status_class : 0]);
+    record_histogram(&stats->latency[request->stats.prefix], usec);
+
+    if (UNLIKELY(l->config.request_timing.enabled))
+        record_phases(l, request, stats);
+}
+
+/* Readers might race with writers, so every value is loaded atomically */
+#define LOAD(v_) __atomic_load_n(&(v_), __ATOMIC_RELAXED)
+
+static const lwan_thread_stats_t *
+thread_stats(const lwan_stats_t *stats, unsigned int thread)
+{
+    const struct lwan_stats_header *header = stats->header;
+
+    return (const lwan_thread_stats_t *)((const char *)header +
+        header->thread_stats_offset) + thread;
+}
+
+static void
+sum_counters(const lwan_stats_t *stats, lwan_thread_stats_t *total)
+{
+    for (unsigned int i = 0; i < stats->header->n_threads; i++) {
+        const lwan_thread_stats_t *t = thread_stats(stats, i);
+
+        total->accepted += LOAD(t->accepted);
+        total->closed += LOAD(t->closed);
+        total->keep_alive_reused += LOAD(t->keep_alive_reused);
+        for (size_t c = 0; c < N_ELEMENTS(t->requests); c++)
+            total->requests[c] += LOAD(t->requests[c]);
+        total->bytes_in += LOAD(t->bytes_in);
+        total->bytes_out += LOAD(t->bytes_out);
+        total->coros_created += LOAD(t->coros_created);
+        total->coros_freed += LOAD(t->coros_freed);
+        total->eagain_yields += LOAD(t->eagain_yields);
+        total->timeouts += LOAD(t->timeouts);
+        total->rejected += LOAD(t->rejected);
+        total->write_bytes_queued += LOAD(t->write_bytes_queued);
+        total->write_blocked_usec += LOAD(t->write_blocked_usec);
+        total->write_stalls += LOAD(t->write_stalls);
+        total->write_stall_timeouts += LOAD(t->write_stall_timeouts);
+    }
+}
+
+/* @first is the histogram in the first thread's block; the same histogram
+ * in other threads is found thread_stats_size bytes apart */
+static void
+sum_histograms(const lwan_stats_t *stats,
+    const struct lwan_stats_histogram *first, struct lwan_stats_histogram *total)
+{
+    memset(total, 0, sizeof(*total));
+
+    for (unsigned int i = 0; i < stats->header->n_threads; i++) {
+        const struct lwan_stats_histogram *h = (const void *)(
+            (const char *)first + i * sizeof(lwan_thread_stats_t));
+
+        total->sum += LOAD(h->sum);
+        for (unsigned int b = 0; b < LWAN_STATS_HISTOGRAM_BUCKETS; b++)
+            total->buckets[b] += LOAD(h->buckets[b]);
+    }
+
+    /* Counts are updated before buckets; keep them consistent */
+    for (unsigned int b = 0; b < LWAN_STATS_HISTOGRAM_BUCKETS; b++)
+        total->count += total->buckets[b];
+}
+
+#undef LOAD
+
+static uint64_t
+histogram_percentile(const struct lwan_stats_histogram *h, double percentile)
+{
+    uint64_t target = (uint64_t)((double)h->count * percentile / 100.0 + 0.5);
+    uint64_t seen = 0;
+
+    if (!target)
+        target = 1;
+
+    for (unsigned int b = 0; b < LWAN_STATS_HISTOGRAM_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= target) {
+            /* Highest value that would fall in this bucket */
+            if (b == LWAN_STATS_HISTOGRAM_BUCKETS - 1)
+                return lwan_stats_histogram_bucket_lower(b);
+            return lwan_stats_histogram_bucket_lower(b + 1) - 1;
+        }
+    }
+
+    return 0;
+}
+
+static void
+append_quoted(strbuf_t *buffer, const char *s)
+{
+    strbuf_append_char(buffer, '"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            strbuf_append_char(buffer, '\\');
+            strbuf_append_char(buffer, *s);
+        } else if ((unsigned char)*s < 0x20) {
+            strbuf_append_printf(buffer, "\\u%04x", (unsigned char)*s);
+        } else {
+            strbuf_append_char(buffer, *s);
+        }
+    }
+    strbuf_append_char(buffer, '"');
+}
+
+static const char *
+prefix_name(const lwan_stats_t *stats, unsigned int prefix)
+{
+    return prefix ? stats->header->prefixes[prefix] : "(none)";
+}
+
+static void
+append_prometheus_metric(strbuf_t *buffer, const char *name,
+    const char *type, const char *help, uint64_t value)
+{
+    strbuf_append_printf(buffer, "# HELP %s %s\n# TYPE %s %s\n%s %" PRIu64 "\n",
+        name, help, name, type, name, value);
+}
+
+static void
+append_prometheus_series(strbuf_t *buffer, const char *name,
+    const char *suffix, const char *label, const char *label_value)
+{
+    strbuf_append_printf(buffer, "%s_%s{%s=", name, suffix, label);
+    append_quoted(buffer, label_value);
+}
+
+/* Exported buckets are powers of two (of @units_per_second), which are
+ * always bucket boundaries internally */
+static void
+append_prometheus_histogram(strbuf_t *buffer, const char *name,
+    const char *label, const char *label_value,
+    const struct lwan_stats_histogram *h, double units_per_second,
+    unsigned int min_log2, unsigned int max_log2)
+{
+    uint64_t cumulative = 0;
+    unsigned int b = 0;
+
+    for (unsigned int k = min_log2; k <= max_log2; k++) {
+        unsigned int limit = lwan_stats_histogram_bucket(1ull << k);
+
+        for (; b < limit; b++)
+            cumulative += h->buckets[b];
+
+        append_prometheus_series(buffer, name, "bucket", label, label_value);
+        strbuf_append_printf(buffer, ",le=\"%.9g\"} %" PRIu64 "\n",
+            (double)(1ull << k) / units_per_second, cumulative);
+    }
+
+    append_prometheus_series(buffer, name, "bucket", label, label_value);
+    strbuf_append_printf(buffer, ",le=\"+Inf\"} %" PRIu64 "\n", h->count);
+
+    append_prometheus_series(buffer, name, "sum", label, label_value);
+    strbuf_append_printf(buffer, "} %.9g\n", (double)h->sum / units_per_second);
+
+    append_prometheus_series(buffer, name, "count", label, label_value);
+    strbuf_append_printf(buffer, "} %" PRIu64 "\n", h->count);
+}
+
+static void
+format_prometheus(strbuf_t *buffer, const lwan_t *l, const lwan_stats_t *stats,
+    const lwan_thread_stats_t *total, struct lwan_stats_histogram *h)
+{
+    unsigned int n_prefixes = __atomic_load_n(&stats->header->n_prefixes,
+        __ATOMIC_ACQUIRE);
+
+    append_prometheus_metric(buffer, "lwan_connections_accepted_total",
+        "counter", "Connections accepted.", total->accepted);
+    append_prometheus_metric(buffer, "lwan_connections_active",
+        "gauge", "Connections currently open.",
+        total->accepted - total->closed);
+    append_prometheus_metric(buffer, "lwan_keep_alive_reused_total",
+        "counter", "Requests served on an already used connection.",
+        total->keep_alive_reused);
+    append_prometheus_metric(buffer, "lwan_received_bytes_total",
+        "counter", "Bytes read from clients.", total->bytes_in);
+    append_prometheus_metric(buffer, "lwan_sent_bytes_total",
+        "counter", "Bytes written to clients.", total->bytes_out);
+    append_prometheus_metric(buffer, "lwan_coroutines_alive",
+        "gauge", "Coroutines currently allocated.",
+        total->coros_created - total->coros_freed);
+    append_prometheus_metric(buffer, "lwan_eagain_yields_total",
+        "counter", "Times a coroutine yielded waiting for a socket.",
+        total->eagain_yields);
+    append_prometheus_metric(buffer, "lwan_timeouts_total",
+        "counter", "Connections closed due to timeouts.", total->timeouts);
+    append_prometheus_metric(buffer, "lwan_connections_rejected_total",
+        "counter", "Connections rejected because of connection limits.",
+        total->rejected);
+    append_prometheus_metric(buffer, "lwan_write_queued_bytes_total",
+        "counter", "Bytes written on connections that have been closed.",
+        total->write_bytes_queued);
+    append_prometheus_metric(buffer, "lwan_write_blocked_microseconds_total",
+        "counter", "Time spent waiting for sockets to become writable.",
+        total->write_blocked_usec);
+    append_prometheus_metric(buffer, "lwan_write_stalls_total",
+        "counter", "Times a write had to wait for a socket.",
+        total->write_stalls);
+    append_prometheus_metric(buffer, "lwan_write_stall_timeouts_total",
+        "counter", "Connections closed for not accepting writes in time.",
+        total->write_stall_timeouts);
+
+    strbuf_append_str(buffer, "# HELP lwan_requests_total Requests by status "
+        "class.\n# TYPE lwan_requests_total counter\n", 0);
+    for (unsigned int c = 0; c < N_ELEMENTS(total->requests); c++) {
+        if (c)
+            strbuf_append_printf(buffer,
+                "lwan_requests_total{code=\"%uxx\"} %" PRIu64 "\n",
+                c, total->requests[c]);
+        else
+            strbuf_append_printf(buffer,
+                "lwan_requests_total{code=\"none\"} %" PRIu64 "\n",
+                total->requests[c]);
+    }
+
+    strbuf_append_str(buffer, "# HELP lwan_request_duration_seconds Request "
+        "latency by URL prefix.\n# TYPE lwan_request_duration_seconds "
+        "histogram\n", 0);
+    for (unsigned int p = 0; p < n_prefixes; p++) {
+        sum_histograms(stats, &thread_stats(stats, 0)->latency[p], h);
+        if (h->count) {
+            append_prometheus_histogram(buffer, "lwan_request_duration_seconds",
+                "prefix", prefix_name(stats, p), h, 1000000.0, 0, 25);
+        }
+    }
+
+    if (!l->config.request_timing.enabled)
+        return;
+
+    strbuf_append_str(buffer, "# HELP lwan_request_phase_duration_seconds "
+        "Time spent in each request phase.\n# TYPE "
+        "lwan_request_phase_duration_seconds histogram\n", 0);
+    for (unsigned int p = 0; p < LWAN_STATS_PHASES; p++) {
+        sum_histograms(stats, &thread_stats(stats, 0)->phases[p], h);
+        append_prometheus_histogram(buffer, "lwan_request_phase_duration_seconds",
+            "phase", phase_names[p], h, 1000000000.0, 6, 32);
+    }
+}
+
+static void
+append_json_histogram(strbuf_t *buffer, const char *name,
+    const struct lwan_stats_histogram *h)
+{
+    append_quoted(buffer, name);
+    strbuf_append_printf(buffer, ":{\"count\":%" PRIu64 ",\"mean\":%"
+        PRIu64 ",\"p50\":%" PRIu64 ",\"p90\":%" PRIu64 ",\"p99\":%"
+        PRIu64 ",\"p999\":%" PRIu64 ",\"max\":%" PRIu64 "}",
+        h->count, h->count ? h->sum / h->count : 0,
+        histogram_percentile(h, 50.0), histogram_percentile(h, 90.0),
+        histogram_percentile(h, 99.0), histogram_percentile(h, 99.9),
+        histogram_percentile(h, 100.0));
+}
+
+static void
+format_json(strbuf_t *buffer, const lwan_t *l, const lwan_stats_t *stats,
+    const lwan_thread_stats_t *total, struct lwan_stats_histogram *h)
+{
+    unsigned int n_prefixes = __atomic_load_n(&stats->header->n_prefixes,
+        __ATOMIC_ACQUIRE);
+    bool first = true;
+
+    strbuf_append_printf(buffer, "{\"connections\":{\"accepted\":%" PRIu64
+        ",\"active\":%" PRIu64 ",\"keep_alive_reused\":%" PRIu64
+        ",\"timeouts\":%" PRIu64 ",\"rejected\":%" PRIu64 "},",
+        total->accepted, total->accepted - total->closed,
+        total->keep_alive_reused, total->timeouts, total->rejected);
+    strbuf_append_printf(buffer, "\"requests\":{\"none\":%" PRIu64
+        ",\"1xx\":%" PRIu64 ",\"2xx\":%" PRIu64 ",\"3xx\":%" PRIu64
+        ",\"4xx\":%" PRIu64 ",\"5xx\":%" PRIu64 "},",
+        total->requests[0], total->requests[1], total->requests[2],
+        total->requests[3], total->requests[4], total->requests[5]);
+    strbuf_append_printf(buffer, "\"bytes\":{\"in\":%" PRIu64 ",\"out\":%"
+        PRIu64 "},\"coroutines_alive\":%" PRIu64 ",\"eagain_yields\":%"
+        PRIu64 ",\"writes\":{\"queued_bytes\":%" PRIu64 ",\"blocked_usec\":%"
+        PRIu64 ",\"stalls\":%" PRIu64 ",\"stall_timeouts\":%" PRIu64 "},"
+        "\"latency_usec\":{",
+        total->bytes_in, total->bytes_out,
+        total->coros_created - total->coros_freed, total->eagain_yields,
+        total->write_bytes_queued, total->write_blocked_usec,
+        total->write_stalls, total->write_stall_timeouts);
+
+    for (unsigned int p = 0; p < n_prefixes; p++) {
+        sum_histograms(stats, &thread_stats(stats, 0)->latency[p], h);
+        if (!h->count)
+            continue;
+
+        if (!first)
+            strbuf_append_char(buffer, ',');
+        first = false;
+
+        append_json_histogram(buffer, prefix_name(stats, p), h);
+    }
+    strbuf_append_char(buffer, '}');
+
+    if (l->config.request_timing.enabled) {
+        strbuf_append_str(buffer, ",\"phases_nsec\":{", 0);
+        for (unsigned int p = 0; p < LWAN_STATS_PHASES; p++) {
+            if (p)
+                strbuf_append_char(buffer, ',');
+
+            sum_histograms(stats, &thread_stats(stats, 0)->phases[p], h);
+            append_json_histogram(buffer, phase_names[p], h);
+        }
+        strbuf_append_char(buffer, '}');
+    }
+
+    strbuf_append_str(buffer, "}\n", 0);
+}
+
+static lwan_http_status_t
+stats_handle_cb(lwan_request_t *request, lwan_response_t *response, void *data)
+{
+    const lwan_t *l = request->conn->thread->lwan;
+    const lwan_stats_t *stats = l->stats;
+    enum stats_format format = (enum stats_format)(uintptr_t)data;
+    const char *format_param = lwan_request_get_query_param(request, "format");
+    lwan_thread_stats_t *total;
+    struct lwan_stats_histogram *histogram;
+
+    if (format_param) {
+        if (!strcmp(format_param, "json"))
+            format = STATS_FORMAT_JSON;
+        else if (!strcmp(format_param, "prometheus"))
+            format = STATS_FORMAT_PROMETHEUS;
+        else
+            return HTTP_BAD_REQUEST;
+    }
+
+    /* Too large for the coroutine stack */
+    total = coro_malloc(request->conn->coro, sizeof(*total));
+    histogram = coro_malloc(request->conn->coro, sizeof(*histogram));
+    if (UNLIKELY(!total || !histogram))
+        return HTTP_INTERNAL_ERROR;
+
+    memset(total, 0, sizeof(*total));
+    sum_counters(stats, total);
+
+    if (format == STATS_FORMAT_JSON) {
+        format_json(response->buffer, l, stats, total, histogram);
+        response->mime_type = "application/json";
+    } else {
+        format_prometheus(response->buffer, l, stats, total, histogram);
+        response->mime_type = "text/plain; version=0.0.4";
+    }
+
+    return HTTP_OK;
+}
+
+static void *
+stats_init(void *args)
+{
+    struct lwan_stats_settings_t *settings = args;
+
+    return (void *)(uintptr_t)(settings->json ? STATS_FORMAT_JSON :
+                                                STATS_FORMAT_PROMETHEUS);
+}
+
+static void *
+stats_init_from_hash(const struct hash *hash)
+{
+    const char *format = hash_find(hash, "format");
+    struct lwan_stats_settings_t settings = { .json = false };
+
+    if (format && !strcmp(format, "json"))
+        settings.json = true;
+    else if (format && strcmp(format, "prometheus"))
+        lwan_status_warning("Unknown statistics format %s, using prometheus", format);
+
+    return stats_init(&settings);
+}
+
+const lwan_module_t *
+lwan_module_stats(void)
+{
+    static const lwan_module_t stats_module = {
+        .name = "stats",
+        .init = stats_init,
+        .init_from_hash = stats_init_from_hash,
+        .handle = stats_handle_cb,
+        .flags = HANDLER_PARSE_QUERY_STRING
+    };
+
+    return &stats_module;
+}
@@ -0,0 +1,186 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2016 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include "lwan.h"
+
+/*
+ * Statistics live in a single memory region: a header, followed by one
+ * block per I/O thread.  Each block is only ever written by its thread;
+ * readers (the stats module, or external tools mapping the shared memory
+ * segment read-only) add up all blocks and might see values that are
+ * slightly out of date, but never torn ones.  All values are in host
+ * byte order.
+ */
+
+#define LWAN_STATS_MAGIC 0x544154534e41574cull /* "LWANSTAT" (little endian) */
+#define LWAN_STATS_VERSION 3
+
+#define LWAN_STATS_MAX_PREFIXES 64
+#define LWAN_STATS_PREFIX_LEN 64
+
+/* Time spent between consecutive request phases; only tracked if
+ * request_timing is enabled */
+#define LWAN_STATS_PHASES (N_REQUEST_PHASES - 1)
+
+/*
+ * Latencies are kept in microseconds (request phases in nanoseconds), in
+ * log-linear buckets (like HdrHistogram with a 3-bit sub-bucket): values
+ * below 16 have their own bucket, and every power of two above that is
+ * split in 8 buckets, for a relative error of at most 12.5%.  Values above
+ * 2^32 are clamped.
+ */
+#define LWAN_STATS_HISTOGRAM_SUB_BITS 3
+#define LWAN_STATS_HISTOGRAM_BUCKETS 240
+
+struct lwan_stats_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[LWAN_STATS_HISTOGRAM_BUCKETS];
+};
+
+struct lwan_thread_stats_t_ {
+    uint64_t accepted;
+    uint64_t closed;
+    uint64_t keep_alive_reused;
+    /* Indexed by status class; [0] are requests without a response */
+    uint64_t requests[6];
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t coros_created;
+    uint64_t coros_freed;
+    uint64_t eagain_yields;
+    uint64_t timeouts;
+    /* Written by the main loop, for connections that would have been
+     * handed to this thread */
+    uint64_t rejected;
+    /* Bytes handed to the kernel by writes that might have had to wait
+     * for the socket, time spent waiting, how many times that happened,
+     * and connections dropped for not making progress in the meantime.
+     * Folded in as connections are closed. */
+    uint64_t write_bytes_queued;
+    uint64_t write_blocked_usec;
+    uint64_t write_stalls;
+    uint64_t write_stall_timeouts;
+
+    /* Indexed by prefix; [0] are requests that matched no prefix */
+    struct lwan_stats_histogram latency[LWAN_STATS_MAX_PREFIXES];
+
+    /* In nanoseconds; [0] is parsing, [1] routing, [2] preparing for the
+     * response, [3] the handler, and [4] writing the response */
+    struct lwan_stats_histogram phases[LWAN_STATS_PHASES];
+} __attribute__((aligned(64)));
+
+struct lwan_stats_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t n_threads;
+    /* Prefixes can be added while running; only read n_prefixes entries */
+    uint32_t n_prefixes;
+    uint32_t thread_stats_size;
+    uint64_t thread_stats_offset;
+    char prefixes[LWAN_STATS_MAX_PREFIXES][LWAN_STATS_PREFIX_LEN];
+};
+
+/* Counters are only written by the thread owning them; relaxed atomics
+ * compile down to plain loads and stores, but keep concurrent readers
+ * from seeing torn values. */
+#define LWAN_STATS_ADD(stats_, field_, n_)                                     \
+    __atomic_store_n(&(stats_)->field_, (stats_)->field_ + (uint64_t)(n_),    \
+        __ATOMIC_RELAXED)
+#define LWAN_STATS_INC(stats_, field_) LWAN_STATS_ADD(stats_, field_, 1)
+
+static inline unsigned int
+lwan_stats_histogram_bucket(uint64_t value)
+{
+    const unsigned int sub_buckets = 1 << LWAN_STATS_HISTOGRAM_SUB_BITS;
+    unsigned int shift;
+
+    if (value < 2 * sub_buckets)
+        return (unsigned int)value;
+    if (value >= 1ull << 32)
+        return LWAN_STATS_HISTOGRAM_BUCKETS - 1;
+
+    shift = (unsigned int)(63 - __builtin_clzll(value)) -
+        LWAN_STATS_HISTOGRAM_SUB_BITS;
+    return (shift + 1) * sub_buckets +
+        (unsigned int)((value >> shift) & (sub_buckets - 1));
+}
+
+static inline uint64_t
+lwan_stats_histogram_bucket_lower(unsigned int bucket)
+{
+    const unsigned int sub_buckets = 1 << LWAN_STATS_HISTOGRAM_SUB_BITS;
+    unsigned int shift;
+
+    if (bucket < 2 * sub_buckets)
+        return bucket;
+
+    shift = bucket / sub_buckets - 1;
+    return (uint64_t)(sub_buckets + bucket % sub_buckets) << shift;
+}
+
+struct lwan_stats_settings_t {
+    bool json;
+};
+
+#define STATS(json_) \
+  .module = lwan_module_stats(), \
+  .args = ((struct lwan_stats_settings_t[]) {{ \
+    .json = json_ \
+  }}), \
+  .flags = HANDLER_PARSE_QUERY_STRING
+
+/* Timestamps for request phases.  On x86-64, this is the TSC (which is
+ * assumed to be invariant); use lwan_stats_ticks_to_nsec() to convert. */
+static ALWAYS_INLINE uint64_t
+lwan_stats_ticks(void)
+{
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+#define LWAN_STATS_TIMESTAMP_PHASE(l_, request_, phase_)                       \
+    do {                                                                       \
+        if (UNLIKELY((l_)->config.request_timing.enabled))                     \
+            (request_)->stats.phases[phase_] = lwan_stats_ticks();             \
+    } while (0)
+
+uint64_t lwan_stats_ticks_to_nsec(const lwan_t *l, uint64_t ticks);
+size_t lwan_stats_format_server_timing(const lwan_request_t *request,
+    char *buffer, size_t buffer_len);
+
+void lwan_stats_open_shared_memory(lwan_t *l, const char *name);
+void lwan_stats_disown_shared_memory(lwan_t *l);
+
+const lwan_module_t *lwan_module_stats(void);
@@ -116,6 +116,7 @@ const char *
 lwan_http_status_as_string_with_code(lwan_http_status_t status)
 {
     switch (status) {
+    case HTTP_SWITCHING_PROTOCOLS: return "101 Switching protocols";
     case HTTP_OK: return "200 OK";
     case HTTP_PARTIAL_CONTENT: return "206 Partial content";
     case HTTP_MOVED_PERMANENTLY: return "301 Moved permanently";
@@ -146,6 +147,7 @@ const char *
 lwan_http_status_as_descriptive_string(lwan_http_status_t status)
 {
     switch (status) {
+    case HTTP_SWITCHING_PROTOCOLS: return "Protocol is being switched.";
     case HTTP_OK: return "Success!";
     case HTTP_PARTIAL_CONTENT: return "Delivering part of requested resource.";
     case HTTP_MOVED_PERMANENTLY: return "This content has moved to another place.";
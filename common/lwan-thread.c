@@ -21,22 +21,35 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
+#include "list.h"
 #include "lwan-private.h"
+#include "lwan-stats.h"
 
 #define CORO_GC_THRESHOLD   16
 
+/* Connections can be given different timeouts, so the death queue is a
+ * timer wheel: each slot is a list of the connections dying at the same
+ * time, modulo the number of slots.  Those dying later than that are just
+ * skipped whenever their slot comes up. */
+#define DEATH_QUEUE_SLOTS   64
+
 struct death_queue_t {
     const lwan_t *lwan;
     lwan_connection_t *conns;
-    lwan_connection_t head;
+    /* Negative indices in the lists refer to these */
+    lwan_connection_t heads[DEATH_QUEUE_SLOTS];
+    unsigned int len;
     unsigned time;
-    unsigned short keep_alive_timeout;
+    unsigned short write_stall_timeout;
 };
 
 static const uint32_t events_by_write_flag[] = {
@@ -44,43 +57,89 @@ static const uint32_t events_by_write_flag[] = {
     EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLET
 };
 
+static __thread lwan_thread_t *this_thread;
+
+static inline int death_queue_head_idx(unsigned int slot)
+{
+    return -1 - (int)slot;
+}
+
 static inline int death_queue_node_to_idx(struct death_queue_t *dq,
     lwan_connection_t *conn)
 {
-    return (conn == &dq->head) ? -1 : (int)(ptrdiff_t)(conn - dq->conns);
+    return (int)(ptrdiff_t)(conn - dq->conns);
 }
 
 static inline lwan_connection_t *death_queue_idx_to_node(struct death_queue_t *dq,
     int idx)
 {
-    return (idx < 0) ? &dq->head : &dq->conns[idx];
+    return (idx < 0) ? &dq->heads[-1 - idx] : &dq->conns[idx];
 }
 
 static void death_queue_insert(struct death_queue_t *dq,
     lwan_connection_t *new_node)
 {
-    new_node->next = -1;
-    new_node->prev = dq->head.prev;
-    lwan_connection_t *prev = death_queue_idx_to_node(dq, dq->head.prev);
-    dq->head.prev = prev->next = death_queue_node_to_idx(dq, new_node);
+    /* Connections that should have died already die at the next tick */
+    unsigned int time = new_node->time_to_die > dq->time ?
+                new_node->time_to_die : dq->time + 1;
+    unsigned int slot = time % DEATH_QUEUE_SLOTS;
+    lwan_connection_t *head = &dq->heads[slot];
+
+    new_node->next = death_queue_head_idx(slot);
+    new_node->prev = head->prev;
+    lwan_connection_t *prev = death_queue_idx_to_node(dq, head->prev);
+    head->prev = prev->next = death_queue_node_to_idx(dq, new_node);
+    dq->len++;
 }
 
 static void death_queue_remove(struct death_queue_t *dq,
     lwan_connection_t *node)
 {
+    int idx = death_queue_node_to_idx(dq, node);
+
+    /* FIXME: Removing a node twice shouldn't happen; there may be a bug
+     * somewhere that manifests if lots of chunked encoding requests are
+     * performed.  Removed nodes point to themselves, so it's harmless. */
+    if (node->next == idx)
+        return;
+
     lwan_connection_t *prev = death_queue_idx_to_node(dq, node->prev);
     lwan_connection_t *next = death_queue_idx_to_node(dq, node->next);
     next->prev = node->prev;
     prev->next = node->next;
 
-    /* FIXME: This shouldn't be required; there may be a bug somewhere
-     * that manifests if lots of chunked encoding requests are performed. */
-    node->next = node->prev = -1;
+    node->next = node->prev = idx;
+    dq->len--;
 }
 
 static bool death_queue_empty(struct death_queue_t *dq)
 {
-    return dq->head.next < 0;
+    return !dq->len;
+}
+
+/* Idle connections are kept around for less time as the thread gets
+ * closer to its connection limit: once more than half of it is used,
+ * the keep-alive timeout shrinks linearly, down to a second. */
+static unsigned int
+keep_alive_timeout(const struct death_queue_t *dq, const lwan_connection_t *conn)
+{
+    unsigned int timeout =
+        lwan_connection_get_listener(dq->lwan, conn)->keep_alive_timeout;
+    unsigned int limit = dq->lwan->thread.connection_limit;
+    unsigned int used, headroom;
+
+    if (LIKELY(!limit))
+        return timeout;
+
+    used = __atomic_load_n(&conn->thread->n_connections, __ATOMIC_RELAXED);
+    if (used <= limit / 2)
+        return timeout;
+    if (used >= limit)
+        return 1;
+
+    headroom = limit - limit / 2;
+    timeout = (unsigned int)((uint64_t)timeout * (limit - used) / headroom);
+    return timeout ? timeout : 1;
 }
 
 static void death_queue_move_to_last(struct death_queue_t *dq,
@@ -89,13 +148,21 @@ static void death_queue_move_to_last(struct death_queue_t *dq,
     /*
      * If the connection isn't keep alive, it might have a coroutine that
      * should be resumed.  If that's the case, schedule for this request to
-     * die according to the keep alive timeout.
+     * die according to the keep alive timeout of its listener.
      *
      * If it's not a keep alive connection, or the coroutine shouldn't be
      * resumed -- then just mark it to be reaped right away.
+     *
+     * Connections waiting for the client to drain the socket buffer are
+     * given the write stall timeout instead.  Suspended connections, and
+     * those asking for it, are woken up rather than killed once their time
+     * is up.
      */
-    conn->time_to_die = dq->time + dq->keep_alive_timeout *
-            (unsigned)!!(conn->flags & (CONN_KEEP_ALIVE | CONN_SHOULD_RESUME_CORO));
+    unsigned timeout = (conn->flags & CONN_WRITE_BLOCKED) ?
+            dq->write_stall_timeout : keep_alive_timeout(dq, conn);
+
+    conn->time_to_die = dq->time + timeout *
+            (unsigned)!!(conn->flags & (CONN_KEEP_ALIVE | CONN_SHOULD_RESUME_CORO | CONN_SUSPENDED));
 
     death_queue_remove(dq, conn);
     death_queue_insert(dq, conn);
@@ -107,8 +174,10 @@ death_queue_init(struct death_queue_t *dq, const lwan_t *lwan)
     dq->lwan = lwan;
     dq->conns = lwan->conns;
     dq->time = 0;
-    dq->keep_alive_timeout = lwan->config.keep_alive_timeout;
-    dq->head.next = dq->head.prev = -1;
+    dq->write_stall_timeout = lwan->config.write_stall_timeout;
+    dq->len = 0;
+    for (unsigned int slot = 0; slot < DEATH_QUEUE_SLOTS; slot++)
+        dq->heads[slot].next = dq->heads[slot].prev = death_queue_head_idx(slot);
 }
 
 static ALWAYS_INLINE int
@@ -124,10 +193,13 @@ destroy_coro(struct death_queue_t *dq, lwan_connection_t *conn)
     if (LIKELY(conn->coro)) {
         coro_free(conn->coro);
         conn->coro = NULL;
+        LWAN_STATS_INC(conn->thread->stats, coros_freed);
     }
     if (conn->flags & CONN_IS_ALIVE) {
         conn->flags &= ~CONN_IS_ALIVE;
         close(lwan_connection_get_fd(dq->lwan, conn));
+        __atomic_fetch_sub(&conn->thread->n_connections, 1, __ATOMIC_RELAXED);
+        LWAN_STATS_INC(conn->thread->stats, closed);
     }
 }
 
@@ -137,11 +209,26 @@ min(const int a, const int b)
     return a < b ? a : b;
 }
 
+static void
+fold_write_stats(void *data)
+{
+    lwan_write_stats_t *stats = data;
+    lwan_thread_t *t = stats->thread;
+
+    /* Deferred statements run in the thread owning the connection, which
+     * is the only one writing to its stats block. */
+    LWAN_STATS_ADD(t->stats, write_bytes_queued, stats->bytes_queued);
+    LWAN_STATS_ADD(t->stats, write_blocked_usec, stats->blocked_usec);
+    LWAN_STATS_ADD(t->stats, write_stalls, stats->stalls);
+}
+
 static int
 process_request_coro(coro_t *coro)
 {
     const lwan_request_flags_t flags_filter = REQUEST_PROXIED;
     strbuf_t *strbuf = coro_malloc_full(coro, sizeof(*strbuf), true, strbuf_free);
+    lwan_write_stats_t *write_stats = coro_malloc_full(coro,
+                sizeof(*write_stats), true, fold_write_stats);
     lwan_connection_t *conn = coro_get_data(coro);
     lwan_t *lwan = conn->thread->lwan;
     int fd = lwan_connection_get_fd(lwan, conn);
@@ -152,11 +239,26 @@ process_request_coro(coro_t *coro)
     };
     char *next_request = NULL;
     lwan_request_flags_t flags =
-        lwan->config.proxy_protocol ? REQUEST_ALLOW_PROXY_REQS : 0;
+        lwan_connection_get_listener(lwan, conn)->proxy_protocol ?
+            REQUEST_ALLOW_PROXY_REQS : 0;
     lwan_proxy_t proxy;
+    lwan_tls_session_t *tls = NULL;
     int gc_counter = CORO_GC_THRESHOLD;
+    unsigned int request_count = 0;
+
+    if (UNLIKELY(!strbuf || !write_stats))
+        return CONN_CORO_ABORT;
 
     strbuf_init(strbuf);
+    *write_stats = (lwan_write_stats_t) { .thread = conn->thread };
+
+#if defined(HAVE_OPENSSL)
+    if (conn->flags & CONN_TLS) {
+        tls = lwan_tls_accept(lwan, conn, fd);
+        /* A PROXY header would precede the handshake, not follow it */
+        flags &= ~REQUEST_ALLOW_PROXY_REQS;
+    }
+#endif
 
     while (true) {
         lwan_request_t request = {
@@ -166,13 +268,20 @@ process_request_coro(coro_t *coro)
                 .buffer = strbuf
             },
             .flags = flags,
-            .proxy = &proxy
+            .proxy = &proxy,
+            .write_stats = write_stats,
+            .tls = tls
         };
 
         assert(conn->flags & CONN_IS_ALIVE);
 
         next_request = lwan_process_request(lwan, &request, &buffer, next_request);
-        if (!gc_counter--) {
+        if (request_count++)
+            LWAN_STATS_INC(conn->thread->stats, keep_alive_reused);
+        /* The routes used by a request are released along with whatever
+         * else it deferred, so that's done as soon as it's done, rather
+         * than having idle connections keep replaced routes around */
+        if ((conn->flags & CONN_ROUTES_REF) || !gc_counter--) {
             coro_collect_garbage(coro);
             gc_counter = CORO_GC_THRESHOLD;
         }
@@ -206,9 +315,16 @@ resume_coro_if_needed(struct death_queue_t *dq, lwan_connection_t *conn,
 
     bool write_events;
     if (conn->flags & CONN_MUST_READ) {
+        /* Already waiting for input: flipping CONN_WRITE_EVENTS again
+         * would get it out of sync with what epoll is watching. */
+        if (!(conn->flags & CONN_WRITE_EVENTS))
+            return;
         write_events = true;
     } else {
-        bool should_resume_coro = (yield_result == CONN_CORO_MAY_RESUME);
+        /* Suspended coroutines are only resumed by lwan_connection_wake();
+         * until then, watch only for the peer hanging up. */
+        bool should_resume_coro = (yield_result == CONN_CORO_MAY_RESUME) &&
+                    !(conn->flags & CONN_SUSPENDED);
 
         if (should_resume_coro)
             conn->flags |= CONN_SHOULD_RESUME_CORO;
@@ -237,25 +353,51 @@ death_queue_kill_waiting(struct death_queue_t *dq)
 {
     dq->time++;
 
-    while (!death_queue_empty(dq)) {
-        lwan_connection_t *conn = death_queue_idx_to_node(dq, dq->head.next);
+    unsigned int slot = dq->time % DEATH_QUEUE_SLOTS;
+    int head_idx = death_queue_head_idx(slot);
+    int next;
 
+    /* Connections woken up below might be put back in this slot, after
+     * the ones that haven't been looked at yet, but won't die now */
+    for (int idx = dq->heads[slot].next; idx != head_idx; idx = next) {
+        lwan_connection_t *conn = death_queue_idx_to_node(dq, idx);
+
+        next = conn->next;
         if (conn->time_to_die > dq->time)
-            return;
+            continue;
 
+        if (conn->flags & (CONN_SUSPENDED | CONN_WAKE_ON_TIMEOUT | CONN_PARKED_STREAMS)) {
+            conn->flags |= CONN_TIMED_OUT;
+            lwan_connection_wake(conn);
+            death_queue_move_to_last(dq, conn);
+
+            if (conn->time_to_die <= dq->time) {
+                LWAN_STATS_INC(conn->thread->stats, timeouts);
+                destroy_coro(dq, conn);
+            }
+            continue;
+        }
+
+        LWAN_STATS_INC(conn->thread->stats, timeouts);
         destroy_coro(dq, conn);
     }
 
     /* Death queue exhausted: reset epoch */
-    dq->time = 0;
+    if (death_queue_empty(dq))
+        dq->time = 0;
 }
 
 static void
 death_queue_kill_all(struct death_queue_t *dq)
 {
-    while (!death_queue_empty(dq)) {
-        lwan_connection_t *conn = death_queue_idx_to_node(dq, dq->head.next);
-        destroy_coro(dq, conn);
+    for (unsigned int slot = 0; slot < DEATH_QUEUE_SLOTS; slot++) {
+        int head_idx = death_queue_head_idx(slot);
+
+        while (dq->heads[slot].next != head_idx) {
+            lwan_connection_t *conn = death_queue_idx_to_node(dq,
+                        dq->heads[slot].next);
+            destroy_coro(dq, conn);
+        }
     }
 }
 
@@ -294,6 +436,8 @@ spawn_coro(lwan_connection_t *conn,
     assert(!(conn->flags & CONN_SHOULD_RESUME_CORO));
 
     conn->coro = coro_new(switcher, process_request_coro, conn);
+    LWAN_STATS_INC(conn->thread->stats, accepted);
+    LWAN_STATS_INC(conn->thread->stats, coros_created);
 
     death_queue_insert(dq, conn);
     conn->flags |= (CONN_IS_ALIVE | CONN_SHOULD_RESUME_CORO);
@@ -311,12 +455,176 @@ grab_and_watch_client(int epoll_fd, int pipe_fd, lwan_connection_t *conns)
         .events = events_by_write_flag[1],
         .data.ptr = &conns[fd]
     };
-    if (UNLIKELY(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0))
+    if (UNLIKELY(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)) {
+        close(fd);
+        __atomic_fetch_sub(&conns[fd].thread->n_connections, 1, __ATOMIC_RELAXED);
         return NULL;
+    }
 
     return &conns[fd];
 }
 
+void
+lwan_connection_suspend(lwan_connection_t *conn)
+{
+    conn->flags = (conn->flags | CONN_SUSPENDED) & ~CONN_TIMED_OUT;
+    if (conn->flags & CONN_HTTP2_STREAM)
+        lwan_http2_stream_parent(conn)->flags |= CONN_PARKED_STREAMS;
+    coro_yield(conn->coro, CONN_CORO_MAY_RESUME);
+}
+
+void
+lwan_connection_wake(lwan_connection_t *conn)
+{
+    /* Must be called from the thread owning the connection.  The coroutine
+     * isn't resumed right away: the connection is armed for write events
+     * instead, so it's resumed from the I/O loop like everything else.
+     * Coroutines that asked to be woken up on timeouts can tell this
+     * happened as CONN_WAKE_ON_TIMEOUT will have been cleared.  */
+    if (conn->flags & CONN_HTTP2_STREAM) {
+        /* Streams are resumed by their connection, which is woken up
+         * without touching the other streams parked in it */
+        if (!(conn->flags & CONN_SUSPENDED))
+            return;
+        conn->flags &= ~CONN_SUSPENDED;
+        conn = lwan_http2_stream_parent(conn);
+    } else if (conn->flags & (CONN_SUSPENDED | CONN_WAKE_ON_TIMEOUT | CONN_PARKED_STREAMS)) {
+        conn->flags &= ~(CONN_SUSPENDED | CONN_WAKE_ON_TIMEOUT | CONN_PARKED_STREAMS);
+    } else {
+        return;
+    }
+
+    conn->flags |= CONN_SHOULD_RESUME_CORO;
+    if (conn->flags & CONN_WRITE_EVENTS)
+        return;
+
+    struct epoll_event event = {
+        .events = events_by_write_flag[0],
+        .data.ptr = conn
+    };
+
+    int fd = lwan_connection_get_fd(conn->thread->lwan, conn);
+    if (UNLIKELY(epoll_ctl(conn->thread->epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0))
+        lwan_status_perror("epoll_ctl");
+
+    conn->flags |= CONN_WRITE_EVENTS;
+}
+
+void
+lwan_thread_notify(lwan_thread_t *t, lwan_thread_notification_t *notification)
+{
+    if (__atomic_exchange_n(&notification->queued, true, __ATOMIC_ACQ_REL))
+        return;
+
+    lwan_thread_notification_t *head = __atomic_load_n(&t->notifications,
+                __ATOMIC_RELAXED);
+    do {
+        notification->next = head;
+    } while (!__atomic_compare_exchange_n(&t->notifications, &head,
+                notification, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    /* Only the first notification queued since the I/O thread last looked
+     * at the list needs to wake it up. */
+    if (head)
+        return;
+
+    uint64_t one = 1;
+    if (UNLIKELY(write(t->notify_fd, &one, sizeof(one)) < 0 && errno != EAGAIN))
+        lwan_status_perror("write");
+}
+
+static void
+process_wakeups(lwan_thread_notification_t *notification)
+{
+    lwan_thread_t *t = container_of(notification, lwan_thread_t,
+                wakeups.notification);
+    lwan_connection_t *conns[64];
+    size_t len;
+
+    do {
+        pthread_mutex_lock(&t->wakeups.lock);
+        len = t->wakeups.len < N_ELEMENTS(conns) ? t->wakeups.len : N_ELEMENTS(conns);
+        t->wakeups.len -= len;
+        memcpy(conns, t->wakeups.conns + t->wakeups.len, len * sizeof(*conns));
+        pthread_mutex_unlock(&t->wakeups.lock);
+
+        for (size_t i = 0; i < len; i++) {
+            /* The connection might have been closed, and its file
+             * descriptor reused by a connection in another thread, since
+             * this was queued. */
+            if (conns[i]->thread == t)
+                lwan_connection_wake(conns[i]);
+        }
+    } while (len == N_ELEMENTS(conns));
+}
+
+/* What to pass to lwan_connection_wake_from_any_thread() later on, once
+ * whatever @conn is about to wait for is done.  HTTP/2 streams might be
+ * gone by then, so their connection is woken up instead (which wakes up
+ * every stream parked in it); connections themselves are never freed. */
+lwan_connection_t *
+lwan_connection_wakeup_target(lwan_connection_t *conn)
+{
+    if (conn->flags & CONN_HTTP2_STREAM)
+        return lwan_http2_stream_parent(conn);
+    return conn;
+}
+
+void
+lwan_connection_wake_from_any_thread(lwan_connection_t *conn)
+{
+    lwan_thread_t *t = conn->thread;
+
+    assert(!(conn->flags & CONN_HTTP2_STREAM));
+
+    if (t == this_thread) {
+        lwan_connection_wake(conn);
+        return;
+    }
+
+    pthread_mutex_lock(&t->wakeups.lock);
+    if (t->wakeups.len == t->wakeups.size) {
+        size_t size = t->wakeups.size ? t->wakeups.size * 2 : 16;
+        lwan_connection_t **conns = realloc(t->wakeups.conns,
+                    size * sizeof(*conns));
+
+        if (UNLIKELY(!conns)) {
+            pthread_mutex_unlock(&t->wakeups.lock);
+            lwan_status_error("Could not queue connection wakeup");
+            return;
+        }
+
+        t->wakeups.conns = conns;
+        t->wakeups.size = size;
+    }
+    t->wakeups.conns[t->wakeups.len++] = conn;
+    pthread_mutex_unlock(&t->wakeups.lock);
+
+    lwan_thread_notify(t, &t->wakeups.notification);
+}
+
+static void
+process_notifications(lwan_thread_t *t)
+{
+    uint64_t count;
+
+    /* Drain the eventfd before grabbing the list: a notification queued
+     * after this point will either be in the list or wake us up again. */
+    if (UNLIKELY(read(t->notify_fd, &count, sizeof(count)) < 0 && errno != EAGAIN))
+        lwan_status_perror("read");
+
+    lwan_thread_notification_t *notification = __atomic_exchange_n(
+                &t->notifications, NULL, __ATOMIC_ACQUIRE);
+    while (notification) {
+        lwan_thread_notification_t *next = notification->next;
+
+        __atomic_store_n(&notification->queued, false, __ATOMIC_RELEASE);
+        notification->callback(notification);
+
+        notification = next;
+    }
+}
+
 static void *
 thread_io_loop(void *data)
 {
@@ -334,6 +642,9 @@ thread_io_loop(void *data)
     lwan_status_debug("Starting IO loop on thread #%d",
         (unsigned short)(ptrdiff_t)(t - t->lwan->thread.threads) + 1);
 
+    __atomic_store_n(&t->tid, (pid_t)syscall(SYS_gettid), __ATOMIC_RELEASE);
+    this_thread = t;
+
     events = calloc((size_t)max_events, sizeof(*events));
     if (UNLIKELY(!events))
         lwan_status_critical("Could not allocate memory for events");
@@ -359,6 +670,11 @@ thread_io_loop(void *data)
             for (struct epoll_event *ep_event = events; n_fds--; ep_event++) {
                 lwan_connection_t *conn;
 
+                if (ep_event->data.ptr == t) {
+                    process_notifications(t);
+                    continue;
+                }
+
                 if (!ep_event->data.ptr) {
                     conn = grab_and_watch_client(epoll_fd, read_pipe_fd, conns);
                     if (UNLIKELY(!conn))
@@ -394,6 +710,8 @@ create_thread(lwan_t *l, lwan_thread_t *thread)
 
     memset(thread, 0, sizeof(*thread));
     thread->lwan = l;
+    thread->stats = lwan_stats_for_thread(l,
+        (unsigned int)(thread - l->thread.threads));
 
     if ((thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
         lwan_status_critical_perror("epoll_create");
@@ -414,6 +732,17 @@ create_thread(lwan_t *l, lwan_thread_t *thread)
     if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, thread->pipe_fd[0], &event) < 0)
         lwan_status_critical_perror("epoll_ctl");
 
+    if ((thread->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        lwan_status_critical_perror("eventfd");
+
+    thread->wakeups.notification.callback = process_wakeups;
+    if (pthread_mutex_init(&thread->wakeups.lock, NULL))
+        lwan_status_critical_perror("pthread_mutex_init");
+
+    event = (struct epoll_event) { .events = EPOLLIN, .data.ptr = thread };
+    if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, thread->notify_fd, &event) < 0)
+        lwan_status_critical_perror("epoll_ctl");
+
     if (pthread_create(&thread->self, &attr, thread_io_loop, thread))
         lwan_status_critical_perror("pthread_create");
 
@@ -422,9 +751,10 @@ create_thread(lwan_t *l, lwan_thread_t *thread)
 }
 
 void
-lwan_thread_add_client(lwan_thread_t *t, int fd)
+lwan_thread_add_client(lwan_thread_t *t, int fd,
+    lwan_connection_flags_t flags)
 {
-    t->lwan->conns[fd].flags = 0;
+    t->lwan->conns[fd].flags = flags;
     t->lwan->conns[fd].thread = t;
 
     if (UNLIKELY(write(t->pipe_fd[1], &fd, sizeof(int)) < 0))
@@ -485,6 +815,10 @@ lwan_thread_shutdown(lwan_t *l)
             t->pipe_fd[1]);
         close(t->pipe_fd[0]);
         close(t->pipe_fd[1]);
+        close(t->notify_fd);
+
+        pthread_mutex_destroy(&t->wakeups.lock);
+        free(t->wakeups.conns);
     }
 
     free(l->thread.threads);
@@ -0,0 +1,508 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2016 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+
+#include "lwan-private.h"
+
+/*
+ * The handshake is performed by OpenSSL inside the connection coroutine.
+ * Once it's done, OpenSSL is asked to hand the session keys over to the
+ * kernel (kTLS): if it manages to do that for both directions, the
+ * connection is treated just like a cleartext one from there on, so
+ * sendfile(), writev() and friends keep working unchanged.  Otherwise,
+ * lwan_request_t::tls is set and the I/O wrappers push records through
+ * OpenSSL instead.  Even then, sendfile() is used whenever the transmit
+ * side could be offloaded, as that's the direction that matters the most.
+ */
+
+struct ticket_key {
+    unsigned char name[16];
+    unsigned char aes_key[32];
+    unsigned char hmac_key[32];
+};
+
+struct lwan_tls_context_t_ {
+    SSL_CTX *ssl_ctx;
+    bool http2;
+
+    struct {
+        pthread_rwlock_t lock;
+        /* keys[0] encrypts new tickets; keys[1] still decrypts old ones */
+        struct ticket_key keys[2];
+        time_t rotated_at;
+        unsigned int period;
+    } ticket;
+};
+
+struct lwan_tls_session_t_ {
+    SSL *ssl;
+    int fd;
+    bool ktls_send;
+    bool ktls_recv;
+
+    /* Small writes are coalesced here so that each one doesn't cost a
+     * record of its own; also used to read files that can't be sent
+     * with sendfile(). */
+    unsigned char buffer[16384];
+};
+
+static int ssl_ctx_index = -1;
+
+static bool
+generate_ticket_key(struct ticket_key *key)
+{
+    return RAND_bytes((unsigned char *)key, sizeof(*key)) == 1;
+}
+
+static bool
+rotate_ticket_keys(void *data)
+{
+    lwan_tls_context_t *ctx = data;
+    struct ticket_key key;
+    time_t now = time(NULL);
+
+    if (now - ctx->ticket.rotated_at < (time_t)ctx->ticket.period)
+        return false;
+
+    if (UNLIKELY(!generate_ticket_key(&key))) {
+        lwan_status_error("Could not generate session ticket key");
+        return false;
+    }
+
+    if (UNLIKELY(pthread_rwlock_wrlock(&ctx->ticket.lock))) {
+        lwan_status_error("Could not lock session ticket keys");
+        return false;
+    }
+    ctx->ticket.keys[1] = ctx->ticket.keys[0];
+    ctx->ticket.keys[0] = key;
+    ctx->ticket.rotated_at = now;
+    pthread_rwlock_unlock(&ctx->ticket.lock);
+
+    OPENSSL_cleanse(&key, sizeof(key));
+    lwan_status_debug("Session ticket keys rotated");
+
+    return true;
+}
+
+static int
+ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char *iv,
+    EVP_CIPHER_CTX *cipher_ctx, EVP_MAC_CTX *mac_ctx, int enc)
+{
+    SSL_CTX *ssl_ctx = SSL_get_SSL_CTX(ssl);
+    lwan_tls_context_t *ctx = SSL_CTX_get_ex_data(ssl_ctx, ssl_ctx_index);
+    struct ticket_key key;
+    int ret;
+
+    if (UNLIKELY(pthread_rwlock_rdlock(&ctx->ticket.lock)))
+        return -1;
+
+    if (enc) {
+        key = ctx->ticket.keys[0];
+        ret = 1;
+    } else if (!memcmp(key_name, ctx->ticket.keys[0].name, 16)) {
+        key = ctx->ticket.keys[0];
+        ret = 1;
+    } else if (!memcmp(key_name, ctx->ticket.keys[1].name, 16)) {
+        /* Still valid, but ask for the ticket to be renewed */
+        key = ctx->ticket.keys[1];
+        ret = 2;
+    } else {
+        ret = 0;
+    }
+
+    pthread_rwlock_unlock(&ctx->ticket.lock);
+
+    if (!ret)
+        return 0;
+
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+            key.hmac_key, sizeof(key.hmac_key)),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+        OSSL_PARAM_construct_end()
+    };
+
+    if (enc) {
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+            goto error;
+        memcpy(key_name, key.name, 16);
+        if (!EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL,
+                    key.aes_key, iv))
+            goto error;
+    } else if (!EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL,
+                    key.aes_key, iv)) {
+        goto error;
+    }
+
+    if (!EVP_MAC_CTX_set_params(mac_ctx, params))
+        goto error;
+
+    OPENSSL_cleanse(&key, sizeof(key));
+    return ret;
+
+error:
+    OPENSSL_cleanse(&key, sizeof(key));
+    return -1;
+}
+
+static int
+alpn_select_cb(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+    const unsigned char *in, unsigned int inlen, void *data)
+{
+    static const unsigned char protos_h2[] = "\x02h2\x08http/1.1";
+    static const unsigned char protos_http1[] = "\x08http/1.1";
+    lwan_tls_context_t *ctx = data;
+    const unsigned char *protos;
+    unsigned int protos_len;
+    unsigned char *selected;
+
+    (void)ssl;
+
+    if (ctx->http2) {
+        protos = protos_h2;
+        protos_len = sizeof(protos_h2) - 1;
+    } else {
+        protos = protos_http1;
+        protos_len = sizeof(protos_http1) - 1;
+    }
+
+    /* An HTTP/2 client will send the connection preface right away, which
+     * is picked up by the request parser as if it were cleartext. */
+    if (SSL_select_next_proto(&selected, outlen, protos, protos_len,
+                in, inlen) != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+static void
+log_ssl_errors(const char *what)
+{
+    unsigned long err;
+
+    while ((err = ERR_get_error()) != 0) {
+        char buffer[256];
+
+        ERR_error_string_n(err, buffer, sizeof(buffer));
+        lwan_status_error("%s: %s", what, buffer);
+    }
+}
+
+void
+lwan_tls_init(lwan_t *l)
+{
+    lwan_tls_context_t *ctx;
+    SSL_CTX *ssl_ctx;
+
+    lwan_status_debug("Initializing TLS");
+
+    if (!l->config.tls.certificate || !l->config.tls.private_key)
+        lwan_status_critical("TLS listener requires a certificate and a private key");
+
+    ctx = calloc(1, sizeof(*ctx));
+    if (!ctx)
+        lwan_status_critical_perror("calloc");
+
+    if (ssl_ctx_index < 0) {
+        ssl_ctx_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+        if (ssl_ctx_index < 0)
+            lwan_status_critical("Could not allocate SSL_CTX ex_data index");
+    }
+
+    ssl_ctx = SSL_CTX_new(TLS_server_method());
+    if (!ssl_ctx)
+        lwan_status_critical("Could not create TLS context");
+
+    SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION |
+        SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+        SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+    if (SSL_CTX_use_certificate_chain_file(ssl_ctx, l->config.tls.certificate) != 1) {
+        log_ssl_errors(l->config.tls.certificate);
+        lwan_status_critical("Could not load TLS certificate");
+    }
+    if (SSL_CTX_use_PrivateKey_file(ssl_ctx, l->config.tls.private_key,
+                SSL_FILETYPE_PEM) != 1) {
+        log_ssl_errors(l->config.tls.private_key);
+        lwan_status_critical("Could not load TLS private key");
+    }
+    if (SSL_CTX_check_private_key(ssl_ctx) != 1)
+        lwan_status_critical("TLS private key does not match the certificate");
+
+    /* Sessions are resumed with tickets only, so that there's no session
+     * cache to be shared between the I/O threads.  A ticket is accepted
+     * for up to two rotation periods. */
+    if (pthread_rwlock_init(&ctx->ticket.lock, NULL))
+        lwan_status_critical("Could not initialize session ticket lock");
+    ctx->ticket.period = l->config.tls.ticket_key_rotation;
+    ctx->ticket.rotated_at = time(NULL);
+    if (!generate_ticket_key(&ctx->ticket.keys[0]) ||
+                !generate_ticket_key(&ctx->ticket.keys[1]))
+        lwan_status_critical("Could not generate session ticket keys");
+
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_timeout(ssl_ctx, (long)ctx->ticket.period * 2);
+    SSL_CTX_set_ex_data(ssl_ctx, ssl_ctx_index, ctx);
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ssl_ctx, ticket_key_cb);
+
+    ctx->http2 = l->config.http2;
+    SSL_CTX_set_alpn_select_cb(ssl_ctx, alpn_select_cb, ctx);
+
+    ctx->ssl_ctx = ssl_ctx;
+    l->tls = ctx;
+
+    lwan_job_add(rotate_ticket_keys, ctx);
+}
+
+void
+lwan_tls_shutdown(lwan_t *l)
+{
+    lwan_tls_context_t *ctx = l->tls;
+
+    if (!ctx)
+        return;
+
+    lwan_status_debug("Shutting down TLS");
+
+    lwan_job_del(rotate_ticket_keys, ctx);
+
+    SSL_CTX_free(ctx->ssl_ctx);
+    pthread_rwlock_destroy(&ctx->ticket.lock);
+    OPENSSL_cleanse(ctx->ticket.keys, sizeof(ctx->ticket.keys));
+    free(ctx);
+
+    l->tls = NULL;
+}
+
+static void
+destroy_session(void *data)
+{
+    lwan_tls_session_t *session = data;
+
+    if (!session->ssl)
+        return;
+
+    /* Best effort: tell the client the connection wasn't truncated.  The
+     * socket is only closed after all deferred statements have run. */
+    if (SSL_is_init_finished(session->ssl))
+        SSL_shutdown(session->ssl);
+
+    ERR_clear_error();
+    SSL_free(session->ssl);
+}
+
+static void
+abort_handshake(lwan_connection_t *conn)
+{
+    /* Failed handshakes are common (scanners, clients not trusting the
+     * certificate); don't let their errors pile up in the thread queue. */
+    ERR_clear_error();
+
+    coro_yield(conn->coro, CONN_CORO_ABORT);
+    __builtin_unreachable();
+}
+
+lwan_tls_session_t *
+lwan_tls_accept(lwan_t *l, lwan_connection_t *conn, int fd)
+{
+    lwan_tls_session_t *session;
+
+    session = coro_malloc_full(conn->coro, sizeof(*session), true,
+                destroy_session);
+    if (UNLIKELY(!session)) {
+        coro_yield(conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
+    session->fd = fd;
+    session->ssl = SSL_new(l->tls->ssl_ctx);
+    if (UNLIKELY(!session->ssl))
+        abort_handshake(conn);
+    if (UNLIKELY(SSL_set_fd(session->ssl, fd) != 1))
+        abort_handshake(conn);
+
+    for (;;) {
+        int ret = SSL_accept(session->ssl);
+
+        if (ret == 1)
+            break;
+
+        switch (SSL_get_error(session->ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            conn->flags |= CONN_MUST_READ;
+            coro_yield(conn->coro, CONN_CORO_MAY_RESUME);
+            break;
+        case SSL_ERROR_WANT_WRITE:
+            conn->flags &= ~CONN_MUST_READ;
+            coro_yield(conn->coro, CONN_CORO_MAY_RESUME);
+            break;
+        default:
+            abort_handshake(conn);
+        }
+    }
+
+    conn->flags &= ~CONN_MUST_READ;
+
+    session->ktls_send = BIO_get_ktls_send(SSL_get_wbio(session->ssl));
+    session->ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(session->ssl));
+
+    /* Fully offloaded: the kernel takes care of the record layer. */
+    if (session->ktls_send && session->ktls_recv)
+        return NULL;
+
+    return session;
+}
+
+static ssize_t
+handle_ssl_error(lwan_tls_session_t *session, int ret)
+{
+    switch (SSL_get_error(session->ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if (errno)
+            return -1;
+        /* fallthrough */
+    default:
+        ERR_clear_error();
+        errno = ECONNRESET;
+        return -1;
+    }
+}
+
+ssize_t
+lwan_tls_read(lwan_tls_session_t *session, void *buf, size_t count)
+{
+    if (session->ktls_recv)
+        return read(session->fd, buf, count);
+
+    if (count > INT_MAX)
+        count = INT_MAX;
+
+    errno = 0;
+    int ret = SSL_read(session->ssl, buf, (int)count);
+    if (LIKELY(ret > 0))
+        return ret;
+
+    return handle_ssl_error(session, ret);
+}
+
+static ssize_t
+write_record(lwan_tls_session_t *session, const void *buf, size_t count)
+{
+    if (count > INT_MAX)
+        count = INT_MAX;
+
+    /* With partial writes enabled, this returns as soon as a record has
+     * been sent.  If the socket buffer is full, the caller will retry with
+     * the same data, which is what OpenSSL expects. */
+    errno = 0;
+    int ret = SSL_write(session->ssl, buf, (int)count);
+    if (LIKELY(ret > 0))
+        return ret;
+
+    /* Readers see close_notify as EOF; for writers, it's an error */
+    if (handle_ssl_error(session, ret) == 0)
+        errno = EPIPE;
+    return -1;
+}
+
+ssize_t
+lwan_tls_send(lwan_tls_session_t *session, const void *buf, size_t count,
+    int flags)
+{
+    if (session->ktls_send)
+        return send(session->fd, buf, count, flags);
+
+    return write_record(session, buf, count);
+}
+
+ssize_t
+lwan_tls_writev(lwan_tls_session_t *session, const struct iovec *iov,
+    int iov_count)
+{
+    size_t used = 0;
+
+    if (session->ktls_send)
+        return writev(session->fd, iov, iov_count);
+
+    if (iov_count == 1 || iov[0].iov_len >= sizeof(session->buffer))
+        return write_record(session, iov[0].iov_base, iov[0].iov_len);
+
+    /* Callers retry with the same vector after EAGAIN, so whatever is
+     * coalesced here is the same on every attempt. */
+    for (int i = 0; i < iov_count && used < sizeof(session->buffer); i++) {
+        size_t len = iov[i].iov_len;
+
+        if (len > sizeof(session->buffer) - used)
+            len = sizeof(session->buffer) - used;
+
+        memcpy(session->buffer + used, iov[i].iov_base, len);
+        used += len;
+    }
+
+    return write_record(session, session->buffer, used);
+}
+
+ssize_t
+lwan_tls_sendfile(lwan_tls_session_t *session, int in_fd, off_t *offset,
+    size_t count)
+{
+    if (session->ktls_send)
+        return sendfile(session->fd, in_fd, offset, count);
+
+    if (count > sizeof(session->buffer))
+        count = sizeof(session->buffer);
+
+    ssize_t read_bytes = pread(in_fd, session->buffer, count, *offset);
+    if (UNLIKELY(read_bytes <= 0)) {
+        if (!read_bytes)
+            errno = EIO;
+        return -1;
+    }
+
+    ssize_t written = write_record(session, session->buffer, (size_t)read_bytes);
+    if (LIKELY(written > 0))
+        *offset += written;
+
+    return written;
+}
@@ -17,11 +17,54 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#define _GNU_SOURCE
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "lwan.h"
 
+/*
+ * Routes are kept in a compressed radix tree.  Keys are split in static
+ * strings and parameters: a parameter is a segment that starts with a
+ * colon right after a slash, and matches anything up to the next slash
+ * (e.g. "/users/:id/posts" has the static strings "/users/" and "/posts",
+ * and a parameter named "id").  Each static string is stored along a
+ * path of nodes with multi-byte labels, that are split as keys sharing
+ * part of a label are added; parameters hang from the node where the
+ * static string preceding them ends.
+ *
+ * Lookups are a depth-first search, as both a static label and a
+ * parameter might match at any node.  The longest match wins; between
+ * routes matching the same length, the one with fewer parameters wins.
+ * Leaves can be restricted to some request methods, and to match only the
+ * whole key rather than anything it prefixes; many leaves (one for each
+ * combination) can hang from a node.
+ */
+
+struct lookup_state {
+    const char *key;
+    size_t key_len;
+    unsigned int method;
+    bool whole_key;
+
+    const lwan_trie_leaf_t *best;
+    size_t best_len;
+
+    /* Longest route that matched everything but the method */
+    size_t other_len;
+    unsigned int other_methods;
+
+    unsigned short n_params;
+    lwan_trie_match_t *match;
+    /* Parameters on the path being searched; not initialized */
+    unsigned short (*params)[2];
+};
+
 bool
 lwan_trie_init(lwan_trie_t *trie, void (*free_node)(void *data))
 {
@@ -29,108 +72,532 @@ lwan_trie_init(lwan_trie_t *trie, void (*free_node)(void *data))
         return false;
     trie->root = NULL;
     trie->free_node = free_node;
+    trie->count = 0;
+    trie->has_params = false;
     return true;
 }
 
-static ALWAYS_INLINE lwan_trie_leaf_t *
-find_leaf_with_key(lwan_trie_node_t *node, const char *key, size_t len)
+static lwan_trie_node_t *
+new_node(const char *label, size_t label_len)
 {
-    lwan_trie_leaf_t *leaf = node->leaf;
+    /* Padded so that labels can be read a word at a time */
+    lwan_trie_node_t *node = calloc(1, sizeof(*node) + label_len +
+        sizeof(uint64_t));
 
-    if (!leaf)
+    if (!node)
+        lwan_status_critical_perror("calloc");
+
+    if (label_len)
+        memcpy(node->label, label, label_len);
+    node->label_len = (unsigned int)label_len;
+
+    return node;
+}
+
+/* Size of lwan_trie_node_t.first_bytes; groups are searched at once */
+#define CHILD_GROUP_SIZE 16u
+
+/* In lwan_trie_node_t.by_nibble, when more than one label starts with
+ * bytes having the same lower bits */
+#define CHILD_COLLISION ((lwan_trie_node_t *)1)
+
+static void
+append_child(lwan_trie_node_t *node, lwan_trie_node_t *child)
+{
+    unsigned int n = node->n_children;
+    lwan_trie_node_t **slot = &node->by_nibble[(unsigned char)child->label[0] & 15];
+    lwan_trie_node_t **children;
+
+    children = reallocarray(node->children, n + 1, sizeof(*children));
+    if (!children)
+        lwan_status_critical_perror("reallocarray");
+    node->children = children;
+
+    if (n < CHILD_GROUP_SIZE) {
+        node->first_bytes[n] = (unsigned char)child->label[0];
+    } else {
+        unsigned int more = n - CHILD_GROUP_SIZE;
+
+        if (more % CHILD_GROUP_SIZE == 0) {
+            unsigned char *more_first_bytes = realloc(node->more_first_bytes,
+                more + CHILD_GROUP_SIZE);
+
+            if (!more_first_bytes)
+                lwan_status_critical_perror("realloc");
+            memset(more_first_bytes + more, 0, CHILD_GROUP_SIZE);
+            node->more_first_bytes = more_first_bytes;
+        }
+
+        node->more_first_bytes[more] = (unsigned char)child->label[0];
+    }
+
+    *slot = *slot ? CHILD_COLLISION : child;
+
+    children[n] = child;
+    node->n_children = n + 1;
+}
+
+static ALWAYS_INLINE int
+find_in_group(const unsigned char *group, char c)
+{
+#if defined(__SSE2__)
+    __m128i bytes = _mm_loadu_si128((const __m128i *)group);
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(bytes, _mm_set1_epi8(c)));
+
+    return mask ? __builtin_ctz(mask) : -1;
+#else
+    for (unsigned int i = 0; i < CHILD_GROUP_SIZE; i++) {
+        if (group[i] == (unsigned char)c)
+            return (int)i;
+    }
+
+    return -1;
+#endif
+}
+
+/* The padding never matches, as long as c isn't NUL */
+static ALWAYS_INLINE int
+find_child(const lwan_trie_node_t *node, char c)
+{
+    int index = find_in_group(node->first_bytes, c);
+
+    if (LIKELY(index >= 0 || node->n_children <= CHILD_GROUP_SIZE))
+        return index;
+
+    for (unsigned int i = 0; i < node->n_children - CHILD_GROUP_SIZE;
+         i += CHILD_GROUP_SIZE) {
+        index = find_in_group(node->more_first_bytes + i, c);
+        if (index >= 0)
+            return (int)(CHILD_GROUP_SIZE + i) + index;
+    }
+
+    return -1;
+}
+
+/* Returns the child that might have a label starting with c, or NULL.
+ * Usually only the lower bits of c are used to find it, so its label
+ * still has to be compared from the first byte. */
+static ALWAYS_INLINE const lwan_trie_node_t *
+lookup_child(const lwan_trie_node_t *node, char c)
+{
+    const lwan_trie_node_t *child = node->by_nibble[(unsigned char)c & 15];
+
+    if (LIKELY(child != CHILD_COLLISION))
+        return child;
+
+    if (!c)
         return NULL;
+    int found = find_child(node, c);
+    return found >= 0 ? node->children[found] : NULL;
+}
+
+/* Splits the label of node->children[index] after prefix_len bytes,
+ * returning the new node holding the prefix. */
+static lwan_trie_node_t *
+split_child(lwan_trie_node_t *node, unsigned int index, size_t prefix_len)
+{
+    lwan_trie_node_t *child = node->children[index];
+    lwan_trie_node_t *mid = new_node(child->label, prefix_len);
+    size_t rest_len = child->label_len - prefix_len;
+
+    /* Labels only get shorter, so they're moved in place */
+    memmove(child->label, child->label + prefix_len, rest_len);
+    child->label[rest_len] = '\0';
+    child->label_len = (unsigned int)rest_len;
+
+    append_child(mid, child);
+    node->children[index] = mid;
+    /* The prefix starts with the same byte the label did */
+    lwan_trie_node_t **slot = &node->by_nibble[(unsigned char)mid->label[0] & 15];
+    if (*slot == child)
+        *slot = mid;
+
+    return mid;
+}
+
+/* Returns the node at the end of a static string, creating (or
+ * splitting) nodes as needed. */
+static lwan_trie_node_t *
+insert_static(lwan_trie_node_t *node, const char *str, size_t len)
+{
+    while (len) {
+        int index = find_child(node, *str);
+        lwan_trie_node_t *child;
+        size_t common = 1;
+
+        if (index < 0) {
+            child = new_node(str, len);
+            append_child(node, child);
+            return child;
+        }
+
+        child = node->children[index];
+        while (common < len && common < child->label_len &&
+               str[common] == child->label[common])
+            common++;
 
-    if (!leaf->next) /* No collisions -- no need to strncmp() */
-        return leaf;
+        if (common < child->label_len)
+            child = split_child(node, (unsigned int)index, common);
 
-    for (; leaf; leaf = leaf->next) {
-        if (!strncmp(leaf->key, key, len - 1))
-            return leaf;
+        node = child;
+        str += common;
+        len -= common;
     }
 
-    return NULL;
+    return node;
+}
+
+static ALWAYS_INLINE bool
+is_param_start(const char *key, const char *p)
+{
+    return *p == ':' && p > key && p[-1] == '/';
+}
+
+static size_t
+count_params(const char *key)
+{
+    size_t n = 0;
+
+    for (const char *p = key; *p; p++)
+        n += is_param_start(key, p);
+
+    return n;
 }
 
-#define GET_NODE() \
-    do { \
-        if (!(node = *knode)) { \
-            *knode = node = calloc(1, sizeof(*node)); \
-            if (!node) \
-                goto oom; \
-        } \
-        ++node->ref_count; \
-    } while(0)
+static void
+destroy_leaf(lwan_trie_leaf_t *leaf)
+{
+    for (unsigned short i = 0; i < leaf->n_params; i++)
+        free(leaf->param_names[i]);
+    free(leaf->param_names);
+    free(leaf->key);
+    free(leaf);
+}
+
+bool
+lwan_trie_add_route(lwan_trie_t *trie, const char *key, unsigned int methods,
+    bool exact, void *data)
+{
+    if (UNLIKELY(!trie || !key || !data))
+        return false;
+
+    size_t n_params = count_params(key);
+    if (n_params > LWAN_TRIE_MAX_PARAMS) {
+        lwan_status_error("Route %s has more than %d parameters", key,
+            LWAN_TRIE_MAX_PARAMS);
+        return false;
+    }
+
+    lwan_trie_leaf_t *leaf = calloc(1, sizeof(*leaf));
+    if (!leaf)
+        lwan_status_critical_perror("calloc");
+    leaf->key = strdup(key);
+    if (!leaf->key)
+        lwan_status_critical_perror("strdup");
+    if (n_params) {
+        leaf->param_names = calloc(n_params, sizeof(char *));
+        if (!leaf->param_names)
+            lwan_status_critical_perror("calloc");
+    }
+    leaf->data = data;
+    leaf->methods = methods;
+    leaf->exact = exact;
+
+    if (!trie->root)
+        trie->root = new_node(NULL, 0);
+
+    lwan_trie_node_t *node = trie->root;
+    const char *p = key;
+    while (*p) {
+        const char *param = p;
+
+        while (*param && !is_param_start(key, param))
+            param++;
+
+        node = insert_static(node, p, (size_t)(param - p));
+        if (!*param)
+            break;
+
+        /* Skip the colon; the name goes up to the next slash */
+        p = param + 1;
+        param = strchrnul(p, '/');
+        leaf->param_names[leaf->n_params] = strndup(p, (size_t)(param - p));
+        if (!leaf->param_names[leaf->n_params])
+            lwan_status_critical_perror("strndup");
+        leaf->n_params++;
+
+        if (!node->param)
+            node->param = new_node(NULL, 0);
+        trie->has_params = true;
+        node = node->param;
+        p = param;
+    }
+
+    for (lwan_trie_leaf_t *l = node->leaf; l; l = l->next) {
+        if (l->methods != methods || l->exact != exact)
+            continue;
+
+        /* Same route added twice: the newest one is used */
+        if (trie->free_node)
+            trie->free_node(l->data);
+        l->data = data;
+        destroy_leaf(leaf);
+        return true;
+    }
+
+    leaf->next = node->leaf;
+    node->leaf = leaf;
+    node->leaf_matches_all = !leaf->next && !methods && !exact;
+    trie->count++;
+
+    return true;
+}
 
 void
 lwan_trie_add(lwan_trie_t *trie, const char *key, void *data)
 {
-    if (UNLIKELY(!trie || !key || !data))
+    lwan_trie_add_route(trie, key, 0, false, data);
+}
+
+/* Leaves for specific methods are preferred over leaves for any method,
+ * and leaves matching the whole key over the ones matching a prefix */
+static ALWAYS_INLINE int
+leaf_rank(const lwan_trie_leaf_t *leaf)
+{
+    return (leaf->exact ? 2 : 0) + (leaf->methods ? 1 : 0);
+}
+
+static void
+match_leaves(const lwan_trie_node_t *node, size_t pos, struct lookup_state *state)
+{
+    const lwan_trie_leaf_t *candidate = NULL;
+
+    if (state->whole_key && state->key[pos] != '\0')
+        return;
+    if (pos < state->best_len && pos < state->other_len)
         return;
 
-    lwan_trie_node_t **knode, *node;
-    const char *orig_key = key;
+    for (const lwan_trie_leaf_t *leaf = node->leaf; leaf; leaf = leaf->next) {
+        if (leaf->exact && state->key[pos] != '\0')
+            continue;
+
+        if (state->method && leaf->methods && !(leaf->methods & state->method)) {
+            if (pos > state->other_len) {
+                state->other_len = pos;
+                state->other_methods = leaf->methods;
+            } else if (pos == state->other_len) {
+                state->other_methods |= leaf->methods;
+            }
+            continue;
+        }
 
-    /* Traverse the trie, allocating nodes if necessary */
-    for (knode = &trie->root; *key; knode = &node->next[(int)(*key++ & 7)])
-        GET_NODE();
+        if (!candidate || leaf_rank(leaf) > leaf_rank(candidate))
+            candidate = leaf;
+    }
 
-    /* Get the leaf node (allocate it if necessary) */
-    GET_NODE();
+    if (!candidate)
+        return;
+    /* Between routes matching the same length, the one with fewer
+     * parameters (i.e. the most static) wins */
+    if (state->best && (pos < state->best_len ||
+            (pos == state->best_len && state->n_params >= state->best->n_params)))
+        return;
 
-    lwan_trie_leaf_t *leaf = find_leaf_with_key(node, orig_key, (size_t)(key - orig_key));
-    bool had_key = leaf;
-    if (!leaf) {
-        leaf = malloc(sizeof(*leaf));
-        if (!leaf)
-            lwan_status_critical_perror("malloc");
+    state->best = candidate;
+    state->best_len = pos;
+    if (state->match) {
+        for (unsigned short i = 0; i < state->n_params; i++) {
+            state->match->params[i].offset = state->params[i][0];
+            state->match->params[i].len = state->params[i][1];
+        }
+        state->match->n_params = state->n_params;
     }
+}
 
-    leaf->data = data;
-    if (!had_key) {
-        leaf->key = strdup(orig_key);
-        leaf->next = node->leaf;
-        node->leaf = leaf;
+static ALWAYS_INLINE uint64_t
+string_as_uint64(const char *s)
+{
+    uint64_t i;
+    memcpy(&i, s, sizeof(uint64_t));
+    return i;
+}
+
+/* Selects the first n (1 to 8) bytes of a word read from a string */
+static ALWAYS_INLINE uint64_t
+first_bytes_mask(unsigned int n)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return ~UINT64_C(0) >> (64 - 8 * n);
+#else
+    return ~UINT64_C(0) << (64 - 8 * n);
+#endif
+}
+
+static ALWAYS_INLINE bool
+label_matches(const lwan_trie_node_t *node, const char *key, size_t key_len)
+{
+    const char *label = node->label;
+    unsigned int len = node->label_len;
+
+    if (len > key_len)
+        return false;
+
+    /* Comparing words rather than bytes avoids a branch that's usually
+     * mispredicted at the end of labels.  Labels are padded, but keys
+     * aren't: their last few bytes are compared one at a time. */
+    while (key_len >= sizeof(uint64_t)) {
+        uint64_t diff = string_as_uint64(key) ^ string_as_uint64(label);
+
+        if (len <= sizeof(uint64_t))
+            return !(diff & first_bytes_mask(len));
+        if (diff)
+            return false;
+
+        key += sizeof(uint64_t);
+        label += sizeof(uint64_t);
+        len -= (unsigned int)sizeof(uint64_t);
+        key_len -= sizeof(uint64_t);
+    }
+
+    for (unsigned int i = 0; i < len; i++) {
+        if (key[i] != label[i])
+            return false;
     }
-    return;
 
-oom:
-    lwan_status_critical_perror("calloc");
+    return true;
 }
 
-#undef GET_NODE
+static void match_node(const lwan_trie_node_t *node, size_t pos,
+    struct lookup_state *state);
+
+static void
+match_param(const lwan_trie_node_t *node, size_t pos, struct lookup_state *state)
+{
+    size_t end = (size_t)(strchrnul(state->key + pos, '/') - state->key);
+
+    /* Offsets are kept in 16-bit integers; parameters past that can't be
+     * matched, but request buffers are way smaller */
+    if (UNLIKELY(end > USHRT_MAX))
+        return;
+
+    state->params[state->n_params][0] = (unsigned short)pos;
+    state->params[state->n_params][1] = (unsigned short)(end - pos);
+    state->n_params++;
+    match_node(node, end, state);
+    state->n_params--;
+}
 
-static ALWAYS_INLINE lwan_trie_node_t *
-lookup_node(lwan_trie_node_t *root, const char *key, bool prefix, size_t *prefix_len)
+static void
+match_node(const lwan_trie_node_t *node, size_t pos, struct lookup_state *state)
 {
-    lwan_trie_node_t *node, *previous_node = NULL;
-    const char *orig_key = key;
+    const char *key = state->key;
 
-    for (node = root; node && *key; node = node->next[(int)(*key++ & 7)]) {
+    while (true) {
         if (node->leaf)
-            previous_node = node;
+            match_leaves(node, pos, state);
+
+        if (UNLIKELY(node->param != NULL) && key[pos] && key[pos] != '/')
+            match_param(node->param, pos, state);
+
+        /* At the end of the key, no label matches the NUL byte */
+        const lwan_trie_node_t *child = lookup_child(node, key[pos]);
+        if (!child || !label_matches(child, key + pos, state->key_len - pos))
+            return;
+
+        node = child;
+        pos += child->label_len;
     }
+}
 
-    *prefix_len = (size_t)(key - orig_key);
-    if (node && node->leaf)
-        return node;
-    if (prefix && previous_node)
-        return previous_node;
-    return NULL;
+/* Without parameters there's a single path to search, and the deepest
+ * matching leaf on it is the best */
+static ALWAYS_INLINE void
+match_static(const lwan_trie_node_t *node, struct lookup_state *state)
+{
+    const char *key = state->key;
+    size_t pos = 0;
+
+    while (true) {
+        if (node->leaf) {
+            if (LIKELY(node->leaf_matches_all && !state->whole_key)) {
+                state->best = node->leaf;
+                state->best_len = pos;
+            } else {
+                match_leaves(node, pos, state);
+            }
+        }
+
+        const lwan_trie_node_t *child = lookup_child(node, key[pos]);
+        if (!child || !label_matches(child, key + pos, state->key_len - pos))
+            return;
+
+        node = child;
+        pos += child->label_len;
+    }
+}
+
+static ALWAYS_INLINE void
+match_root(const lwan_trie_t *trie, struct lookup_state *state)
+{
+    if (trie->has_params)
+        match_node(trie->root, 0, state);
+    else
+        match_static(trie->root, state);
 }
 
+void *
+lwan_trie_lookup_route(const lwan_trie_t *trie, const char *key,
+    unsigned int method, lwan_trie_match_t *match)
+{
+    unsigned short params[LWAN_TRIE_MAX_PARAMS][2];
+    struct lookup_state state = {
+        .key = key,
+        .key_len = strlen(key),
+        .method = method,
+        .match = match,
+        .params = params
+    };
+
+    if (UNLIKELY(!trie || !trie->root))
+        goto not_found;
+
+    /* Set when a leaf is checked, which matches from static tries skip */
+    match->n_params = 0;
+    match_root(trie, &state);
+
+    /* Unless a longer route would have matched with another method */
+    if (state.best && state.best_len >= state.other_len) {
+        match->len = state.best_len;
+        match->other_methods = 0;
+        match->param_names = (const char *const *)state.best->param_names;
+        return state.best->data;
+    }
+
+not_found:
+    match->len = 0;
+    match->n_params = 0;
+    match->param_names = NULL;
+    match->other_methods = state.other_methods;
+    return NULL;
+}
 
 ALWAYS_INLINE void *
 lwan_trie_lookup_full(lwan_trie_t *trie, const char *key, bool prefix)
 {
-    if (UNLIKELY(!trie))
+    unsigned short params[LWAN_TRIE_MAX_PARAMS][2];
+    struct lookup_state state = {
+        .key = key,
+        .key_len = strlen(key),
+        .whole_key = !prefix,
+        .params = params
+    };
+
+    if (UNLIKELY(!trie || !trie->root))
         return NULL;
 
-    size_t prefix_len;
-    lwan_trie_node_t *node = lookup_node(trie->root, key, prefix, &prefix_len);
-    if (!node)
-        return NULL;
-    lwan_trie_leaf_t *leaf = find_leaf_with_key(node, key, prefix_len);
-    return leaf ? leaf->data : NULL;
+    match_root(trie, &state);
+    return state.best ? state.best->data : NULL;
 }
 
 ALWAYS_INLINE void *
@@ -148,16 +615,37 @@ lwan_trie_lookup_exact(lwan_trie_t *trie, const char *key)
 ALWAYS_INLINE int32_t
 lwan_trie_entry_count(lwan_trie_t *trie)
 {
-    return (trie && trie->root) ? trie->root->ref_count : 0;
+    return trie ? trie->count : 0;
 }
 
 static void
-lwan_trie_node_destroy(lwan_trie_t *trie, lwan_trie_node_t *node)
+lwan_trie_node_foreach(const lwan_trie_node_t *node,
+    void (*callback)(void *data, void *context), void *context)
 {
     if (!node)
         return;
 
-    int32_t nodes_destroyed = node->ref_count;
+    for (const lwan_trie_leaf_t *leaf = node->leaf; leaf; leaf = leaf->next)
+        callback(leaf->data, context);
+
+    for (unsigned int i = 0; i < node->n_children; i++)
+        lwan_trie_node_foreach(node->children[i], callback, context);
+    lwan_trie_node_foreach(node->param, callback, context);
+}
+
+void
+lwan_trie_foreach(const lwan_trie_t *trie,
+    void (*callback)(void *data, void *context), void *context)
+{
+    if (trie)
+        lwan_trie_node_foreach(trie->root, callback, context);
+}
+
+static void
+lwan_trie_node_destroy(lwan_trie_t *trie, lwan_trie_node_t *node)
+{
+    if (!node)
+        return;
 
     for (lwan_trie_leaf_t *leaf = node->leaf; leaf;) {
         lwan_trie_leaf_t *tmp = leaf->next;
@@ -165,18 +653,16 @@ lwan_trie_node_destroy(lwan_trie_t *trie, lwan_trie_node_t *node)
         if (trie->free_node)
             trie->free_node(leaf->data);
 
-        free(leaf->key);
-        free(leaf);
+        destroy_leaf(leaf);
         leaf = tmp;
     }
 
-    for (int32_t i = 0; nodes_destroyed > 0 && i < 8; i++) {
-        if (node->next[i]) {
-            lwan_trie_node_destroy(trie, node->next[i]);
-            --nodes_destroyed;
-        }
-    }
+    for (unsigned int i = 0; i < node->n_children; i++)
+        lwan_trie_node_destroy(trie, node->children[i]);
+    lwan_trie_node_destroy(trie, node->param);
 
+    free(node->more_first_bytes);
+    free(node->children);
     free(node);
 }
 
@@ -186,4 +672,7 @@ lwan_trie_destroy(lwan_trie_t *trie)
     if (!trie || !trie->root)
         return;
     lwan_trie_node_destroy(trie, trie->root);
+    trie->root = NULL;
+    trie->count = 0;
+    trie->has_params = false;
 }
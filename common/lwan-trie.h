@@ -20,34 +20,92 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+/* Routes can have up to this many ":name" segments */
+#define LWAN_TRIE_MAX_PARAMS 8
+
 typedef struct lwan_trie_t_		lwan_trie_t;
 typedef struct lwan_trie_node_t_	lwan_trie_node_t;
 typedef struct lwan_trie_leaf_t_	lwan_trie_leaf_t;
+typedef struct lwan_trie_match_t_	lwan_trie_match_t;
 
+/* Compressed radix tree: each node is reached through a label with one
+ * or more bytes, and children are picked by the first byte of their
+ * labels.  A key segment starting with a colon (e.g. "/users/:id") is a
+ * parameter, matching everything up to the next slash. */
 struct lwan_trie_node_t_ {
-    lwan_trie_node_t *next[8];
+    /* Children indexed by the lower 4 bits of the first byte of their
+     * labels; if more than one label maps to the same entry, it's a
+     * marker to search them by their first bytes */
+    lwan_trie_node_t *by_nibble[16];
+    /* First bytes of the labels of the first children, and of the
+     * others (in groups of the same size), padded with zeros */
+    unsigned char first_bytes[16];
+    unsigned char *more_first_bytes;
+    lwan_trie_node_t **children;
+    unsigned int n_children;
+
+    unsigned int label_len;
+
+    /* Reached after a parameter following this node's label */
+    lwan_trie_node_t *param;
+
     lwan_trie_leaf_t *leaf;
-    int ref_count;
+    /* Set if the only leaf is for any method and any key this node's
+     * path prefixes, so lookups can take it without checking */
+    bool leaf_matches_all;
+
+    char label[];
 };
 
 struct lwan_trie_leaf_t_ {
     char *key;
     void *data;
+    /* REQUEST_METHOD_* bits this leaf is used for; 0 for any method */
+    unsigned int methods;
+    /* Only matches the whole key, rather than any string it prefixes */
+    bool exact;
+    unsigned short n_params;
+    char **param_names;
     lwan_trie_leaf_t *next;
 };
 
 struct lwan_trie_t_ {
     lwan_trie_node_t *root;
     void (*free_node)(void *data);
+    int32_t count;
+    /* Lookups only backtrack in tries with parameters */
+    bool has_params;
+};
+
+/* Filled by lwan_trie_lookup_route(); parameters are offsets into the
+ * key that was looked up, so nothing is copied. */
+struct lwan_trie_match_t_ {
+    /* Length of the key that matched */
+    size_t len;
+    /* Union of the methods of the routes that matched but were for
+     * other methods */
+    unsigned int other_methods;
+    const char *const *param_names;
+    unsigned short n_params;
+    struct {
+        unsigned short offset;
+        unsigned short len;
+    } params[LWAN_TRIE_MAX_PARAMS];
 };
 
 bool		 lwan_trie_init(lwan_trie_t *trie, void (*free_node)(void *data));
 void		 lwan_trie_destroy(lwan_trie_t *trie);
 void		 lwan_trie_add(lwan_trie_t *trie, const char *key, void *data);
+bool		 lwan_trie_add_route(lwan_trie_t *trie, const char *key,
+			unsigned int methods, bool exact, void *data);
+void		*lwan_trie_lookup_route(const lwan_trie_t *trie, const char *key,
+			unsigned int method, lwan_trie_match_t *match);
 void 		*lwan_trie_lookup_full(lwan_trie_t *trie, const char *key, bool prefix);
 void 		*lwan_trie_lookup_prefix(lwan_trie_t *trie, const char *key);
 void		*lwan_trie_lookup_exact(lwan_trie_t *trie, const char *key);
 int32_t		 lwan_trie_entry_count(lwan_trie_t *trie);
-
+void		 lwan_trie_foreach(const lwan_trie_t *trie,
+			void (*callback)(void *data, void *context), void *context);
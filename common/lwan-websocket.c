@@ -0,0 +1,840 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2016 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "base64.h"
+#include "lwan-private.h"
+#include "lwan-io-wrappers.h"
+#include "lwan-stats.h"
+#include "sha1.h"
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+/* Messages smaller than this are sent uncompressed */
+#define WS_DEFLATE_MIN_SIZE 64
+/* Reads larger than this bypass the input buffer */
+#define WS_DIRECT_READ_SIZE 1024
+
+enum {
+    WS_FIN = 0x80,
+    WS_RSV1 = 0x40,
+    WS_RSV_MASK = 0x70,
+    WS_OPCODE_MASK = 0x0f,
+    WS_CONTROL_FRAME = 0x08,
+    WS_MASKED = 0x80,
+    WS_LENGTH_MASK = 0x7f
+};
+
+enum {
+    WS_CLOSE_NORMAL = 1000,
+    WS_CLOSE_GOING_AWAY = 1001,
+    WS_CLOSE_PROTOCOL_ERROR = 1002,
+    WS_CLOSE_INVALID_DATA = 1007,
+    WS_CLOSE_TOO_BIG = 1009,
+    WS_CLOSE_INTERNAL_ERROR = 1011
+};
+
+struct ws_frame {
+    uint64_t len;
+    unsigned char mask[4];
+    unsigned char opcode;
+    bool fin;
+    bool rsv1;
+};
+
+struct lwan_websocket_t_ {
+    struct {
+        char buffer[DEFAULT_BUFFER_SIZE];
+        size_t pos, len;
+    } in;
+
+    struct {
+        z_stream inflate, deflate;
+        /* Compressed payloads, in either direction; reused across messages */
+        strbuf_t *buffer;
+        int server_window_bits;
+        bool enabled;
+        bool server_no_context_takeover;
+        bool inflate_ready, deflate_ready;
+    } deflate;
+
+    bool ping_sent;
+    bool close_sent;
+};
+
+static void
+unmask_scalar(char *data, size_t len, uint32_t mask)
+{
+    const uint64_t mask64 = (uint64_t)mask << 32 | mask;
+    const unsigned char *mask_bytes = (const unsigned char *)&mask;
+
+    for (; len >= sizeof(mask64); len -= sizeof(mask64), data += sizeof(mask64)) {
+        uint64_t v;
+
+        memcpy(&v, data, sizeof(v));
+        v ^= mask64;
+        memcpy(data, &v, sizeof(v));
+    }
+
+    for (size_t i = 0; i < len; i++)
+        data[i] = (char)(data[i] ^ mask_bytes[i & 3]);
+}
+
+#if defined(__SSE2__)
+static void
+unmask_sse2(char *data, size_t len, uint32_t mask)
+{
+    const __m128i mask128 = _mm_set1_epi32((int)mask);
+
+    for (; len >= 16; len -= 16, data += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)data);
+        _mm_storeu_si128((__m128i *)data, _mm_xor_si128(v, mask128));
+    }
+
+    unmask_scalar(data, len, mask);
+}
+#endif
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) static void
+unmask_avx2(char *data, size_t len, uint32_t mask)
+{
+    const __m256i mask256 = _mm256_set1_epi32((int)mask);
+
+    for (; len >= 32; len -= 32, data += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)data);
+        _mm256_storeu_si256((__m256i *)data, _mm256_xor_si256(v, mask256));
+    }
+
+    unmask_sse2(data, len, mask);
+}
+#endif
+
+static void
+unmask(char *data, size_t len, const unsigned char mask_bytes[static 4])
+{
+    uint32_t mask;
+
+    /* Every block starts at a multiple of 4 bytes from the start of the
+     * payload, so the same (unrotated) mask applies to all of them. */
+    memcpy(&mask, mask_bytes, sizeof(mask));
+
+#if defined(__x86_64__)
+    if (len >= 64 && __builtin_cpu_supports("avx2")) {
+        unmask_avx2(data, len, mask);
+        return;
+    }
+#endif
+#if defined(__SSE2__)
+    unmask_sse2(data, len, mask);
+#else
+    unmask_scalar(data, len, mask);
+#endif
+}
+
+static void
+websocket_destroy(void *data)
+{
+    lwan_websocket_t *ws = data;
+
+    if (ws->deflate.inflate_ready)
+        inflateEnd(&ws->deflate.inflate);
+    if (ws->deflate.deflate_ready)
+        deflateEnd(&ws->deflate.deflate);
+    strbuf_free(ws->deflate.buffer);
+}
+
+static void
+send_frame(lwan_request_t *request, unsigned char first_byte,
+    const char *payload, size_t len)
+{
+    unsigned char header[10];
+    size_t header_len;
+
+    header[0] = first_byte;
+    if (len < 126) {
+        header[1] = (unsigned char)len;
+        header_len = 2;
+    } else if (len <= 0xffff) {
+        uint16_t len16 = htobe16((uint16_t)len);
+
+        header[1] = 126;
+        memcpy(header + 2, &len16, sizeof(len16));
+        header_len = 4;
+    } else {
+        uint64_t len64 = htobe64((uint64_t)len);
+
+        header[1] = 127;
+        memcpy(header + 2, &len64, sizeof(len64));
+        header_len = 10;
+    }
+
+    struct iovec vec[] = {
+        { .iov_base = header, .iov_len = header_len },
+        { .iov_base = (char *)payload, .iov_len = len }
+    };
+    lwan_writev(request, vec, N_ELEMENTS(vec));
+}
+
+static void
+send_close(lwan_request_t *request, uint16_t code)
+{
+    uint16_t code_be = htobe16(code);
+
+    if (request->websocket->close_sent)
+        return;
+
+    request->websocket->close_sent = true;
+    send_frame(request, WS_FIN | WS_OPCODE_CLOSE, (char *)&code_be, sizeof(code_be));
+}
+
+static ALWAYS_INLINE void
+abort_connection(lwan_request_t *request)
+{
+    coro_yield(request->conn->coro, CONN_CORO_ABORT);
+    __builtin_unreachable();
+}
+
+static size_t
+read_some(lwan_request_t *request, char *buffer, size_t len)
+{
+    lwan_connection_t *conn = request->conn;
+    lwan_websocket_t *ws = request->websocket;
+
+    while (true) {
+        ssize_t r = lwan_read_socket(request, buffer, len);
+
+        if (LIKELY(r > 0)) {
+            ws->ping_sent = false;
+            return (size_t)r;
+        }
+
+        /* Client has shutdown orderly, nothing else to do; kill coro */
+        if (UNLIKELY(!r))
+            abort_connection(request);
+
+        switch (errno) {
+        case EINTR:
+            continue;
+        case EAGAIN:
+            break;
+        default:
+            abort_connection(request);
+        }
+
+        /*
+         * Ask to be woken up when the keep-alive timeout expires, so that
+         * idle connections are pinged instead of closed.  If the previous
+         * ping hasn't been answered by the next timeout, the peer is gone.
+         */
+        LWAN_STATS_INC(conn->thread->stats, eagain_yields);
+        lwan_response_flush(request);
+        conn->flags |= CONN_MUST_READ | CONN_WAKE_ON_TIMEOUT;
+        coro_yield(conn->coro, CONN_CORO_MAY_RESUME);
+        conn->flags &= ~CONN_MUST_READ;
+
+        if (conn->flags & CONN_WAKE_ON_TIMEOUT) {
+            conn->flags &= ~CONN_WAKE_ON_TIMEOUT;
+            continue;
+        }
+
+        if (ws->ping_sent)
+            abort_connection(request);
+
+        send_frame(request, WS_FIN | WS_OPCODE_PING, NULL, 0);
+        ws->ping_sent = true;
+    }
+}
+
+static void
+read_exact(lwan_request_t *request, char *dst, size_t len)
+{
+    lwan_websocket_t *ws = request->websocket;
+
+    while (len) {
+        size_t available = ws->in.len - ws->in.pos;
+
+        if (available) {
+            size_t to_copy = available < len ? available : len;
+
+            memcpy(dst, ws->in.buffer + ws->in.pos, to_copy);
+            ws->in.pos += to_copy;
+            dst += to_copy;
+            len -= to_copy;
+            continue;
+        }
+
+        if (len >= WS_DIRECT_READ_SIZE) {
+            size_t r = read_some(request, dst, len);
+            dst += r;
+            len -= r;
+        } else {
+            ws->in.pos = 0;
+            ws->in.len = read_some(request, ws->in.buffer, sizeof(ws->in.buffer));
+        }
+    }
+}
+
+static bool
+read_frame_header(lwan_request_t *request, struct ws_frame *frame)
+{
+    unsigned char header[2];
+
+    read_exact(request, (char *)header, sizeof(header));
+
+    /* RSV2 and RSV3 have no meaning without an extension that uses them */
+    if (UNLIKELY(header[0] & (WS_RSV_MASK & ~WS_RSV1)))
+        return false;
+    /* Frames sent by clients must always be masked */
+    if (UNLIKELY(!(header[1] & WS_MASKED)))
+        return false;
+
+    frame->fin = header[0] & WS_FIN;
+    frame->rsv1 = header[0] & WS_RSV1;
+    frame->opcode = header[0] & WS_OPCODE_MASK;
+    frame->len = header[1] & WS_LENGTH_MASK;
+
+    if (frame->len == 126) {
+        uint16_t len16;
+
+        read_exact(request, (char *)&len16, sizeof(len16));
+        frame->len = be16toh(len16);
+    } else if (frame->len == 127) {
+        uint64_t len64;
+
+        read_exact(request, (char *)&len64, sizeof(len64));
+        frame->len = be64toh(len64);
+        /* The most significant bit must be 0 */
+        if (UNLIKELY(frame->len > INT64_MAX))
+            return false;
+    }
+
+    read_exact(request, (char *)frame->mask, sizeof(frame->mask));
+
+    return true;
+}
+
+static bool
+read_payload(lwan_request_t *request, const struct ws_frame *frame,
+    strbuf_t *buffer)
+{
+    size_t len = strbuf_get_length(buffer);
+    size_t payload_len = (size_t)frame->len;
+
+    if (UNLIKELY(!strbuf_grow_to(buffer, len + payload_len)))
+        return false;
+
+    char *payload = strbuf_get_buffer(buffer) + len;
+    read_exact(request, payload, payload_len);
+    unmask(payload, payload_len, frame->mask);
+
+    buffer->len.buffer = len + payload_len;
+    payload[payload_len] = '\0';
+
+    return true;
+}
+
+static uint16_t
+handle_control_frame(lwan_request_t *request, const struct ws_frame *frame)
+{
+    char payload[125];
+
+    if (UNLIKELY(!frame->fin || frame->rsv1 || frame->len > sizeof(payload)))
+        return WS_CLOSE_PROTOCOL_ERROR;
+
+    read_exact(request, payload, (size_t)frame->len);
+    unmask(payload, (size_t)frame->len, frame->mask);
+
+    switch (frame->opcode) {
+    case WS_OPCODE_PING:
+        send_frame(request, WS_FIN | WS_OPCODE_PONG, payload, (size_t)frame->len);
+        return 0;
+    case WS_OPCODE_PONG:
+        request->websocket->ping_sent = false;
+        return 0;
+    case WS_OPCODE_CLOSE:
+        if (frame->len >= sizeof(uint16_t)) {
+            uint16_t code;
+
+            memcpy(&code, payload, sizeof(code));
+            code = be16toh(code);
+            return code ? code : WS_CLOSE_PROTOCOL_ERROR;
+        }
+        return WS_CLOSE_NORMAL;
+    default:
+        return WS_CLOSE_PROTOCOL_ERROR;
+    }
+}
+
+static uint16_t
+inflate_message(lwan_websocket_t *ws, strbuf_t *output)
+{
+    static const char trailer[] = { 0x00, 0x00, (char)0xff, (char)0xff };
+    z_stream *zs = &ws->deflate.inflate;
+
+    if (UNLIKELY(!ws->deflate.inflate_ready)) {
+        if (inflateInit2(zs, -MAX_WBITS) != Z_OK)
+            return WS_CLOSE_INTERNAL_ERROR;
+        ws->deflate.inflate_ready = true;
+    }
+
+    /* Senders strip the end of the final, empty, deflate block */
+    if (UNLIKELY(!strbuf_append_str(ws->deflate.buffer, trailer, sizeof(trailer))))
+        return WS_CLOSE_INTERNAL_ERROR;
+
+    zs->next_in = (unsigned char *)strbuf_get_buffer(ws->deflate.buffer);
+    zs->avail_in = (unsigned int)strbuf_get_length(ws->deflate.buffer);
+
+    do {
+        size_t len = strbuf_get_length(output);
+        size_t room = zs->avail_in * 2 + 256;
+
+        if (UNLIKELY(len + room > WS_MAX_MESSAGE_SIZE))
+            room = WS_MAX_MESSAGE_SIZE - len;
+        if (UNLIKELY(!room))
+            return WS_CLOSE_TOO_BIG;
+        if (UNLIKELY(!strbuf_grow_to(output, len + room)))
+            return WS_CLOSE_INTERNAL_ERROR;
+
+        zs->next_out = (unsigned char *)strbuf_get_buffer(output) + len;
+        zs->avail_out = (unsigned int)room;
+
+        int ret = inflate(zs, Z_SYNC_FLUSH);
+        if (UNLIKELY(ret != Z_OK && ret != Z_BUF_ERROR && ret != Z_STREAM_END))
+            return WS_CLOSE_INVALID_DATA;
+
+        output->len.buffer = len + room - zs->avail_out;
+
+        if (UNLIKELY(ret == Z_STREAM_END)) {
+            /* Messages may also end with a BFINAL block (RFC 7692
+             * 7.2.3.3): the trailer appended above is then ignored, and
+             * the next message starts a new DEFLATE stream. */
+            inflateReset(zs);
+            break;
+        }
+    } while (zs->avail_in || !zs->avail_out);
+
+    strbuf_get_buffer(output)[strbuf_get_length(output)] = '\0';
+    strbuf_reset_length(ws->deflate.buffer);
+
+    return 0;
+}
+
+static bool
+is_valid_utf8(const unsigned char *s, size_t len)
+{
+    const unsigned char *end = s + len;
+
+    while (s < end) {
+        /* Skip over ASCII a word at a time */
+        while (end - s >= 8) {
+            uint64_t v;
+
+            memcpy(&v, s, sizeof(v));
+            if (v & 0x8080808080808080ull)
+                break;
+            s += 8;
+        }
+        if (s == end)
+            break;
+
+        if (*s < 0x80) {
+            s++;
+            continue;
+        }
+
+        /* Overlong forms, surrogates and anything above U+10FFFF are
+         * rejected by narrowing the range of the second byte */
+        unsigned char lo = 0x80, hi = 0xbf;
+        size_t n;
+
+        if (*s >= 0xc2 && *s <= 0xdf) {
+            n = 1;
+        } else if (*s >= 0xe0 && *s <= 0xef) {
+            n = 2;
+            if (*s == 0xe0)
+                lo = 0xa0;
+            else if (*s == 0xed)
+                hi = 0x9f;
+        } else if (*s >= 0xf0 && *s <= 0xf4) {
+            n = 3;
+            if (*s == 0xf0)
+                lo = 0x90;
+            else if (*s == 0xf4)
+                hi = 0x8f;
+        } else {
+            return false;
+        }
+
+        if ((size_t)(end - s) <= n)
+            return false;
+        if (s[1] < lo || s[1] > hi)
+            return false;
+        for (size_t i = 2; i <= n; i++) {
+            if ((s[i] & 0xc0) != 0x80)
+                return false;
+        }
+
+        s += n + 1;
+    }
+
+    return true;
+}
+
+static bool
+deflate_message(lwan_websocket_t *ws, strbuf_t *input)
+{
+    z_stream *zs = &ws->deflate.deflate;
+
+    if (UNLIKELY(!ws->deflate.deflate_ready)) {
+        if (deflateInit2(zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                    -ws->deflate.server_window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+        ws->deflate.deflate_ready = true;
+    }
+
+    if (UNLIKELY(!strbuf_reset_length(ws->deflate.buffer)))
+        return false;
+
+    zs->next_in = (unsigned char *)strbuf_get_buffer(input);
+    zs->avail_in = (unsigned int)strbuf_get_length(input);
+
+    do {
+        size_t len = strbuf_get_length(ws->deflate.buffer);
+        size_t room = zs->avail_in + 64;
+
+        if (UNLIKELY(!strbuf_grow_to(ws->deflate.buffer, len + room)))
+            return false;
+
+        zs->next_out = (unsigned char *)strbuf_get_buffer(ws->deflate.buffer) + len;
+        zs->avail_out = (unsigned int)room;
+
+        if (UNLIKELY(deflate(zs, Z_SYNC_FLUSH) == Z_STREAM_ERROR))
+            return false;
+
+        ws->deflate.buffer->len.buffer = len + room - zs->avail_out;
+    } while (!zs->avail_out);
+
+    /* Remove the 0x00 0x00 0xff 0xff trailer added by Z_SYNC_FLUSH */
+    ws->deflate.buffer->len.buffer -= 4;
+
+    if (ws->deflate.server_no_context_takeover)
+        deflateReset(zs);
+
+    return true;
+}
+
+lwan_ws_opcode_t
+lwan_ws_read(lwan_request_t *request)
+{
+    lwan_websocket_t *ws = request->websocket;
+    strbuf_t *buffer = request->response.buffer;
+    lwan_ws_opcode_t opcode = WS_OPCODE_CONTINUATION;
+    bool compressed = false;
+    struct ws_frame frame;
+    uint16_t close_code;
+
+    if (UNLIKELY(!ws || ws->close_sent))
+        return WS_OPCODE_CLOSE;
+
+    if (UNLIKELY(!strbuf_reset_length(buffer)))
+        abort_connection(request);
+
+    while (true) {
+        if (UNLIKELY(!read_frame_header(request, &frame))) {
+            close_code = WS_CLOSE_PROTOCOL_ERROR;
+            goto close;
+        }
+
+        if (frame.opcode & WS_CONTROL_FRAME) {
+            /* Control frames may be interleaved with fragments */
+            close_code = handle_control_frame(request, &frame);
+            if (close_code)
+                goto close;
+            continue;
+        }
+
+        if (frame.opcode == WS_OPCODE_CONTINUATION) {
+            if (UNLIKELY(opcode == WS_OPCODE_CONTINUATION || frame.rsv1)) {
+                close_code = WS_CLOSE_PROTOCOL_ERROR;
+                goto close;
+            }
+        } else if (frame.opcode == WS_OPCODE_TEXT || frame.opcode == WS_OPCODE_BINARY) {
+            if (UNLIKELY(opcode != WS_OPCODE_CONTINUATION)) {
+                close_code = WS_CLOSE_PROTOCOL_ERROR;
+                goto close;
+            }
+            if (UNLIKELY(frame.rsv1 && !ws->deflate.enabled)) {
+                close_code = WS_CLOSE_PROTOCOL_ERROR;
+                goto close;
+            }
+
+            opcode = frame.opcode;
+            compressed = frame.rsv1;
+        } else {
+            close_code = WS_CLOSE_PROTOCOL_ERROR;
+            goto close;
+        }
+
+        strbuf_t *target = compressed ? ws->deflate.buffer : buffer;
+        if (UNLIKELY(frame.len > WS_MAX_MESSAGE_SIZE - strbuf_get_length(target))) {
+            close_code = WS_CLOSE_TOO_BIG;
+            goto close;
+        }
+        if (UNLIKELY(!read_payload(request, &frame, target))) {
+            close_code = WS_CLOSE_INTERNAL_ERROR;
+            goto close;
+        }
+
+        if (frame.fin)
+            break;
+    }
+
+    if (compressed) {
+        close_code = inflate_message(ws, buffer);
+        if (UNLIKELY(close_code))
+            goto close;
+    }
+
+    if (opcode == WS_OPCODE_TEXT &&
+            UNLIKELY(!is_valid_utf8((const unsigned char *)strbuf_get_buffer(buffer),
+                strbuf_get_length(buffer)))) {
+        close_code = WS_CLOSE_INVALID_DATA;
+        goto close;
+    }
+
+    return opcode;
+
+close:
+    send_close(request, close_code);
+    return WS_OPCODE_CLOSE;
+}
+
+void
+lwan_ws_write(lwan_request_t *request, lwan_ws_opcode_t opcode)
+{
+    lwan_websocket_t *ws = request->websocket;
+    strbuf_t *buffer = request->response.buffer;
+    size_t len = strbuf_get_length(buffer);
+
+    if (UNLIKELY(!ws || ws->close_sent))
+        return;
+
+    if (opcode == WS_OPCODE_CLOSE)
+        ws->close_sent = true;
+
+    if (ws->deflate.enabled && !(opcode & WS_CONTROL_FRAME) &&
+                len >= WS_DEFLATE_MIN_SIZE && deflate_message(ws, buffer)) {
+        send_frame(request, (unsigned char)(WS_FIN | WS_RSV1 | opcode),
+                    strbuf_get_buffer(ws->deflate.buffer),
+                    strbuf_get_length(ws->deflate.buffer));
+        strbuf_reset_length(ws->deflate.buffer);
+    } else {
+        send_frame(request, (unsigned char)(WS_FIN | opcode),
+                    strbuf_get_buffer(buffer), len);
+    }
+
+    if (UNLIKELY(!strbuf_reset_length(buffer)))
+        abort_connection(request);
+}
+
+void
+lwan_websocket_finish(lwan_request_t *request)
+{
+    send_close(request, WS_CLOSE_GOING_AWAY);
+    abort_connection(request);
+    __builtin_unreachable();
+}
+
+static bool
+parse_deflate_offer(lwan_websocket_t *ws, char *offer)
+{
+    char *saveptr;
+    char *param = strtok_r(offer, ";", &saveptr);
+
+    param += strspn(param, " \t");
+    if (strncasecmp(param, "permessage-deflate", sizeof("permessage-deflate") - 1))
+        return false;
+
+    ws->deflate.server_window_bits = MAX_WBITS;
+    ws->deflate.server_no_context_takeover = false;
+
+    while ((param = strtok_r(NULL, ";", &saveptr))) {
+        param += strspn(param, " \t");
+
+        if (!strncasecmp(param, "server_no_context_takeover", sizeof("server_no_context_takeover") - 1)) {
+            ws->deflate.server_no_context_takeover = true;
+        } else if (!strncasecmp(param, "server_max_window_bits", sizeof("server_max_window_bits") - 1)) {
+            char *value = strchr(param, '=');
+            if (!value)
+                return false;
+
+            long bits = parse_long(value + 1 + strspn(value + 1, " \t\""), -1);
+            /* zlib can't produce raw deflate streams with a 256-byte window */
+            if (bits < 9 || bits > MAX_WBITS)
+                return false;
+            ws->deflate.server_window_bits = (int)bits;
+        } else if (!strncasecmp(param, "client_no_context_takeover", sizeof("client_no_context_takeover") - 1)) {
+            /* Doesn't affect the inflate side */
+        } else if (!strncasecmp(param, "client_max_window_bits", sizeof("client_max_window_bits") - 1)) {
+            /* Inflating with the largest window handles all sizes */
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static const char *
+negotiate_deflate(lwan_request_t *request, lwan_websocket_t *ws)
+{
+    lwan_value_t *extensions = &request->header.websocket.extensions;
+    char *saveptr;
+
+    if (!extensions->len)
+        return NULL;
+
+    /* Offers are listed in order of preference; pick the first usable one */
+    char *copy = coro_strdup(request->conn->coro, extensions->value);
+    if (UNLIKELY(!copy))
+        return NULL;
+
+    for (char *offer = strtok_r(copy, ",", &saveptr); offer;
+                offer = strtok_r(NULL, ",", &saveptr)) {
+        if (!parse_deflate_offer(ws, offer))
+            continue;
+
+        ws->deflate.enabled = true;
+
+        if (ws->deflate.server_window_bits != MAX_WBITS) {
+            return coro_printf(request->conn->coro,
+                        "permessage-deflate; server_max_window_bits=%d%s",
+                        ws->deflate.server_window_bits,
+                        ws->deflate.server_no_context_takeover ?
+                            "; server_no_context_takeover" : "");
+        }
+        if (ws->deflate.server_no_context_takeover)
+            return "permessage-deflate; server_no_context_takeover";
+        return "permessage-deflate";
+    }
+
+    return NULL;
+}
+
+static char *
+compute_accept_key(lwan_request_t *request)
+{
+    lwan_value_t *key = &request->header.websocket.key;
+    unsigned char digest[SHA1_DIGEST_SIZE];
+    char key_and_guid[128];
+    size_t encoded_len;
+
+    if (UNLIKELY(key->len + sizeof(WS_GUID) > sizeof(key_and_guid)))
+        return NULL;
+
+    memcpy(mempcpy(key_and_guid, key->value, key->len), WS_GUID, sizeof(WS_GUID));
+    sha1(key_and_guid, key->len + sizeof(WS_GUID) - 1, digest);
+
+    unsigned char *encoded = base64_encode(digest, sizeof(digest), &encoded_len);
+    if (UNLIKELY(!encoded))
+        return NULL;
+
+    /* base64_encode() terminates lines with a newline */
+    char *accept = coro_malloc(request->conn->coro, encoded_len + 1);
+    if (LIKELY(accept)) {
+        while (encoded_len && encoded[encoded_len - 1] == '\n')
+            encoded_len--;
+        memcpy(accept, encoded, encoded_len);
+        accept[encoded_len] = '\0';
+    }
+    free(encoded);
+
+    return accept;
+}
+
+lwan_http_status_t
+lwan_request_websocket_upgrade(lwan_request_t *request)
+{
+    char headers[DEFAULT_HEADERS_SIZE];
+    lwan_key_value_t *response_headers;
+    lwan_websocket_t *ws;
+    size_t headers_len;
+
+    if (UNLIKELY(!(request->flags & REQUEST_UPGRADE_WEBSOCKET)))
+        return HTTP_BAD_REQUEST;
+    if (UNLIKELY(request->flags & RESPONSE_SENT_HEADERS))
+        return HTTP_INTERNAL_ERROR;
+
+    ws = coro_malloc_full(request->conn->coro, sizeof(*ws), false, websocket_destroy);
+    if (UNLIKELY(!ws))
+        return HTTP_INTERNAL_ERROR;
+
+    memset(ws, 0, sizeof(*ws));
+    ws->deflate.buffer = strbuf_new();
+    if (UNLIKELY(!ws->deflate.buffer))
+        return HTTP_INTERNAL_ERROR;
+
+    response_headers = coro_malloc(request->conn->coro, 4 * sizeof(*response_headers));
+    if (UNLIKELY(!response_headers))
+        return HTTP_INTERNAL_ERROR;
+
+    response_headers[0].key = "Upgrade";
+    response_headers[0].value = "websocket";
+    response_headers[1].key = "Sec-WebSocket-Accept";
+    response_headers[1].value = compute_accept_key(request);
+    if (UNLIKELY(!response_headers[1].value))
+        return HTTP_INTERNAL_ERROR;
+    response_headers[2].key = "Sec-WebSocket-Extensions";
+    response_headers[2].value = (char *)negotiate_deflate(request, ws);
+    if (!response_headers[2].value)
+        response_headers[2].key = NULL;
+    response_headers[3].key = NULL;
+    response_headers[3].value = NULL;
+
+    request->response.headers = response_headers;
+    request->flags |= RESPONSE_NO_CONTENT_LENGTH;
+
+    headers_len = lwan_prepare_response_header(request, HTTP_SWITCHING_PROTOCOLS,
+                headers, sizeof(headers));
+    if (UNLIKELY(!headers_len))
+        return HTTP_INTERNAL_ERROR;
+
+    request->flags |= RESPONSE_SENT_HEADERS | RESPONSE_WEBSOCKET;
+    request->websocket = ws;
+
+    lwan_write(request, headers, headers_len);
+
+    return HTTP_SWITCHING_PROTOCOLS;
+}
@@ -22,12 +22,20 @@
 #include <ctype.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <poll.h>
+#include <semaphore.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "lwan.h"
@@ -37,7 +45,9 @@
 #include "lwan-http-authorize.h"
 #include "lwan-redirect.h"
 #include "lwan-rewrite.h"
+#include "lwan-stats.h"
 #include "lwan-serve-files.h"
+#include "sd-daemon.h"
 
 #if defined(HAVE_LUA)
 #include "lwan-lua.h"
@@ -46,11 +56,18 @@
 static const lwan_config_t default_config = {
     .listener = "localhost:8080",
     .keep_alive_timeout = 15,
+    .write_stall_timeout = 30,
+    .drain_timeout = 30,
+    .stream_flush_watermark = 16384,
     .quiet = false,
     .reuse_port = false,
     .proxy_protocol = false,
+    .http2 = true,
     .expires = 1 * ONE_WEEK,
-    .n_threads = 0
+    .n_threads = 0,
+    .tls = {
+        .ticket_key_rotation = 1 * ONE_HOUR
+    }
 };
 
 static void lwan_module_init(lwan_t *l)
@@ -118,13 +135,27 @@ static const lwan_module_t *lwan_module_find(lwan_t *l, const char *name)
     return module;
 }
 
+struct routes_builder {
+    lwan_routes_t *routes;
+    /* Maps from the routes being replaced, by section text, whose
+     * module instances can be reused; NULL unless reloading */
+    struct hash *previous;
+};
+
+/* Module instances shared by maps in different routes are shut down
+ * with the last of them */
+static bool owns_module_instance(const lwan_url_map_t *url_map)
+{
+    return !url_map->reused_from && !url_map->handed_over;
+}
+
 static void destroy_urlmap(void *data)
 {
     lwan_url_map_t *url_map = data;
 
     if (url_map->module) {
         const lwan_module_t *module = url_map->module;
-        if (module->shutdown)
+        if (module->shutdown && owns_module_instance(url_map))
             module->shutdown(url_map->data);
     } else if (url_map->data) {
         hash_free(url_map->data);
@@ -132,11 +163,48 @@ static void destroy_urlmap(void *data)
 
     free(url_map->authorization.realm);
     free(url_map->authorization.password_file);
+    free(url_map->section_text);
     free((char *)url_map->prefix);
     free(url_map);
 }
 
-static lwan_url_map_t *add_url_map(lwan_trie_t *t, const char *prefix, const lwan_url_map_t *map)
+static lwan_routes_t *routes_new(unsigned int generation)
+{
+    lwan_routes_t *routes = malloc(sizeof(*routes));
+
+    if (!routes)
+        return NULL;
+
+    for (size_t i = 0; i < N_ELEMENTS(routes->trie); i++) {
+        if (!lwan_trie_init(&routes->trie[i], destroy_urlmap)) {
+            free(routes);
+            return NULL;
+        }
+    }
+
+    routes->generation = generation;
+    return routes;
+}
+
+static void routes_destroy(lwan_routes_t *routes)
+{
+    if (!routes)
+        return;
+
+    for (size_t i = 0; i < N_ELEMENTS(routes->trie); i++)
+        lwan_trie_destroy(&routes->trie[i]);
+    free(routes);
+}
+
+static void routes_foreach(const lwan_routes_t *routes,
+    void (*callback)(void *data, void *context), void *context)
+{
+    for (size_t i = 0; i < N_ELEMENTS(routes->trie); i++)
+        lwan_trie_foreach(&routes->trie[i], callback, context);
+}
+
+static lwan_url_map_t *add_url_map(lwan_t *l, lwan_trie_t *trie,
+    const char *prefix, const lwan_url_map_t *map)
 {
     lwan_url_map_t *copy = malloc(sizeof(*copy));
 
@@ -147,11 +215,42 @@ static lwan_url_map_t *add_url_map(lwan_trie_t *t, const char *prefix, const lwa
 
     copy->prefix = strdup(prefix ? prefix : copy->prefix);
     copy->prefix_len = strlen(copy->prefix);
-    lwan_trie_add(t, copy->prefix, copy);
+    copy->stats_index = lwan_stats_register_prefix(l, copy->prefix);
+    if (!lwan_trie_add_route(trie, copy->prefix, copy->methods,
+                copy->exact_match, copy)) {
+        destroy_urlmap(copy);
+        return NULL;
+    }
 
     return copy;
 }
 
+static bool parse_listener_prefix_methods(const char *value,
+                    lwan_request_flags_t *methods)
+{
+    char *copy = strdupa(value);
+    char *saveptr;
+    unsigned int flags = 0;
+
+    for (char *method = strtok_r(copy, ", \t", &saveptr); method;
+                method = strtok_r(NULL, ", \t", &saveptr)) {
+        if (!strcasecmp(method, "GET"))
+            flags |= REQUEST_METHOD_GET | REQUEST_METHOD_HEAD;
+        else if (!strcasecmp(method, "HEAD"))
+            flags |= REQUEST_METHOD_HEAD;
+        else if (!strcasecmp(method, "POST"))
+            flags |= REQUEST_METHOD_POST;
+        else
+            return false;
+    }
+
+    if (!flags)
+        return false;
+
+    *methods = (lwan_request_flags_t)flags;
+    return true;
+}
+
 static void parse_listener_prefix_authorization(config_t *c,
                     config_line_t *l, lwan_url_map_t *url_map)
 {
@@ -197,13 +296,32 @@ error:
     free(url_map->authorization.password_file);
 }
 
+static char *get_section_text(const char *name, const char *param,
+    config_t *isolated)
+{
+    char *contents = config_isolated_text(isolated);
+    char *text;
+
+    if (!contents)
+        return NULL;
+
+    if (asprintf(&text, "%s %s\n%s", name, param, contents) < 0)
+        text = NULL;
+
+    free(contents);
+    return text;
+}
+
 static void parse_listener_prefix(config_t *c, config_line_t *l, lwan_t *lwan,
+    struct routes_builder *builder, lwan_trie_t *trie,
     const lwan_module_t *module)
 {
     lwan_url_map_t url_map = {0};
     struct hash *hash = hash_str_new(free, free);
     void *handler = NULL;
     char *prefix = strdupa(l->line.value);
+    char *section_name = strdupa(l->section.name);
+    char *section_text = NULL;
     config_t isolated = {0};
 
     if (!config_isolate_section(c, l, &isolated)) {
@@ -211,6 +329,8 @@ static void parse_listener_prefix(config_t *c, config_line_t *l, lwan_t *lwan,
         goto out;
     }
 
+    section_text = get_section_text(section_name, prefix, &isolated);
+
     while (config_read_line(c, l)) {
       switch (l->type) {
       case CONFIG_LINE_TYPE_LINE:
@@ -230,6 +350,21 @@ static void parse_listener_prefix(config_t *c, config_line_t *l, lwan_t *lwan,
                   config_error(c, "Could not find handler \"%s\"", l->line.value);
                   goto out;
               }
+          } else if (!strcmp(l->line.key, "methods")) {
+              if (!parse_listener_prefix_methods(l->line.value, &url_map.methods)) {
+                  config_error(c, "Invalid methods: \"%s\"", l->line.value);
+                  goto out;
+              }
+          } else if (!strcmp(l->line.key, "exact_match")) {
+              url_map.exact_match = parse_bool(l->line.value, false);
+          } else if (!strcmp(l->line.key, "max_concurrent_requests")) {
+              long max = parse_long(l->line.value, -1);
+              if (max < 0 || max > UINT_MAX) {
+                  config_error(c, "Invalid maximum number of concurrent requests: %s",
+                      l->line.value);
+                  goto out;
+              }
+              url_map.max_concurrent_requests = (unsigned int)max;
           } else {
               hash_add(hash, strdup(l->line.key), strdup(l->line.value));
           }
@@ -272,12 +407,27 @@ add_map:
 
         hash = NULL;
     } else if (module && module->init_from_hash && module->handle) {
-        url_map.data = module->init_from_hash(hash);
-        if (isolated.file && module->parse_conf) {
-            if (!module->parse_conf(url_map.data, &isolated)) {
-                config_error(c, "Error from module: %s",
-                    isolated.error_message ? isolated.error_message : "Unknown");
-                goto out;
+        lwan_url_map_t *previous = NULL;
+
+        if (builder->previous && section_text)
+            previous = hash_find(builder->previous, section_text);
+
+        if (previous && previous->module == module) {
+            /* Nothing changed: keep the instance, and whatever it has
+             * cached, rather than creating another one */
+            hash_del(builder->previous, section_text);
+            url_map.data = previous->data;
+            url_map.reused_from = previous;
+        } else {
+            url_map.data = module->init_from_hash(hash);
+            if (isolated.file && module->parse_conf) {
+                if (!module->parse_conf(url_map.data, &isolated)) {
+                    config_error(c, "Error from module: %s",
+                        isolated.error_message ? isolated.error_message : "Unknown");
+                    if (module->shutdown)
+                        module->shutdown(url_map.data);
+                    goto out;
+                }
             }
         }
         url_map.handler = module->handle;
@@ -288,21 +438,45 @@ add_map:
         goto out;
     }
 
-    add_url_map(&lwan->url_map_trie, prefix, &url_map);
+    url_map.section_text = section_text;
+    section_text = NULL;
+
+    if (!add_url_map(lwan, trie, prefix, &url_map))
+        config_error(c, "Could not add route for %s", prefix);
 
 out:
+    free(section_text);
     hash_free(hash);
     config_close(&isolated);
 }
 
+static struct {
+    sem_t requested;
+    pthread_t thread;
+    /* Routes were loaded from the configuration file */
+    bool enabled;
+    bool running;
+    bool shutting_down;
+    /* Replaced routes, by the slot of their generation; destroyed by the
+     * reload thread once no request uses them anymore.  A reload that
+     * would reuse the slot of one of these waits until it's destroyed. */
+    lwan_routes_t *retired[LWAN_ROUTES_SLOTS];
+    unsigned int n_retired;
+} reload;
+
 void lwan_set_url_map(lwan_t *l, const lwan_url_map_t *map)
 {
-    lwan_trie_destroy(&l->url_map_trie);
-    if (UNLIKELY(!lwan_trie_init(&l->url_map_trie, destroy_urlmap)))
+    lwan_routes_t *routes = routes_new(0);
+
+    if (UNLIKELY(!routes))
         lwan_status_critical_perror("Could not initialize trie");
 
+    routes_destroy(l->routes);
+    l->routes = routes;
+    reload.enabled = false;
+
     for (; map->prefix; map++) {
-        lwan_url_map_t *copy = add_url_map(&l->url_map_trie, NULL, map);
+        lwan_url_map_t *copy = add_url_map(l, &routes->trie[0], NULL, map);
 
         if (UNLIKELY(!copy))
             continue;
@@ -317,25 +491,77 @@ void lwan_set_url_map(lwan_t *l, const lwan_url_map_t *map)
     }
 }
 
-static void parse_listener(config_t *c, config_line_t *l, lwan_t *lwan)
+/* Settings from a listener section; the ones that aren't there are
+ * taken from the global settings, which might come after it */
+struct listener_options {
+    char *address;
+    long keep_alive_timeout;
+    int proxy_protocol;
+    int http2;
+};
+
+static void listener_options_init(struct listener_options *options,
+    const char *address)
+{
+    *options = (struct listener_options) {
+        .address = strdup(address),
+        .keep_alive_timeout = -1,
+        .proxy_protocol = -1,
+        .http2 = -1
+    };
+}
+
+static void add_listener(lwan_t *l, const struct listener_options *options)
+{
+    lwan_listener_t *listener = &l->listeners[l->n_listeners++];
+
+    *listener = (lwan_listener_t) {
+        .address = options->address,
+        .fd = -1,
+        .keep_alive_timeout = options->keep_alive_timeout < 0 ?
+            l->config.keep_alive_timeout : (unsigned short)options->keep_alive_timeout,
+        .proxy_protocol = options->proxy_protocol < 0 ?
+            l->config.proxy_protocol : !!options->proxy_protocol,
+        .http2 = options->http2 < 0 ? l->config.http2 : !!options->http2
+    };
+}
+
+static void parse_listener(config_t *c, config_line_t *l, lwan_t *lwan,
+    struct routes_builder *builder, lwan_trie_t *trie,
+    struct listener_options *options)
 {
-    lwan->config.listener = strdup(l->section.param);
+    listener_options_init(options, l->section.param);
 
     while (config_read_line(c, l)) {
         switch (l->type) {
         case CONFIG_LINE_TYPE_LINE:
-            config_error(c, "Expecting prefix section");
-            return;
+            if (!strcmp(l->line.key, "keep_alive_timeout")) {
+                options->keep_alive_timeout = parse_long(l->line.value, -1);
+                if (options->keep_alive_timeout < 0 ||
+                            options->keep_alive_timeout > USHRT_MAX) {
+                    config_error(c, "Invalid keep-alive timeout: %s", l->line.value);
+                    return;
+                }
+            } else if (!strcmp(l->line.key, "proxy_protocol")) {
+                options->proxy_protocol = parse_bool(l->line.value,
+                            lwan->config.proxy_protocol);
+            } else if (!strcmp(l->line.key, "http2")) {
+                options->http2 = parse_bool(l->line.value, lwan->config.http2);
+            } else {
+                config_error(c, "Unknown listener config key: %s", l->line.key);
+                return;
+            }
+            break;
         case CONFIG_LINE_TYPE_SECTION:
             if (!strcmp(l->section.name, "prefix")) {
-                parse_listener_prefix(c, l, lwan, NULL);
+                parse_listener_prefix(c, l, lwan, builder, trie, NULL);
             } else {
                 const lwan_module_t *module = lwan_module_find(lwan, l->section.name);
                 if (!module) {
                     config_error(c, "Invalid section name or module not found: %s",
                         l->section.name);
                 } else {
-                    parse_listener_prefix(c, l, lwan, module);
+                    parse_listener_prefix(c, l, lwan, builder, trie, module);
                 }
             }
             break;
@@ -347,6 +573,104 @@ static void parse_listener(config_t *c, config_line_t *l, lwan_t *lwan)
     config_error(c, "Expecting section end while parsing listener");
 }
 
+static void parse_tls(config_t *c, config_line_t *l, lwan_t *lwan)
+{
+    lwan->config.tls.listener = strdup(l->section.param);
+
+    while (config_read_line(c, l)) {
+        switch (l->type) {
+        case CONFIG_LINE_TYPE_LINE:
+            if (!strcmp(l->line.key, "certificate")) {
+                free(lwan->config.tls.certificate);
+                lwan->config.tls.certificate = strdup(l->line.value);
+            } else if (!strcmp(l->line.key, "private_key")) {
+                free(lwan->config.tls.private_key);
+                lwan->config.tls.private_key = strdup(l->line.value);
+            } else if (!strcmp(l->line.key, "ticket_key_rotation")) {
+                lwan->config.tls.ticket_key_rotation = parse_time_period(
+                    l->line.value, default_config.tls.ticket_key_rotation);
+            } else {
+                config_error(c, "Unknown TLS config key: %s", l->line.key);
+                return;
+            }
+            break;
+        case CONFIG_LINE_TYPE_SECTION:
+            config_error(c, "Unexpected section: %s", l->section.name);
+            return;
+        case CONFIG_LINE_TYPE_SECTION_END:
+            return;
+        }
+    }
+
+    config_error(c, "Expecting section end while parsing TLS listener");
+}
+
+static void parse_access_log(config_t *c, config_line_t *l, lwan_t *lwan)
+{
+    lwan->config.access_log.path = strdup(l->section.param);
+
+    while (config_read_line(c, l)) {
+        switch (l->type) {
+        case CONFIG_LINE_TYPE_LINE:
+            if (!strcmp(l->line.key, "format")) {
+                if (!strcmp(l->line.value, "text")) {
+                    lwan->config.access_log.format = ACCESS_LOG_TEXT;
+                } else if (!strcmp(l->line.value, "json")) {
+                    lwan->config.access_log.format = ACCESS_LOG_JSON;
+                } else if (!strcmp(l->line.value, "binary")) {
+                    lwan->config.access_log.format = ACCESS_LOG_BINARY;
+                } else {
+                    config_error(c, "Unknown access log format: %s", l->line.value);
+                    return;
+                }
+            } else {
+                config_error(c, "Unknown access log config key: %s", l->line.key);
+                return;
+            }
+            break;
+        case CONFIG_LINE_TYPE_SECTION:
+            config_error(c, "Unexpected section: %s", l->section.name);
+            return;
+        case CONFIG_LINE_TYPE_SECTION_END:
+            return;
+        }
+    }
+
+    config_error(c, "Expecting section end while parsing access log");
+}
+
+static void parse_request_timing(config_t *c, config_line_t *l, lwan_t *lwan)
+{
+    lwan->config.request_timing.enabled = true;
+
+    while (config_read_line(c, l)) {
+        switch (l->type) {
+        case CONFIG_LINE_TYPE_LINE:
+            if (!strcmp(l->line.key, "server_timing")) {
+                lwan->config.request_timing.server_timing = parse_bool(l->line.value, false);
+            } else if (!strcmp(l->line.key, "slow_request_threshold")) {
+                long threshold = parse_long(l->line.value, 0);
+                if (threshold < 0) {
+                    config_error(c, "Invalid slow request threshold: %ld", threshold);
+                    return;
+                }
+                lwan->config.request_timing.slow_request_threshold = (unsigned int)threshold;
+            } else {
+                config_error(c, "Unknown request timing config key: %s", l->line.key);
+                return;
+            }
+            break;
+        case CONFIG_LINE_TYPE_SECTION:
+            config_error(c, "Unexpected section: %s", l->section.name);
+            return;
+        case CONFIG_LINE_TYPE_SECTION_END:
+            return;
+        }
+    }
+
+    config_error(c, "Expecting section end while parsing request timing");
+}
+
 const char *get_config_path(char *path_buf)
 {
     char *path = NULL;
@@ -371,29 +695,94 @@ out:
     return "lwan.conf";
 }
 
-static bool setup_from_config(lwan_t *lwan)
+/* Listeners are set up once, as sockets aren't opened again when
+ * reloading: their addresses have to stay the same */
+static void check_listeners(config_t *c, const lwan_t *lwan,
+    const struct listener_options *listeners, unsigned short n_listeners)
+{
+    if (n_listeners != lwan->n_listeners) {
+        config_error(c, "Listeners can't be added or removed without restarting");
+        return;
+    }
+
+    for (unsigned short i = 0; i < n_listeners; i++) {
+        if (strcmp(listeners[i].address, lwan->listeners[i].address)) {
+            config_error(c, "Listeners can't be changed without restarting");
+            return;
+        }
+    }
+}
+
+static bool setup_from_config(lwan_t *lwan, struct routes_builder *builder)
 {
     config_t conf;
     config_line_t line;
-    bool has_listener = false;
+    struct listener_options listeners[LWAN_MAX_LISTENERS];
+    unsigned short n_listeners = 0;
     char path_buf[PATH_MAX];
     const char *path;
 
     path = get_config_path(path_buf);
     lwan_status_info("Loading configuration file: %s", path);
 
-    if (!lwan_trie_init(&lwan->url_map_trie, destroy_urlmap))
-        return false;
-
     if (!config_open(&conf, path))
         return false;
 
     while (config_read_line(&conf, &line)) {
+        if (line.type == CONFIG_LINE_TYPE_SECTION &&
+                    !strcmp(line.section.name, "listener")) {
+            if (n_listeners < LWAN_MAX_LISTENERS) {
+                parse_listener(&conf, &line, lwan, builder,
+                    &builder->routes->trie[n_listeners],
+                    &listeners[n_listeners]);
+                n_listeners++;
+            } else {
+                config_error(&conf, "At most %d listeners are supported",
+                    LWAN_MAX_LISTENERS);
+            }
+            continue;
+        }
+
+        if (builder->previous) {
+            /* Only routes can be reloaded; changes to anything else
+             * take effect after a restart */
+            if (line.type == CONFIG_LINE_TYPE_SECTION)
+                config_skip_section(&conf, &line);
+            continue;
+        }
+
         switch (line.type) {
         case CONFIG_LINE_TYPE_LINE:
             if (!strcmp(line.line.key, "keep_alive_timeout"))
                 lwan->config.keep_alive_timeout = (unsigned short)parse_long(line.line.value,
                             default_config.keep_alive_timeout);
+            else if (!strcmp(line.line.key, "write_stall_timeout"))
+                lwan->config.write_stall_timeout = (unsigned short)parse_long(line.line.value,
+                            default_config.write_stall_timeout);
+            else if (!strcmp(line.line.key, "drain_timeout"))
+                lwan->config.drain_timeout = (unsigned short)parse_long(line.line.value,
+                            default_config.drain_timeout);
+            else if (!strcmp(line.line.key, "stream_flush_watermark")) {
+                long watermark = parse_long(line.line.value,
+                            default_config.stream_flush_watermark);
+                if (watermark < 0)
+                    config_error(&conf, "Invalid stream flush watermark: %ld", watermark);
+                lwan->config.stream_flush_watermark = (unsigned int)watermark;
+            }
+            else if (!strcmp(line.line.key, "max_connections")) {
+                long max = parse_long(line.line.value, -1);
+                if (max < 0 || max > UINT_MAX)
+                    config_error(&conf, "Invalid maximum number of connections: %s",
+                        line.line.value);
+                lwan->config.max_connections = (unsigned int)max;
+            }
+            else if (!strcmp(line.line.key, "max_connections_per_thread")) {
+                long max = parse_long(line.line.value, -1);
+                if (max < 0 || max > UINT_MAX)
+                    config_error(&conf, "Invalid maximum number of connections per thread: %s",
+                        line.line.value);
+                lwan->config.max_connections_per_thread = (unsigned int)max;
+            }
             else if (!strcmp(line.line.key, "quiet"))
                 lwan->config.quiet = parse_bool(line.line.value,
                             default_config.quiet);
@@ -403,6 +792,11 @@ static bool setup_from_config(lwan_t *lwan)
             else if (!strcmp(line.line.key, "proxy_protocol"))
                 lwan->config.proxy_protocol = parse_bool(line.line.value,
                             default_config.proxy_protocol);
+            else if (!strcmp(line.line.key, "http2"))
+                lwan->config.http2 = parse_bool(line.line.value,
+                            default_config.http2);
+            else if (!strcmp(line.line.key, "stats_shared_memory"))
+                lwan_stats_open_shared_memory(lwan, line.line.value);
             else if (!strcmp(line.line.key, "expires"))
                 lwan->config.expires = parse_time_period(line.line.value,
                             default_config.expires);
@@ -416,13 +810,18 @@ static bool setup_from_config(lwan_t *lwan)
                 config_error(&conf, "Unknown config key: %s", line.line.key);
             break;
         case CONFIG_LINE_TYPE_SECTION:
-            if (!strcmp(line.section.name, "listener")) {
-                if (!has_listener) {
-                    parse_listener(&conf, &line, lwan);
-                    has_listener = true;
-                } else {
-                    config_error(&conf, "Only one listener supported");
-                }
+            if (!strcmp(line.section.name, "tls")) {
+                if (!lwan->config.tls.listener)
+                    parse_tls(&conf, &line, lwan);
+                else
+                    config_error(&conf, "Only one TLS listener supported");
+            } else if (!strcmp(line.section.name, "access_log")) {
+                if (!lwan->config.access_log.path)
+                    parse_access_log(&conf, &line, lwan);
+                else
+                    config_error(&conf, "Only one access log supported");
+            } else if (!strcmp(line.section.name, "request_timing")) {
+                parse_request_timing(&conf, &line, lwan);
             } else if (!strcmp(line.section.name, "straitjacket")) {
                 lwan_straitjacket_enforce(&conf, &line);
             } else {
@@ -434,9 +833,30 @@ static bool setup_from_config(lwan_t *lwan)
         }
     }
 
+    if (builder->previous && !conf.error_message)
+        check_listeners(&conf, lwan, listeners, n_listeners);
+
     if (conf.error_message) {
-        lwan_status_critical("Error on config file \"%s\", line %d: %s",
-              path, conf.line, conf.error_message);
+        /* A configuration that worked is kept if reloading fails */
+        if (!builder->previous) {
+            lwan_status_critical("Error on config file \"%s\", line %d: %s",
+                  path, conf.line, conf.error_message);
+        } else {
+            lwan_status_error("Error on config file \"%s\", line %d: %s",
+                  path, conf.line, conf.error_message);
+        }
+
+        for (unsigned short i = 0; i < n_listeners; i++)
+            free(listeners[i].address);
+        config_close(&conf);
+        return false;
+    }
+
+    for (unsigned short i = 0; i < n_listeners; i++) {
+        if (builder->previous)
+            free(listeners[i].address);
+        else
+            add_listener(lwan, &listeners[i]);
     }
 
     config_close(&conf);
@@ -444,6 +864,194 @@ static bool setup_from_config(lwan_t *lwan)
     return true;
 }
 
+static void add_previous_url_map(void *data, void *context)
+{
+    lwan_url_map_t *url_map = data;
+
+    if (url_map->module && url_map->section_text)
+        hash_add_unique(context, url_map->section_text, url_map);
+}
+
+static void hand_over_module_instance(void *data,
+    void *context __attribute__((unused)))
+{
+    lwan_url_map_t *url_map = data;
+
+    if (url_map->reused_from) {
+        url_map->reused_from->handed_over = true;
+        url_map->reused_from = NULL;
+    }
+}
+
+static bool routes_in_use(const lwan_t *l, unsigned int slot)
+{
+    for (unsigned short i = 0; i < l->thread.count; i++) {
+        if (__atomic_load_n(&l->thread.threads[i].route_refs[slot],
+                    __ATOMIC_SEQ_CST))
+            return true;
+    }
+
+    return false;
+}
+
+/* Returns false if the slot for the next generation of routes is still
+ * taken by routes some request is using */
+static bool destroy_retired_routes(const lwan_t *l)
+{
+    /* New requests can't get to these routes anymore; the ones that
+     * did are counted by the I/O threads until they're done */
+    for (unsigned int slot = 0; slot < LWAN_ROUTES_SLOTS; slot++) {
+        if (!reload.retired[slot] || routes_in_use(l, slot))
+            continue;
+
+        routes_destroy(reload.retired[slot]);
+        reload.retired[slot] = NULL;
+        reload.n_retired--;
+    }
+
+    return !reload.retired[(l->routes->generation + 1) & (LWAN_ROUTES_SLOTS - 1)];
+}
+
+static void reload_routes(lwan_t *l)
+{
+    lwan_routes_t *current = l->routes;
+    struct routes_builder builder = {
+        .routes = routes_new(current->generation + 1),
+        .previous = hash_str_new(NULL, NULL)
+    };
+
+    if (UNLIKELY(!builder.routes || !builder.previous)) {
+        lwan_status_error("Could not allocate routes to reload configuration");
+        goto error;
+    }
+
+    routes_foreach(current, add_previous_url_map, builder.previous);
+    if (!setup_from_config(l, &builder)) {
+        lwan_status_error("Could not reload configuration, keeping the current one");
+        goto error;
+    }
+    hash_free(builder.previous);
+
+    routes_foreach(builder.routes, hand_over_module_instance, NULL);
+    __atomic_store_n(&l->routes, builder.routes, __ATOMIC_SEQ_CST);
+    lwan_status_info("Configuration reloaded");
+
+    reload.retired[current->generation & (LWAN_ROUTES_SLOTS - 1)] = current;
+    reload.n_retired++;
+    return;
+
+error:
+    /* Maps reusing module instances don't shut them down */
+    routes_destroy(builder.routes);
+    hash_free(builder.previous);
+}
+
+/* How often the reload thread checks whether replaced routes are still
+ * in use, while there are any */
+#define RETIRED_ROUTES_CHECK_NSEC (100 * 1000 * 1000)
+
+static int wait_for_reload_request(void)
+{
+    struct timespec deadline;
+
+    if (!reload.n_retired)
+        return sem_wait(&reload.requested);
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += RETIRED_ROUTES_CHECK_NSEC;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    return sem_timedwait(&reload.requested, &deadline);
+}
+
+static void *reload_thread(void *data)
+{
+    lwan_t *l = data;
+    bool requested = false;
+
+    while (true) {
+        bool new_request = false;
+
+        if (wait_for_reload_request() < 0) {
+            if (errno != EINTR && errno != ETIMEDOUT) {
+                lwan_status_perror("sem_wait");
+                break;
+            }
+        } else {
+            /* Signals received up to this point are handled by the
+             * next reload */
+            while (!sem_trywait(&reload.requested))
+                ;
+            requested = new_request = true;
+        }
+
+        if (__atomic_load_n(&reload.shutting_down, __ATOMIC_ACQUIRE))
+            break;
+
+        if (reload.n_retired && !destroy_retired_routes(l)) {
+            if (new_request) {
+                lwan_status_info("Reloading configuration once requests "
+                    "using the previous one finish");
+            }
+            continue;
+        }
+
+        if (requested) {
+            requested = false;
+            reload_routes(l);
+        }
+    }
+
+    return NULL;
+}
+
+static void
+sighup_handler(int signal_number __attribute__((unused)))
+{
+    sem_post(&reload.requested);
+}
+
+static void
+reload_thread_init(lwan_t *l)
+{
+    if (!reload.enabled)
+        return;
+
+    if (sem_init(&reload.requested, 0, 0) < 0) {
+        lwan_status_perror("sem_init");
+        return;
+    }
+
+    if (pthread_create(&reload.thread, NULL, reload_thread, l)) {
+        lwan_status_perror("pthread_create");
+        sem_destroy(&reload.requested);
+        return;
+    }
+
+    reload.running = true;
+    if (signal(SIGHUP, sighup_handler) == SIG_ERR)
+        lwan_status_critical("Could not set signal handler");
+}
+
+static void
+reload_thread_shutdown(void)
+{
+    if (!reload.running)
+        return;
+
+    signal(SIGHUP, SIG_IGN);
+
+    __atomic_store_n(&reload.shutting_down, true, __ATOMIC_RELEASE);
+    sem_post(&reload.requested);
+    pthread_join(reload.thread, NULL);
+    sem_destroy(&reload.requested);
+
+    reload.running = false;
+}
+
 static rlim_t
 setup_open_file_count_limits(void)
 {
@@ -517,15 +1125,29 @@ lwan_init_with_config(lwan_t *l, const lwan_config_t *config)
 
     lwan_module_init(l);
 
+    l->routes = routes_new(0);
+    if (!l->routes)
+        lwan_status_critical_perror("Could not initialize trie");
+
     /* Load the configuration file. */
     if (config == &default_config) {
-        if (!setup_from_config(l))
+        struct routes_builder builder = { .routes = l->routes };
+
+        if (!setup_from_config(l, &builder))
             lwan_status_warning("Could not read config file, using defaults");
+        reload.enabled = true;
 
         /* `config` key might have changed value. */
         lwan_status_init(l);
     }
 
+    if (!l->n_listeners) {
+        struct listener_options options;
+
+        listener_options_init(&options, l->config.listener);
+        add_listener(l, &options);
+    }
+
     /* Continue initialization as normal. */
     lwan_status_debug("Initializing lwan web server");
 
@@ -544,9 +1166,30 @@ lwan_init_with_config(lwan_t *l, const lwan_config_t *config)
     lwan_status_info("Using %d threads, maximum %d sockets per thread",
         l->thread.count, l->thread.max_fd);
 
+    if (l->config.max_connections_per_thread) {
+        l->thread.connection_limit = l->config.max_connections_per_thread;
+    } else if (l->config.max_connections) {
+        l->thread.connection_limit = (l->config.max_connections +
+            l->thread.count - 1u) / l->thread.count;
+    }
+    if (l->thread.connection_limit) {
+        lwan_status_info("Accepting up to %u connections (%u per thread)",
+            l->config.max_connections, l->thread.connection_limit);
+    }
+
     signal(SIGPIPE, SIG_IGN);
 
+    if (l->config.tls.listener) {
+#if defined(HAVE_OPENSSL)
+        lwan_tls_init(l);
+#else
+        lwan_status_critical("TLS listener configured, but lwan was built without OpenSSL");
+#endif
+    }
+
+    lwan_stats_init(l);
     lwan_thread_init(l);
+    lwan_access_log_init(l);
     lwan_socket_init(l);
     lwan_http_authorize_init();
 }
@@ -556,14 +1199,29 @@ lwan_shutdown(lwan_t *l)
 {
     lwan_status_info("Shutting down");
 
-    if (l->config.listener != default_config.listener)
-        free(l->config.listener);
+    reload_thread_shutdown();
 
     lwan_job_thread_shutdown();
     lwan_thread_shutdown(l);
+    lwan_access_log_shutdown(l);
+    lwan_stats_shutdown(l);
+    free(l->config.access_log.path);
+
+#if defined(HAVE_OPENSSL)
+    lwan_tls_shutdown(l);
+#endif
+    lwan_socket_shutdown(l);
+    free(l->config.tls.listener);
+    free(l->config.tls.certificate);
+    free(l->config.tls.private_key);
 
     lwan_status_debug("Shutting down URL handlers");
-    lwan_trie_destroy(&l->url_map_trie);
+    for (unsigned int slot = 0; slot < LWAN_ROUTES_SLOTS; slot++) {
+        routes_destroy(reload.retired[slot]);
+        reload.retired[slot] = NULL;
+    }
+    reload.n_retired = 0;
+    routes_destroy(l->routes);
 
     free(l->conns);
 
@@ -574,8 +1232,8 @@ lwan_shutdown(lwan_t *l)
     lwan_module_shutdown(l);
 }
 
-static ALWAYS_INLINE void
-schedule_client(lwan_t *l, int fd)
+static ALWAYS_INLINE lwan_thread_t *
+pick_thread(lwan_t *l, int fd)
 {
     int thread;
 #ifdef __x86_64__
@@ -592,48 +1250,622 @@ schedule_client(lwan_t *l, int fd)
     static int counter = 0;
     thread = counter++ % l->thread.count;
 #endif
-    lwan_thread_t *t = &l->thread.threads[thread];
-    lwan_thread_add_client(t, fd);
+    return &l->thread.threads[thread];
+}
+
+/* Returns the thread a new connection goes to, or NULL if it has to be
+ * rejected.  That's the one picked from the file descriptor, unless it's
+ * full: then the least loaded of the others is used, if any has room. */
+static lwan_thread_t *
+admit_client(lwan_t *l, int fd)
+{
+    lwan_thread_t *t = pick_thread(l, fd);
+    lwan_thread_t *least_loaded = NULL;
+    unsigned int least_loaded_count = UINT_MAX;
+    unsigned int open = 0;
+
+    if (LIKELY(!l->thread.connection_limit))
+        return t;
+
+    for (unsigned short i = 0; i < l->thread.count; i++) {
+        lwan_thread_t *other = &l->thread.threads[i];
+        unsigned int count =
+            __atomic_load_n(&other->n_connections, __ATOMIC_RELAXED);
+
+        if (count < least_loaded_count) {
+            least_loaded = other;
+            least_loaded_count = count;
+        }
+        open += count;
+    }
+
+    if (l->config.max_connections && open >= l->config.max_connections)
+        return NULL;
+
+    if (l->config.max_connections_per_thread &&
+            __atomic_load_n(&t->n_connections, __ATOMIC_RELAXED) >=
+                l->config.max_connections_per_thread) {
+        if (least_loaded_count >= l->config.max_connections_per_thread)
+            return NULL;
+        return least_loaded;
+    }
+
+    return t;
+}
+
+/* Nothing is read from the client, and no I/O thread is involved.  TLS
+ * clients would have to finish a handshake first, so they're just
+ * disconnected. */
+static void
+reject_client(lwan_thread_t *t, int fd, lwan_connection_flags_t flags)
+{
+    static const char response[] = "HTTP/1.1 503 Service unavailable\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n"
+        "Retry-After: 1\r\n"
+        "\r\n";
+
+    if (!(flags & CONN_TLS))
+        (void)send(fd, response, sizeof(response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+
+    LWAN_STATS_INC(t->stats, rejected);
+}
+
+static ALWAYS_INLINE void
+schedule_client(lwan_t *l, int fd, lwan_connection_flags_t flags)
+{
+    lwan_thread_t *t = admit_client(l, fd);
+
+    if (UNLIKELY(!t)) {
+        reject_client(pick_thread(l, fd), fd, flags);
+        return;
+    }
+
+    __atomic_fetch_add(&t->n_connections, 1, __ATOMIC_RELAXED);
+    lwan_thread_add_client(t, fd, flags);
 }
 
-static volatile sig_atomic_t main_socket = -1;
+/* Listening sockets, for each listener and then the TLS one, if any;
+ * closed from the SIGINT handler, so that the main loop stops waiting
+ * for connections */
+static volatile sig_atomic_t listen_sockets[LWAN_MAX_LISTENERS + 1];
+static volatile sig_atomic_t n_listen_sockets = 0;
+static volatile sig_atomic_t interrupted = 0;
+static volatile sig_atomic_t upgrade_requested = 0;
+
+/* Closed when the process runs out of file descriptors, so that pending
+ * connections can still be accepted (and rejected right away) instead of
+ * piling up in the backlog */
+static int spare_fd = -1;
+
+static void
+close_listen_sockets(void)
+{
+    for (int i = 0; i < n_listen_sockets; i++) {
+        int fd = listen_sockets[i];
+
+        if (fd < 0)
+            continue;
+        listen_sockets[i] = -1;
+        close(fd);
+    }
+}
 
 static void
 sigint_handler(int signal_number __attribute__((unused)))
 {
-    if (main_socket < 0)
+    interrupted = 1;
+    close_listen_sockets();
+}
+
+static void
+sigusr2_handler(int signal_number __attribute__((unused)))
+{
+    upgrade_requested = 1;
+}
+
+/* Time given to the new binary to start serving before giving up on it */
+#define UPGRADE_READY_TIMEOUT 60
+
+/* New binary that has been started, but isn't serving requests yet; the
+ * main loop keeps accepting connections while it waits for ready_fd */
+static struct {
+    pid_t pid;
+    int ready_fd;
+    time_t deadline;
+} upgrade = { .pid = -1, .ready_fd = -1 };
+
+static char **
+get_upgrade_argv(char *cmdline, size_t len)
+{
+    size_t argc = 0;
+    char **argv;
+
+    for (size_t i = 0; i < len; i++)
+        argc += !cmdline[i];
+
+    argv = calloc(argc + 1, sizeof(*argv));
+    if (!argv)
+        return NULL;
+
+    for (size_t arg = 0, i = 0; arg < argc; arg++) {
+        argv[arg] = cmdline + i;
+        i += strlen(cmdline + i) + 1;
+    }
+
+    return argv;
+}
+
+static char **
+get_upgrade_envp(char *listen_fds, char *listen_pid, char *ready_fd)
+{
+    size_t n_vars = 0;
+    char **envp;
+
+    for (char **var = environ; *var; var++)
+        n_vars++;
+
+    envp = calloc(n_vars + 4, sizeof(*envp));
+    if (!envp)
+        return NULL;
+
+    n_vars = 0;
+    for (char **var = environ; *var; var++) {
+        if (!strncmp(*var, "LISTEN_", sizeof("LISTEN_") - 1))
+            continue;
+        if (!strncmp(*var, "LWAN_READY_FD=", sizeof("LWAN_READY_FD=") - 1))
+            continue;
+        envp[n_vars++] = *var;
+    }
+    envp[n_vars++] = listen_fds;
+    envp[n_vars++] = listen_pid;
+    envp[n_vars] = ready_fd;
+
+    return envp;
+}
+
+/* Runs in the child after fork(), so only async-signal-safe functions
+ * can be used */
+static void __attribute__((noreturn))
+exec_upgraded_binary(const char *path, char **argv, char **envp,
+    const int *fds, int n_fds, char *listen_pid)
+{
+    int moved[LWAN_MAX_LISTENERS + 2];
+    char digits[16];
+    pid_t pid = getpid();
+    int n_digits = 0;
+
+    /* Moved out of the way first, as some of them might already be
+     * using the descriptors they're going to end up in */
+    for (int i = 0; i < n_fds; i++) {
+        moved[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, SD_LISTEN_FDS_START + n_fds);
+        if (moved[i] < 0)
+            _exit(127);
+    }
+    for (int i = 0; i < n_fds; i++) {
+        if (dup2(moved[i], SD_LISTEN_FDS_START + i) < 0)
+            _exit(127);
+    }
+
+    do {
+        digits[n_digits++] = (char)('0' + pid % 10);
+        pid /= 10;
+    } while (pid);
+    listen_pid += sizeof("LISTEN_PID=") - 1;
+    while (n_digits)
+        *listen_pid++ = digits[--n_digits];
+    *listen_pid = '\0';
+
+    execve(path, argv, envp);
+    _exit(127);
+}
+
+static void
+forget_upgraded_binary(void)
+{
+    close(upgrade.ready_fd);
+    upgrade.ready_fd = -1;
+    upgrade.pid = -1;
+}
+
+/* Gives up on a new binary that hasn't started serving yet */
+static void
+abort_upgrade(void)
+{
+    if (upgrade.pid < 0)
         return;
-    close(main_socket);
-    main_socket = -1;
+
+    lwan_status_info("Stopping new binary (pid %d)", upgrade.pid);
+    kill(upgrade.pid, SIGTERM);
+    waitpid(upgrade.pid, NULL, 0);
+    forget_upgraded_binary();
+}
+
+/* Returns true once the new binary is serving requests; until then,
+ * or if it has failed to start, this process keeps serving them */
+static bool
+upgraded_binary_is_ready(void)
+{
+    struct pollfd fds[] = {{ .fd = upgrade.ready_fd, .events = POLLIN }};
+    char ready;
+
+    if (poll(fds, N_ELEMENTS(fds), 0) <= 0) {
+        if (time(NULL) < upgrade.deadline)
+            return false;
+
+        lwan_status_error("New binary (pid %d) took too long to start",
+            upgrade.pid);
+        kill(upgrade.pid, SIGTERM);
+    } else if (read(upgrade.ready_fd, &ready, 1) == 1) {
+        lwan_status_info("New binary (pid %d) is serving requests",
+            upgrade.pid);
+        forget_upgraded_binary();
+        return true;
+    } else {
+        lwan_status_error("New binary (pid %d) exited before starting",
+            upgrade.pid);
+    }
+
+    waitpid(upgrade.pid, NULL, 0);
+    forget_upgraded_binary();
+    return false;
+}
+
+/* The new binary gets the listening sockets as if it were started by
+ * systemd with socket activation, and writes to the file descriptor in
+ * LWAN_READY_FD once it's ready to serve; that's not waited for here. */
+static bool
+spawn_upgraded_binary(lwan_t *l)
+{
+    char path[PATH_MAX];
+    char listen_fds[sizeof("LISTEN_FDS=") + 12];
+    char listen_pid[sizeof("LISTEN_PID=") + 16] = "LISTEN_PID=";
+    char ready_fd[sizeof("LWAN_READY_FD=") + 12];
+    char *cmdline = NULL;
+    char **argv = NULL, **envp = NULL;
+    /* Listeners, TLS, and the pipe to tell this process it's ready */
+    int fds[LWAN_MAX_LISTENERS + 2], n_fds = 0;
+    int ready[2] = { -1, -1 };
+    size_t cmdline_len = 0;
+    bool spawned = false;
+    ssize_t len;
+    FILE *file;
+    pid_t pid;
+
+    /* If the binary was replaced, the link points to the one that's
+     * running, which has been deleted */
+    len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len < 0) {
+        lwan_status_perror("Could not find out which binary to run");
+        return false;
+    }
+    path[len] = '\0';
+    if ((size_t)len > sizeof(" (deleted)") - 1) {
+        char *deleted = path + len - (sizeof(" (deleted)") - 1);
+        if (!strcmp(deleted, " (deleted)"))
+            *deleted = '\0';
+    }
+
+    file = fopen("/proc/self/cmdline", "re");
+    if (!file) {
+        lwan_status_perror("Could not read command line");
+        return false;
+    }
+    len = getdelim(&cmdline, &cmdline_len, EOF, file);
+    fclose(file);
+    if (len <= 0) {
+        lwan_status_error("Could not read command line");
+        goto out;
+    }
+
+    for (unsigned short i = 0; i < l->n_listeners; i++)
+        fds[n_fds++] = l->listeners[i].fd;
+    if (l->tls_socket >= 0)
+        fds[n_fds++] = l->tls_socket;
+    snprintf(listen_fds, sizeof(listen_fds), "LISTEN_FDS=%d", n_fds);
+    snprintf(ready_fd, sizeof(ready_fd), "LWAN_READY_FD=%d",
+        SD_LISTEN_FDS_START + n_fds);
+
+    argv = get_upgrade_argv(cmdline, (size_t)len);
+    envp = get_upgrade_envp(listen_fds, listen_pid, ready_fd);
+    if (!argv || !envp) {
+        lwan_status_error("Could not allocate environment for new binary");
+        goto out;
+    }
+
+    if (pipe2(ready, O_CLOEXEC) < 0) {
+        lwan_status_perror("pipe2");
+        goto out;
+    }
+    fds[n_fds] = ready[1];
+
+    lwan_status_info("Starting %s", path);
+
+    pid = fork();
+    if (pid < 0) {
+        lwan_status_perror("fork");
+        goto out;
+    }
+    if (!pid)
+        exec_upgraded_binary(path, argv, envp, fds, n_fds + 1, listen_pid);
+
+    close(ready[1]);
+    ready[1] = -1;
+
+    upgrade.pid = pid;
+    upgrade.ready_fd = ready[0];
+    upgrade.deadline = time(NULL) + UPGRADE_READY_TIMEOUT;
+    ready[0] = -1;
+    spawned = true;
+
+out:
+    if (ready[0] >= 0)
+        close(ready[0]);
+    if (ready[1] >= 0)
+        close(ready[1]);
+    free(envp);
+    free(argv);
+    free(cmdline);
+
+    return spawned;
+}
+
+static void
+notify_ready(void)
+{
+    const char *fd_str = getenv("LWAN_READY_FD");
+    int fd;
+
+    if (!fd_str)
+        return;
+
+    fd = parse_int(fd_str, -1);
+    unsetenv("LWAN_READY_FD");
+    if (fd < 0)
+        return;
+
+    if (write(fd, "", 1) < 0)
+        lwan_status_perror("Could not tell previous process it can stop serving");
+    close(fd);
+}
+
+static uint64_t
+count_open_connections(const lwan_t *l)
+{
+    uint64_t open = 0;
+
+    for (unsigned short i = 0; i < l->thread.count; i++) {
+        const lwan_thread_stats_t *stats = l->thread.threads[i].stats;
+
+        open += __atomic_load_n(&stats->accepted, __ATOMIC_RELAXED) -
+                __atomic_load_n(&stats->closed, __ATOMIC_RELAXED);
+    }
+
+    return open;
+}
+
+static void
+drain_connections(lwan_t *l)
+{
+    const struct timespec delay = { .tv_nsec = 100 * 1000 * 1000 };
+    time_t deadline = time(NULL) + l->config.drain_timeout;
+    uint64_t open;
+
+    while ((open = count_open_connections(l)) && !interrupted) {
+        if (time(NULL) >= deadline) {
+            lwan_status_warning("Closing %"PRIu64" connections that didn't "
+                "finish in time", open);
+            return;
+        }
+
+        nanosleep(&delay, NULL);
+    }
+}
+
+static void
+start_upgrade(lwan_t *l)
+{
+    upgrade_requested = 0;
+
+    if (upgrade.pid >= 0) {
+        lwan_status_warning("New binary (pid %d) is still starting",
+            upgrade.pid);
+        return;
+    }
+
+    spawn_upgraded_binary(l);
+}
+
+/* Once the new binary is serving requests, sockets are closed here, so
+ * that only it accepts connections from now on. */
+static bool
+finish_upgrade(lwan_t *l)
+{
+    if (!upgraded_binary_is_ready())
+        return false;
+
+    lwan_stats_disown_shared_memory(l);
+    __atomic_store_n(&l->draining, true, __ATOMIC_RELAXED);
+
+    close_listen_sockets();
+
+    lwan_status_info("Draining connections");
+    return true;
+}
+
+static void
+reject_with_spare_fd(lwan_t *l, int listen_fd, lwan_connection_flags_t flags)
+{
+    static time_t last_warning = 0;
+    time_t now = time(NULL);
+    int fd;
+
+    if (now != last_warning) {
+        lwan_status_warning("Out of file descriptors, rejecting connections");
+        last_warning = now;
+    }
+
+    if (spare_fd < 0) {
+        /* Nothing to give up: wait for connections to be closed rather
+         * than spinning */
+        const struct timespec delay = { .tv_nsec = 10 * 1000 * 1000 };
+
+        nanosleep(&delay, NULL);
+        spare_fd = eventfd(0, EFD_CLOEXEC);
+        return;
+    }
+
+    close(spare_fd);
+    fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd >= 0)
+        reject_client(pick_thread(l, fd), fd, flags);
+    spare_fd = eventfd(0, EFD_CLOEXEC);
+}
+
+/* Waits until one of the listening sockets has a pending connection,
+ * returning its index in listen_sockets, or -1 if it should be checked
+ * whether the main loop should stop (or whether a new binary is ready,
+ * if one is being started) */
+static int
+poll_listen_sockets(void)
+{
+    static unsigned int next = 0;
+    struct pollfd fds[N_ELEMENTS(listen_sockets) + 1];
+    unsigned int n_fds = (unsigned int)n_listen_sockets;
+    int timeout = -1;
+
+    for (unsigned int i = 0; i < n_fds; i++) {
+        fds[i] = (struct pollfd) { .fd = listen_sockets[i], .events = POLLIN };
+        /* Negative descriptors would be ignored by poll() */
+        if (UNLIKELY(fds[i].fd < 0))
+            return -1;
+    }
+
+    if (UNLIKELY(upgrade.pid >= 0)) {
+        time_t now = time(NULL);
+
+        if (now >= upgrade.deadline)
+            return -1;
+        timeout = (int)(upgrade.deadline - now) * 1000;
+        fds[n_fds] = (struct pollfd) { .fd = upgrade.ready_fd, .events = POLLIN };
+    }
+
+    int r = poll(fds, n_fds + (upgrade.pid >= 0), timeout);
+    if (UNLIKELY(r <= 0)) {
+        if (r < 0 && errno != EINTR)
+            lwan_status_perror("poll");
+        return -1;
+    }
+
+    /* Starting after the last one that had a connection, so that a busy
+     * listener doesn't starve the others */
+    for (unsigned int i = 0; i < n_fds; i++) {
+        unsigned int index = (next + i) % n_fds;
+
+        if (fds[index].revents) {
+            next = index + 1;
+            return (int)index;
+        }
+    }
+
+    return -1;
 }
 
 void
 lwan_main_loop(lwan_t *l)
 {
-    assert(main_socket == -1);
-    main_socket = l->main_socket;
+    assert(n_listen_sockets == 0);
+    for (unsigned short i = 0; i < l->n_listeners; i++)
+        listen_sockets[n_listen_sockets++] = l->listeners[i].fd;
+    if (l->tls_socket >= 0)
+        listen_sockets[n_listen_sockets++] = l->tls_socket;
+
     if (signal(SIGINT, sigint_handler) == SIG_ERR)
         lwan_status_critical("Could not set signal handler");
 
+    /* Not restarting accept() and poll(), so upgrades start right away */
+    struct sigaction sa = { .sa_handler = sigusr2_handler };
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGUSR2, &sa, NULL) < 0)
+        lwan_status_critical_perror("Could not set signal handler");
+
+    reload_thread_init(l);
+
+    spare_fd = eventfd(0, EFD_CLOEXEC);
+    if (spare_fd < 0)
+        lwan_status_perror("Could not reserve a file descriptor");
+
     lwan_status_info("Ready to serve");
+    notify_ready();
 
     for (;;) {
-        int client_fd = accept4(main_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        lwan_connection_flags_t flags;
+        int index = 0;
+
+        if (UNLIKELY(upgrade_requested))
+            start_upgrade(l);
+
+        if (n_listen_sockets > 1 || UNLIKELY(upgrade.pid >= 0)) {
+            index = poll_listen_sockets();
+            if (UNLIKELY(index < 0)) {
+                if (interrupted) {
+                    lwan_status_info("Signal 2 (Interrupt) received");
+                    break;
+                }
+                if (upgrade.pid >= 0 && finish_upgrade(l))
+                    break;
+                continue;
+            }
+        }
+
+        if (index < l->n_listeners)
+            flags = (lwan_connection_flags_t)(index << CONN_LISTENER_SHIFT);
+        else
+            flags = CONN_TLS;
+
+        int client_fd = accept4(listen_sockets[index], NULL, NULL,
+                    SOCK_NONBLOCK | SOCK_CLOEXEC);
         if (UNLIKELY(client_fd < 0)) {
-            if (errno != EBADF) {
+            switch (errno) {
+            case EINTR:
+                continue;
+            case EMFILE:
+            case ENFILE:
+                reject_with_spare_fd(l, listen_sockets[index], flags);
+                continue;
+            case EBADF:
+                break;
+            default:
                 lwan_status_perror("accept");
                 continue;
             }
 
-            if (main_socket < 0) {
+            if (interrupted) {
                 lwan_status_info("Signal 2 (Interrupt) received");
             } else {
-                lwan_status_info("Main socket closed for unknown reasons");
+                lwan_status_info("Listening socket closed for unknown reasons");
             }
 
             break;
         }
 
-        schedule_client(l, client_fd);
+        schedule_client(l, client_fd, flags);
+    }
+
+    abort_upgrade();
+
+    if (spare_fd >= 0) {
+        close(spare_fd);
+        spare_fd = -1;
     }
+
+    /* Closed by now, or closed here if the loop ended for another reason */
+    close_listen_sockets();
+    for (unsigned short i = 0; i < l->n_listeners; i++)
+        l->listeners[i].fd = -1;
+    l->tls_socket = -1;
+
+    if (l->draining)
+        drain_connections(l);
 }
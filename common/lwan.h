@@ -39,6 +39,18 @@ extern "C" {
 #define DEFAULT_BUFFER_SIZE 4096
 #define DEFAULT_HEADERS_SIZE 512
 
+/* Must be a power of two: the index of the listener a connection came
+ * from is kept in its flags, starting at bit CONN_LISTENER_SHIFT */
+#define LWAN_MAX_LISTENERS 16
+#define CONN_LISTENER_SHIFT 13
+
+/* Also a power of two: requests are counted by the generation of the
+ * routes they use modulo this, which is kept in their connection flags
+ * starting at bit CONN_ROUTES_SLOT_SHIFT.  Up to LWAN_ROUTES_SLOTS - 1
+ * replaced configurations can wait for requests still using them. */
+#define LWAN_ROUTES_SLOTS 4
+#define CONN_ROUTES_SLOT_SHIFT 19
+
 #define N_ELEMENTS(array) (sizeof(array) / sizeof(array[0]))
 
 #ifdef DISABLE_INLINE_FUNCTIONS
@@ -108,12 +120,24 @@ typedef struct lwan_request_t_		lwan_request_t;
 typedef struct lwan_response_t_		lwan_response_t;
 typedef struct lwan_thread_t_		lwan_thread_t;
 typedef struct lwan_url_map_t_		lwan_url_map_t;
+typedef struct lwan_routes_t_		lwan_routes_t;
+typedef struct lwan_listener_t_		lwan_listener_t;
 typedef struct lwan_value_t_		lwan_value_t;
 typedef struct lwan_config_t_		lwan_config_t;
 typedef struct lwan_proxy_t_		lwan_proxy_t;
 typedef struct lwan_connection_t_	lwan_connection_t;
+typedef struct lwan_write_stats_t_	lwan_write_stats_t;
+typedef struct lwan_thread_notification_t_	lwan_thread_notification_t;
+typedef struct lwan_websocket_t_	lwan_websocket_t;
+typedef struct lwan_tls_context_t_	lwan_tls_context_t;
+typedef struct lwan_tls_session_t_	lwan_tls_session_t;
+typedef struct lwan_access_log_t_	lwan_access_log_t;
+typedef struct lwan_access_log_ring_t_	lwan_access_log_ring_t;
+typedef struct lwan_stats_t_		lwan_stats_t;
+typedef struct lwan_thread_stats_t_	lwan_thread_stats_t;
 
 typedef enum {
+    HTTP_SWITCHING_PROTOCOLS = 101,
     HTTP_OK = 200,
     HTTP_PARTIAL_CONTENT = 206,
     HTTP_MOVED_PERMANENTLY = 301,
@@ -142,8 +166,10 @@ typedef enum {
     HANDLER_REMOVE_LEADING_SLASH = 1<<6,
     HANDLER_CAN_REWRITE_URL = 1<<7,
     HANDLER_PARSE_COOKIES = 1<<8,
+    HANDLER_PARSE_LAST_EVENT_ID = 1<<9,
+    HANDLER_PARSE_WEBSOCKET = 1<<10,
 
-    HANDLER_PARSE_MASK = 1<<0 | 1<<1 | 1<<2 | 1<<3 | 1<<4 | 1<<8
+    HANDLER_PARSE_MASK = 1<<0 | 1<<1 | 1<<2 | 1<<3 | 1<<4 | 1<<8 | 1<<9 | 1<<10
 } lwan_handler_flags_t;
 
 typedef enum {
@@ -151,6 +177,7 @@ typedef enum {
     REQUEST_METHOD_GET         = 1<<0,
     REQUEST_METHOD_HEAD        = 1<<1,
     REQUEST_METHOD_POST        = 1<<2,
+    REQUEST_METHOD_MASK        = 1<<0 | 1<<1 | 1<<2,
     REQUEST_ACCEPT_DEFLATE     = 1<<3,
     REQUEST_ACCEPT_GZIP        = 1<<4,
     REQUEST_IS_HTTP_1_0        = 1<<5,
@@ -159,7 +186,10 @@ typedef enum {
     RESPONSE_NO_CONTENT_LENGTH = 1<<8,
     RESPONSE_URL_REWRITTEN     = 1<<9,
     REQUEST_ALLOW_PROXY_REQS   = 1<<10,
-    REQUEST_PROXIED            = 1<<11
+    REQUEST_PROXIED            = 1<<11,
+    REQUEST_UPGRADE_WEBSOCKET  = 1<<12,
+    RESPONSE_WEBSOCKET         = 1<<13,
+    REQUEST_HTTP2              = 1<<14
 } lwan_request_flags_t;
 
 typedef enum {
@@ -169,8 +199,52 @@ typedef enum {
     CONN_SHOULD_RESUME_CORO = 1<<2,
     CONN_WRITE_EVENTS       = 1<<3,
     CONN_MUST_READ          = 1<<4,
+    CONN_WRITE_BLOCKED      = 1<<5,
+    CONN_NOTSENT_LOWAT      = 1<<6,
+    CONN_SUSPENDED          = 1<<7,
+    CONN_WAKE_ON_TIMEOUT    = 1<<8,
+    CONN_TLS                = 1<<9,
+    /* Not backed by a socket: these are resumed by the HTTP/2 connection
+     * they're multiplexed onto, which skips them while they're suspended */
+    CONN_HTTP2_STREAM       = 1<<10,
+    /* A release of the routes in use by this connection has been
+     * deferred; CONN_ROUTES_SLOT_MASK has the slot of their generation */
+    CONN_ROUTES_REF         = 1<<11,
+    /* Set if a suspended connection was woken up by its timeout */
+    CONN_TIMED_OUT          = 1<<17,
+    /* HTTP/2 connection with suspended streams; cleared when it's woken
+     * up, so that all of them are resumed */
+    CONN_PARKED_STREAMS     = 1<<18,
+    CONN_ROUTES_SLOT_MASK   = (LWAN_ROUTES_SLOTS - 1) << CONN_ROUTES_SLOT_SHIFT,
+    /* Index of the listener the connection was accepted from */
+    CONN_LISTENER_MASK      = (LWAN_MAX_LISTENERS - 1) << CONN_LISTENER_SHIFT,
 } lwan_connection_flags_t;
 
+typedef enum {
+    REQUEST_PHASE_READ,
+    REQUEST_PHASE_PARSED,
+    REQUEST_PHASE_ROUTED,
+    REQUEST_PHASE_PREPARED,
+    REQUEST_PHASE_HANDLED,
+    REQUEST_PHASE_WRITTEN,
+    N_REQUEST_PHASES
+} lwan_request_phase_t;
+
+typedef enum {
+    ACCESS_LOG_TEXT,
+    ACCESS_LOG_JSON,
+    ACCESS_LOG_BINARY
+} lwan_access_log_format_t;
+
+typedef enum {
+    WS_OPCODE_CONTINUATION = 0,
+    WS_OPCODE_TEXT = 1,
+    WS_OPCODE_BINARY = 2,
+    WS_OPCODE_CLOSE = 8,
+    WS_OPCODE_PING = 9,
+    WS_OPCODE_PONG = 10
+} lwan_ws_opcode_t;
+
 typedef enum {
     CONN_CORO_ABORT = -1,
     CONN_CORO_MAY_RESUME = 0,
@@ -193,6 +267,12 @@ struct lwan_response_t_ {
         void *data;
         void *priv;
     } stream;
+
+    struct {
+        /* Framed chunks and events waiting to be written */
+        char *buffer;
+        size_t used;
+    } pending;
 };
 
 struct lwan_value_t_ {
@@ -210,6 +290,15 @@ struct lwan_connection_t_ {
     int prev, next; /* for death queue */
 };
 
+struct lwan_write_stats_t_ {
+    /* Per-connection write accounting; folded into the owning thread's
+     * totals when the connection is closed. */
+    lwan_thread_t *thread;
+    uint64_t bytes_queued;
+    uint64_t blocked_usec;
+    unsigned int stalls;
+};
+
 struct lwan_proxy_t_ {
     union {
         struct sockaddr_in ipv4;
@@ -224,6 +313,25 @@ struct lwan_request_t_ {
     lwan_value_t original_url;
     lwan_connection_t *conn;
     lwan_proxy_t *proxy;
+    lwan_write_stats_t *write_stats;
+    lwan_websocket_t *websocket;
+    /* Only set if TLS records have to go through userspace */
+    lwan_tls_session_t *tls;
+
+    /* Set when the request is routed; parameters are offsets into url */
+    struct {
+        const char *url;
+        lwan_trie_match_t match;
+    } route;
+
+    struct {
+        struct timespec start;
+        size_t bytes_written;
+        lwan_http_status_t status;
+        unsigned int prefix;
+        /* Only taken if request_timing is enabled */
+        uint64_t phases[N_REQUEST_PHASES];
+    } stats;
 
     struct {
         lwan_key_value_t *base;
@@ -235,6 +343,11 @@ struct lwan_request_t_ {
           off_t from;
           off_t to;
         } range;
+        lwan_value_t last_event_id;
+        struct {
+            lwan_value_t key;
+            lwan_value_t extensions;
+        } websocket;
     } header;
     lwan_response_t response;
 };
@@ -257,13 +370,65 @@ struct lwan_url_map_t_ {
     size_t prefix_len;
     lwan_handler_flags_t flags;
 
+    /* REQUEST_METHOD_* this handler is used for; 0 for all of them */
+    lwan_request_flags_t methods;
+    /* Only handle requests for the prefix itself */
+    bool exact_match;
+
+    /* Requests over this are answered with 503 without going through
+     * the handler; 0 for no limit */
+    unsigned int max_concurrent_requests;
+    unsigned int concurrent_requests;
+
     const lwan_module_t *module;
     void *args;
 
+    unsigned int stats_index;
+
     struct {
         char *realm;
         char *password_file;
     } authorization;
+
+    /* Type, prefix, and contents of the configuration file section this
+     * was created from; NULL if it wasn't loaded from one */
+    char *section_text;
+    /* While reloading, the map whose module instance this one is taking
+     * over because their sections didn't change */
+    lwan_url_map_t *reused_from;
+    /* The module instance now belongs to a map with newer routes */
+    bool handed_over;
+};
+
+struct lwan_routes_t_ {
+    /* One for each listener, in the same order as lwan_t.listeners */
+    lwan_trie_t trie[LWAN_MAX_LISTENERS];
+    /* Incremented every time the configuration is reloaded; requests
+     * using these routes are counted by I/O threads in
+     * route_refs[generation % LWAN_ROUTES_SLOTS] */
+    unsigned int generation;
+};
+
+struct lwan_listener_t_ {
+    /* As given in the configuration; Unix domain sockets are given as
+     * "unix:" followed by their path */
+    char *address;
+    int fd;
+    unsigned short keep_alive_timeout;
+    bool proxy_protocol;
+    bool http2;
+    /* The socket file was created by this process, rather than received
+     * from systemd or a previous binary, and is removed on shutdown */
+    bool owns_path;
+};
+
+struct lwan_thread_notification_t_ {
+    /* Queued with lwan_thread_notify(); the callback is then executed
+     * once in the I/O thread, no matter how many times it was queued in
+     * the meantime. */
+    lwan_thread_notification_t *next;
+    void (*callback)(lwan_thread_notification_t *notification);
+    bool queued;
 };
 
 struct lwan_thread_t_ {
@@ -274,34 +439,104 @@ struct lwan_thread_t_ {
         time_t last;
     } date;
 
+    lwan_thread_notification_t *notifications;
+
+    /* Connections to wake, queued by other threads */
+    struct {
+        lwan_thread_notification_t notification;
+        pthread_mutex_t lock;
+        lwan_connection_t **conns;
+        size_t len, size;
+    } wakeups;
+
+    lwan_access_log_ring_t *access_log;
+    lwan_thread_stats_t *stats;
+
+    /* Requests using routes of each generation slot; only changed by
+     * this thread, but read while reloading the configuration */
+    unsigned int route_refs[LWAN_ROUTES_SLOTS];
+
+    /* Connections handed to this thread and not closed yet; incremented
+     * by the main loop, and decremented by this thread */
+    unsigned int n_connections;
+
     int epoll_fd;
     int pipe_fd[2];
+    int notify_fd;
     pthread_t self;
+    /* Kernel thread ID, to direct signals (e.g. profiler timers) at it */
+    pid_t tid;
 };
 
 struct lwan_config_t_ {
+    /* Used if the configuration file doesn't have any listener */
     char *listener;
     unsigned short keep_alive_timeout;
+    unsigned short write_stall_timeout;
+    unsigned short drain_timeout;
+    unsigned int stream_flush_watermark;
+    /* Connections over these limits are rejected; 0 for no limit */
+    unsigned int max_connections;
+    unsigned int max_connections_per_thread;
     unsigned int expires;
     short unsigned int n_threads;
     bool quiet;
     bool reuse_port;
     bool proxy_protocol;
+    bool http2;
+
+    struct {
+        char *listener;
+        char *certificate;
+        char *private_key;
+        unsigned int ticket_key_rotation;
+    } tls;
+
+    struct {
+        char *path;
+        lwan_access_log_format_t format;
+    } access_log;
+
+    struct {
+        bool enabled;
+        bool server_timing;
+        /* In milliseconds; 0 disables the slow request log */
+        unsigned int slow_request_threshold;
+    } request_timing;
 };
 
 struct lwan_t_ {
-    lwan_trie_t url_map_trie;
+    /* Replaced atomically when the configuration is reloaded */
+    lwan_routes_t *routes;
     lwan_connection_t *conns;
 
     struct {
         lwan_thread_t *threads;
         unsigned int max_fd;
+        /* Connections each thread is expected to handle at most: the
+         * per-thread limit, or its share of the global one; 0 if there
+         * are no limits.  Keep-alive timeouts shrink as it's reached. */
+        unsigned int connection_limit;
         unsigned short count;
     } thread;
 
     struct hash *module_registry;
     lwan_config_t config;
-    int main_socket;
+
+    /* Routes, limits and options for connections accepted from each
+     * listener; the TLS socket uses the first one's */
+    lwan_listener_t listeners[LWAN_MAX_LISTENERS];
+    unsigned short n_listeners;
+
+    lwan_tls_context_t *tls;
+    int tls_socket;
+
+    lwan_access_log_t *access_log;
+    lwan_stats_t *stats;
+
+    /* Listening sockets were handed over to a new binary: connections
+     * are closed after the response they're waiting for */
+    bool draining;
 };
 
 void lwan_set_url_map(lwan_t *l, const lwan_url_map_t *map);
@@ -318,6 +553,8 @@ const char *lwan_request_get_query_param(lwan_request_t *request, const char *ke
     __attribute__((warn_unused_result));
 const char * lwan_request_get_cookie(lwan_request_t *request, const char *key)
     __attribute__((warn_unused_result));
+lwan_value_t lwan_request_get_route_param(const lwan_request_t *request, const char *name)
+    __attribute__((warn_unused_result));
 
 bool lwan_response_set_chunked(lwan_request_t *request, lwan_http_status_t status);
 void lwan_response_send_chunk(lwan_request_t *request);
@@ -325,6 +562,13 @@ void lwan_response_send_chunk(lwan_request_t *request);
 bool lwan_response_set_event_stream(lwan_request_t *request, lwan_http_status_t status);
 void lwan_response_send_event(lwan_request_t *request, const char *event);
 
+void lwan_response_flush(lwan_request_t *request);
+
+lwan_http_status_t lwan_request_websocket_upgrade(lwan_request_t *request)
+    __attribute__((warn_unused_result));
+lwan_ws_opcode_t lwan_ws_read(lwan_request_t *request);
+void lwan_ws_write(lwan_request_t *request, lwan_ws_opcode_t opcode);
+
 const char *lwan_http_status_as_string(lwan_http_status_t status)
     __attribute__((pure)) __attribute__((warn_unused_result));
 const char *lwan_http_status_as_string_with_code(lwan_http_status_t status)
@@ -347,6 +591,8 @@ int lwan_connection_get_fd(const lwan_t *lwan, const lwan_connection_t *conn)
 const char *lwan_request_get_remote_address(lwan_request_t *request,
             char buffer[ENFORCE_STATIC_BUFFER_LENGTH INET6_ADDRSTRLEN])
     __attribute__((warn_unused_result));
+const char *lwan_request_get_method_str(const lwan_request_t *request)
+    __attribute__((pure));
 
 void lwan_format_rfc_time(time_t t, char buffer[ENFORCE_STATIC_BUFFER_LENGTH 30]);
 
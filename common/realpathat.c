@@ -38,7 +38,7 @@ char *
 realpathat2(int dirfd, char *dirfdpath, const char *name, char *resolved,
         struct stat *st)
 {
-    char *rpath, *dest, extra_buf[PATH_MAX];
+    char *rpath, *dest, *extra_buf = NULL;
     const char *start, *end, *rpath_limit;
     int num_links = 0;
     ptrdiff_t dirfdlen;
@@ -145,7 +145,7 @@ realpathat2(int dirfd, char *dirfdpath, const char *name, char *resolved,
                 goto error;
 
             if (UNLIKELY(S_ISLNK(st->st_mode))) {
-                char buf[PATH_MAX];
+                char *buf;
                 size_t len;
 
                 if (UNLIKELY(++num_links > MAXSYMLINKS)) {
@@ -153,6 +153,15 @@ realpathat2(int dirfd, char *dirfdpath, const char *name, char *resolved,
                     goto error;
                 }
 
+                /* This is usually called from coroutines, which can't
+                 * spare 8KiB of stack for the rare symlink */
+                if (!extra_buf) {
+                    extra_buf = malloc(2 * PATH_MAX);
+                    if (UNLIKELY(!extra_buf))
+                        goto error;
+                }
+                buf = extra_buf + PATH_MAX;
+
                 n = (int)readlinkat(dirfd, pathat, buf, PATH_MAX - 1);
                 if (UNLIKELY(n < 0))
                     goto error;
@@ -186,10 +195,12 @@ realpathat2(int dirfd, char *dirfdpath, const char *name, char *resolved,
     *dest = '\0';
 
     assert(resolved == NULL || resolved == rpath);
+    free(extra_buf);
     return rpath;
 
   error:
     assert(resolved == NULL || resolved == rpath);
+    free(extra_buf);
     if (resolved == NULL)
         free(rpath);
     return NULL;
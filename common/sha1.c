@@ -0,0 +1,113 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2016 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+/*
+ * Straightforward SHA-1 (RFC 3174).  This is only used to compute the
+ * WebSocket handshake response, so it's not been optimized at all.
+ */
+
+#include <string.h>
+
+#include "sha1.h"
+
+static inline uint32_t
+rol32(uint32_t value, unsigned int bits)
+{
+	return (value << bits) | (value >> (32 - bits));
+}
+
+static void
+sha1_block(uint32_t state[static 5], const unsigned char block[static 64])
+{
+	uint32_t w[80];
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+	for (int i = 0; i < 16; i++) {
+		w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+			(uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+	}
+	for (int i = 16; i < 80; i++)
+		w[i] = rol32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	for (int i = 0; i < 80; i++) {
+		uint32_t f, k;
+
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+
+		uint32_t tmp = rol32(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = rol32(b, 30);
+		b = a;
+		a = tmp;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+}
+
+void
+sha1(const void *data, size_t len, unsigned char digest[static SHA1_DIGEST_SIZE])
+{
+	uint32_t state[5] = {
+		0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+	};
+	const unsigned char *p = data;
+	unsigned char block[64];
+	uint64_t bits = (uint64_t)len * 8;
+	size_t remaining = len;
+
+	for (; remaining >= 64; remaining -= 64, p += 64)
+		sha1_block(state, p);
+
+	memcpy(block, p, remaining);
+	block[remaining++] = 0x80;
+	if (remaining > 56) {
+		memset(block + remaining, 0, 64 - remaining);
+		sha1_block(state, block);
+		remaining = 0;
+	}
+	memset(block + remaining, 0, 56 - remaining);
+	for (int i = 0; i < 8; i++)
+		block[56 + i] = (unsigned char)(bits >> (56 - i * 8));
+	sha1_block(state, block);
+
+	for (int i = 0; i < 5; i++) {
+		digest[i * 4] = (unsigned char)(state[i] >> 24);
+		digest[i * 4 + 1] = (unsigned char)(state[i] >> 16);
+		digest[i * 4 + 2] = (unsigned char)(state[i] >> 8);
+		digest[i * 4 + 3] = (unsigned char)state[i];
+	}
+}
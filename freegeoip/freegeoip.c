@@ -34,6 +34,10 @@
 /* Set to 0 to disable */
 #define QUERIES_PER_HOUR 10000
 
+/* Scanning random addresses shouldn't make caches grow without bounds */
+#define IP_INFO_CACHE_MAX_ENTRIES 65536
+#define QUERY_LIMIT_CACHE_MAX_ENTRIES 262144
+
 struct ip_info_t {
     struct cache_entry_t base;
     struct {
@@ -292,6 +296,8 @@ create_ipinfo(const char *key, void *context __attribute__((unused)))
 end:
     sqlite3_finalize(stmt);
 end_no_finalize:
+    if (ip_info)
+        ip_info->base.cost = sizeof(*ip_info);
     return (struct cache_entry_t *)ip_info;
 }
 
@@ -301,8 +307,10 @@ create_query_limit(const char *key __attribute__((unused)),
             void *context __attribute__((unused)))
 {
     struct query_limit_t *entry = malloc(sizeof(*entry));
-    if (LIKELY(entry))
+    if (LIKELY(entry)) {
+        entry->base.cost = sizeof(*entry);
         entry->queries = 0;
+    }
     return (struct cache_entry_t *)entry;
 }
 
@@ -414,12 +422,19 @@ main(void)
         lwan_status_critical("Could not open database: %s",
                     sqlite3_errmsg(db));
     cache = cache_create(create_ipinfo, destroy_ipinfo, NULL, 10);
+    if (!cache || !cache_set_limits(cache, 0, IP_INFO_CACHE_MAX_ENTRIES))
+        lwan_status_critical("Could not create IP info cache");
+    /* Addresses that aren't in the database are looked up again less often */
+    cache_set_negative_ttl(cache, 5);
 
 #if QUERIES_PER_HOUR != 0
     lwan_status_info("Limiting to %d queries per hour per client",
                 QUERIES_PER_HOUR);
     query_limit = cache_create(create_query_limit,
                 destroy_query_limit, NULL, 3600);
+    if (!query_limit ||
+            !cache_set_limits(query_limit, 0, QUERY_LIMIT_CACHE_MAX_ENTRIES))
+        lwan_status_critical("Could not create query limit cache");
 #else
     lwan_status_info("Rate-limiting disabled");
 #endif
@@ -23,7 +23,9 @@
 #include <unistd.h>
 
 #include "lwan.h"
+#include "lwan-cache.h"
 #include "lwan-serve-files.h"
+#include "lwan-sse.h"
 
 enum args {
   ARGS_FAILED,
@@ -91,6 +93,61 @@ test_server_sent_event(lwan_request_t *request,
     return HTTP_OK;
 }
 
+lwan_http_status_t
+test_websocket_echo(lwan_request_t *request,
+            lwan_response_t *response __attribute__((unused)),
+            void *data __attribute__((unused)))
+{
+    lwan_http_status_t status = lwan_request_websocket_upgrade(request);
+    lwan_ws_opcode_t opcode;
+
+    if (status != HTTP_SWITCHING_PROTOCOLS)
+        return status;
+
+    while ((opcode = lwan_ws_read(request)) != WS_OPCODE_CLOSE)
+        lwan_ws_write(request, opcode);
+
+    return HTTP_OK;
+}
+
+static lwan_sse_channel_t *broadcast_channel;
+
+lwan_http_status_t
+test_sse_subscribe(lwan_request_t *request,
+            lwan_response_t *response __attribute__((unused)),
+            void *data __attribute__((unused)))
+{
+    lwan_sse_subscriber_t *subscriber;
+
+    subscriber = lwan_sse_channel_subscribe(broadcast_channel, request);
+    if (!subscriber)
+        return HTTP_INTERNAL_ERROR;
+
+    while (lwan_sse_subscriber_wait(subscriber));
+
+    return HTTP_OK;
+}
+
+lwan_http_status_t
+test_sse_publish(lwan_request_t *request,
+            lwan_response_t *response,
+            void *data __attribute__((unused)))
+{
+    const char *event = lwan_request_get_query_param(request, "event");
+    const char *value = lwan_request_get_query_param(request, "data");
+
+    if (!value)
+        return HTTP_BAD_REQUEST;
+
+    if (!lwan_sse_channel_publish(broadcast_channel, event, value, strlen(value)))
+        return HTTP_INTERNAL_ERROR;
+
+    response->mime_type = "text/plain";
+    strbuf_set_static(response->buffer, "Published", sizeof("Published") - 1);
+
+    return HTTP_OK;
+}
+
 lwan_http_status_t
 test_proxy(lwan_request_t *request,
            lwan_response_t *response,
@@ -112,6 +169,77 @@ test_proxy(lwan_request_t *request,
     return HTTP_OK;
 }
 
+lwan_http_status_t
+test_route_params(lwan_request_t *request,
+            lwan_response_t *response,
+            void *data __attribute__((unused)))
+{
+    lwan_value_t user = lwan_request_get_route_param(request, "user");
+    lwan_value_t post = lwan_request_get_route_param(request, "post");
+
+    if (!user.value || !post.value)
+        return HTTP_INTERNAL_ERROR;
+
+    response->mime_type = "text/plain";
+    strbuf_printf(response->buffer, "User %.*s, post %.*s",
+                (int)user.len, user.value, (int)post.len, post.value);
+
+    return HTTP_OK;
+}
+
+struct slow_cache_entry {
+    struct cache_entry_t base;
+    unsigned int fill;
+};
+
+static struct cache_t *slow_cache;
+static unsigned int slow_cache_fills;
+
+static struct cache_entry_t *
+slow_cache_entry_create(const char *key __attribute__((unused)),
+            void *context __attribute__((unused)))
+{
+    struct slow_cache_entry *entry = malloc(sizeof(*entry));
+
+    if (UNLIKELY(!entry))
+        return NULL;
+
+    /* Long enough for other requests for the same key to come in */
+    usleep(250000);
+    entry->fill = __atomic_add_fetch(&slow_cache_fills, 1, __ATOMIC_SEQ_CST);
+
+    return &entry->base;
+}
+
+static void
+slow_cache_entry_destroy(struct cache_entry_t *entry,
+            void *context __attribute__((unused)))
+{
+    free(entry);
+}
+
+lwan_http_status_t
+test_slow_cache(lwan_request_t *request,
+            lwan_response_t *response,
+            void *data __attribute__((unused)))
+{
+    const char *key = lwan_request_get_query_param(request, "key");
+    struct slow_cache_entry *entry;
+
+    if (!key)
+        return HTTP_BAD_REQUEST;
+
+    entry = (struct slow_cache_entry *)cache_coro_get_and_ref_entry(slow_cache,
+                request->conn->coro, key);
+    if (!entry)
+        return HTTP_INTERNAL_ERROR;
+
+    response->mime_type = "text/plain";
+    strbuf_printf(response->buffer, "Fill #%u", entry->fill);
+
+    return HTTP_OK;
+}
+
 lwan_http_status_t
 hello_world(lwan_request_t *request,
             lwan_response_t *response,
@@ -248,8 +376,21 @@ main(int argc, char *argv[])
         goto out;
     }
 
+    broadcast_channel = lwan_sse_channel_new(&l, 64, 0, SSE_SLOW_CONSUMER_DROP);
+    if (!broadcast_channel)
+        lwan_status_critical("Could not create broadcast channel");
+
+    slow_cache = cache_create(slow_cache_entry_create, slow_cache_entry_destroy,
+                NULL, 3600);
+    if (!slow_cache)
+        lwan_status_critical("Could not create slow cache");
+    if (!cache_enable_async_fill(slow_cache))
+        lwan_status_warning("Could not enable asynchronous fills for slow cache");
+
     lwan_main_loop(&l);
     lwan_shutdown(&l);
+    cache_destroy(slow_cache);
+    lwan_sse_channel_free(broadcast_channel);
 
 out:
 
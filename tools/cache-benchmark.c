@@ -0,0 +1,214 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2016 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Measures lwan-cache lookups from several threads at once, with a mix of
+ * keys that are (mostly) already cached and keys that aren't.
+ *
+ * Usage: cache-benchmark [threads] [lookups per thread]
+ */
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lwan.h"
+#include "lwan-cache.h"
+#include "lwan-private.h"
+
+#define HOT_KEYS 1024
+
+struct bench_entry {
+    struct cache_entry_t base;
+    size_t len;
+};
+
+struct mix {
+    const char *name;
+    /* Percentage of lookups for keys that were never seen before */
+    unsigned int miss_percent;
+    /* 0 for an unlimited cache */
+    unsigned int max_entries;
+};
+
+struct worker {
+    pthread_t self;
+    struct cache_t *cache;
+    const struct mix *mix;
+    unsigned int id;
+    unsigned int lookups;
+    uint64_t failed;
+};
+
+static struct cache_entry_t *
+create_entry(const char *key, void *context __attribute__((unused)))
+{
+    struct bench_entry *entry = malloc(sizeof(*entry));
+
+    if (!entry)
+        return NULL;
+
+    entry->len = strlen(key);
+    entry->base.cost = sizeof(*entry);
+    return &entry->base;
+}
+
+static void
+destroy_entry(struct cache_entry_t *entry,
+    void *context __attribute__((unused)))
+{
+    free(entry);
+}
+
+static void *
+run_worker(void *data)
+{
+    struct worker *worker = data;
+    unsigned int seed = worker->id;
+    unsigned int fresh = 0;
+    char key[64];
+
+    for (unsigned int i = 0; i < worker->lookups; i++) {
+        struct cache_entry_t *entry;
+        int error;
+
+        if ((unsigned int)rand_r(&seed) % 100 < worker->mix->miss_percent)
+            snprintf(key, sizeof(key), "/fresh/%u/%u", worker->id, fresh++);
+        else
+            snprintf(key, sizeof(key), "/hot/%u", (unsigned int)rand_r(&seed) % HOT_KEYS);
+
+        entry = cache_get_and_ref_entry(worker->cache, key, &error);
+        if (entry)
+            cache_entry_unref(worker->cache, entry);
+        else
+            worker->failed++;
+    }
+
+    return NULL;
+}
+
+static double
+elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) +
+        (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void
+run_mix(const struct mix *mix, unsigned int n_threads, unsigned int lookups)
+{
+    struct worker *workers = calloc(n_threads, sizeof(*workers));
+    struct cache_t *cache;
+    struct cache_stats stats;
+    struct timespec start;
+    uint64_t failed = 0;
+    double seconds;
+
+    if (!workers) {
+        perror("calloc");
+        exit(1);
+    }
+
+    cache = cache_create(create_entry, destroy_entry, NULL, 5);
+    if (!cache || !cache_set_limits(cache, 0, mix->max_entries)) {
+        fprintf(stderr, "Could not create cache\n");
+        exit(1);
+    }
+
+    for (unsigned int k = 0; k < HOT_KEYS; k++) {
+        char key[64];
+        struct cache_entry_t *entry;
+        int error;
+
+        snprintf(key, sizeof(key), "/hot/%u", k);
+        entry = cache_get_and_ref_entry(cache, key, &error);
+        if (entry)
+            cache_entry_unref(cache, entry);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (unsigned int i = 0; i < n_threads; i++) {
+        workers[i] = (struct worker) {
+            .cache = cache,
+            .mix = mix,
+            .id = i + 1,
+            .lookups = lookups
+        };
+        if (pthread_create(&workers[i].self, NULL, run_worker, &workers[i])) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    for (unsigned int i = 0; i < n_threads; i++) {
+        pthread_join(workers[i].self, NULL);
+        failed += workers[i].failed;
+    }
+
+    seconds = elapsed(&start);
+    cache_get_stats(cache, &stats);
+
+    printf("%-12s %2u threads: %10.0f lookups/s, %" PRIu64 " failed, "
+        "%5.1f%% hits, %zu entries\n",
+        mix->name, n_threads, (double)n_threads * lookups / seconds, failed,
+        100.0 * (double)stats.hits / (double)(stats.hits + stats.misses),
+        stats.entries);
+
+    cache_destroy(cache);
+    free(workers);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const struct mix mixes[] = {
+        { .name = "hit-heavy", .miss_percent = 0 },
+        { .name = "mixed", .miss_percent = 10 },
+        { .name = "miss-heavy", .miss_percent = 90 },
+        /* Room for all hot keys, but not for everything else */
+        { .name = "scan", .miss_percent = 50, .max_entries = 4 * HOT_KEYS },
+    };
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int n_threads = argc > 1 ? (unsigned int)atoi(argv[1]) :
+                                        (unsigned int)(n_cpus > 0 ? n_cpus : 1);
+    unsigned int lookups = argc > 2 ? (unsigned int)atoi(argv[2]) : 1000000;
+
+    if (!n_threads || !lookups) {
+        fprintf(stderr, "Usage: %s [threads] [lookups per thread]\n", argv[0]);
+        return 1;
+    }
+
+    lwan_job_thread_init();
+
+    for (size_t i = 0; i < N_ELEMENTS(mixes); i++)
+        run_mix(&mixes[i], n_threads, lookups);
+
+    lwan_job_thread_shutdown();
+
+    return 0;
+}
@@ -0,0 +1,238 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2016 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Measures insertions, lookups (for keys that are there and keys that
+ * aren't) and removals in hash tables with integer and string keys, for
+ * a few table sizes, both for the current tables and for the ones lwan
+ * used before (see hash-old.c).  The slowest insertions are also shown
+ * (the 99.99th percentile, which is less affected by the benchmark being
+ * preempted, and the maximum), as tables are resized while they're filled.
+ *
+ * The old tables get slow quickly past a few hundred thousand entries;
+ * pass -n to only measure the current ones.
+ *
+ * Usage: hash-benchmark [-n] [entries...]
+ */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+#include "hash-old.h"
+
+struct table_ops {
+    const char *name;
+    void *(*int_new)(void);
+    void *(*str_new)(void);
+    int (*add)(void *table, const void *key, const void *value);
+    void *(*find)(const void *table, const void *key);
+    int (*del)(void *table, const void *key);
+    unsigned int (*get_count)(const void *table);
+    void (*free)(void *table);
+};
+
+static void *new_int_new(void) { return hash_int_new(NULL, NULL); }
+static void *new_str_new(void) { return hash_str_new(NULL, NULL); }
+static int new_add(void *t, const void *k, const void *v) { return hash_add(t, k, v); }
+static void *new_find(const void *t, const void *k) { return hash_find(t, k); }
+static int new_del(void *t, const void *k) { return hash_del(t, k); }
+static unsigned int new_get_count(const void *t) { return hash_get_count(t); }
+static void new_free(void *t) { hash_free(t); }
+
+static void *old_int_new(void) { return old_hash_int_new(NULL, NULL); }
+static void *old_str_new(void) { return old_hash_str_new(NULL, NULL); }
+static int old_add(void *t, const void *k, const void *v) { return old_hash_add(t, k, v); }
+static void *old_find(const void *t, const void *k) { return old_hash_find(t, k); }
+static int old_del(void *t, const void *k) { return old_hash_del(t, k); }
+static unsigned int old_get_count(const void *t) { return old_hash_get_count(t); }
+static void old_free(void *t) { old_hash_free(t); }
+
+static const struct table_ops tables[] = {
+    {
+        .name = "old",
+        .int_new = old_int_new, .str_new = old_str_new,
+        .add = old_add, .find = old_find, .del = old_del,
+        .get_count = old_get_count, .free = old_free,
+    },
+    {
+        .name = "new",
+        .int_new = new_int_new, .str_new = new_str_new,
+        .add = new_add, .find = new_find, .del = new_del,
+        .get_count = new_get_count, .free = new_free,
+    },
+};
+
+static double
+elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) +
+        (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void
+report(const char *what, unsigned int n, const struct timespec *start)
+{
+    printf(" %s %7.1f", what, elapsed(start) * 1e9 / n);
+}
+
+static int
+compare_floats(const void *a, const void *b)
+{
+    float fa = *(const float *)a, fb = *(const float *)b;
+
+    return (fa > fb) - (fa < fb);
+}
+
+/* Keys [0, n) are inserted; keys [n, 2n) are only looked up */
+static void
+run(const struct table_ops *ops, const char *name, void *(*new_table)(void),
+    const void **keys, unsigned int n)
+{
+    void *hash = new_table();
+    struct timespec start;
+    unsigned int found = 0;
+    float *add_times;
+
+    printf("%s %-6s %9u entries, ns/op:", ops->name, name, n);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned int i = 0; i < n; i++) {
+        if (ops->add(hash, keys[i], keys[i]) < 0) {
+            fprintf(stderr, "\nCould not add entry\n");
+            exit(1);
+        }
+    }
+    report("add", n, &start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned int i = 0; i < n; i++)
+        found += ops->find(hash, keys[i]) != NULL;
+    report("hit", n, &start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned int i = n; i < 2 * n; i++)
+        found += ops->find(hash, keys[i]) != NULL;
+    report("miss", n, &start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned int i = 0; i < n; i++)
+        ops->del(hash, keys[i]);
+    report("del", n, &start);
+
+    /* Filled again from scratch, so that it's resized again */
+    ops->free(hash);
+    hash = new_table();
+
+    add_times = malloc(n * sizeof(*add_times));
+    if (!add_times) {
+        perror("malloc");
+        exit(1);
+    }
+
+    /* Timed separately, so that the average isn't skewed by the time it
+     * takes to read the clock */
+    for (unsigned int i = 0; i < n; i++) {
+        struct timespec add_start;
+
+        clock_gettime(CLOCK_MONOTONIC, &add_start);
+        ops->add(hash, keys[i], keys[i]);
+        add_times[i] = (float)(elapsed(&add_start) * 1e6);
+    }
+    qsort(add_times, n, sizeof(*add_times), compare_floats);
+    printf(" slowest adds (us): 99.99%% %.1f max %.1f\n",
+        add_times[(size_t)n * 9999 / 10000], add_times[n - 1]);
+    free(add_times);
+
+    if (found != n || ops->get_count(hash) != n) {
+        fprintf(stderr, "Found %u entries, expected %u\n", found, n);
+        exit(1);
+    }
+
+    ops->free(hash);
+}
+
+static void
+run_size(unsigned int n, bool skip_old)
+{
+    const void **keys = calloc(2 * (size_t)n, sizeof(*keys));
+    char *pool = malloc(2 * (size_t)n * 16);
+
+    if (!keys || !pool) {
+        perror("malloc");
+        exit(1);
+    }
+
+    /* Zero isn't a valid key: it's what hash_find() returns if a key
+     * isn't found */
+    for (unsigned int i = 0; i < 2 * n; i++)
+        keys[i] = (const void *)(uintptr_t)(i + 1);
+    for (size_t t = skip_old; t < sizeof(tables) / sizeof(tables[0]); t++)
+        run(&tables[t], "int", tables[t].int_new, keys, n);
+
+    for (unsigned int i = 0; i < 2 * n; i++) {
+        char *key = pool + (size_t)i * 16;
+
+        snprintf(key, 16, "/key/%u", i);
+        keys[i] = key;
+    }
+    for (size_t t = skip_old; t < sizeof(tables) / sizeof(tables[0]); t++)
+        run(&tables[t], "string", tables[t].str_new, keys, n);
+
+    free(pool);
+    free(keys);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const unsigned int default_sizes[] = { 1000, 100000, 10000000 };
+    bool skip_old = false;
+    int first = 1;
+
+    if (argc > 1 && !strcmp(argv[1], "-n")) {
+        skip_old = true;
+        first++;
+    }
+
+    if (argc > first) {
+        for (int i = first; i < argc; i++) {
+            int n = atoi(argv[i]);
+
+            if (n <= 0) {
+                fprintf(stderr, "Usage: %s [-n] [entries...]\n", argv[0]);
+                return 1;
+            }
+            run_size((unsigned int)n, skip_old);
+        }
+    } else {
+        for (size_t i = 0; i < sizeof(default_sizes) / sizeof(default_sizes[0]); i++)
+            run_size(default_sizes[i], skip_old);
+    }
+
+    return 0;
+}
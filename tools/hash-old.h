@@ -0,0 +1,20 @@
+#pragma once
+
+/*
+ * The hash table lwan used before common/hash.c switched to open
+ * addressing (512 buckets, each a linearly scanned array), kept only so
+ * that hash-benchmark can compare both.  Iterators and hash_add_unique()
+ * were left out.
+ */
+
+struct old_hash;
+
+struct old_hash *old_hash_int_new(void (*free_key)(void *value),
+			void (*free_value)(void *value));
+struct old_hash *old_hash_str_new(void (*free_key)(void *value),
+			void (*free_value)(void *value));
+void old_hash_free(struct old_hash *hash);
+int old_hash_add(struct old_hash *hash, const void *key, const void *value);
+int old_hash_del(struct old_hash *hash, const void *key);
+void *old_hash_find(const struct old_hash *hash, const void *key);
+unsigned int old_hash_get_count(const struct old_hash *hash);
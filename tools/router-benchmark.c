@@ -0,0 +1,229 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2016 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Measures route lookups in a table with a few hundred routes sharing
+ * long prefixes (as in "/api/v2/orders/refunds"), for URLs that match a
+ * route exactly, URLs with a suffix after the route (as prefixes are
+ * usually used), URLs that only match the root (including upper case
+ * versions of the routes), and URLs for routes with parameters.  Results
+ * are checked, and wrong ones are counted.  Static lookups are also
+ * measured with the trie lwan used before (see trie-old.c), which matches
+ * upper case URLs to lower case routes, so it gets all of those wrong.
+ *
+ * Usage: router-benchmark [lookups]
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lwan.h"
+#include "trie-old.h"
+
+static const char *const versions[] = { "v1", "v2", "v3" };
+static const char *const resources[] = {
+    "users", "orders", "products", "invoices", "payments", "shipments",
+    "carts", "reviews", "sessions", "tokens", "webhooks", "reports",
+};
+static const char *const actions[] = {
+    "", "/search", "/export", "/import", "/stats", "/history", "/archive",
+    "/refunds",
+};
+
+#define N_ROUTES \
+    (N_ELEMENTS(versions) * N_ELEMENTS(resources) * N_ELEMENTS(actions))
+
+struct table {
+    char *routes[N_ROUTES];
+    size_t n_routes;
+};
+
+static double
+elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) +
+        (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void
+build_table(lwan_trie_t *trie, struct old_trie *old_trie, struct table *table)
+{
+    lwan_trie_init(trie, NULL);
+
+    for (size_t v = 0; v < N_ELEMENTS(versions); v++) {
+        for (size_t r = 0; r < N_ELEMENTS(resources); r++) {
+            for (size_t a = 0; a < N_ELEMENTS(actions); a++) {
+                char *route;
+
+                if (asprintf(&route, "/api/%s/%s%s", versions[v],
+                             resources[r], actions[a]) < 0) {
+                    perror("asprintf");
+                    exit(1);
+                }
+
+                table->routes[table->n_routes++] = route;
+                lwan_trie_add(trie, route, route);
+                old_trie_add(old_trie, route, route);
+            }
+        }
+    }
+
+    lwan_trie_add(trie, "/", "/");
+    old_trie_add(old_trie, "/", "/");
+}
+
+static void
+run_urls(const char *name, lwan_trie_t *trie, struct old_trie *old_trie,
+    char **urls, const char **expected, size_t n_urls, unsigned int lookups)
+{
+    struct timespec start;
+    unsigned int wrong = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned int i = 0; i < lookups; i++) {
+        size_t idx = i % n_urls;
+
+        if (old_trie_lookup_prefix(old_trie, urls[idx]) != expected[idx])
+            wrong++;
+    }
+
+    printf("old %-8s %7.1f ns/lookup, %u wrong\n", name,
+        elapsed(&start) * 1e9 / lookups, wrong);
+
+    wrong = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned int i = 0; i < lookups; i++) {
+        size_t idx = i % n_urls;
+
+        if (lwan_trie_lookup_prefix(trie, urls[idx]) != expected[idx])
+            wrong++;
+    }
+
+    printf("new %-8s %7.1f ns/lookup, %u wrong\n", name,
+        elapsed(&start) * 1e9 / lookups, wrong);
+}
+
+static void
+run_params(unsigned int lookups)
+{
+    static const char *const urls[] = {
+        "/users/1234",
+        "/users/1234/posts/5678",
+        "/users/1234/posts/5678/comments/9",
+        "/repos/lpereira/lwan/issues/42",
+    };
+    lwan_trie_t trie;
+    struct timespec start;
+    unsigned int wrong = 0;
+
+    lwan_trie_init(&trie, NULL);
+    lwan_trie_add_route(&trie, "/users/:user", 0, false, "user");
+    lwan_trie_add_route(&trie, "/users/:user/posts/:post", 0, false, "post");
+    lwan_trie_add_route(&trie, "/users/:user/posts/:post/comments/:comment",
+        0, true, "comment");
+    lwan_trie_add_route(&trie, "/repos/:owner/:repo/issues/:issue", 0, true,
+        "issue");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned int i = 0; i < lookups; i++) {
+        lwan_trie_match_t match;
+        size_t idx = i % N_ELEMENTS(urls);
+
+        if (!lwan_trie_lookup_route(&trie, urls[idx], REQUEST_METHOD_GET, &match) ||
+            match.n_params != (idx == 3 ? 3 : idx + 1))
+            wrong++;
+    }
+
+    printf("new %-8s %7.1f ns/lookup, %u wrong\n", "params",
+        elapsed(&start) * 1e9 / lookups, wrong);
+
+    lwan_trie_destroy(&trie);
+}
+
+int
+main(int argc, char *argv[])
+{
+    unsigned int lookups = argc > 1 ? (unsigned int)atoi(argv[1]) : 10000000;
+    struct table table = { .n_routes = 0 };
+    char *urls[N_ROUTES];
+    const char *expected[N_ROUTES];
+    struct old_trie *old_trie = old_trie_new();
+    lwan_trie_t trie;
+
+    if (!lookups) {
+        fprintf(stderr, "Usage: %s [lookups]\n", argv[0]);
+        return 1;
+    }
+
+    build_table(&trie, old_trie, &table);
+    printf("%zu routes\n", table.n_routes + 1);
+
+    for (size_t i = 0; i < table.n_routes; i++) {
+        urls[i] = table.routes[i];
+        expected[i] = table.routes[i];
+    }
+    run_urls("exact", &trie, old_trie, urls, expected, table.n_routes, lookups);
+
+    for (size_t i = 0; i < table.n_routes; i++) {
+        if (asprintf(&urls[i], "%s/some/file.html", table.routes[i]) < 0) {
+            perror("asprintf");
+            return 1;
+        }
+    }
+    run_urls("suffix", &trie, old_trie, urls, expected, table.n_routes, lookups);
+    for (size_t i = 0; i < table.n_routes; i++)
+        free(urls[i]);
+
+    for (size_t i = 0; i < table.n_routes; i++) {
+        /* Long enough to hold any route, for the next run */
+        if (asprintf(&urls[i], "/static/%zu/file.html%32s", i, "") < 0) {
+            perror("asprintf");
+            return 1;
+        }
+        expected[i] = "/";
+    }
+    run_urls("root", &trie, old_trie, urls, expected, table.n_routes, lookups);
+
+    /* Upper case URLs don't match any route other than the root */
+    for (size_t i = 0; i < table.n_routes; i++) {
+        strcpy(urls[i], table.routes[i]);
+        for (char *p = urls[i]; *p; p++)
+            *p = (char)toupper(*p);
+    }
+    run_urls("case", &trie, old_trie, urls, expected, table.n_routes, lookups);
+
+    for (size_t i = 0; i < table.n_routes; i++)
+        free(urls[i]);
+
+    run_params(lookups);
+
+    lwan_trie_destroy(&trie);
+    old_trie_free(old_trie);
+    for (size_t i = 0; i < table.n_routes; i++)
+        free(table.routes[i]);
+
+    return 0;
+}
@@ -11,6 +11,14 @@ import socket
 import sys
 import os
 import re
+import signal
+import struct
+import threading
+import tempfile
+import shutil
+import select
+import resource
+import json
 
 LWAN_PATH = './build/lwan/lwan'
 for arg in sys.argv[1:]:
@@ -21,11 +29,27 @@ for arg in sys.argv[1:]:
 print 'Using', LWAN_PATH, 'for lwan'
 
 class LwanTest(unittest.TestCase):
+  # If set, lwan is started in a temporary directory, with this as lwan.conf
+  config = None
+
   def setUp(self):
+    self.cwd = None
+    if self.config is not None:
+      self.cwd = tempfile.mkdtemp()
+      with open(os.path.join(self.cwd, 'lwan.conf'), 'w') as f:
+        f.write(self.config)
+
+    # Nothing reads lwan's output: a pipe would fill up and block it
+    # (e.g. a debug build under load)
+    self.output = open(os.devnull, 'w')
+
+    if self.cwd is not None:
+      self.populate()
+
     for spawn_try in range(20):
       self.lwan=subprocess.Popen(
-        [LWAN_PATH],
-        stdout=subprocess.PIPE, stderr=subprocess.STDOUT
+        [os.path.abspath(LWAN_PATH)], cwd=self.cwd,
+        stdout=self.output, stderr=subprocess.STDOUT
       )
       for request_try in range(20):
         try:
@@ -38,12 +62,19 @@ class LwanTest(unittest.TestCase):
 
     raise Exception('Timeout waiting for lwan')
 
+  def populate(self):
+    # Creates whatever lwan needs in self.cwd before it's started
+    pass
+
   def tearDown(self):
     self.lwan.poll()
     if self.lwan.returncode is not None:
       self.assertEqual(self.lwan.returncode, 0)
     else:
       self.lwan.kill()
+    self.output.close()
+    if self.cwd is not None:
+      shutil.rmtree(self.cwd)
 
   def assertHttpResponseValid(self, request, status_code, content_type):
     self.assertEqual(request.status_code, status_code)
@@ -211,6 +242,326 @@ class TestFileServing(LwanTest):
     self.assertTrue('location' in r.headers)
     self.assertEqual(r.headers['location'], '/icons/')
 
+class TestCachedFiles(LwanTest):
+  config = """
+listener *:8080 {
+    prefix /hello {
+            handler = hello_world
+    }
+    serve_files /files {
+            path = .
+            cache negative period = 0
+    }
+}
+"""
+
+  def setUp(self):
+    # lwan raises its soft limit up to the hard one when it starts; the
+    # number of files it keeps open should follow that
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if hard == resource.RLIM_INFINITY or hard < 1024:
+      self.skipTest('needs a hard limit on open files of at least 1024')
+    resource.setrlimit(resource.RLIMIT_NOFILE, (64, hard))
+    try:
+      super(TestCachedFiles, self).setUp()
+    finally:
+      resource.setrlimit(resource.RLIMIT_NOFILE, (soft, hard))
+
+  def open_files(self):
+    fd_dir = '/proc/%d/fd' % self.lwan.pid
+    paths = set()
+    for fd in os.listdir(fd_dir):
+      try:
+        paths.add(os.readlink(os.path.join(fd_dir, fd)))
+      except OSError:
+        pass
+    return paths
+
+  def test_large_files_stay_open_past_the_initial_limit(self):
+    names = ['large%d.bin' % i for i in range(32)]
+    for name in names:
+      with open(os.path.join(self.cwd, name), 'w') as f:
+        f.write(name[0] * 65536)
+
+    for name in names:
+      r = requests.get('http://127.0.0.1:8080/files/' + name)
+      self.assertEqual(len(r.content), 65536)
+
+    # 64 / 4 would have been 16 of them
+    open_files = self.open_files()
+    self.assertEqual(sum(1 for name in names
+          if os.path.join(os.path.realpath(self.cwd), name) in open_files), 32)
+
+
+class TestNonblockingReads(LwanTest):
+  config = """
+listener *:8080 {
+    prefix /hello {
+            handler = hello_world
+    }
+    serve_files /files {
+            path = .
+            cache negative period = 0
+            nonblocking reads = true
+    }
+}
+"""
+
+  def drop_from_page_cache(self, path):
+    # GNU dd drops the whole file with this
+    subprocess.call(['dd', 'if=' + path, 'iflag=nocache', 'count=0'],
+          stderr=open(os.devnull, 'w'))
+
+  def test_cold_and_warm_files(self):
+    path = os.path.join(self.cwd, 'large.bin')
+    contents = ''.join(chr(i % 251) for i in range(3 * 1024 * 1024 + 1234))
+    with open(path, 'wb') as f:
+      f.write(contents)
+    url = 'http://127.0.0.1:8080/files/large.bin'
+
+    for i in range(2):
+      self.drop_from_page_cache(path)
+      r = requests.get(url)
+      self.assertEqual(r.status_code, 200)
+      self.assertEqual(r.content, contents)
+
+      # Warm now, except for what gets dropped again
+      r = requests.get(url)
+      self.assertEqual(r.content, contents)
+
+    # Sent at once up to where it's not in the page cache anymore, and
+    # a window at a time from there, starting in the middle of a window
+    self.drop_from_page_cache(path)
+    with open(path, 'rb') as f:
+      f.read(1536 * 1024 + 100)
+    r = requests.get(url)
+    self.assertEqual(r.content, contents)
+
+
+class TestConcurrentCache(LwanTest):
+  config = """
+threads = 4
+listener *:8080 {
+    prefix /hello {
+            handler = hello_world
+    }
+    serve_files /files {
+            path = .
+            # Small enough for entries to be evicted while others are
+            # being looked up
+            cache max entries = 32
+            cache negative period = 1h
+    }
+}
+"""
+
+  def test_concurrent_hits_and_misses(self):
+    # Keys are spread over all the shards; large files keep descriptors
+    # open, small ones are mapped
+    files = {}
+    for i in range(128):
+      name = 'file%d.txt' % i
+      files[name] = ('%d\n' % i) * (i % 4 == 0 and 8192 or 16)
+      with open(os.path.join(self.cwd, name), 'w') as f:
+        f.write(files[name])
+    missing = ['missing%d.txt' % i for i in range(32)]
+
+    errors = []
+
+    def generate_load(seed):
+      session = requests.Session()
+      names = files.keys() + missing
+      for i in range(300):
+        name = names[(seed * 7919 + i * 104729) % len(names)]
+        try:
+          r = session.get('http://127.0.0.1:8080/files/' + name)
+        except requests.RequestException as e:
+          errors.append(e)
+          continue
+        expected = (200, files[name]) if name in files else (404, None)
+        if r.status_code != expected[0] or \
+              (expected[1] is not None and r.content != expected[1]):
+          errors.append((name, r.status_code))
+
+    threads = [threading.Thread(target=generate_load, args=(seed,))
+          for seed in range(8)]
+    for thread in threads:
+      thread.daemon = True
+      thread.start()
+    for thread in threads:
+      thread.join(60)
+
+    self.assertFalse(any(thread.is_alive() for thread in threads))
+    self.assertEqual(errors, [])
+
+
+class TestAccessLog(LwanTest):
+  config = """
+access_log access.log {
+    format = %s
+}
+listener *:8080 {
+    prefix /hello {
+            handler = hello_world
+    }
+}
+"""
+
+  format = 'text'
+
+  def setUp(self):
+    self.config = TestAccessLog.config % self.format
+    super(TestAccessLog, self).setUp()
+
+  def read_log(self, marker):
+    # Records are written by another thread, a batch at a time
+    for i in range(50):
+      with open(os.path.join(self.cwd, 'access.log'), 'rb') as f:
+        contents = f.read()
+      if marker in contents:
+        return contents
+      time.sleep(0.1)
+    self.fail('%s not found in access log' % marker)
+
+  def get_raw(self, target):
+    sock = socket.create_connection(('127.0.0.1', 8080))
+    try:
+      sock.send('GET %s HTTP/1.0\r\n\r\n' % target)
+      return sock.recv(4096)
+    finally:
+      sock.close()
+
+  def test_query_string_is_logged(self):
+    r = requests.get('http://127.0.0.1:8080/hello?name=access&x=1')
+    self.assertResponsePlain(r)
+
+    lines = [l for l in self.read_log('name=access').splitlines()
+          if 'name=access' in l]
+    self.assertEqual(len(lines), 1)
+    self.assertTrue(re.match(r'^127\.0\.0\.1 - - '
+          r'\[\d{2}/\w{3}/\d{4}:\d{2}:\d{2}:\d{2} \+0000\] '
+          r'"GET /hello\?name=access&x=1 HTTP/1\.1" 200 \d+ \d+us$',
+          lines[0]), lines[0])
+
+  def test_quotes_are_escaped(self):
+    self.get_raw('/hello?name="quoted"')
+
+    contents = self.read_log('quoted')
+    self.assertTrue('"GET /hello?name=\\"quoted\\" HTTP/1.0" 200 ' in contents)
+
+
+class TestAccessLogJSON(TestAccessLog):
+  format = 'json'
+
+  def test_query_string_is_logged(self):
+    r = requests.get('http://127.0.0.1:8080/hello?name=access&x=1')
+    self.assertResponsePlain(r)
+
+    lines = [l for l in self.read_log('name=access').splitlines()
+          if 'name=access' in l]
+    self.assertEqual(len(lines), 1)
+    record = json.loads(lines[0])
+    self.assertEqual(record['addr'], '127.0.0.1')
+    self.assertEqual(record['method'], 'GET')
+    self.assertEqual(record['url'], '/hello?name=access&x=1')
+    self.assertEqual(record['version'], 'HTTP/1.1')
+    self.assertEqual(record['status'], 200)
+    self.assertTrue(record['bytes'] > 0)
+    self.assertTrue(re.match(r'^\d{4}-\d{2}-\d{2}T\d{2}:\d{2}:\d{2}\.\d{6}Z$',
+          record['time']))
+
+  def test_quotes_are_escaped(self):
+    self.get_raw('/hello?name="quoted"')
+
+    lines = [l for l in self.read_log('quoted').splitlines() if 'quoted' in l]
+    self.assertEqual(json.loads(lines[0])['url'], '/hello?name="quoted"')
+
+
+class TestAccessLogBinary(TestAccessLog):
+  format = 'binary'
+  header = struct.Struct('=QQIHHBBBB16s4x')
+
+  def records(self, contents):
+    while contents:
+      fields = self.header.unpack_from(contents)
+      url_len = fields[4]
+      start = self.header.size
+      yield fields, contents[start:start + url_len]
+      contents = contents[start + url_len:]
+
+  def test_query_string_is_logged(self):
+    r = requests.get('http://127.0.0.1:8080/hello?name=access&x=1')
+    self.assertResponsePlain(r)
+
+    records = [(fields, url) for fields, url in
+          self.records(self.read_log('name=access')) if 'name=access' in url]
+    self.assertEqual(len(records), 1)
+    fields, url = records[0]
+    time_usec, length, duration_usec, status, url_len, method, family, \
+          version, flags, addr = fields
+    self.assertEqual(url, '/hello?name=access&x=1')
+    self.assertEqual(status, 200)
+    self.assertEqual(version, 11)
+    self.assertEqual(family, socket.AF_INET)
+    self.assertEqual(socket.inet_ntoa(addr[:4]), '127.0.0.1')
+    self.assertEqual(flags, 0)
+    self.assertTrue(length > 0)
+    self.assertTrue(abs(time_usec / 1000000 - time.time()) < 60)
+
+  def test_quotes_are_escaped(self):
+    # Nothing to escape: targets are stored as they were sent
+    self.get_raw('/hello?name="quoted"')
+
+    urls = [url for fields, url in self.records(self.read_log('quoted'))]
+    self.assertTrue('/hello?name="quoted"' in urls)
+
+  def test_long_targets_are_truncated(self):
+    self.get_raw('/hello?name=long&pad=' + 'x' * 512)
+
+    records = [(fields, url) for fields, url in
+          self.records(self.read_log('name=long')) if 'name=long' in url]
+    fields, url = records[0]
+    self.assertTrue(url.startswith('/hello?name=long&pad=xxx'))
+    self.assertTrue(len(url) < 512)
+    self.assertEqual(fields[8], 1)
+
+
+class TestServerTiming(LwanTest):
+  config = """
+request_timing {
+    server_timing = true
+}
+listener *:8080 {
+    prefix /hello {
+            handler = hello_world
+    }
+    prefix /chunked {
+            handler = test_chunked_encoding
+    }
+}
+"""
+
+  def phases(self, r):
+    self.assertTrue('Server-Timing' in r.headers)
+    phases = []
+    for metric in r.headers['Server-Timing'].split(', '):
+      m = re.match(r'^(\w+);dur=(\d+\.\d{3})$', metric)
+      self.assertTrue(m, metric)
+      phases.append(m.group(1))
+    return phases
+
+  def test_phases_until_handler(self):
+    r = requests.get('http://127.0.0.1:8080/hello')
+    self.assertResponsePlain(r)
+    self.assertEqual(self.phases(r), ['parse', 'route', 'prepare', 'handler'])
+
+  def test_streamed_responses_dont_time_handler(self):
+    # Headers go out before the handler returns
+    r = requests.get('http://127.0.0.1:8080/chunked')
+    self.assertEqual(r.status_code, 200)
+    self.assertEqual(self.phases(r), ['parse', 'route', 'prepare'])
+
+
 class TestRewrite(LwanTest):
   def test_pattern_redirect_to(self):
     r = requests.get('http://127.0.0.1:8080/pattern/foo/1234x5678', allow_redirects=False)
@@ -227,6 +578,53 @@ class TestRewrite(LwanTest):
     self.assertEqual(r.text, 'Hello, rewritten42!')
 
 
+class TestRoutes(LwanTest):
+  def test_route_params(self):
+    r = requests.get('http://127.0.0.1:8080/users/alice/posts/42')
+
+    self.assertResponsePlain(r)
+    self.assertEqual(r.text, 'User alice, post 42')
+
+    r = requests.get('http://127.0.0.1:8080/users/bob/posts/1/comments?page=2')
+
+    self.assertResponsePlain(r)
+    self.assertEqual(r.text, 'User bob, post 1')
+
+  def test_route_params_need_whole_segments(self):
+    r = requests.get('http://127.0.0.1:8080/users/alice')
+    self.assertResponse404(r)
+
+    r = requests.get('http://127.0.0.1:8080/users/alice/comments/42')
+    self.assertResponse404(r)
+
+  def test_routes_by_method(self):
+    r = requests.get('http://127.0.0.1:8080/by-method')
+    self.assertResponsePlain(r)
+    self.assertEqual(r.text, 'Hello, world!')
+
+    r = requests.head('http://127.0.0.1:8080/by-method')
+    self.assertResponsePlain(r)
+
+    r = requests.post('http://127.0.0.1:8080/by-method', data={'foo': 'bar'})
+    self.assertHttpResponseValid(r, 200, 'image/gif')
+
+  def test_method_not_allowed(self):
+    r = requests.post('http://127.0.0.1:8080/exact', data={'foo': 'bar'})
+
+    self.assertResponseHtml(r, 405)
+    self.assertEqual(r.headers['allow'], 'GET, HEAD')
+
+  def test_exact_match(self):
+    r = requests.get('http://127.0.0.1:8080/exact?name=exact')
+    self.assertResponsePlain(r)
+    self.assertEqual(r.text, 'Hello, exact!')
+
+    r = requests.get('http://127.0.0.1:8080/exact/more')
+    self.assertResponse404(r)
+
+    r = requests.get('http://127.0.0.1:8080/exactly')
+    self.assertResponse404(r)
+
 class SocketTest(LwanTest):
   def connect(self, host='127.0.0.1', port=8080):
     def _connect(host, port):
@@ -357,6 +755,13 @@ class TestHelloWorld(LwanTest):
     self.assertEqual(r.text, '')
 
 
+  def test_no_server_timing_by_default(self):
+    r = requests.get('http://127.0.0.1:8080/hello')
+
+    self.assertResponsePlain(r)
+    self.assertFalse('server-timing' in r.headers)
+
+
   def test_has_custom_header(self):
     r = requests.get('http://127.0.0.1:8080/hello')
 
@@ -480,6 +885,94 @@ class TestCache(LwanTest):
     requests.get('http://127.0.0.1:8080/100.html')
     self.assertEqual(self.count_mmaps('/100.html'), 1)
 
+
+  def test_concurrent_misses_share_one_fill(self):
+    results = []
+
+    def get():
+      r = requests.get('http://127.0.0.1:8080/slow-cache?key=shared')
+      results.append((r.status_code, r.text))
+
+    threads = [threading.Thread(target=get) for i in range(8)]
+    for thread in threads:
+      thread.start()
+    for thread in threads:
+      thread.join()
+
+    self.assertEqual(results, [(200, 'Fill #1')] * 8)
+
+    r = requests.get('http://127.0.0.1:8080/slow-cache?key=shared')
+    self.assertEqual(r.text, 'Fill #1')
+    r = requests.get('http://127.0.0.1:8080/slow-cache?key=another')
+    self.assertEqual(r.text, 'Fill #2')
+
+
+  def test_missing_files_are_remembered_for_a_while(self):
+    path = 'wwwroot/created-later.txt'
+
+    r = requests.get('http://127.0.0.1:8080/created-later.txt')
+    self.assertResponse404(r)
+
+    try:
+      with open(path, 'w') as f:
+        f.write('Created later')
+
+      # "cache negative period" is 2s in lwan.conf
+      r = requests.get('http://127.0.0.1:8080/created-later.txt')
+      self.assertResponse404(r)
+
+      time.sleep(3)
+
+      r = requests.get('http://127.0.0.1:8080/created-later.txt')
+      self.assertResponsePlain(r)
+      self.assertEqual(r.text, 'Created later')
+    finally:
+      os.unlink(path)
+
+
+  def wait_for_text(self, url, text, timeout=3.0):
+    while timeout >= 0:
+      r = requests.get(url)
+      if r.text == text:
+        return r
+      time.sleep(0.1)
+      timeout -= 0.1
+    return r
+
+
+  def test_inotify_invalidation(self):
+    path = 'wwwroot/watched.txt'
+    url = 'http://127.0.0.1:8080/watched/watched.txt'
+
+    # Directories are watched once something in them is cached
+    r = requests.get('http://127.0.0.1:8080/watched/100.html')
+    self.assertResponseHtml(r)
+
+    r = requests.get(url)
+    self.assertResponse404(r)
+
+    try:
+      # Found right away, even though "cache negative period" is 1h
+      with open(path, 'w') as f:
+        f.write('First version')
+      r = self.wait_for_text(url, 'First version')
+      self.assertResponsePlain(r)
+
+      # Otherwise, the cached version would be served for an hour
+      with open(path, 'w') as f:
+        f.write('Second version')
+      r = self.wait_for_text(url, 'Second version')
+      self.assertResponsePlain(r)
+    finally:
+      os.unlink(path)
+
+    timeout = 3.0
+    while timeout >= 0 and r.status_code != 404:
+      r = requests.get(url)
+      time.sleep(0.1)
+      timeout -= 0.1
+    self.assertResponse404(r)
+
 class TestProxyProtocolRequests(SocketTest):
   def test_proxy_version1(self):
     proxy = "PROXY TCP4 192.168.242.221 192.168.242.242 56324 31337\r\n"
@@ -538,5 +1031,724 @@ Accept: text/plain,text/html;q=0.9,application/xhtml+xml;q=0.9,application/xml;q
       self.assertTrue(s in responses)
       responses = responses.replace(s, '')
 
+class TestBroadcast(SocketTest):
+  def subscribe(self, last_event_id=None):
+    sock = self.connect()
+    req = 'GET /broadcast/subscribe HTTP/1.1\r\nHost: localhost\r\n'
+    if last_event_id is not None:
+      req += 'Last-Event-ID: %d\r\n' % last_event_id
+    sock.send(req + '\r\n')
+    return sock
+
+  def recv_until(self, sock, s):
+    contents = ''
+    while s not in contents:
+      response = sock.recv(4096)
+      if not response:
+        break
+      contents += response
+    return contents
+
+  def test_publish_reaches_all_subscribers(self):
+    socks = [self.subscribe() for i in range(8)]
+    for sock in socks:
+      self.assertTrue('text/event-stream' in self.recv_until(sock, '\r\n\r\n'))
+
+    r = requests.get('http://127.0.0.1:8080/broadcast/publish?event=tick&data=42')
+    self.assertResponsePlain(r)
+
+    for sock in socks:
+      self.assertEqual(self.recv_until(sock, 'data: 42\n\n'),
+                       'id: 1\nevent: tick\ndata: 42\n\n')
+
+  def test_last_event_id_replays_events(self):
+    for i in range(3):
+      requests.get('http://127.0.0.1:8080/broadcast/publish?data=%d' % i)
+
+    sock = self.subscribe(last_event_id=1)
+    contents = self.recv_until(sock, 'data: 2\n\n')
+
+    self.assertFalse('data: 0\n' in contents)
+    self.assertTrue('id: 2\ndata: 1\n\nid: 3\ndata: 2\n\n' in contents)
+
+class TestConnectionLimits(SocketTest):
+  config = '''
+threads = 1
+max_connections = 2
+listener *:8080 {
+    prefix /hello {
+            handler = hello_world
+    }
+    prefix /subscribe {
+            handler = test_sse_subscribe
+            max concurrent requests = 1
+    }
+}
+'''
+
+  def is_rejected(self, sock):
+    # Connections over the limit are sent a 503 without lwan reading
+    # anything from them
+    readable, _, _ = select.select([sock], [], [], 0.5)
+    if not readable:
+      return False
+
+    response = sock.recv(4096)
+    self.assertTrue(response.startswith('HTTP/1.1 503 Service unavailable\r\n'), response)
+    self.assertTrue('Connection: close\r\n' in response, response)
+    self.assertEqual(sock.recv(4096), '')
+    return True
+
+  def request(self, sock, path):
+    sock.send('GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n' % path)
+    response = ''
+    while '\r\n\r\n' not in response:
+      data = sock.recv(4096)
+      if not data:
+        break
+      response += data
+    return response
+
+  def test_connections_over_the_limit_are_rejected(self):
+    # Wait for the connection made by setUp() to go away
+    time.sleep(0.5)
+
+    # At the limit, idle connections are only kept for a second: look at
+    # all of them at once
+    socks = [self.connect() for i in range(4)]
+    time.sleep(0.5)
+    readable, _, _ = select.select(socks, [], [], 0)
+    self.assertEqual([sock in readable for sock in socks],
+          [False, False, True, True])
+    self.assertTrue(self.is_rejected(socks[2]))
+    self.assertTrue(self.is_rejected(socks[3]))
+
+    socks[0].close()
+    time.sleep(0.5)
+
+    sock = self.connect()
+    self.assertFalse(self.is_rejected(sock))
+    self.assertTrue(self.request(sock, '/hello').startswith('HTTP/1.1 200 OK'))
+
+  def test_requests_over_the_prefix_limit_are_rejected(self):
+    time.sleep(0.5)
+
+    subscriber = self.connect()
+    self.assertTrue('text/event-stream' in self.request(subscriber, '/subscribe'))
+
+    sock = self.connect()
+    self.assertTrue(self.request(sock, '/subscribe').startswith('HTTP/1.1 503 '))
+    sock.close()
+
+    subscriber.close()
+    time.sleep(0.5)
+
+    sock = self.connect()
+    self.assertTrue('text/event-stream' in self.request(sock, '/subscribe'))
+
+class TestTimeouts(SocketTest):
+  config = """
+threads = 1
+listener *:8080 {
+    keep alive timeout = 30
+    prefix /hello {
+            handler = hello_world
+    }
+}
+listener *:8081 {
+    keep alive timeout = 2
+    prefix /hello {
+            handler = hello_world
+    }
+}
+"""
+
+  def request(self, sock):
+    sock.send('GET /hello HTTP/1.1\r\nHost: localhost\r\n\r\n')
+    response = ''
+    while 'Hello, world!' not in response:
+      response += sock.recv(4096)
+
+  def is_closed(self, sock, timeout):
+    readable, _, _ = select.select([sock], [], [], timeout)
+    return bool(readable) and sock.recv(4096) == ''
+
+  def test_shorter_timeouts_expire_first(self):
+    long_lived = self.connect()
+    self.request(long_lived)
+    short_lived = self.connect(port=8081)
+    self.request(short_lived)
+
+    # Connections with a longer timeout don't hold up the others
+    self.assertTrue(self.is_closed(short_lived, 5))
+    self.assertFalse(self.is_closed(long_lived, 0))
+
+
+class TestSSEHeartbeat(SocketTest):
+  config = """
+listener *:8080 {
+    keep alive timeout = 1
+    prefix /subscribe {
+            handler = test_sse_subscribe
+    }
+    prefix /publish {
+            handler = test_sse_publish
+    }
+}
+"""
+
+  def recv_until(self, sock, s):
+    contents = ''
+    while s not in contents:
+      readable, _, _ = select.select([sock], [], [], 5)
+      if not readable:
+        break
+      response = sock.recv(4096)
+      if not response:
+        break
+      contents += response
+    return contents
+
+  def test_heartbeat_only_after_timeout(self):
+    sock = self.connect()
+    sock.send('GET /subscribe HTTP/1.1\r\nHost: localhost\r\n\r\n')
+    self.assertTrue('text/event-stream' in self.recv_until(sock, '\r\n\r\n'))
+
+    # Being woken up by a publish doesn't send a heartbeat
+    r = requests.get('http://127.0.0.1:8080/publish?data=42')
+    self.assertResponsePlain(r)
+    self.assertEqual(self.recv_until(sock, 'data: 42\n\n'), 'id: 1\ndata: 42\n\n')
+
+    # Staying idle past the keep-alive timeout does
+    self.assertEqual(self.recv_until(sock, ':\n\n'), ':\n\n')
+
+
+class TestReload(SocketTest):
+  config = """
+listener *:8080 {
+    prefix /hello {
+            handler = hello_world
+    }
+    prefix /subscribe {
+            handler = test_sse_subscribe
+    }
+    serve_files /files {
+            path = .
+            cache period = 1h
+            cache negative period = 0
+    }
+%s}
+"""
+
+  def setUp(self):
+    self.config = self.config % ''
+    super(TestReload, self).setUp()
+
+  def reload(self, extra_routes):
+    with open(os.path.join(self.cwd, 'lwan.conf'), 'w') as f:
+      f.write(TestReload.config % extra_routes)
+    self.lwan.send_signal(signal.SIGHUP)
+
+  def wait_for_status(self, url, status, timeout=3.0):
+    while timeout >= 0:
+      r = requests.get(url)
+      if r.status_code == status:
+        return r
+      time.sleep(0.1)
+      timeout -= 0.1
+    return r
+
+  def route(self, prefix):
+    return '    prefix %s {\n            handler = hello_world\n    }\n' % prefix
+
+  def test_reload_while_streaming(self):
+    path = os.path.join(self.cwd, 'file.txt')
+    with open(path, 'w') as f:
+      f.write('one')
+    r = requests.get('http://127.0.0.1:8080/files/file.txt')
+    self.assertEqual(r.text, 'one')
+    # Cached files might be mapped: replace this one rather than change it
+    with open(path + '.new', 'w') as f:
+      f.write('two')
+    os.rename(path + '.new', path)
+
+    # Keeps the routes it started with until it's closed
+    subscriber = self.connect()
+    subscriber.send('GET /subscribe HTTP/1.1\r\nHost: localhost\r\n\r\n')
+    self.assertTrue('text/event-stream' in subscriber.recv(4096))
+
+    self.assertEqual(requests.get('http://127.0.0.1:8080/first').status_code, 404)
+    self.reload(self.route('/first'))
+    r = self.wait_for_status('http://127.0.0.1:8080/first', 200)
+    self.assertResponsePlain(r)
+
+    # The serve_files section didn't change, and neither did its cache
+    r = requests.get('http://127.0.0.1:8080/files/file.txt')
+    self.assertEqual(r.text, 'one')
+
+    # Replacing these routes doesn't wait for the subscriber either
+    self.reload(self.route('/first') + self.route('/second'))
+    r = self.wait_for_status('http://127.0.0.1:8080/second', 200)
+    self.assertResponsePlain(r)
+
+    subscriber.close()
+
+
+class TestWebSocket(SocketTest):
+  def upgrade(self, extensions=None):
+    sock = self.connect()
+    req = 'GET /ws-echo HTTP/1.1\r\n' \
+          'Host: localhost\r\n' \
+          'Upgrade: websocket\r\n' \
+          'Connection: Upgrade\r\n' \
+          'Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n' \
+          'Sec-WebSocket-Version: 13\r\n'
+    if extensions is not None:
+      req += 'Sec-WebSocket-Extensions: %s\r\n' % extensions
+    sock.send(req + '\r\n')
+
+    response = ''
+    while not '\r\n\r\n' in response:
+      response += sock.recv(4096)
+    return sock, response
+
+  def send_frame(self, sock, first_byte, payload):
+    mask = '\x01\x02\x03\x04'
+    masked = ''.join(chr(ord(c) ^ ord(mask[i % 4])) for i, c in enumerate(payload))
+    sock.send(chr(first_byte) + chr(0x80 | len(payload)) + mask + masked)
+
+  def recv_frame(self, sock):
+    header = sock.recv(2)
+    length = ord(header[1]) & 0x7f
+    payload = ''
+    while len(payload) < length:
+      payload += sock.recv(length - len(payload))
+    return ord(header[0]), payload
+
+  def test_handshake(self):
+    sock, response = self.upgrade()
+
+    self.assertTrue(response.startswith('HTTP/1.1 101 '))
+    self.assertTrue('\r\nUpgrade: websocket\r\n' in response)
+    self.assertTrue('\r\nSec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n' in response)
+    self.assertFalse('Sec-WebSocket-Extensions' in response)
+
+  def test_deflate_negotiation(self):
+    sock, response = self.upgrade('permessage-deflate; server_max_window_bits=10')
+
+    self.assertTrue('\r\nSec-WebSocket-Extensions: permessage-deflate; server_max_window_bits=10\r\n' in response)
+
+  def test_fragmented_echo_with_ping(self):
+    sock, response = self.upgrade()
+
+    self.send_frame(sock, 0x01, 'Hello, ')
+    self.send_frame(sock, 0x89, 'ping')
+    self.send_frame(sock, 0x80, 'World!')
+
+    self.assertEqual(self.recv_frame(sock), (0x8a, 'ping'))
+    self.assertEqual(self.recv_frame(sock), (0x81, 'Hello, World!'))
+
+  def test_close_handshake(self):
+    sock, response = self.upgrade()
+
+    self.send_frame(sock, 0x88, '\x03\xe8')
+
+    self.assertEqual(self.recv_frame(sock), (0x88, '\x03\xe8'))
+    self.assertEqual(sock.recv(1), '')
+
+  def test_invalid_utf8_text_is_rejected(self):
+    sock, response = self.upgrade()
+
+    self.send_frame(sock, 0x81, '\xff\xfe')
+
+    self.assertEqual(self.recv_frame(sock), (0x88, '\x03\xef'))
+
+  def test_deflate_message_with_final_block(self):
+    import zlib
+
+    sock, response = self.upgrade('permessage-deflate')
+    decompressor = zlib.decompressobj(-15)
+
+    for i in range(2):
+      compressor = zlib.compressobj(9, zlib.DEFLATED, -15)
+      payload = compressor.compress('Hello, World!') + compressor.flush()
+      self.send_frame(sock, 0xc1, payload)
+
+      first_byte, echoed = self.recv_frame(sock)
+      if first_byte & 0x40:
+        echoed = decompressor.decompress(echoed + '\x00\x00\xff\xff')
+      self.assertEqual(echoed, 'Hello, World!')
+
+  def test_plain_request_is_rejected(self):
+    r = requests.get('http://127.0.0.1:8080/ws-echo')
+
+    self.assertEqual(r.status_code, 400)
+
+
+class TestHTTP2(SocketTest):
+  PREFACE = 'PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n'
+
+  def frame(self, type, flags, stream_id, payload=''):
+    return struct.pack('!I', len(payload))[1:] + \
+           struct.pack('!BBI', type, flags, stream_id) + payload
+
+  def literal(self, name, value):
+    # Literal header field without indexing, new name, no Huffman coding
+    return '\x00' + chr(len(name)) + name + chr(len(value)) + value
+
+  def get_request(self, stream_id, path):
+    # :method GET and :scheme http come from the static table
+    block = '\x82\x86' + self.literal(':path', path) + \
+            self.literal(':authority', 'localhost')
+    return self.frame(0x1, 0x5, stream_id, block)
+
+  def recv_frame(self, sock):
+    header = ''
+    while len(header) < 9:
+      chunk = sock.recv(9 - len(header))
+      if not chunk:
+        return None
+      header += chunk
+    length = struct.unpack('!I', '\x00' + header[:3])[0]
+    type, flags, stream_id = struct.unpack('!BBI', header[3:])
+    payload = ''
+    while len(payload) < length:
+      payload += sock.recv(length - len(payload))
+    return type, flags, stream_id & 0x7fffffff, payload
+
+  def recv_response(self, sock, stream_id):
+    block, body = '', ''
+    while True:
+      type, flags, sid, payload = self.recv_frame(sock)
+      if sid != stream_id:
+        continue
+      if type == 0x1:
+        block += payload
+      elif type == 0x0:
+        body += payload
+      if flags & 0x1:
+        return block, body
+
+  def test_prior_knowledge(self):
+    sock = self.connect()
+    sock.send(self.PREFACE + self.frame(0x4, 0, 0) + self.get_request(1, '/hello'))
+
+    block, body = self.recv_response(sock, 1)
+
+    # Dynamic table size update to 0, then :status 200 from the static table
+    self.assertEqual(block[:2], '\x20\x88')
+    self.assertEqual(body, 'Hello, world!')
+
+  def test_multiplexed_streams(self):
+    sock = self.connect()
+    sock.send(self.PREFACE + self.frame(0x4, 0, 0) +
+              self.get_request(1, '/hello?name=one') +
+              self.get_request(3, '/hello?name=three'))
+
+    bodies = {}
+    while len(bodies) < 2:
+      type, flags, stream_id, payload = self.recv_frame(sock)
+      if type == 0x0:
+        bodies[stream_id] = bodies.get(stream_id, '') + payload
+
+    self.assertEqual(bodies[1], 'Hello, one!')
+    self.assertEqual(bodies[3], 'Hello, three!')
+
+  def test_upgrade(self):
+    sock = self.connect()
+    sock.send('GET /hello HTTP/1.1\r\n'
+              'Host: localhost\r\n'
+              'Connection: Upgrade, HTTP2-Settings\r\n'
+              'Upgrade: h2c\r\n'
+              'HTTP2-Settings: AAMAAABkAAQAAP__\r\n\r\n')
+
+    response = ''
+    while not '\r\n\r\n' in response:
+      response += sock.recv(1)
+    self.assertTrue(response.startswith('HTTP/1.1 101 '))
+    self.assertTrue('\r\nUpgrade: h2c\r\n' in response)
+
+    sock.send(self.PREFACE + self.frame(0x4, 0, 0))
+    block, body = self.recv_response(sock, 1)
+
+    self.assertEqual(body, 'Hello, world!')
+
+  def cpu_ticks(self):
+    with open('/proc/%d/stat' % self.lwan.pid) as f:
+      fields = f.read().rsplit(')', 1)[1].split()
+    # utime and stime
+    return int(fields[11]) + int(fields[12])
+
+  def test_waiting_streams_are_parked(self):
+    sock = self.connect()
+    sock.send(self.PREFACE + self.frame(0x4, 0, 0) +
+              ''.join(self.get_request(1 + 2 * i, '/slow-cache?key=parked%d&n=%d' % (i % 2, i))
+                      for i in range(8)))
+
+    ticks = self.cpu_ticks()
+    bodies, finished = {}, set()
+    while len(finished) < 8:
+      type, flags, stream_id, payload = self.recv_frame(sock)
+      if type == 0x0:
+        bodies[stream_id] = bodies.get(stream_id, '') + payload
+      if type in (0x0, 0x1) and flags & 0x1:
+        finished.add(stream_id)
+
+    # Both fills take 250ms; streams waiting for them shouldn't be
+    # resumed over and over in the meantime
+    self.assertLess(self.cpu_ticks() - ticks, 10)
+    self.assertEqual(len(set(bodies.values())), 2)
+
+  def test_ping(self):
+    sock = self.connect()
+    sock.send(self.PREFACE + self.frame(0x4, 0, 0) + self.frame(0x6, 0, 0, 'lwanping'))
+
+    while True:
+      type, flags, stream_id, payload = self.recv_frame(sock)
+      if type == 0x6:
+        break
+    self.assertEqual((flags, payload), (0x1, 'lwanping'))
+
+  def test_protocol_error(self):
+    sock = self.connect()
+    # Clients can't initiate streams with even identifiers
+    sock.send(self.PREFACE + self.frame(0x4, 0, 0) + self.get_request(2, '/hello'))
+
+    while True:
+      type, flags, stream_id, payload = self.recv_frame(sock)
+      if type == 0x7:
+        break
+    self.assertEqual(struct.unpack('!II', payload), (0, 0x1))
+    self.assertEqual(self.recv_frame(sock), None)
+
+class TestStats(LwanTest):
+  def test_prometheus(self):
+    for i in range(3):
+      requests.get('http://127.0.0.1:8080/hello')
+
+    r = requests.get('http://127.0.0.1:8080/stats')
+
+    self.assertHttpResponseValid(r, 200, 'text/plain; version=0.0.4')
+    self.assertTrue('# TYPE lwan_connections_accepted_total counter\n' in r.text)
+    self.assertTrue('lwan_requests_total{code="2xx"} ' in r.text)
+
+    count = re.search(r'^lwan_request_duration_seconds_count{prefix="/hello"} (\d+)$',
+          r.text, re.MULTILINE)
+    self.assertTrue(count is not None)
+    self.assertTrue(int(count.group(1)) >= 3)
+    self.assertTrue('lwan_request_duration_seconds_bucket{prefix="/hello",le="+Inf"} %s\n' %
+          count.group(1) in r.text)
+
+  def test_json(self):
+    requests.get('http://127.0.0.1:8080/hello')
+
+    r = requests.get('http://127.0.0.1:8080/stats?format=json')
+
+    self.assertHttpResponseValid(r, 200, 'application/json')
+    stats = r.json()
+    self.assertTrue(stats['connections']['accepted'] >= 2)
+    self.assertTrue(stats['requests']['2xx'] >= 1)
+
+    hello = stats['latency_usec']['/hello']
+    self.assertTrue(hello['count'] >= 1)
+    self.assertTrue(hello['p50'] <= hello['p99'] <= hello['max'])
+
+  def test_invalid_format(self):
+    r = requests.get('http://127.0.0.1:8080/stats?format=xml')
+
+    self.assertEqual(r.status_code, 400)
+
+
+class TestProfiler(LwanTest):
+  def test_start_stop(self):
+    r = requests.get('http://127.0.0.1:8080/profiler?action=start&frequency=1000')
+    self.assertHttpResponseValid(r, 200, 'text/plain')
+    self.assertEqual(r.text, 'Profiling at 1000Hz\n')
+
+    for i in range(100):
+      requests.get('http://127.0.0.1:8080/hello')
+
+    r = requests.get('http://127.0.0.1:8080/profiler?action=stop')
+    self.assertHttpResponseValid(r, 200, 'text/plain')
+
+    r = requests.get('http://127.0.0.1:8080/profiler')
+    self.assertHttpResponseValid(r, 200, 'text/plain')
+    for line in r.text.splitlines():
+      self.assertTrue(re.match(r'^lwan-thread-\d+(;[^; ]+)+ \d+$', line))
+
+  def test_invalid_parameters(self):
+    r = requests.get('http://127.0.0.1:8080/profiler?action=pause')
+    self.assertEqual(r.status_code, 400)
+
+    r = requests.get('http://127.0.0.1:8080/profiler?action=start&frequency=0')
+    self.assertEqual(r.status_code, 400)
+
+
+class TestUnixSocket(LwanTest):
+  def test_hello_world(self):
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect('lwan.sock')
+    sock.send('GET /hello HTTP/1.0\r\n\r\n')
+
+    response = ''
+    while True:
+      data = sock.recv(1024)
+      if not data:
+        break
+      response += data
+    sock.close()
+
+    self.assertTrue(response.startswith('HTTP/1.0 200 OK'))
+    self.assertTrue(response.endswith('\r\n\r\nHello, world!'))
+
+  def test_routes_are_per_listener(self):
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect('lwan.sock')
+    sock.send('GET /100.html HTTP/1.0\r\n\r\n')
+    response = sock.recv(128)
+    sock.close()
+
+    self.assertTrue(response.startswith('HTTP/1.0 404 Not found'))
+
+    r = requests.get('http://127.0.0.1:8080/100.html')
+    self.assertEqual(r.status_code, 200)
+
+
+class TestUpgrade(LwanTest):
+  def new_lwan_pid(self):
+    for i in range(100):
+      try:
+        return int(subprocess.check_output(['pgrep', '-P', str(self.lwan.pid)]))
+      except subprocess.CalledProcessError:
+        time.sleep(0.1)
+    raise Exception('Timeout waiting for new lwan')
+
+  def test_no_errors_across_upgrade(self):
+    results = {'ok': 0, 'errors': []}
+    done = threading.Event()
+
+    def generate_load(path):
+      session = requests.Session()
+      while not done.is_set():
+        try:
+          r = session.get('http://127.0.0.1:8080%s' % path)
+          if r.status_code == 200:
+            results['ok'] += 1
+          else:
+            results['errors'].append(r.status_code)
+        except requests.RequestException as e:
+          results['errors'].append(e)
+
+    threads = [threading.Thread(target=generate_load, args=(path,))
+          for path in ('/hello', '/', '/100.html', '/hello?name=upgrade')]
+    try:
+      for thread in threads:
+        thread.daemon = True
+        thread.start()
+
+      time.sleep(1)
+      self.lwan.send_signal(signal.SIGUSR2)
+      new_pid = self.new_lwan_pid()
+
+      # The previous process exits once its connections have been drained
+      self.lwan.wait()
+      time.sleep(1)
+    finally:
+      # Daemon threads won't keep the suite from exiting if one of these
+      # is stuck waiting for lwan
+      done.set()
+      for thread in threads:
+        if thread.is_alive():
+          thread.join(5)
+
+    try:
+      self.assertEqual(results['errors'], [])
+      self.assertTrue(results['ok'] > 0)
+
+      r = requests.get('http://127.0.0.1:8080/hello')
+      self.assertResponsePlain(r)
+    finally:
+      os.kill(new_pid, signal.SIGINT)
+
+
+class TestTLS(LwanTest):
+  config = """
+listener *:8080 {
+    prefix /hello {
+            handler = hello_world
+    }
+    serve_files /files {
+            path = .
+    }
+}
+tls *:8443 {
+    certificate = server.crt
+    private_key = server.key
+}
+"""
+
+  def populate(self):
+    subprocess.check_call(['openssl', 'req', '-x509', '-nodes', '-days', '1',
+          '-newkey', 'ec', '-pkeyopt', 'ec_paramgen_curve:prime256v1',
+          '-subj', '/CN=localhost', '-keyout', 'server.key',
+          '-out', 'server.crt'], cwd=self.cwd,
+          stdout=self.output, stderr=subprocess.STDOUT)
+
+  def s_client(self, *args):
+    # lwan doesn't close connections right after the response, so read
+    # until it arrives instead of waiting for EOF
+    p = subprocess.Popen(['openssl', 's_client', '-connect', '127.0.0.1:8443',
+          '-ign_eof'] + list(args), cwd=self.cwd, stdin=subprocess.PIPE,
+          stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    p.stdin.write('GET /hello HTTP/1.1\r\nHost: localhost\r\n\r\n')
+    p.stdin.flush()
+
+    output = ''
+    try:
+      while 'Hello, world!' not in output:
+        readable, _, _ = select.select([p.stdout], [], [], 5)
+        if not readable:
+          break
+        data = os.read(p.stdout.fileno(), 4096)
+        if not data:
+          break
+        output += data
+    finally:
+      p.kill()
+      p.wait()
+    return output
+
+  def test_hello_world(self):
+    r = requests.get('https://127.0.0.1:8443/hello', verify=False)
+    self.assertResponsePlain(r)
+    self.assertEqual(r.text, 'Hello, world!')
+
+  def test_routes_are_shared_with_first_listener(self):
+    r = requests.get('https://127.0.0.1:8443/hello?name=tls', verify=False)
+    self.assertEqual(r.text, 'Hello, tls!')
+
+  def test_large_file(self):
+    # Sent with sendfile() once the kernel has the keys, or encrypted in
+    # userspace otherwise; either way, it must arrive intact
+    contents = ''.join(chr(i % 251) for i in range(2 * 1024 * 1024 + 1234))
+    with open(os.path.join(self.cwd, 'large.bin'), 'wb') as f:
+      f.write(contents)
+
+    session = requests.Session()
+    for i in range(2):
+      r = session.get('https://127.0.0.1:8443/files/large.bin', verify=False)
+      self.assertEqual(r.status_code, 200)
+      self.assertEqual(r.content, contents)
+
+  def test_session_tickets_resume_sessions(self):
+    output = self.s_client('-sess_out', 'session.pem')
+    self.assertTrue('Hello, world!' in output)
+    self.assertTrue(os.path.exists(os.path.join(self.cwd, 'session.pem')))
+
+    output = self.s_client('-sess_in', 'session.pem')
+    self.assertTrue('Hello, world!' in output)
+    self.assertTrue('Reused, ' in output)
+
+
 if __name__ == '__main__':
   unittest.main()
@@ -0,0 +1,180 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2012 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwan.h"
+#include "trie-old.h"
+
+struct old_trie_leaf {
+    char *key;
+    void *data;
+    struct old_trie_leaf *next;
+};
+
+struct old_trie_node {
+    struct old_trie_node *next[8];
+    struct old_trie_leaf *leaf;
+    int ref_count;
+};
+
+struct old_trie {
+    struct old_trie_node *root;
+};
+
+struct old_trie *
+old_trie_new(void)
+{
+    struct old_trie *trie = calloc(1, sizeof(*trie));
+
+    if (!trie)
+        lwan_status_critical_perror("calloc");
+    return trie;
+}
+
+static ALWAYS_INLINE struct old_trie_leaf *
+find_leaf_with_key(struct old_trie_node *node, const char *key, size_t len)
+{
+    struct old_trie_leaf *leaf = node->leaf;
+
+    if (!leaf)
+        return NULL;
+
+    if (!leaf->next) /* No collisions -- no need to strncmp() */
+        return leaf;
+
+    for (; leaf; leaf = leaf->next) {
+        if (!strncmp(leaf->key, key, len - 1))
+            return leaf;
+    }
+
+    return NULL;
+}
+
+#define GET_NODE() \
+    do { \
+        if (!(node = *knode)) { \
+            *knode = node = calloc(1, sizeof(*node)); \
+            if (!node) \
+                goto oom; \
+        } \
+        ++node->ref_count; \
+    } while(0)
+
+void
+old_trie_add(struct old_trie *trie, const char *key, void *data)
+{
+    if (UNLIKELY(!trie || !key || !data))
+        return;
+
+    struct old_trie_node **knode, *node;
+    const char *orig_key = key;
+
+    /* Traverse the trie, allocating nodes if necessary */
+    for (knode = &trie->root; *key; knode = &node->next[(int)(*key++ & 7)])
+        GET_NODE();
+
+    /* Get the leaf node (allocate it if necessary) */
+    GET_NODE();
+
+    struct old_trie_leaf *leaf = find_leaf_with_key(node, orig_key, (size_t)(key - orig_key));
+    bool had_key = leaf;
+    if (!leaf) {
+        leaf = malloc(sizeof(*leaf));
+        if (!leaf)
+            lwan_status_critical_perror("malloc");
+    }
+
+    leaf->data = data;
+    if (!had_key) {
+        leaf->key = strdup(orig_key);
+        leaf->next = node->leaf;
+        node->leaf = leaf;
+    }
+    return;
+
+oom:
+    lwan_status_critical_perror("calloc");
+}
+
+#undef GET_NODE
+
+static ALWAYS_INLINE struct old_trie_node *
+lookup_node(struct old_trie_node *root, const char *key, size_t *prefix_len)
+{
+    struct old_trie_node *node, *previous_node = NULL;
+    const char *orig_key = key;
+
+    for (node = root; node && *key; node = node->next[(int)(*key++ & 7)]) {
+        if (node->leaf)
+            previous_node = node;
+    }
+
+    *prefix_len = (size_t)(key - orig_key);
+    if (node && node->leaf)
+        return node;
+    return previous_node;
+}
+
+void *
+old_trie_lookup_prefix(struct old_trie *trie, const char *key)
+{
+    size_t prefix_len;
+    struct old_trie_node *node = lookup_node(trie->root, key, &prefix_len);
+    if (!node)
+        return NULL;
+    struct old_trie_leaf *leaf = find_leaf_with_key(node, key, prefix_len);
+    return leaf ? leaf->data : NULL;
+}
+
+static void
+old_trie_node_destroy(struct old_trie_node *node)
+{
+    if (!node)
+        return;
+
+    int32_t nodes_destroyed = node->ref_count;
+
+    for (struct old_trie_leaf *leaf = node->leaf; leaf;) {
+        struct old_trie_leaf *tmp = leaf->next;
+
+        free(leaf->key);
+        free(leaf);
+        leaf = tmp;
+    }
+
+    for (int32_t i = 0; nodes_destroyed > 0 && i < 8; i++) {
+        if (node->next[i]) {
+            old_trie_node_destroy(node->next[i]);
+            --nodes_destroyed;
+        }
+    }
+
+    free(node);
+}
+
+void
+old_trie_free(struct old_trie *trie)
+{
+    if (!trie)
+        return;
+    old_trie_node_destroy(trie->root);
+    free(trie);
+}
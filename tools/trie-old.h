@@ -0,0 +1,17 @@
+#pragma once
+
+/*
+ * The trie lwan used for URL maps before common/lwan-trie.c switched to a
+ * radix tree (one node per byte, with children indexed by the lower 3
+ * bits of the next byte), kept only so that router-benchmark can compare
+ * both.
+ */
+
+#include <stdbool.h>
+
+struct old_trie;
+
+struct old_trie *old_trie_new(void);
+void old_trie_free(struct old_trie *trie);
+void old_trie_add(struct old_trie *trie, const char *key, void *data);
+void *old_trie_lookup_prefix(struct old_trie *trie, const char *key);
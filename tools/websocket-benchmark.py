@@ -0,0 +1,197 @@
+#!/usr/bin/python
+# Measures WebSocket echo throughput and latency against the sample
+# server's /ws-echo endpoint.  Every connection sends one message and waits
+# for it to be echoed back before sending the next one.
+
+import argparse
+import base64
+import os
+import socket
+import struct
+import sys
+import threading
+import time
+import zlib
+
+
+def handshake(host, port, path, deflate):
+  sock = socket.create_connection((host, port))
+  sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+  key = base64.b64encode(os.urandom(16)).decode('ascii')
+  request = 'GET %s HTTP/1.1\r\n' \
+            'Host: %s\r\n' \
+            'Upgrade: websocket\r\n' \
+            'Connection: Upgrade\r\n' \
+            'Sec-WebSocket-Key: %s\r\n' \
+            'Sec-WebSocket-Version: 13\r\n' % (path, host, key)
+  if deflate:
+    request += 'Sec-WebSocket-Extensions: permessage-deflate\r\n'
+  sock.sendall((request + '\r\n').encode('ascii'))
+
+  response = b''
+  while not b'\r\n\r\n' in response:
+    chunk = sock.recv(4096)
+    if not chunk:
+      raise RuntimeError('connection closed during handshake')
+    response += chunk
+
+  headers, rest = response.split(b'\r\n\r\n', 1)
+  if not headers.startswith(b'HTTP/1.1 101'):
+    raise RuntimeError('upgrade refused: %r' % headers.split(b'\r\n')[0])
+  if rest:
+    raise RuntimeError('unexpected data after handshake')
+
+  negotiated = b'permessage-deflate' in headers.lower()
+  return sock, negotiated
+
+
+def recv_exact(sock, length):
+  data = b''
+  while len(data) < length:
+    chunk = sock.recv(length - len(data))
+    if not chunk:
+      raise RuntimeError('connection closed')
+    data += chunk
+  return data
+
+
+def mask_payload(payload, mask):
+  masked = bytearray(payload)
+  mask = bytearray(mask)
+  for i in range(len(masked)):
+    masked[i] ^= mask[i & 3]
+  return bytes(masked)
+
+
+def send_frame(sock, opcode, payload, rsv1=False):
+  first = 0x80 | opcode | (0x40 if rsv1 else 0)
+  length = len(payload)
+  if length < 126:
+    header = struct.pack('!BB', first, 0x80 | length)
+  elif length <= 0xffff:
+    header = struct.pack('!BBH', first, 0x80 | 126, length)
+  else:
+    header = struct.pack('!BBQ', first, 0x80 | 127, length)
+  mask = os.urandom(4)
+  sock.sendall(header + mask + mask_payload(payload, mask))
+
+
+def recv_frame(sock):
+  first, second = struct.unpack('!BB', recv_exact(sock, 2))
+  length = second & 0x7f
+  if length == 126:
+    length, = struct.unpack('!H', recv_exact(sock, 2))
+  elif length == 127:
+    length, = struct.unpack('!Q', recv_exact(sock, 8))
+  return first & 0x0f, bool(first & 0x40), recv_exact(sock, length)
+
+
+class Connection(object):
+  def __init__(self, args):
+    self.sock, self.deflate = handshake(args.host, args.port, args.path,
+                                        args.deflate)
+    if self.deflate:
+      self.compressor = zlib.compressobj(zlib.Z_DEFAULT_COMPRESSION,
+                                         zlib.DEFLATED, -zlib.MAX_WBITS)
+      self.decompressor = zlib.decompressobj(-zlib.MAX_WBITS)
+
+  def send(self, payload):
+    if self.deflate:
+      data = self.compressor.compress(payload)
+      data += self.compressor.flush(zlib.Z_SYNC_FLUSH)
+      send_frame(self.sock, 0x2, data[:-4], rsv1=True)
+    else:
+      send_frame(self.sock, 0x2, payload)
+
+  def recv(self):
+    while True:
+      opcode, compressed, payload = recv_frame(self.sock)
+      if opcode == 0x9:
+        send_frame(self.sock, 0xa, payload)
+        continue
+      if opcode == 0x8:
+        raise RuntimeError('server closed the connection')
+      if compressed:
+        return self.decompressor.decompress(payload + b'\x00\x00\xff\xff')
+      return payload
+
+  def close(self):
+    send_frame(self.sock, 0x8, struct.pack('!H', 1000))
+    try:
+      recv_frame(self.sock)
+    except RuntimeError:
+      pass
+    self.sock.close()
+
+
+def worker(args, payload, latencies, errors):
+  try:
+    conn = Connection(args)
+    deadline = time.time() + args.duration
+    samples = []
+    while time.time() < deadline:
+      start = time.time()
+      conn.send(payload)
+      if conn.recv() != payload:
+        raise RuntimeError('echoed payload differs')
+      samples.append(time.time() - start)
+    conn.close()
+    latencies.extend(samples)
+  except Exception as e:
+    errors.append(str(e))
+
+
+def percentile(sorted_values, p):
+  if not sorted_values:
+    return 0.0
+  index = min(len(sorted_values) - 1, int(len(sorted_values) * p / 100.0))
+  return sorted_values[index]
+
+
+def main():
+  parser = argparse.ArgumentParser(description='WebSocket echo benchmark')
+  parser.add_argument('--host', default='127.0.0.1')
+  parser.add_argument('--port', type=int, default=8080)
+  parser.add_argument('--path', default='/ws-echo')
+  parser.add_argument('-c', '--connections', type=int, default=8)
+  parser.add_argument('-d', '--duration', type=float, default=5.0)
+  parser.add_argument('-s', '--size', type=int, default=128,
+                      help='message size, in bytes')
+  parser.add_argument('--deflate', action='store_true',
+                      help='negotiate permessage-deflate')
+  args = parser.parse_args()
+
+  # Somewhat compressible payload, so that deflate has something to do
+  pattern = b'lwan websocket benchmark '
+  payload = (pattern * (args.size // len(pattern) + 1))[:args.size]
+
+  latencies = []
+  errors = []
+  threads = [threading.Thread(target=worker,
+                              args=(args, payload, latencies, errors))
+             for _ in range(args.connections)]
+  start = time.time()
+  for thread in threads:
+    thread.start()
+  for thread in threads:
+    thread.join()
+  elapsed = time.time() - start
+
+  for error in set(errors):
+    sys.stderr.write('error: %s\n' % error)
+
+  latencies.sort()
+  print('%d connections, %d-byte messages%s' % (args.connections, args.size,
+        ', permessage-deflate' if args.deflate else ''))
+  print('%d messages in %.2fs: %.0f msgs/sec' % (len(latencies), elapsed,
+        len(latencies) / elapsed))
+  print('latency: p50 %.3fms, p99 %.3fms, max %.3fms' % (
+        percentile(latencies, 50) * 1000, percentile(latencies, 99) * 1000,
+        (latencies[-1] if latencies else 0) * 1000))
+
+  return 1 if errors else 0
+
+
+if __name__ == '__main__':
+  sys.exit(main())